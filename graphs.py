@@ -1,16 +1,52 @@
 #!/usr/bin/env python3
 
+import json
 import matplotlib.pyplot as plt
 import os
 import string
+import subprocess
 import sys
 import time
 from typing import Tuple
 
+
+def graph_bench(bench_dir: str, samples: int):
+    """
+    Compare the in-process microbenchmarks (test/bench) of both implementations.
+    Usage: graphs.py bench <samples> <directory containing bench and bench-pthread>
+    """
+    results = {}
+    for variant in ["bench", "bench-pthread"]:
+        output = subprocess.run([os.path.join(bench_dir, variant), "--format", "json", "--samples", str(samples)],
+                                check=True, capture_output=True, text=True).stdout
+        for result in json.loads(output):
+            results.setdefault(result["benchmark"], {})[result["variant"]] = result
+
+    fig, axes = plt.subplots(1, len(results), figsize=(4 * len(results), 4))
+    for ax, (benchmark, variants) in zip(axes, results.items()):
+        names = list(variants.keys())
+        medians = [variants[v]["median"] for v in names]
+        errors = [[0 for _ in names], [variants[v]["p90"] - variants[v]["median"] for v in names]]
+        ax.bar(names, medians, yerr=errors, color=['blue', 'red'][:len(names)])
+        ax.set_title(benchmark)
+        ax.set_ylabel(next(iter(variants.values()))["unit"] + " (median, p90)")
+    fig.suptitle("Microbenchmarks, " + str(samples) + " samples")
+    plt.tight_layout()
+    plt.show()
+
+
+if len(sys.argv) > 1 and sys.argv[1] == "bench":
+    graph_bench(sys.argv[3], int(sys.argv[2]))
+    sys.exit(0)
+
 test_battery = ["01-main", "02-switch", "03-equity", "11-join", "12-join-main", "21-create-many",
                 "22-create-many-recursive", "23-create-many-once", "31-switch-many",
                 "32-switch-many-join", "33-switch-many-cascade", "51-fibonacci", "61-mutex",
-                "62-mutex", "71-preemption", "81-deadlock"]
+                "62-mutex", "71-preemption", "72-watchdog", "73-time-slice", "81-deadlock", "91-offload", "92-io-uring", "52-forkjoin-fibonacci", "53-parallel-sum",
+                "24-thread-pool", "25-stack-paint", "34-generator", "35-yield-to",
+                "36-sched-policies", "37-stats", "38-trace", "39-profile", "64-mutex-profile", "13-thread-specific",
+                "41-sched-instances", "42-numa", "26-stack-arena", "63-priority-inheritance", "14-cancel",
+                "27-create-inplace", "65-cond-timedwait"]
 args = sys.argv
 
 # Number of iterations per test, with the same parameters, of which the average is taken
@@ -0,0 +1,114 @@
+#ifndef OS_S8_FORKJOIN_H
+#define OS_S8_FORKJOIN_H
+
+#include <stdatomic.h>
+#include "thread.h"
+
+/*
+ * Fork-join layer built on top of thread.h.
+ *
+ * A pool owns one deque of spawned tasks per worker. A spawn pushes the task at the bottom of the
+ * deque of the current worker, idle workers steal from the top of the others' deques, those of
+ * their NUMA node first.
+ * Joining a task that nobody has started yet runs it inline, so most spawns never leave the
+ * worker that created them and never cost a thread_create().
+ *
+ * Compiled twice: 'forkjoin' on top of our threads, 'forkjoin-pthread' with -DUSE_PTHREAD.
+ */
+
+/**
+ * Pool of workers.
+ */
+typedef struct fj_pool fj_pool_t;
+
+/**
+ * A spawned task.
+ *
+ * The storage is provided by the caller (usually on its stack) and must stay valid until fj_join
+ * returns. The fields are private.
+ */
+typedef struct fj_task {
+	void *(*func)(void *);
+	void *arg;
+	void *result;
+	struct fj_worker *owner;
+	atomic_int state;
+} fj_task_t;
+
+/**
+ * Create a pool.
+ *
+ * The thread calling fj_pool_run is the first worker, so only `workers - 1` threads are created.
+ * @param pool The new pool is placed here
+ * @param workers The number of workers (0 is treated as 1)
+ * @return 0 on success, -1 on failure
+ */
+extern int fj_pool_init(fj_pool_t **pool, unsigned int workers);
+
+/**
+ * Stop the workers and free the pool.
+ * @param pool The pool, which must not be running anything
+ */
+extern void fj_pool_destroy(fj_pool_t *pool);
+
+/**
+ * Run a task on the pool, and wait for it to complete.
+ *
+ * Tasks must join everything they spawn before returning. Only one pool may be running at a time.
+ * @param pool The pool
+ * @param func The root task
+ * @param func_arg Arguments passed to func
+ * @return The value returned by func
+ */
+extern void *fj_pool_run(fj_pool_t *pool, void *(*func)(void *), void *func_arg);
+
+/**
+ * Make a task available to the other workers.
+ *
+ * Outside of fj_pool_run, or when the deque is full, the task is executed immediately.
+ * @param task Storage for the task, must stay valid until fj_join
+ * @param func The function executed by the task
+ * @param func_arg Arguments passed to func
+ */
+extern void fj_spawn(fj_task_t *task, void *(*func)(void *), void *func_arg);
+
+/**
+ * Wait for a spawned task.
+ *
+ * If no worker has stolen the task yet, it is executed by the caller. Otherwise, the caller
+ * executes other tasks while it waits, on its own stack: once it runs too many of them nested,
+ * it sleeps until the task is done instead.
+ * @param task The task
+ * @return The value returned by the task
+ */
+extern void *fj_join(fj_task_t *task);
+
+/**
+ * Call `body` on sub-ranges of [begin, end) in parallel.
+ * @param begin First index
+ * @param end Last index (excluded)
+ * @param grain Maximum size of a sub-range, 0 to choose it from the number of workers
+ * @param body The function called on each sub-range
+ * @param arg Arguments passed to body
+ */
+extern void fj_parallel_for(long begin, long end, long grain,
+                            void (*body)(long begin, long end, void *arg), void *arg);
+
+/**
+ * Reduce [begin, end) in parallel.
+ *
+ * `map` computes the value of a sub-range, `combine` merges the values of two adjacent sub-ranges
+ * (left first). Empty ranges return NULL.
+ * @param begin First index
+ * @param end Last index (excluded)
+ * @param grain Maximum size of a sub-range, 0 to choose it from the number of workers
+ * @param map The function called on each sub-range
+ * @param combine The function merging two results
+ * @param arg Arguments passed to map and combine
+ * @return The reduced value
+ */
+extern void *fj_parallel_reduce(long begin, long end, long grain,
+                                void *(*map)(long begin, long end, void *arg),
+                                void *(*combine)(void *left, void *right, void *arg), void *arg);
+
+#endif //OS_S8_FORKJOIN_H
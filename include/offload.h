@@ -0,0 +1,101 @@
+#ifndef OS_S8_OFFLOAD_H
+#define OS_S8_OFFLOAD_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include "thread.h"
+
+/*
+ * Blocking calls on helper kernel threads.
+ *
+ * All the threads of a scheduler run on its kernel thread: a call that blocks it (a disk read, fsync,
+ * a DNS lookup) stops all of them. thread_offload runs such a call on a small pool of helper kernel
+ * threads instead, shared by all the schedulers, and only the calling thread waits for it. Its
+ * scheduler picks up the results when it switches, and sleeps on an eventfd when every thread is
+ * waiting for one.
+ *
+ * With -DUSE_PTHREAD, the calls are made directly.
+ */
+
+#ifndef USE_PTHREAD
+
+/**
+ * Default number of helper kernel threads, and of calls in progress at once.
+ */
+#define THREAD_OFFLOAD_THREADS_DEFAULT 4
+#define THREAD_OFFLOAD_QUEUE_DEFAULT   256
+
+/**
+ * Size the pool, before the first offloaded call. The environment variables THREAD_OFFLOAD_THREADS
+ * and THREAD_OFFLOAD_QUEUE set the initial values.
+ * @param threads The number of helper kernel threads, started on the first call
+ * @param queue_depth The maximum number of calls in progress per scheduler: beyond, the callers wait for a slot
+ * @return 0 on success, -1 if a value is 0 or the pool has already started
+ */
+extern int thread_offload_configure(unsigned int threads, unsigned int queue_depth);
+
+/**
+ * Call func(arg) on a helper kernel thread. The calling thread blocks until it returns, the
+ * others keep running. func must not use the functions of thread.h.
+ * @return The return value of func. If func set errno, errno has the same value
+ */
+extern void *thread_offload(void *(*func)(void *), void *arg);
+
+/*
+ * Offloaded versions of common blocking calls, with the same arguments and results.
+ */
+
+extern ssize_t thread_read(int fd, void *buffer, size_t count);
+
+extern ssize_t thread_write(int fd, const void *buffer, size_t count);
+
+extern int thread_fsync(int fd);
+
+extern int thread_stat(const char *path, struct stat *stat);
+
+extern int thread_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+                              struct addrinfo **result);
+
+/*
+ * Completion-based I/O, with the same arguments and results as the system calls.
+ *
+ * With io_uring (Linux 5.6), the operations of the blocked threads are submitted together, when no
+ * thread is runnable or when one yields, and the scheduler reads their results from memory shared
+ * with the kernel when it switches: under load, there are far fewer system calls than operations.
+ * Without io_uring (older kernels, seccomp filters, Valgrind, or THREAD_IO_URING=0), they are offloaded.
+ */
+
+extern ssize_t thread_pread(int fd, void *buffer, size_t count, off_t offset);
+
+extern ssize_t thread_pwrite(int fd, const void *buffer, size_t count, off_t offset);
+
+extern ssize_t thread_recv(int fd, void *buffer, size_t count, int flags);
+
+extern ssize_t thread_send(int fd, const void *buffer, size_t count, int flags);
+
+#else /* USE_PTHREAD */
+
+static inline int thread_offload_configure(unsigned int threads, unsigned int queue_depth) {
+	return threads == 0 || queue_depth == 0 ? -1 : 0;
+}
+
+static inline void *thread_offload(void *(*func)(void *), void *arg) {
+	return func(arg);
+}
+
+#define thread_read        read
+#define thread_write       write
+#define thread_fsync       fsync
+#define thread_stat        stat
+#define thread_getaddrinfo getaddrinfo
+#define thread_pread       pread
+#define thread_pwrite      pwrite
+#define thread_recv        recv
+#define thread_send        send
+
+#endif /* USE_PTHREAD */
+
+#endif //OS_S8_OFFLOAD_H
@@ -0,0 +1,83 @@
+#ifndef OS_S8_POOL_H
+#define OS_S8_POOL_H
+
+#include "thread.h"
+
+/*
+ * Executor built on top of thread.h.
+ *
+ * Long-lived workers loop over a bounded submission queue, so each request reuses a warm stack
+ * and control block instead of paying for a thread_create() and a thread_join().
+ *
+ * Compiled twice: 'pool' on top of our threads, 'pool-pthread' with -DUSE_PTHREAD.
+ */
+
+/**
+ * Pool of workers.
+ */
+typedef struct thread_pool thread_pool_t;
+
+/**
+ * Completion handle of a submitted job.
+ *
+ * The storage is provided by the caller and must stay valid until thread_pool_wait returns.
+ * The fields are private.
+ */
+typedef struct thread_future {
+	struct thread_pool *pool;
+	void *result;
+	int is_done;
+	thread_cond_t done;
+} thread_future_t;
+
+/**
+ * Flag for thread_pool_submit: fail instead of waiting when the queue is full.
+ */
+#define THREAD_POOL_NONBLOCK 1
+
+/**
+ * Create a pool.
+ *
+ * `min_workers` are created immediately. When jobs are waiting and no worker is idle, new workers
+ * are created, up to `max_workers`. Workers live until thread_pool_destroy. A worker that couldn't
+ * be created still counts towards `max_workers`.
+ * @param pool The new pool is placed here
+ * @param min_workers The number of workers created immediately
+ * @param max_workers The maximum number of workers (at least 1, and at least min_workers)
+ * @param queue_size The maximum number of jobs waiting for a worker (at least 1)
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_pool_init(thread_pool_t **pool, unsigned int min_workers, unsigned int max_workers,
+                            unsigned int queue_size);
+
+/**
+ * Execute the queued jobs, stop the workers and free the pool.
+ *
+ * Every future must have been waited for before.
+ * @param pool The pool
+ */
+extern void thread_pool_destroy(thread_pool_t *pool);
+
+/**
+ * Queue a job.
+ *
+ * When the queue is full, waits for a free slot, or fails if `flags` contains THREAD_POOL_NONBLOCK.
+ * @param pool The pool
+ * @param future The completion handle, or `NULL` if the result is not needed
+ * @param func The function executed by a worker
+ * @param func_arg Arguments passed to func
+ * @param flags 0 or THREAD_POOL_NONBLOCK
+ * @return 0 on success, -1 if the job was not queued (full queue, or the pool is being destroyed)
+ */
+extern int thread_pool_submit(thread_pool_t *pool, thread_future_t *future,
+                              void *(*func)(void *), void *func_arg, int flags);
+
+/**
+ * Wait for a job to complete.
+ * @param future The handle given to thread_pool_submit
+ * @param return_value The job's return value is placed here. If `NULL` is passed, the return value is ignored.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_pool_wait(thread_future_t *future, void **return_value);
+
+#endif //OS_S8_POOL_H
@@ -3,6 +3,8 @@
 
 #ifndef USE_PTHREAD
 
+#include <stdio.h>
+#include <time.h>
 #include "sys/queue.h"
 /**
  * Thread identifier.
@@ -26,12 +28,212 @@ extern thread_t thread_self(void);
  */
 extern int thread_create(thread_t *new_thread, void *(*func)(void *), void *func_arg);
 
+/**
+ * Lowest, highest and initial priority of a thread. Only the priority and fair policies use it.
+ */
+#define THREAD_PRIORITY_MIN     0
+#define THREAD_PRIORITY_MAX     31
+#define THREAD_PRIORITY_DEFAULT 16
+
+/**
+ * Default and smallest stack size of a thread, in bytes.
+ */
+#define THREAD_STACK_SIZE_DEFAULT (64 * 1024)
+#define THREAD_STACK_SIZE_MIN     (16 * 1024)
+
+/**
+ * Thread creation attributes.
+ */
+typedef struct thread_attr {
+	int priority;
+	unsigned long stack_size;
+	/** -1 for any node. */
+	int node;
+	/** NULL for the scheduler of the calling kernel thread. */
+	struct thread_sched *sched;
+} thread_attr_t;
+
+/**
+ * Initialize attributes to their default values.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_attr_init(thread_attr_t *attr);
+
+/**
+ * @param priority Between THREAD_PRIORITY_MIN and THREAD_PRIORITY_MAX, higher runs first
+ * @return 0 on success, -1 if the priority is out of range
+ */
+extern int thread_attr_setpriority(thread_attr_t *attr, int priority);
+
+/**
+ * @param stack_size In bytes, at least THREAD_STACK_SIZE_MIN (see thread_stack_recommended_size)
+ * @return 0 on success, -1 if the size is too small
+ */
+extern int thread_attr_setstacksize(thread_attr_t *attr, unsigned long stack_size);
+
+/**
+ * Run the thread on a scheduler of a NUMA node (the one with the fewest threads), with its stack
+ * and control block allocated on the node. thread_create_attr fails if no scheduler is on the node.
+ * @param node Between 0 and thread_numa_nodes() - 1, or -1 for the scheduler of the caller
+ * @return 0 on success, -1 if the node doesn't exist
+ */
+extern int thread_attr_setnode(thread_attr_t *attr, int node);
+
+/**
+ * Run the thread on a given scheduler (see thread_sched_self), which takes precedence over the node.
+ * @param sched NULL for the scheduler of the caller
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_attr_setsched(thread_attr_t *attr, struct thread_sched *sched);
+
+/**
+ * Create a new thread, with attributes.
+ * A thread created for another scheduler starts when that scheduler next switches, and is joined
+ * by a thread of that scheduler.
+ * @param new_thread The identifier of the new thread (allocate the pointer, the function will return it)
+ * @param attr The attributes of the new thread, `NULL` for the default ones
+ * @param func The function executed by the new thread
+ * @param func_arg Arguments passed to the function func
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_create_attr(thread_t *new_thread, const thread_attr_t *attr,
+                              void *(*func)(void *), void *func_arg);
+
+/**
+ * Size of a buffer for thread_create_inplace with a stack of stack_size bytes: the control block and
+ * its alignment take up to THREAD_INPLACE_OVERHEAD bytes.
+ */
+#define THREAD_INPLACE_OVERHEAD 2048
+#define THREAD_INPLACE_SIZE(stack_size) ((stack_size) + THREAD_INPLACE_OVERHEAD)
+
+/**
+ * Create a new thread in a buffer of the caller, without allocating: the control block is at its end,
+ * and the stack takes the rest (the stack size of the attributes is ignored).
+ * The buffer belongs to the caller, the library never frees or reuses it: it must stay untouched
+ * until thread_join returns for the thread, and can then be used for another thread or freed.
+ * @param buffer Any alignment, for instance in a static array or an arena
+ * @param size At least THREAD_INPLACE_SIZE(THREAD_STACK_SIZE_MIN)
+ * @param attr The attributes of the new thread, `NULL` for the default ones
+ * @return 0 on success, -1 if the buffer is too small or there is no scheduler on the node
+ */
+extern int thread_create_inplace(thread_t *new_thread, void *buffer, size_t size, const thread_attr_t *attr,
+                                 void *(*func)(void *), void *func_arg);
+
+/**
+ * Change the priority of a thread. While it holds a mutex a thread of higher priority waits for,
+ * it keeps running with the priority of that waiter.
+ * @return 0 on success, -1 if the priority is out of range
+ */
+extern int thread_setpriority(thread_t thread, int priority);
+
+/**
+ * @return The priority of a thread, boosted by the waiters of the mutexes it holds
+ */
+extern int thread_getpriority(thread_t thread);
+
+/**
+ * How the next thread to run is chosen.
+ */
+typedef enum thread_sched_policy {
+	/** Round-robin: yielding and woken threads go to the back of the queue (default). */
+	THREAD_SCHED_FIFO,
+	/** New and woken threads run first, to keep their data in the cache. */
+	THREAD_SCHED_LIFO,
+	/** The runnable thread with the highest priority runs first, round-robin within a priority. */
+	THREAD_SCHED_PRIORITY,
+	/** Each thread gets a share of the processor time proportional to its priority + 1. */
+	THREAD_SCHED_FAIR,
+} thread_sched_policy_t;
+
+/**
+ * Change the scheduling policy.
+ *
+ * The initial policy is read from the environment variable THREAD_SCHED
+ * ("fifo", "lifo", "priority" or "fair").
+ * @return 0 on success, -1 if the policy doesn't exist
+ */
+extern int thread_sched_set_policy(thread_sched_policy_t policy);
+
+extern thread_sched_policy_t thread_sched_get_policy(void);
+
 /**
  * Let another thread take control.
  * @return 0 on success, -1 on failure
  */
 extern int thread_yield(void);
 
+/**
+ * Clock of the time slices: the cycle counter on x86-64, nanoseconds elsewhere.
+ */
+static inline unsigned long long thread_slice_clock(void) {
+#ifdef __x86_64__
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/**
+ * When the time slice of the running thread ends, in thread_slice_clock units. Only for thread_maybe_yield.
+ * Each kernel thread has its own.
+ */
+extern __thread unsigned long long thread_slice_deadline;
+
+/**
+ * The slow path of thread_maybe_yield.
+ */
+extern int thread_slice_expired(void);
+
+/**
+ * Let another thread take control if the current one has used up its time slice.
+ *
+ * Made to be called often in long computations: while the slice lasts, it costs a read of the
+ * cycle counter and a comparison. Once it is over, the thread yields (which does nothing if no
+ * other thread is runnable) and gets a new slice.
+ * @return 0 on success, -1 on failure
+ */
+static inline int thread_maybe_yield(void) {
+	if (__builtin_expect(thread_slice_clock() < thread_slice_deadline, 1))
+		return 0;
+	return thread_slice_expired();
+}
+
+/**
+ * Set the length of the time slices of thread_maybe_yield. A thread gets a new slice each time it
+ * starts running. The initial length is read from the environment variable THREAD_TIME_SLICE_US.
+ * @param slice_us In microseconds, 1000 by default
+ * @return 0 on success, -1 if the length is 0
+ */
+extern int thread_set_time_slice(unsigned int slice_us);
+
+/**
+ * Let a specific thread take control, ahead of the other runnable threads.
+ *
+ * The current thread goes to the back of the queue, as with thread_yield.
+ * @param thread The thread to run, which must be runnable (not blocked nor dead)
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_yield_to(thread_t thread);
+
+/**
+ * Where the threads woken up by thread_mutex_unlock, thread_exit (for the joiner) and
+ * thread_cond_signal go in the queue. The LIFO policy always runs them first.
+ */
+typedef enum thread_wakeup_policy {
+	/** At the back of the queue (default). */
+	THREAD_WAKEUP_FIFO,
+	/** Right after the current thread: it runs next. */
+	THREAD_WAKEUP_NEXT,
+} thread_wakeup_policy_t;
+
+/**
+ * Choose where woken up threads are placed in the queue.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_set_wakeup_policy(thread_wakeup_policy_t policy);
+
 /**
  * Wait for a thread to terminate.
  *
@@ -50,10 +252,69 @@ extern int thread_join(thread_t thread, void **return_value);
  */
 extern void thread_exit(void *return_value);
 
+/**
+ * The return value of a cancelled thread, for thread_join.
+ */
+#define THREAD_CANCELED ((void *) -1)
+
+/**
+ * Ask a thread to stop.
+ *
+ * The thread exits at its next cancellation point: thread_yield (and thread_maybe_yield), thread_join,
+ * thread_mutex_lock, thread_cond_wait, thread_park, the I/O of offload.h, and thread_testcancel.
+ * Blocked in one of them, it is woken up, an io_uring operation is cancelled, and an offloaded call
+ * is waited for; thread_mutex_lock only acts while waiting, not once it has the mutex, and
+ * thread_cond_wait locks the mutex again first. It runs its cleanup handlers, then exits through
+ * thread_exit(THREAD_CANCELED). Can be called from any kernel thread; the thread must not have been joined.
+ * @return 0 on success (also if the thread is already cancelled or exiting), -1 on failure
+ */
+extern int thread_cancel(thread_t thread);
+
+/**
+ * A cancellation point, for the long computations that don't yield.
+ */
+extern void thread_testcancel(void);
+
+/**
+ * Cleanup handler, on the stack of its thread.
+ */
+typedef struct thread_cleanup {
+	void (*routine)(void *);
+	void *arg;
+	struct thread_cleanup *next;
+} thread_cleanup_t;
+
+extern void thread_cleanup_register(thread_cleanup_t *cleanup);
+
+extern void thread_cleanup_unregister(thread_cleanup_t *cleanup, int execute);
+
+/**
+ * Run routine(arg) if the thread exits (with thread_exit, or cancelled) before the matching
+ * thread_cleanup_pop, in the same block. The handlers run innermost first.
+ */
+#define thread_cleanup_push(_routine, _arg) \
+	do { \
+		thread_cleanup_t thread_cleanup_ = {(_routine), (_arg), NULL}; \
+		thread_cleanup_register(&thread_cleanup_);
+
+/**
+ * Remove the handler of the matching thread_cleanup_push, and run it if execute isn't 0.
+ */
+#define thread_cleanup_pop(_execute) \
+		thread_cleanup_unregister(&thread_cleanup_, (_execute)); \
+	} while (0)
+
 /* Interface possible pour les mutex */
+/**
+ * Mutex with priority inheritance: while a thread waits for it, its owner runs with at least the
+ * priority of the waiter, and so does the owner of the mutex that owner waits for, and so on.
+ * The boost is undone when the owner unlocks it.
+ */
 typedef struct thread_mutex {
 	thread_t owner;
-	STAILQ_HEAD(waiting_queue, thread) waiting_queue;
+	TAILQ_HEAD(waiting_queue, thread) waiting_queue;
+	/** The next mutex held by the owner. */
+	struct thread_mutex *next_held;
 } thread_mutex_t;
 
 int thread_mutex_init(thread_mutex_t *mutex);
@@ -64,6 +325,475 @@ int thread_mutex_lock(thread_mutex_t *mutex);
 
 int thread_mutex_unlock(thread_mutex_t *mutex);
 
+/**
+ * Start profiling the contention of the mutexes: acquisitions, contended acquisitions, waiting and
+ * holding times, and the call sites that wait the most, for each mutex.
+ *
+ * Profiling also starts when the program is loaded if the environment variable THREAD_MUTEX_PROFILE
+ * is set to the sampling period, and the report of the 10 hottest mutexes is printed at exit.
+ * The statistics are kept by address: a mutex destroyed then created again at the same address
+ * shares its statistics with the previous one.
+ * @param sample_every Profile one acquisition out of `sample_every` (1 to profile them all)
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_mutex_profile_start(unsigned int sample_every);
+
+/**
+ * Stop profiling. The statistics are kept until thread_mutex_profile_reset.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_mutex_profile_stop(void);
+
+/**
+ * Forget the statistics.
+ */
+extern void thread_mutex_profile_reset(void);
+
+/**
+ * Print the mutexes with the longest total waiting time.
+ * @param file Where to print the report
+ * @param top The maximum number of mutexes printed
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_mutex_profile_report(FILE *file, unsigned int top);
+
+/**
+ * Condition variable, always used with a thread_mutex_t.
+ */
+typedef struct thread_cond {
+	struct waiting_queue waiting_queue;
+} thread_cond_t;
+
+int thread_cond_init(thread_cond_t *cond);
+
+int thread_cond_destroy(thread_cond_t *cond);
+
+/**
+ * Release the mutex and wait for the condition to be signaled, then lock the mutex again.
+ * @param cond The condition to wait for
+ * @param mutex A mutex owned by the current thread
+ * @return 0 on success, -1 if no other thread could ever signal the condition
+ */
+int thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex);
+
+/**
+ * Wake up one thread waiting for the condition, if any.
+ */
+int thread_cond_signal(thread_cond_t *cond);
+
+/**
+ * Wake up all threads waiting for the condition.
+ */
+int thread_cond_broadcast(thread_cond_t *cond);
+
+/**
+ * Key of a thread-specific value: each thread has its own value for each key, NULL at first.
+ */
+typedef unsigned int thread_key_t;
+
+/**
+ * Number of keys that can exist at once.
+ */
+#define THREAD_KEYS_MAX 128
+
+/**
+ * Create a key.
+ * @param destructor Called with the value of a thread that exits while it isn't NULL, or NULL
+ * @return 0 on success, -1 if THREAD_KEYS_MAX keys exist
+ */
+extern int thread_key_create(thread_key_t *key, void (*destructor)(void *));
+
+/**
+ * Delete a key. The destructor is not called for the values left.
+ * @return 0 on success, -1 if the key doesn't exist
+ */
+extern int thread_key_delete(thread_key_t key);
+
+/**
+ * @return The value of the current thread for a key, NULL if it has none or the key doesn't exist
+ */
+extern void *thread_getspecific(thread_key_t key);
+
+/**
+ * Set the value of the current thread for a key. Only the pointer is kept, *value isn't read.
+ * @return 0 on success, -1 if the key doesn't exist or the allocation failed
+ */
+extern int thread_setspecific(thread_key_t key, const void *value);
+
+/**
+ * Runtime statistics of a thread. The times are in nanoseconds.
+ */
+typedef struct thread_stats {
+	/** Switches away from the thread while it was still runnable (thread_yield, thread_yield_to, thread_create). */
+	unsigned long voluntary_switches;
+	/** Switches away from the thread because it blocked (thread_join, thread_mutex_lock, thread_cond_wait). */
+	unsigned long blocking_switches;
+	/** Time spent running. */
+	unsigned long long run_ns;
+	/** Time spent in the run queue, waiting to run. */
+	unsigned long long runnable_ns;
+	/** Time spent blocked. */
+	unsigned long long blocked_ns;
+	/** Deepest stack use seen when the thread was switched out, in bytes (0 for the main thread).
+	 * Exact if the stack is painted (see thread_stack_paint_start). */
+	unsigned long stack_high_water;
+	/** Times the watchdog caught the thread running too long without switching. */
+	unsigned long hogs;
+} thread_stats_t;
+
+/**
+ * Get the statistics of a thread that hasn't been joined yet. The current state is included up to now.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_stats_get(thread_t thread, thread_stats_t *stats);
+
+/**
+ * Number of buckets of the run queue delay histogram.
+ *
+ * Delays under 4 ns have their own buckets, then each power of two is split in 4 buckets:
+ * the percentiles are upper bounds, at most 25% above the real value.
+ */
+#define THREAD_STATS_DELAY_BUCKETS 252
+
+/**
+ * Statistics of the scheduler since the start of the program (or the last reset).
+ */
+typedef struct thread_sched_stats {
+	unsigned long long voluntary_switches;
+	unsigned long long blocking_switches;
+	/** Switches from a thread that has just exited. */
+	unsigned long long exit_switches;
+	unsigned long threads_created;
+	unsigned long threads_exited;
+	/** Times the watchdog caught a thread running too long without switching. */
+	unsigned long watchdog_hogs;
+	/** Threads created with a stack from the pool of their NUMA node, and for another scheduler. */
+	unsigned long stacks_reused;
+	unsigned long threads_sent;
+	/** Threads received from the other kernel threads (created, unparked, or done with an offloaded call),
+	 * the batches they came in, and times the scheduler slept until they rang its doorbell. */
+	unsigned long inbox_threads;
+	unsigned long inbox_batches;
+	unsigned long idle_sleeps;
+	/** Times a thread holding a mutex was boosted to the priority of a waiter. */
+	unsigned long priority_boosts;
+
+	/** Run queue delay: time between a thread becoming runnable and running, in nanoseconds. */
+	unsigned long long delay_count;
+	unsigned long long delay_max_ns;
+	unsigned long long delay_p50_ns, delay_p90_ns, delay_p99_ns;
+	/** Bucket i counts the delays between thread_sched_stats_bucket_min(i) and thread_sched_stats_bucket_min(i + 1). */
+	unsigned long long delay_histogram[THREAD_STATS_DELAY_BUCKETS];
+} thread_sched_stats_t;
+
+/**
+ * Get the statistics of the scheduler, and compute the delay percentiles.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_sched_stats(thread_sched_stats_t *stats);
+
+/**
+ * Reset the statistics of the scheduler (not those of the threads).
+ */
+extern void thread_sched_stats_reset(void);
+
+/**
+ * @return The smallest delay counted by a bucket of the histogram, in nanoseconds
+ */
+extern unsigned long long thread_sched_stats_bucket_min(unsigned int bucket);
+
+/**
+ * Scheduler instance.
+ *
+ * Each kernel thread that calls the library gets its own scheduler on its first call: run queue,
+ * policies, statistics, time slice and trace. A thread only ever runs on the kernel thread of the
+ * scheduler that created it, and the schedulers don't synchronize with each other. So a thread,
+ * and the mutexes and conditions it uses, must only be used by threads of its own scheduler:
+ * the only cross-scheduler operations are thread_sched_post and thread_unpark.
+ * When a kernel thread exits, its scheduler and the threads left in it are freed.
+ */
+typedef struct thread_sched thread_sched_t;
+
+/**
+ * @return The scheduler of the calling kernel thread, created if needed
+ */
+extern thread_sched_t *thread_sched_self(void);
+
+/**
+ * Run a function on the kernel thread of a scheduler, the next time it switches (right away if it is idle).
+ *
+ * The function runs on the stack of the switching thread: it must not block, but it may create threads,
+ * unpark them, signal conditions or unlock mutexes of that scheduler.
+ * Can be called from any kernel thread. The scheduler must still exist when the function runs.
+ * @return 0 on success, -1 if the allocation failed
+ */
+extern int thread_sched_post(thread_sched_t *sched, void (*func)(void *), void *arg);
+
+/**
+ * Block the current thread until thread_unpark wakes it up.
+ * If it has been unparked since its last park, it doesn't block.
+ * @return 0 on success, -1 if nothing can unpark it (no other thread, no other scheduler)
+ */
+extern int thread_park(void);
+
+/**
+ * Wake up a parked thread, or let its next thread_park return at once.
+ * Can be called from any kernel thread: a parked thread of another scheduler is added to its inbox,
+ * without a lock or an allocation, which it takes at once when it switches.
+ * The thread must not have been joined.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_unpark(thread_t thread);
+
+/**
+ * NUMA placement.
+ *
+ * The topology comes from /sys/devices/system/node. THREAD_NUMA_NODES=<n> fakes one of n nodes by
+ * splitting the processors, to test on a machine that isn't NUMA. With THREAD_PIN=1, each new
+ * scheduler pins its kernel thread to the next processor, node after node.
+ * The stacks and control blocks are allocated on the node of the scheduler of the thread (bound to
+ * it when the machine is NUMA), and those of the default size are kept in a pool per node when the
+ * threads are freed.
+ */
+
+/**
+ * @return The number of NUMA nodes, 1 if the machine isn't NUMA
+ */
+extern unsigned int thread_numa_nodes(void);
+
+/**
+ * Pin the calling kernel thread to a processor, and move its scheduler to the processor's node.
+ * The threads already created keep their stacks.
+ * @return 0 on success, -1 if the processor isn't available
+ */
+extern int thread_sched_pin(int cpu);
+
+/**
+ * @return The processor the kernel thread of a scheduler is pinned to, -1 if it isn't
+ */
+extern int thread_sched_cpu(thread_sched_t *sched);
+
+/**
+ * @return The NUMA node of a scheduler
+ */
+extern int thread_sched_node(thread_sched_t *sched);
+
+/**
+ * Start recording the scheduling events (creations, switches, blocks, wakeups, exits, mutexes).
+ *
+ * The events are kept in a ring buffer: when it is full, the oldest ones are overwritten.
+ * Tracing also starts when the program is loaded if the environment variable THREAD_TRACE names a file,
+ * which is written at exit (THREAD_TRACE_EVENTS sets the capacity).
+ * Convert a trace file with thread-trace-dump to open it in chrome://tracing or Perfetto.
+ * @param events The capacity of the ring (rounded up to a power of two), 0 for the default (65536)
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_trace_start(unsigned long events);
+
+/**
+ * Stop recording. The events recorded so far can still be dumped.
+ * The schedulers of the other kernel threads start and stop recording themselves, at their next switch.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_trace_stop(void);
+
+/**
+ * Write the recorded events to a file: those of the current kernel thread, and those of the other
+ * schedulers that have stopped recording (see thread_trace_stop).
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_trace_dump(const char *path);
+
+/**
+ * Start sampling the running thread, to find where the processor time goes.
+ *
+ * Uses SIGPROF and ITIMER_PROF, which the program must not use. Each sample records the thread
+ * that was running and its call stack.
+ * Profiling also starts when the program is loaded if the environment variable THREAD_PROFILE names
+ * a file, which is written at exit (THREAD_PROFILE_HZ sets the frequency).
+ * Functions of the executable only have names if it is linked with -rdynamic.
+ * @param frequency Samples per second of processor time, 0 for the default (997)
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_profile_start(unsigned int frequency);
+
+/**
+ * Stop sampling. The samples can still be dumped.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_profile_stop(void);
+
+/**
+ * Write the samples in the collapsed stack format of flamegraph.pl: one line per distinct stack,
+ * "main;func1;func2 <count>" or "thread-<n>;func1;func2 <count>", <n> being the creation order.
+ * Can be called while sampling: the samples other kernel threads are still writing are left out.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_profile_dump(const char *path);
+
+/**
+ * Paint the stacks of the threads created from now on, to measure how deep they go.
+ *
+ * The stack is filled with a pattern at creation, and the pattern left untouched tells the deepest
+ * use so far. This costs a write of the whole stack per creation, which also makes all of its pages
+ * resident. When a thread is freed, its use is added to the statistics of its function, from which
+ * thread_stack_recommended_size is computed.
+ * Painting also starts when the program is loaded if the environment variable THREAD_STACK_PAINT is set,
+ * and the report is printed at exit.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_stack_paint_start(void);
+
+/**
+ * Stop painting new stacks. The painted ones are still measured.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_stack_paint_stop(void);
+
+/**
+ * @return The deepest use of the stack of a thread that hasn't been joined yet, in bytes,
+ * or -1 if its stack is not painted
+ */
+extern long thread_stack_usage(thread_t thread);
+
+/**
+ * Stack size to give the threads running a function, from the deepest use by the painted threads
+ * freed so far, plus a margin for signal handlers and rarer paths.
+ * @param func The function passed to thread_create, or NULL for all the threads
+ * @return The size in bytes, or 0 if no painted thread running this function has been freed
+ */
+extern unsigned long thread_stack_recommended_size(void *(*func)(void *));
+
+/**
+ * Print the stack use of the painted threads that have been freed, by function,
+ * the deepest first, with the recommended sizes.
+ * @param top The maximum number of functions to print
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_stack_report(FILE *file, unsigned int top);
+
+/**
+ * Stack arena: the stacks of the default size (and the structures of their threads) are carved out
+ * of 2 MiB huge pages, about 30 per page, so that switching between thousands of threads doesn't
+ * miss the TLB at each switch. Each huge page is resident as a whole once touched.
+ *
+ * The huge pages are transparent by default: the kernel may split or not yet collapse them when
+ * /sys/kernel/mm/transparent_hugepage/enabled is "never" or memory is fragmented, see huge_bytes.
+ * Explicit ones come from the pages reserved in /proc/sys/vm/nr_hugepages, and fall back to
+ * transparent ones when there is none left.
+ * A guard page below each stack catches overflows, but splits a transparent huge page into small
+ * pages: the stacks stay packed, without the TLB gain. It isn't possible with explicit huge pages.
+ */
+#define THREAD_STACK_ARENA_HUGETLB 1
+#define THREAD_STACK_ARENA_GUARD   2
+
+typedef struct {
+	/** Huge pages reserved for stacks, explicit ones among them, and explicit ones that couldn't be had. */
+	unsigned long huge_pages;
+	unsigned long explicit_huge_pages;
+	unsigned long hugetlb_failures;
+	/** Stacks carved out of each huge page, with the current flags. */
+	unsigned long stacks_per_huge_page;
+	/** Stacks in use, given since the start, and given in a huge page already holding one in use. */
+	unsigned long stacks_in_use;
+	unsigned long stacks_allocated;
+	unsigned long stacks_packed;
+	/** Stacks taken outside the arena because no huge page could be mapped. */
+	unsigned long fallbacks;
+	/** Bytes of the arena actually backed by huge pages, from /proc/self/smaps. */
+	unsigned long huge_bytes;
+} thread_stack_arena_stats_t;
+
+/**
+ * Take the stacks of the default size of the threads created from now on from the arena.
+ * Starting it again with other flags leaves the stacks carved with the former ones to their threads.
+ * The arena also starts when the program is loaded if the environment variable THREAD_STACK_ARENA
+ * is set, to "thp" or "hugetlb", with guard pages if THREAD_STACK_ARENA_GUARD is set.
+ * @param flags THREAD_STACK_ARENA_HUGETLB for explicit huge pages, THREAD_STACK_ARENA_GUARD for guard pages
+ * @return 0 on success, -1 if the flags are invalid
+ */
+extern int thread_stack_arena_start(int flags);
+
+/**
+ * Allocate the new stacks outside the arena again. The huge pages are kept for when it restarts.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_stack_arena_stop(void);
+
+/**
+ * Fill the counters of the arena, of all the schedulers.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_stack_arena_stats(thread_stack_arena_stats_t *stats);
+
+/**
+ * Start watching for threads that run too long without switching, and block all the others.
+ *
+ * A timer per scheduler checks periodically since when its running thread runs: the schedulers that
+ * exist when it starts, the calling kernel thread's included, and those created while it watches.
+ * Once a thread has run longer than the threshold while other threads exist, the watchdog prints
+ * which thread it is and where it is to the standard error, and counts it in thread_stats_t.hogs and
+ * thread_sched_stats_t.watchdog_hogs (once per run of the thread).
+ * Uses the signal SIGRTMIN, which the program must not use, and a timer on CLOCK_MONOTONIC:
+ * system calls interrupted by the signal are restarted.
+ * The watchdog also starts when the program is loaded if the environment variable THREAD_WATCHDOG
+ * is set, to the threshold in milliseconds.
+ * @param threshold_ms The longest time a thread may run, 0 for the default (100 ms)
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_watchdog_start(unsigned int threshold_ms);
+
+/**
+ * Stop the watchdog.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_watchdog_stop(void);
+
+/**
+ * Generator identifier.
+ *
+ * A generator runs on its own stack, but inside the thread that resumes it: resuming and yielding
+ * switch directly between the two, without going through the scheduler.
+ */
+typedef void *thread_gen_t;
+
+/**
+ * Create a new generator. It doesn't start until it is resumed.
+ * @param new_gen The identifier of the new generator (allocate the pointer, the function will return it)
+ * @param func The function executed by the generator, its return value is the last value produced
+ * @param func_arg Arguments passed to the function func
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_gen_create(thread_gen_t *new_gen, void *(*func)(void *), void *func_arg);
+
+/**
+ * Execute a generator until it yields or returns.
+ * @param gen The generator, which must not be running nor done
+ * @param in The value returned by thread_gen_yield in the generator (ignored by the first resume)
+ * @return The value passed to thread_gen_yield, or returned by the generator's function
+ */
+extern void *thread_gen_resume(thread_gen_t gen, void *in);
+
+/**
+ * Give a value back to the thread that resumed the current generator, and wait to be resumed.
+ *
+ * Must be called from inside a generator.
+ * @param out The value returned by thread_gen_resume
+ * @return The value passed to the next thread_gen_resume
+ */
+extern void *thread_gen_yield(void *out);
+
+/**
+ * @return 1 if the generator's function has returned, 0 otherwise
+ */
+extern int thread_gen_is_done(thread_gen_t gen);
+
+/**
+ * Free a generator. If it hasn't returned, its stack is discarded.
+ * @return 0 on success, -1 on failure
+ */
+extern int thread_gen_destroy(thread_gen_t gen);
+
 #else /* USE_PTHREAD */
 
 /* Si on compile avec -DUSE_PTHREAD, ce sont les pthreads qui sont utilisés */
@@ -75,6 +805,11 @@ int thread_mutex_unlock(thread_mutex_t *mutex);
 #define thread_yield sched_yield
 #define thread_join pthread_join
 #define thread_exit pthread_exit
+#define thread_cancel pthread_cancel
+#define thread_testcancel pthread_testcancel
+#define THREAD_CANCELED PTHREAD_CANCELED
+#define thread_cleanup_push pthread_cleanup_push
+#define thread_cleanup_pop pthread_cleanup_pop
 
 /* Interface possible pour les mutex */
 #define thread_mutex_t            pthread_mutex_t
@@ -83,6 +818,24 @@ int thread_mutex_unlock(thread_mutex_t *mutex);
 #define thread_mutex_lock         pthread_mutex_lock
 #define thread_mutex_unlock       pthread_mutex_unlock
 
+#define thread_cond_t            pthread_cond_t
+#define thread_cond_init(_cond)  pthread_cond_init(_cond, NULL)
+#define thread_cond_destroy      pthread_cond_destroy
+#define thread_cond_wait         pthread_cond_wait
+#define thread_cond_signal       pthread_cond_signal
+#define thread_cond_broadcast    pthread_cond_broadcast
+
+#define thread_key_t        pthread_key_t
+#define thread_key_create   pthread_key_create
+#define thread_key_delete   pthread_key_delete
+#define thread_getspecific  pthread_getspecific
+#define thread_setspecific  pthread_setspecific
+
+/* Les pthreads sont préemptées par le noyau */
+static inline int thread_maybe_yield(void) {
+	return 0;
+}
+
 #endif /* USE_PTHREAD */
 
 #endif //OS_S8_THREAD_H
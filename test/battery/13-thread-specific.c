@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "thread.h"
+
+/* test des données propres à chaque thread (clés).
+ *
+ * chaque thread associe à une clé une valeur allouée, puis vérifie en yieldant plusieurs fois
+ * qu'elle retrouve sa propre valeur. Le destructeur de la clé doit être appelé une fois par thread
+ * à sa terminaison, avec sa valeur.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de yield
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_key_create(), thread_key_delete(), thread_getspecific(), thread_setspecific()
+ */
+
+static thread_key_t key;
+static unsigned long nb_yields;
+static unsigned long nb_destroyed = 0;
+
+static void destroy(void *value) {
+	free(value);
+	nb_destroyed++;
+}
+
+static void *thfunc(void *index) {
+	unsigned long *value = malloc(sizeof *value), i;
+	int err;
+
+	assert(thread_getspecific(key) == NULL);
+	*value = (unsigned long) index;
+	err = thread_setspecific(key, value);
+	assert(!err);
+
+	for (i = 0; i < nb_yields; i++) {
+		thread_yield();
+		assert(thread_getspecific(key) == value);
+		assert(*(unsigned long *) thread_getspecific(key) == (unsigned long) index);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long nb_threads, i;
+	thread_t *th;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de yield\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_yields = atoi(argv[2]);
+	th = malloc(nb_threads * sizeof *th);
+	if (!th) {
+		perror("malloc");
+		return -1;
+	}
+
+	err = thread_key_create(&key, destroy);
+	assert(!err);
+	assert(thread_getspecific(key) == NULL);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], thfunc, (void *) i);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+
+	printf("%lu valeurs détruites à la terminaison des threads\n", nb_destroyed);
+	assert(nb_destroyed == nb_threads);
+
+	err = thread_key_delete(key);
+	assert(!err);
+	free(th);
+	return 0;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "thread.h"
+#include "offload.h"
+
+/* test de l'annulation des threads.
+ *
+ * des threads sont annulées pendant qu'elles calculent (avec des yields), ou bloquées sur un mutex,
+ * une condition, un join, un thread_park ou une lecture sur une socket, et par un autre thread noyau.
+ * Chacune se termine par thread_exit(THREAD_CANCELED) après ses fonctions de nettoyage, qui libèrent
+ * ce qu'elle a alloué, et ce qu'elle attendait n'est plus attendu: le mutex, la condition et la thread
+ * qu'elle devait joindre servent encore.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de yields
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield(), thread_exit(), thread_park(), thread_unpark()
+ * - thread_cancel(), thread_testcancel(), thread_cleanup_push(), thread_cleanup_pop()
+ * - thread_mutex_*, thread_cond_*
+ * - thread_recv(), thread_sched_self(), thread_attr_setsched()
+ */
+
+#ifndef USE_PTHREAD
+
+static thread_mutex_t mutex;
+static thread_cond_t cond;
+static int sockets[2];
+static unsigned long nb_yields;
+static unsigned long nb_cleanups;
+/* la thread bloquée a atteint son attente */
+static volatile int is_waiting;
+
+static void cleanup_free(void *buffer) {
+	free(buffer);
+	nb_cleanups++;
+}
+
+static void cleanup_unlock(void *_mutex) {
+	thread_mutex_t *locked = _mutex;
+	/* thread_cond_wait a repris le mutex */
+	assert(locked->owner == thread_self());
+	thread_mutex_unlock(locked);
+	nb_cleanups++;
+}
+
+static void *spinner(void *dummy __attribute__((unused))) {
+	void *buffer = malloc(4096);
+
+	thread_cleanup_push(cleanup_free, buffer);
+	for (;;)
+		thread_yield();
+	thread_cleanup_pop(1);
+	return NULL;
+}
+
+static void *locker(void *dummy __attribute__((unused))) {
+	void *buffer = malloc(4096);
+
+	thread_cleanup_push(cleanup_free, buffer);
+	is_waiting = 1;
+	thread_mutex_lock(&mutex);
+	assert(0);
+	thread_cleanup_pop(1);
+	return NULL;
+}
+
+static void *waiter(void *dummy __attribute__((unused))) {
+	thread_mutex_lock(&mutex);
+	thread_cleanup_push(cleanup_unlock, &mutex);
+	is_waiting = 1;
+	for (;;)
+		thread_cond_wait(&cond, &mutex);
+	thread_cleanup_pop(1);
+	return NULL;
+}
+
+static void *parker(void *arg) {
+	is_waiting = 1;
+	for (;;)
+		thread_park();
+	return arg;
+}
+
+static void *joiner(void *target) {
+	is_waiting = 1;
+	thread_join(target, NULL);
+	assert(0);
+	return NULL;
+}
+
+static void *receiver(void *dummy __attribute__((unused))) {
+	char byte;
+
+	is_waiting = 1;
+	/* annulée avec io_uring; sans, l'appel déporté finit et l'annulation agit ensuite */
+	thread_recv(sockets[1], &byte, 1, 0);
+	thread_testcancel();
+	assert(0);
+	return NULL;
+}
+
+static void *exiting(void *dummy __attribute__((unused))) {
+	void *buffer = malloc(4096);
+
+	/* retirée sans être appelée, puis appelée, puis appelée par thread_exit */
+	thread_cleanup_push(cleanup_free, NULL);
+	thread_cleanup_pop(0);
+	thread_cleanup_push(cleanup_free, NULL);
+	thread_cleanup_pop(1);
+	thread_cleanup_push(cleanup_free, buffer);
+	thread_exit((void *) 0xdeadbeef);
+	thread_cleanup_pop(0);
+	return NULL;
+}
+
+/**
+ * Crée une thread, la laisse arriver à son attente, l'annule et vérifie qu'elle a été annulée.
+ */
+static void cancel_blocked(void *(*func)(void *), void *arg) {
+	thread_t th;
+	void *ret;
+	int err;
+
+	is_waiting = 0;
+	err = thread_create(&th, func, arg);
+	assert(!err);
+	while (!is_waiting)
+		thread_yield();
+	thread_yield();
+
+	err = thread_cancel(th);
+	assert(!err);
+	/* déjà demandé: sans effet */
+	err = thread_cancel(th);
+	assert(!err);
+	err = thread_join(th, &ret);
+	assert(!err);
+	assert(ret == THREAD_CANCELED);
+}
+
+/* un autre thread noyau: une thread parquée est annulée depuis le thread principal */
+static thread_sched_t *remote_sched;
+static thread_t remote_parker;
+static pthread_barrier_t barrier;
+
+static void *worker_main(void *dummy __attribute__((unused))) {
+	thread_attr_t attr;
+	void *ret;
+	int err;
+
+	remote_sched = thread_sched_self();
+	thread_attr_init(&attr);
+	thread_attr_setsched(&attr, remote_sched);
+	err = thread_create_attr(&remote_parker, &attr, parker, NULL);
+	assert(!err);
+	pthread_barrier_wait(&barrier);
+
+	err = thread_join(remote_parker, &ret);
+	assert(!err);
+	assert(ret == THREAD_CANCELED);
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_threads, i;
+	thread_t *th, target;
+	pthread_t worker;
+	void *ret;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de yields\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_yields = atoi(argv[2]);
+	th = malloc(nb_threads * sizeof *th);
+	assert(th != NULL);
+	thread_mutex_init(&mutex);
+	thread_cond_init(&cond);
+
+	/* en train de calculer: au prochain yield */
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], spinner, NULL);
+		assert(!err);
+	}
+	for (i = 0; i < nb_yields; i++)
+		thread_yield();
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_cancel(th[i]);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], &ret);
+		assert(!err);
+		assert(ret == THREAD_CANCELED);
+	}
+	assert(nb_cleanups == nb_threads);
+
+	/* en attente d'un mutex: le mutex reste au thread principal, sans attente */
+	thread_mutex_lock(&mutex);
+	cancel_blocked(locker, NULL);
+	assert(TAILQ_EMPTY(&mutex.waiting_queue));
+	thread_mutex_unlock(&mutex);
+	assert(nb_cleanups == nb_threads + 1);
+
+	/* en attente d'une condition: le nettoyage rend le mutex */
+	cancel_blocked(waiter, NULL);
+	assert(mutex.owner == NULL);
+	assert(TAILQ_EMPTY(&cond.waiting_queue));
+	assert(nb_cleanups == nb_threads + 2);
+
+	/* pareil, mais le mutex est tenu par le thread principal quand elle se réveille: elle l'attend */
+	is_waiting = 0;
+	err = thread_create(&target, waiter, NULL);
+	assert(!err);
+	while (!is_waiting)
+		thread_yield();
+	thread_mutex_lock(&mutex);
+	err = thread_cancel(target);
+	assert(!err);
+	thread_yield();
+	assert(!TAILQ_EMPTY(&mutex.waiting_queue));
+	thread_mutex_unlock(&mutex);
+	err = thread_join(target, &ret);
+	assert(!err);
+	assert(ret == THREAD_CANCELED);
+	assert(mutex.owner == NULL);
+	assert(nb_cleanups == nb_threads + 3);
+
+	/* parquée, puis en train de joindre une thread parquée, qui peut encore être jointe */
+	cancel_blocked(parker, NULL);
+	is_waiting = 0;
+	err = thread_create(&target, parker, NULL);
+	assert(!err);
+	cancel_blocked(joiner, target);
+	err = thread_cancel(target);
+	assert(!err);
+	err = thread_join(target, &ret);
+	assert(!err);
+	assert(ret == THREAD_CANCELED);
+
+	/* en attente d'une lecture */
+	err = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+	assert(!err);
+	cancel_blocked(receiver, NULL);
+	/* sans io_uring, la lecture déportée ne finit qu'avec un octet */
+	err = (int) write(sockets[0], "x", 1);
+	assert(err == 1);
+	close(sockets[0]);
+	close(sockets[1]);
+
+	/* annulée avant de commencer: au premier point d'annulation */
+	err = thread_create(&target, spinner, NULL);
+	assert(!err);
+	err = thread_cancel(target);
+	assert(!err);
+	err = thread_join(target, &ret);
+	assert(!err);
+	assert(ret == THREAD_CANCELED);
+
+	/* thread_exit appelle les fonctions de nettoyage restantes, et l'annulation d'une thread finie est sans effet */
+	nb_cleanups = 0;
+	err = thread_create(&target, exiting, NULL);
+	assert(!err);
+	thread_yield();
+	err = thread_cancel(target);
+	assert(!err);
+	err = thread_join(target, &ret);
+	assert(!err);
+	assert(ret == (void *) 0xdeadbeef);
+	assert(nb_cleanups == 2);
+
+	/* depuis un autre thread noyau */
+	pthread_barrier_init(&barrier, NULL, 2);
+	err = pthread_create(&worker, NULL, worker_main, NULL);
+	assert(!err);
+	pthread_barrier_wait(&barrier);
+	err = thread_cancel(remote_parker);
+	assert(!err);
+	err = pthread_join(worker, NULL);
+	assert(!err);
+	pthread_barrier_destroy(&barrier);
+
+	printf("%lu threads annulées en calcul, et une dans chaque attente\n", nb_threads);
+	thread_cond_destroy(&cond);
+	thread_mutex_destroy(&mutex);
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
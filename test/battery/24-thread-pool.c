@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "thread.h"
+#include "pool.h"
+
+/* comparaison entre un thread par requête et un pool de threads.
+ *
+ * chaque requête est d'abord exécutée par un thread_create/thread_join, puis soumise au pool.
+ * Le pool a une file de 4 requêtes: les soumissions non-bloquantes qui échouent sont refaites
+ * en mode bloquant.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de requêtes, nombre maximum de workers
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join()
+ * - thread_pool_init(), thread_pool_submit(), thread_pool_wait(), thread_pool_destroy()
+ */
+
+#define QUEUE_SIZE 4
+
+static void *request(void *_value) {
+	return (void *) ((unsigned long) _value * 2);
+}
+
+int main(int argc, char *argv[]) {
+	thread_future_t *futures;
+	thread_pool_t *pool;
+	thread_t th;
+	struct timeval tv1, tv2;
+	unsigned long us_create, us_pool;
+	int err, i, nb, workers, rejected = 0;
+	void *res;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de requêtes, nombre de workers\n");
+		return -1;
+	}
+
+	nb = atoi(argv[1]);
+	workers = atoi(argv[2]);
+
+	futures = malloc(nb * sizeof *futures);
+	if (nb > 0 && futures == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < nb; i++) {
+		err = thread_create(&th, request, (void *) (unsigned long) i);
+		assert(!err);
+		err = thread_join(th, &res);
+		assert(!err);
+		assert((unsigned long) res == (unsigned long) i * 2);
+	}
+	gettimeofday(&tv2, NULL);
+	us_create = (tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+
+	err = thread_pool_init(&pool, 1, workers, QUEUE_SIZE);
+	assert(!err);
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < nb; i++) {
+		if (thread_pool_submit(pool, &futures[i], request, (void *) (unsigned long) i, THREAD_POOL_NONBLOCK) != 0) {
+			rejected++;
+			err = thread_pool_submit(pool, &futures[i], request, (void *) (unsigned long) i, 0);
+			assert(!err);
+		}
+	}
+	for (i = 0; i < nb; i++) {
+		err = thread_pool_wait(&futures[i], &res);
+		assert(!err);
+		if ((unsigned long) res != (unsigned long) i * 2) {
+			printf("la requête %d a renvoyé %lu (FAILED)\n", i, (unsigned long) res);
+			return EXIT_FAILURE;
+		}
+	}
+	gettimeofday(&tv2, NULL);
+	us_pool = (tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+
+	thread_pool_destroy(pool);
+	free(futures);
+
+	printf("%d requêtes: %lu us avec un thread par requête, %lu us avec le pool (%d soumissions refusées)\n",
+	       nb, us_create, us_pool, rejected);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "thread.h"
+
+/* test de la mesure de la pile utilisée (peinture des piles).
+ *
+ * la i-ème thread fait i x (nombre de niveaux) appels récursifs qui utilisent chacun FRAME octets de pile.
+ * On vérifie que la profondeur mesurée augmente avec i, puis que la taille recommandée suffit
+ * pour recréer des threads avec une pile de cette taille.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de niveaux de récursion
+ *
+ * support nécessaire:
+ * - thread_create(), thread_create_attr(), thread_join(), thread_yield()
+ * - thread_attr_setstacksize()
+ * - thread_stack_paint_start(), thread_stack_usage(), thread_stack_recommended_size()
+ */
+
+#ifndef USE_PTHREAD
+
+#define FRAME 512
+
+static unsigned long nb_levels;
+static unsigned long nb_done = 0;
+
+static unsigned long recurse(unsigned long depth) {
+	volatile char buffer[FRAME];
+	buffer[0] = (char) depth;
+	if (depth == 0)
+		return buffer[0];
+	return recurse(depth - 1) + buffer[0];
+}
+
+static void *deep(void *index) {
+	recurse((unsigned long) index * nb_levels);
+	nb_done++;
+	return NULL;
+}
+
+static void *other(void *dummy __attribute__((unused))) {
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_threads, i;
+	thread_t *th, small;
+	thread_attr_t attr;
+	thread_stats_t stats;
+	long *usage;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de niveaux de récursion\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_levels = atoi(argv[2]);
+
+	th = malloc(nb_threads * sizeof *th);
+	usage = malloc(nb_threads * sizeof *usage);
+	if (th == NULL || usage == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	/* une pile créée avant la peinture n'est pas mesurée */
+	err = thread_create(&small, other, NULL);
+	assert(!err);
+	assert(thread_stack_usage(small) == -1);
+	err = thread_join(small, NULL);
+	assert(!err);
+
+	err = thread_stack_paint_start();
+	assert(!err);
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], deep, (void *) i);
+		assert(!err);
+	}
+	/* toutes les threads doivent avoir terminé, mais sans être jointes, pour être mesurées */
+	while (nb_done < nb_threads)
+		thread_yield();
+
+	for (i = 0; i < nb_threads; i++) {
+		usage[i] = thread_stack_usage(th[i]);
+		err = thread_stats_get(th[i], &stats);
+		assert(!err);
+		printf("thread %lu: %ld octets de pile utilisés\n", i, usage[i]);
+		assert(usage[i] >= (long) (i * nb_levels * FRAME));
+		assert(usage[i] < THREAD_STACK_SIZE_DEFAULT);
+		assert(stats.stack_high_water >= (unsigned long) usage[i]);
+		if (i > 0 && nb_levels > 0)
+			assert(usage[i] > usage[i - 1]);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+
+	/* la taille recommandée couvre la plus grande profondeur, et sert à recréer les threads */
+	assert(thread_stack_recommended_size(deep) >= (unsigned long) usage[nb_threads - 1]);
+	assert(thread_stack_recommended_size(NULL) >= thread_stack_recommended_size(deep));
+	assert(thread_stack_recommended_size(other) == 0);
+	printf("taille recommandée: %lu octets\n", thread_stack_recommended_size(deep));
+
+	thread_attr_init(&attr);
+	assert(thread_attr_setstacksize(&attr, THREAD_STACK_SIZE_MIN - 1) == -1);
+	err = thread_attr_setstacksize(&attr, thread_stack_recommended_size(deep));
+	assert(!err);
+	nb_done = 0;
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create_attr(&th[i], &attr, deep, (void *) i);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		assert(thread_stack_usage(th[i]) <= (long) thread_stack_recommended_size(deep));
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	assert(nb_done == nb_threads);
+
+	thread_stack_report(stdout, 10);
+
+	free(usage);
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
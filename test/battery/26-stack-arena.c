@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "thread.h"
+
+/* test de l'arène de piles dans des pages énormes.
+ *
+ * les threads prennent leur pile dans l'arène: elles sont regroupées dans le moins de pages énormes
+ * possible, et les piles libérées sont reprises par les threads suivantes sans nouvelle page.
+ * Puis l'arène repart avec des pages de garde: une thread qui déborde de sa pile meurt d'un SIGSEGV
+ * (dans un processus fils) au lieu d'écraser la thread voisine.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de yields
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_stack_arena_start(), thread_stack_arena_stop(), thread_stack_arena_stats()
+ * - thread_sched_stats()
+ */
+
+#ifndef USE_PTHREAD
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define FRAME 512
+
+static unsigned long nb_yields;
+
+static void *yielder(void *address) {
+	volatile char local = 0;
+	/* l'adresse d'une variable locale: où est la pile */
+	*(unsigned long *) address = (unsigned long) &local;
+	for (unsigned long i = 0; i < nb_yields; i++)
+		thread_yield();
+	return NULL;
+}
+
+/* jamais atteinte: la pile déborde avant */
+static volatile unsigned long max_depth = ~0UL;
+
+static unsigned long recurse(unsigned long depth) {
+	volatile char buffer[FRAME];
+	buffer[0] = (char) depth;
+	if (depth == max_depth)
+		return buffer[0];
+	return recurse(depth + 1) + buffer[0];
+}
+
+static void *overflow(void *dummy __attribute__((unused))) {
+	recurse(0);
+	return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Crée les threads et vérifie qu'elles se partagent le moins de pages énormes possible.
+ */
+static void run(thread_t *th, unsigned long *addresses, unsigned long nb_threads) {
+	thread_stack_arena_stats_t before, stats;
+	unsigned long *pages = malloc(nb_threads * sizeof *pages), nb_pages = 0, i;
+	int err;
+
+	assert(pages != NULL);
+	thread_stack_arena_stats(&before);
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], yielder, (void *) &addresses[i]);
+		assert(!err);
+	}
+	thread_yield();
+
+	thread_stack_arena_stats(&stats);
+	assert(stats.stacks_in_use == nb_threads);
+	assert(stats.stacks_allocated == before.stacks_allocated + nb_threads);
+	assert(stats.fallbacks == 0);
+	for (i = 0; i < nb_threads; i++)
+		pages[i] = addresses[i] / HUGE_PAGE_SIZE;
+	qsort(pages, nb_threads, sizeof *pages, compare);
+	for (i = 0; i < nb_threads; i++)
+		nb_pages += i == 0 || pages[i] != pages[i - 1];
+	assert(nb_pages == (nb_threads + stats.stacks_per_huge_page - 1) / stats.stacks_per_huge_page);
+	printf("%lu threads sur %lu pages énormes (%lu piles par page, %lu octets en pages énormes)\n",
+	       nb_threads, nb_pages, stats.stacks_per_huge_page, stats.huge_bytes);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	thread_stack_arena_stats(&stats);
+	assert(stats.stacks_in_use == 0);
+	free(pages);
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	thread_stack_arena_stats_t stats, guarded;
+	thread_sched_stats_t sched_stats;
+	unsigned long nb_threads, huge_pages;
+	unsigned long *addresses;
+	thread_t *th;
+	int err, status;
+	pid_t child;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de yields\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_yields = atoi(argv[2]);
+	th = malloc(nb_threads * sizeof *th);
+	addresses = malloc(nb_threads * sizeof *addresses);
+	assert(th != NULL && addresses != NULL);
+
+	assert(thread_stack_arena_start(THREAD_STACK_ARENA_HUGETLB | THREAD_STACK_ARENA_GUARD) == -1);
+	assert(thread_stack_arena_start(4) == -1);
+
+	err = thread_stack_arena_start(0);
+	assert(!err);
+	run(th, addresses, nb_threads);
+	thread_stack_arena_stats(&stats);
+	huge_pages = stats.huge_pages;
+
+	/* les piles libérées sont reprises, sans nouvelle page */
+	thread_sched_stats_reset();
+	run(th, addresses, nb_threads);
+	thread_stack_arena_stats(&stats);
+	assert(stats.huge_pages == huge_pages);
+	thread_sched_stats(&sched_stats);
+	assert(sched_stats.stacks_reused == nb_threads);
+
+	/* arrêtée, l'arène ne donne plus de piles */
+	err = thread_stack_arena_stop();
+	assert(!err);
+	err = thread_create(&th[0], yielder, (void *) &addresses[0]);
+	assert(!err);
+	err = thread_join(th[0], NULL);
+	assert(!err);
+	thread_stack_arena_stats(&stats);
+	assert(stats.stacks_allocated == 2 * nb_threads);
+
+	/* avec des pages de garde, les emplacements sont plus grands et dans de nouvelles pages */
+	err = thread_stack_arena_start(THREAD_STACK_ARENA_GUARD);
+	assert(!err);
+	run(th, addresses, nb_threads);
+	thread_stack_arena_stats(&guarded);
+	assert(guarded.stacks_per_huge_page < stats.stacks_per_huge_page);
+	assert(guarded.huge_pages > huge_pages);
+
+	child = fork();
+	assert(child != -1);
+	if (child == 0) {
+		thread_create(&th[0], overflow, NULL);
+		thread_join(th[0], NULL);
+		_exit(EXIT_SUCCESS);
+	}
+	err = waitpid(child, &status, 0);
+	assert(err == child);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+	printf("%lu pages énormes, %lu piles données dont %lu dans une page déjà utilisée\n",
+	       guarded.huge_pages, guarded.stacks_allocated, guarded.stacks_packed);
+	free(addresses);
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <malloc.h>
+#include "thread.h"
+
+/* test de la création de threads dans la mémoire de l'appelant (thread_create_inplace).
+ *
+ * les threads sont créées dans un tableau statique, plusieurs fois de suite dans les mêmes tampons:
+ * leur structure et leur pile y sont, la bibliothèque ne les libère pas au join, et après le premier
+ * tour, créer et joindre les threads n'alloue plus rien.
+ * Puis dans un tampon de malloc, libéré par le test, et un tampon trop petit est refusé.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de tours
+ *
+ * support nécessaire:
+ * - thread_create_inplace(), thread_join(), thread_self(), thread_yield()
+ */
+
+#ifndef USE_PTHREAD
+
+#define MAX_THREADS 64
+#define BUFFER_SIZE THREAD_INPLACE_SIZE(THREAD_STACK_SIZE_MIN)
+
+static char buffers[MAX_THREADS][BUFFER_SIZE];
+
+static int is_in(const void *address, const char *buffer, size_t size) {
+	return (uintptr_t) address >= (uintptr_t) buffer && (uintptr_t) address < (uintptr_t) buffer + size;
+}
+
+static void *thfunc(void *buffer) {
+	char local;
+
+	thread_yield();
+	/* sa structure et sa pile sont dans son tampon */
+	return is_in(thread_self(), buffer, BUFFER_SIZE) && is_in(&local, buffer, BUFFER_SIZE) ? buffer : NULL;
+}
+
+static void run(unsigned long nb_threads) {
+	thread_t th[MAX_THREADS];
+	void *ret;
+	int err;
+
+	for (unsigned long i = 0; i < nb_threads; i++) {
+		err = thread_create_inplace(&th[i], buffers[i], sizeof buffers[i], NULL, thfunc, buffers[i]);
+		assert(!err);
+	}
+	for (unsigned long i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], &ret);
+		assert(!err);
+		assert(ret == buffers[i]);
+	}
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_threads, nb_rounds;
+	thread_t th;
+	void *ret;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de tours\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_rounds = atoi(argv[2]);
+	if (nb_threads > MAX_THREADS)
+		nb_threads = MAX_THREADS;
+
+	/* le premier tour peut allouer pour l'ordonnanceur, les suivants rien */
+	run(nb_threads);
+	size_t allocated = mallinfo2().uordblks;
+	for (unsigned long round = 1; round < nb_rounds; round++)
+		run(nb_threads);
+	allocated = mallinfo2().uordblks - allocated;
+	assert(allocated == 0);
+
+	/* dans un tampon quelconque, non aligné, que le test libère après le join */
+	char *buffer = malloc(BUFFER_SIZE + 1);
+	assert(buffer != NULL);
+	err = thread_create_inplace(&th, buffer + 1, BUFFER_SIZE, NULL, thfunc, buffer + 1);
+	assert(!err);
+	err = thread_join(th, &ret);
+	assert(!err);
+	assert(ret == buffer + 1);
+	free(buffer);
+
+	err = thread_create_inplace(&th, buffers[0], BUFFER_SIZE - 1, NULL, thfunc, buffers[0]);
+	assert(err == -1);
+	err = thread_create_inplace(&th, NULL, BUFFER_SIZE, NULL, thfunc, NULL);
+	assert(err == -1);
+
+	printf("%lu tours de %lu threads créées dans des tampons de %d octets, %zu octets alloués après le premier\n",
+	       nb_rounds, nb_threads, BUFFER_SIZE, allocated);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "thread.h"
+
+/* test des générateurs: un générateur produit les entiers de 0 à n-1, un second générateur
+ * les filtre et renvoie les pairs multipliés par la valeur reçue du main.
+ *
+ * valgrind doit etre content.
+ * la durée du programme doit etre proportionnelle au nombre d'entiers donné en argument.
+ *
+ * support nécessaire:
+ * - thread_gen_create(), thread_gen_destroy()
+ * - thread_gen_resume(), thread_gen_yield() y compris depuis un générateur imbriqué
+ * - thread_gen_is_done()
+ */
+
+#ifndef USE_PTHREAD
+
+static void *counter(void *_nb) {
+	unsigned long nb = (unsigned long) _nb;
+	unsigned long i;
+
+	for (i = 0; i < nb; i++)
+		thread_gen_yield((void *) i);
+	return (void *) nb;
+}
+
+static void *evens(void *_source) {
+	thread_gen_t source = _source;
+	unsigned long value, factor = 0;
+
+	for (;;) {
+		value = (unsigned long) thread_gen_resume(source, NULL);
+		if (thread_gen_is_done(source))
+			return NULL;
+		if (value % 2 == 0)
+			factor = (unsigned long) thread_gen_yield((void *) (value * factor));
+	}
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	thread_gen_t source, filter;
+	unsigned long i, nb, value, expected, first;
+	struct timeval tv1, tv2;
+	unsigned long us;
+	int err;
+
+	if (argc < 2) {
+		printf("argument manquant: nombre d'entiers\n");
+		return -1;
+	}
+
+	nb = atoi(argv[1]);
+
+	err = thread_gen_create(&source, counter, (void *) nb);
+	assert(!err);
+	err = thread_gen_create(&filter, evens, source);
+	assert(!err);
+
+	gettimeofday(&tv1, NULL);
+	/* le premier resume démarre le générateur: la valeur envoyée est ignorée (facteur à 0) */
+	first = (unsigned long) thread_gen_resume(filter, (void *) 42);
+	for (i = 2; !thread_gen_is_done(filter); i += 2) {
+		value = (unsigned long) thread_gen_resume(filter, (void *) 3);
+		if (thread_gen_is_done(filter))
+			break;
+		expected = i * 3;
+		if (value != expected) {
+			printf("valeur %lu != %lu (FAILED)\n", value, expected);
+			return EXIT_FAILURE;
+		}
+	}
+	gettimeofday(&tv2, NULL);
+	us = (tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+
+	assert(first == 0);
+	assert(thread_gen_is_done(source));
+	assert(i >= nb);
+
+	thread_gen_destroy(filter);
+	thread_gen_destroy(source);
+
+	printf("%lu valeurs générées en %lu us\n", nb, us);
+	return EXIT_SUCCESS;
+#endif
+}
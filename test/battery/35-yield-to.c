@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "thread.h"
+
+/* test de latence d'un ping-pong entre deux threads, au milieu de plein de threads qui font des yields.
+ *
+ * le ping-pong est fait une fois avec thread_yield (il faut attendre tous les autres threads)
+ * puis avec thread_yield_to (le partenaire est exécuté immédiatement).
+ * Ensuite, avec THREAD_WAKEUP_NEXT, un joiner doit être exécuté juste après la mort du thread qu'il attend.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads en arrière-plan, nombre d'allers-retours
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_yield_to()
+ * - thread_set_wakeup_policy()
+ */
+
+#ifndef USE_PTHREAD
+
+static volatile int stop = 0;
+static volatile int joining = 0;
+static volatile unsigned long ball = 0, background_steps = 0, steps_at_exit = 0;
+static thread_t pinger;
+
+static void *background(void *dummy __attribute__((unused))) {
+	while (!stop) {
+		background_steps++;
+		thread_yield();
+	}
+	return NULL;
+}
+
+static void *ponger(void *_nb) {
+	unsigned long nb = (unsigned long) _nb, i;
+	int directed = nb & 1;
+	nb >>= 1;
+
+	for (i = 0; i < nb; i++) {
+		while (ball % 2 == 0)
+			directed ? thread_yield_to(pinger) : thread_yield();
+		ball++;
+	}
+	return NULL;
+}
+
+static void *dying(void *dummy __attribute__((unused))) {
+	while (!joining)
+		thread_yield();
+	steps_at_exit = background_steps;
+	return NULL;
+}
+
+/**
+ * @return The time of a round trip, in nanoseconds
+ */
+static unsigned long ping_pong(unsigned long nb, int directed) {
+	struct timeval tv1, tv2;
+	thread_t th;
+	unsigned long i;
+	int err;
+
+	ball = 0;
+	err = thread_create(&th, ponger, (void *) (nb << 1 | directed));
+	assert(!err);
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < nb; i++) {
+		ball++;
+		while (ball % 2 == 1)
+			directed ? thread_yield_to(th) : thread_yield();
+	}
+	gettimeofday(&tv2, NULL);
+
+	err = thread_join(th, NULL);
+	assert(!err);
+	assert(ball == 2 * nb);
+	return nb ? ((tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec)) * 1000 / nb : 0;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb, ns_yield, ns_yield_to;
+	int err, i, nb_background;
+	thread_t *th, dying_thread;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads en arrière-plan, nombre d'allers-retours\n");
+		return -1;
+	}
+
+	nb_background = atoi(argv[1]);
+	nb = atoi(argv[2]);
+	pinger = thread_self();
+	thread_sched_set_policy(THREAD_SCHED_FIFO);
+
+	th = malloc(nb_background * sizeof *th);
+	if (nb_background > 0 && th == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (i = 0; i < nb_background; i++) {
+		err = thread_create(&th[i], background, NULL);
+		assert(!err);
+	}
+
+	ns_yield = ping_pong(nb, 0);
+	ns_yield_to = ping_pong(nb, 1);
+
+	/* le joiner doit passer avant tous les threads en arrière-plan */
+	thread_set_wakeup_policy(THREAD_WAKEUP_NEXT);
+	err = thread_create(&dying_thread, dying, NULL);
+	assert(!err);
+	joining = 1;
+	err = thread_join(dying_thread, NULL);
+	assert(!err);
+	if (background_steps != steps_at_exit) {
+		printf("%lu yields en arrière-plan entre la mort et le join (FAILED)\n", background_steps - steps_at_exit);
+		return EXIT_FAILURE;
+	}
+	thread_set_wakeup_policy(THREAD_WAKEUP_FIFO);
+
+	stop = 1;
+	for (i = 0; i < nb_background; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	free(th);
+
+	printf("aller-retour avec %d threads en arrière-plan: %lu ns avec thread_yield, %lu ns avec thread_yield_to\n",
+	       nb_background, ns_yield, ns_yield_to);
+	return EXIT_SUCCESS;
+#endif
+}
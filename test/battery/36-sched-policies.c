@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include "thread.h"
+
+/* comparaison des politiques d'ordonnancement sur une charge mixte.
+ *
+ * des threads de calcul (priorité minimale) font des yields en boucle, et réveillent régulièrement
+ * un thread sensible à la latence (priorité maximale) bloqué sur une condition.
+ * Pour chaque politique, on mesure le délai entre le réveil et l'exécution du thread sensible,
+ * et le débit des threads de calcul.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads de calcul, nombre de réveils (x10)
+ *
+ * support nécessaire:
+ * - thread_create_attr(), thread_attr_init(), thread_attr_setpriority()
+ * - thread_sched_set_policy()
+ * - thread_mutex_*, thread_cond_*
+ */
+
+#ifndef USE_PTHREAD
+
+#define TICK_EVERY 16
+#define WORK 1000
+
+static thread_mutex_t lock;
+static thread_cond_t wakeup;
+static volatile int stop, pending;
+static unsigned long ticks, nb_ticks, iterations;
+static unsigned long long signal_time, latency_sum, latency_max;
+
+static unsigned long long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *latency_sensitive(void *dummy __attribute__((unused))) {
+	unsigned long long latency;
+
+	thread_mutex_lock(&lock);
+	while (ticks < nb_ticks) {
+		while (!pending)
+			thread_cond_wait(&wakeup, &lock);
+		pending = 0;
+
+		latency = now() - signal_time;
+		latency_sum += latency;
+		if (latency > latency_max)
+			latency_max = latency;
+		ticks++;
+	}
+	stop = 1;
+	thread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void *bulk(void *dummy __attribute__((unused))) {
+	volatile unsigned long sink = 0;
+	unsigned long i;
+
+	while (!stop) {
+		for (i = 0; i < WORK; i++)
+			sink += i;
+
+		if (++iterations % TICK_EVERY == 0 && !pending) {
+			thread_mutex_lock(&lock);
+			pending = 1;
+			signal_time = now();
+			thread_cond_signal(&wakeup);
+			thread_mutex_unlock(&lock);
+		}
+		thread_yield();
+	}
+	return NULL;
+}
+
+static int run(thread_sched_policy_t policy, const char *name, int nb_bulk) {
+	thread_attr_t high, low;
+	thread_t latency_thread, *bulk_threads;
+	unsigned long long start, elapsed;
+	int err, i;
+
+	stop = pending = 0;
+	ticks = iterations = 0;
+	latency_sum = latency_max = 0;
+
+	bulk_threads = malloc(nb_bulk * sizeof *bulk_threads);
+	if (nb_bulk > 0 && bulk_threads == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	err = thread_sched_set_policy(policy);
+	assert(!err);
+	thread_attr_init(&high);
+	thread_attr_setpriority(&high, THREAD_PRIORITY_MAX);
+	thread_attr_init(&low);
+	thread_attr_setpriority(&low, THREAD_PRIORITY_MIN);
+
+	start = now();
+	err = thread_create_attr(&latency_thread, &high, latency_sensitive, NULL);
+	assert(!err);
+	for (i = 0; i < nb_bulk; i++) {
+		err = thread_create_attr(&bulk_threads[i], &low, bulk, NULL);
+		assert(!err);
+	}
+
+	err = thread_join(latency_thread, NULL);
+	assert(!err);
+	for (i = 0; i < nb_bulk; i++) {
+		err = thread_join(bulk_threads[i], NULL);
+		assert(!err);
+	}
+	elapsed = now() - start;
+	free(bulk_threads);
+
+	if (ticks != nb_ticks) {
+		printf("%s: %lu réveils au lieu de %lu (FAILED)\n", name, ticks, nb_ticks);
+		return -1;
+	}
+
+	printf("%-8s latence moyenne %8llu ns, max %9llu ns, débit %8.1f itérations/ms\n",
+	       name, latency_sum / nb_ticks, latency_max, iterations * 1e6 / elapsed);
+	return 0;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	int nb_bulk;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads de calcul, nombre de réveils (x10)\n");
+		return -1;
+	}
+
+	nb_bulk = atoi(argv[1]);
+	nb_ticks = atoi(argv[2]) * 10;
+	if (nb_bulk < 1 || nb_ticks < 1) {
+		printf("il faut au moins un thread de calcul et un réveil\n");
+		return -1;
+	}
+
+	thread_mutex_init(&lock);
+	thread_cond_init(&wakeup);
+
+	if (run(THREAD_SCHED_FIFO, "fifo", nb_bulk) != 0
+	    || run(THREAD_SCHED_LIFO, "lifo", nb_bulk) != 0
+	    || run(THREAD_SCHED_PRIORITY, "priority", nb_bulk) != 0
+	    || run(THREAD_SCHED_FAIR, "fair", nb_bulk) != 0)
+		return EXIT_FAILURE;
+
+	thread_sched_set_policy(THREAD_SCHED_FIFO);
+	thread_cond_destroy(&wakeup);
+	thread_mutex_destroy(&lock);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "thread.h"
+
+/* test des statistiques des threads et de l'ordonnanceur.
+ *
+ * des threads font des yields, prennent un mutex partagé (et se bloquent dessus) et utilisent leur pile.
+ * On vérifie la cohérence des compteurs de chaque thread, puis ceux de l'ordonnanceur,
+ * et on affiche les percentiles du délai passé dans la file des threads prêts.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de yields par thread
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_mutex_*
+ * - thread_stats_get(), thread_sched_stats()
+ */
+
+#ifndef USE_PTHREAD
+
+#define STACK_USE 4096
+
+static thread_mutex_t lock;
+static unsigned long nb_yields;
+
+/**
+ * Use some stack before switching, so the high-water mark is visible.
+ */
+static unsigned long deep_yield(void) {
+	volatile char buffer[STACK_USE];
+	buffer[0] = 1;
+	thread_yield();
+	return buffer[0];
+}
+
+static void *worker(void *dummy __attribute__((unused))) {
+	unsigned long i;
+	thread_stats_t before, stats;
+
+	/* la profondeur de pile n'est mesurée que si le yield change vraiment de thread */
+	thread_stats_get(thread_self(), &before);
+	deep_yield();
+	thread_stats_get(thread_self(), &stats);
+	assert(stats.voluntary_switches == before.voluntary_switches || stats.stack_high_water >= STACK_USE);
+
+	for (i = 0; i < nb_yields; i++) {
+		thread_mutex_lock(&lock);
+		thread_yield(); // the others block on the mutex
+		thread_mutex_unlock(&lock);
+	}
+
+	thread_stats_get(thread_self(), &stats);
+	assert(stats.voluntary_switches >= before.voluntary_switches);
+	assert(stats.run_ns > before.run_ns);
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	thread_t *th;
+	thread_stats_t stats, main_stats;
+	thread_sched_stats_t sched;
+	unsigned long nb_threads, i, bucket_sum = 0, blocking = 0;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de yields par thread\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_yields = atoi(argv[2]);
+	thread_mutex_init(&lock);
+	thread_sched_stats_reset();
+
+	th = malloc(nb_threads * sizeof *th);
+	if (th == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], worker, NULL);
+		assert(!err);
+	}
+
+	for (i = 0; i < nb_threads; i++) {
+		thread_stats_get(th[i], &stats);
+		assert(stats.run_ns > 0);
+		blocking += stats.blocking_switches;
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	free(th);
+	thread_mutex_destroy(&lock);
+
+	thread_stats_get(thread_self(), &main_stats);
+	assert(main_stats.stack_high_water == 0);
+	assert(main_stats.run_ns > 0);
+
+	thread_sched_stats(&sched);
+	assert(sched.threads_created == nb_threads);
+	assert(sched.threads_exited == nb_threads);
+	assert(nb_threads == 0 || sched.voluntary_switches > 0);
+	assert(sched.blocking_switches >= blocking);
+	/* avec plusieurs threads, il y a forcément de la contention sur le mutex */
+	assert(nb_threads < 2 || nb_yields == 0 || blocking > 0);
+
+	for (i = 0; i < THREAD_STATS_DELAY_BUCKETS; i++)
+		bucket_sum += sched.delay_histogram[i];
+	assert(bucket_sum == sched.delay_count);
+	assert(sched.delay_count == sched.voluntary_switches + sched.blocking_switches + sched.exit_switches);
+	assert(sched.delay_p50_ns <= sched.delay_p90_ns);
+	assert(sched.delay_p90_ns <= sched.delay_p99_ns);
+	assert(sched.delay_p99_ns <= sched.delay_max_ns);
+
+	printf("%llu changements de contexte (%llu volontaires, %llu bloquants), délai dans la file: "
+	       "p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+	       sched.delay_count, sched.voluntary_switches, sched.blocking_switches,
+	       sched.delay_p50_ns, sched.delay_p90_ns, sched.delay_p99_ns, sched.delay_max_ns);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "thread.h"
+
+/* test du traceur d'évènements.
+ *
+ * des threads se passent un mutex en faisant des yields pendant que le traceur enregistre,
+ * dans un buffer plus petit que le nombre d'évènements (les plus anciens sont écrasés).
+ * On vérifie que le fichier écrit par thread_trace_dump contient le bon nombre d'évènements.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de yields par thread
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_mutex_*
+ * - thread_trace_start(), thread_trace_stop(), thread_trace_dump()
+ */
+
+#ifndef USE_PTHREAD
+
+#define RING_EVENTS 1024
+
+/* en-tête du fichier, voir thread/trace.h */
+struct header {
+	char magic[8];
+	unsigned int version, event_size;
+	unsigned long long events, lost;
+	unsigned long long start_tsc, start_ns, end_tsc, end_ns;
+};
+
+static thread_mutex_t lock;
+static unsigned long nb_yields;
+
+static void *worker(void *dummy __attribute__((unused))) {
+	unsigned long i;
+
+	for (i = 0; i < nb_yields; i++) {
+		thread_mutex_lock(&lock);
+		thread_yield();
+		thread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+/**
+ * @return Le nombre d'évènements dans le fichier
+ */
+static unsigned long long check(const char *path, unsigned long long min_events) {
+	struct header header;
+	size_t nb_read;
+	FILE *file = fopen(path, "r");
+	assert(file != NULL);
+	nb_read = fread(&header, sizeof header, 1, file);
+	fclose(file);
+	if (nb_read != 1) {
+		printf("fichier de trace vide (FAILED)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	assert(memcmp(header.magic, "THRTRACE", 8) == 0);
+	assert(header.events <= RING_EVENTS);
+	assert(header.events >= min_events);
+	assert(header.end_ns >= header.start_ns);
+	printf("%llu évènements dans la trace, %llu écrasés\n", header.events, header.lost);
+	return header.events;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	char path[] = "/tmp/thread-trace-XXXXXX";
+	thread_t *th;
+	unsigned long nb_threads, i;
+	unsigned long long nb_events;
+	int err, fd;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de yields par thread\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_yields = atoi(argv[2]);
+	thread_mutex_init(&lock);
+
+	th = malloc(nb_threads * sizeof *th);
+	fd = mkstemp(path);
+	if (th == NULL || fd == -1) {
+		perror("malloc/mkstemp");
+		return -1;
+	}
+	close(fd);
+
+	/* rien n'a été enregistré */
+	assert(thread_trace_dump(path) == -1);
+
+	err = thread_trace_start(RING_EVENTS - 1); /* arrondi à une puissance de deux */
+	assert(!err);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], worker, NULL);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+
+	thread_trace_stop();
+	/* au moins une création, un changement de contexte et une fin par thread */
+	err = thread_trace_dump(path);
+	assert(!err);
+	nb_events = check(path, 3 * nb_threads < RING_EVENTS ? 3 * nb_threads : RING_EVENTS);
+
+	/* plus rien n'est enregistré après l'arrêt */
+	err = thread_create(&th[0], worker, NULL);
+	assert(!err);
+	err = thread_join(th[0], NULL);
+	assert(!err);
+	err = thread_trace_dump(path);
+	assert(!err);
+	if (check(path, 0) != nb_events) {
+		printf("des évènements ont été enregistrés après thread_trace_stop (FAILED)\n");
+		return EXIT_FAILURE;
+	}
+
+	unlink(path);
+	free(th);
+	thread_mutex_destroy(&lock);
+	return EXIT_SUCCESS;
+#endif
+}
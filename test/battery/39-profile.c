@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "thread.h"
+
+/* test du profileur par échantillonnage.
+ *
+ * des threads calculent en faisant des yields pendant que le profileur tourne,
+ * puis on vérifie que le profil (au format des flame graphs) attribue des échantillons à ces threads.
+ * Les échantillons de chacune sont affichés, mais une thread peut ne pas en avoir: seul le total compte.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, temps de calcul par thread (x10 ms)
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_profile_start(), thread_profile_stop(), thread_profile_dump()
+ */
+
+#ifndef USE_PTHREAD
+
+static unsigned long long work_ns;
+
+static unsigned long long cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker(void *dummy __attribute__((unused))) {
+	unsigned long long spent = 0, start;
+	volatile unsigned long sum = 0;
+	unsigned long i;
+
+	/* toutes les threads partagent le thread noyau: on compte le temps processeur entre les yields */
+	while (spent < work_ns) {
+		start = cpu_ns();
+		for (i = 0; i < 100000; i++)
+			sum += i;
+		spent += cpu_ns() - start;
+		thread_yield();
+	}
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	char path[] = "/tmp/thread-profile-XXXXXX", line[4096], prefix[32];
+	unsigned long nb_threads, i, samples = 0, threads_samples = 0, *thread_samples;
+	thread_t *th;
+	FILE *file;
+	int err, fd;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, temps de calcul par thread (x10 ms)\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	work_ns = atoi(argv[2]) * 10000000ULL;
+
+	th = malloc(nb_threads * sizeof *th);
+	thread_samples = calloc(nb_threads + 1, sizeof *thread_samples);
+	fd = mkstemp(path);
+	if (th == NULL || thread_samples == NULL || fd == -1) {
+		perror("malloc/mkstemp");
+		return -1;
+	}
+	close(fd);
+
+	err = thread_profile_start(1000);
+	assert(!err);
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], worker, NULL);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	thread_profile_stop();
+	err = thread_profile_dump(path);
+	assert(!err);
+
+	/* une ligne par pile: "thread-<n>;f1;f2 <nombre>" */
+	file = fopen(path, "r");
+	assert(file != NULL);
+	while (fgets(line, sizeof line, file) != NULL) {
+		char *count = strrchr(line, ' ');
+		assert(count != NULL);
+		samples += atol(count + 1);
+		for (i = 1; i <= nb_threads; i++) {
+			snprintf(prefix, sizeof prefix, "thread-%lu;", i);
+			if (strncmp(line, prefix, strlen(prefix)) == 0)
+				thread_samples[i] += atol(count + 1);
+		}
+	}
+	fclose(file);
+	unlink(path);
+
+	printf("%lu échantillons:", samples);
+	for (i = 1; i <= nb_threads; i++) {
+		printf(" %lu", thread_samples[i]);
+		threads_samples += thread_samples[i];
+	}
+	printf("\n");
+
+	/* le compteur de threads est global: les threads de ce test ne sont numérotées à partir de 1
+	 * que si c'est le premier à en créer, ce qui est le cas ici */
+	if (threads_samples == 0) {
+		printf("aucun échantillon pour les threads (FAILED)\n");
+		return EXIT_FAILURE;
+	}
+
+	free(thread_samples);
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
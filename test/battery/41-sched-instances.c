@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "thread.h"
+
+/* test des ordonnanceurs indépendants, un par thread noyau.
+ *
+ * chaque thread noyau crée son ordonnanceur et y lance des threads qui font des yield:
+ * les statistiques sont propres à chaque ordonnanceur.
+ * Puis le thread principal poste une fonction à chaque ordonnanceur pour réveiller sa thread principale,
+ * et un jeton fait plusieurs tours des threads noyau avec thread_park() et thread_unpark().
+ * thread_park() peut rendre la main pour un réveil destiné à plus tard: on attend dans une boucle.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads noyau, nombre de threads par thread noyau
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_sched_self(), thread_sched_post(), thread_park(), thread_unpark()
+ * - thread_sched_stats()
+ */
+
+#ifndef USE_PTHREAD
+
+#define NB_YIELDS 10
+#define NB_ROUNDS 100
+#define MAX_WORKERS 16
+
+static unsigned long nb_workers, nb_threads;
+static pthread_barrier_t barrier;
+static thread_sched_t *scheds[MAX_WORKERS];
+static thread_t owners[MAX_WORKERS];
+static unsigned long yields[MAX_WORKERS];
+static unsigned long posted[MAX_WORKERS];
+static unsigned long token = 0;
+
+static void *yielder(void *worker) {
+	for (int i = 0; i < NB_YIELDS; i++) {
+		/* pas de verrou: seules les threads de cet ordonnanceur y touchent */
+		yields[(unsigned long) worker]++;
+		thread_yield();
+	}
+	return NULL;
+}
+
+static void start(void *worker) {
+	posted[(unsigned long) worker]++;
+	thread_unpark(owners[(unsigned long) worker]);
+}
+
+static void *worker_main(void *_worker) {
+	unsigned long worker = (unsigned long) _worker, i;
+	thread_t *th = malloc(nb_threads * sizeof *th);
+	thread_sched_stats_t stats;
+	int err;
+
+	assert(th != NULL);
+	scheds[worker] = thread_sched_self();
+	assert(thread_sched_self() == scheds[worker]);
+	owners[worker] = thread_self();
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], yielder, (void *) worker);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	assert(yields[worker] == nb_threads * NB_YIELDS);
+	thread_sched_stats(&stats);
+	assert(stats.voluntary_switches >= nb_threads * NB_YIELDS);
+	free(th);
+
+	pthread_barrier_wait(&barrier);
+
+	/* réveillée par la fonction que le thread principal poste,
+	 * ou avant par le jeton: thread_park peut rendre la main pour un thread_unpark précédent */
+	while (posted[worker] == 0) {
+		err = thread_park();
+		assert(!err);
+	}
+	assert(posted[worker] == 1);
+
+	/* le jeton passe au thread noyau suivant */
+	for (i = 0; i < NB_ROUNDS; i++) {
+		while (__atomic_load_n(&token, __ATOMIC_ACQUIRE) != i * nb_workers + worker) {
+			err = thread_park();
+			assert(!err);
+		}
+		__atomic_store_n(&token, token + 1, __ATOMIC_RELEASE);
+		if (worker != nb_workers - 1 || i != NB_ROUNDS - 1) {
+			err = thread_unpark(owners[(worker + 1) % nb_workers]);
+			assert(!err);
+		}
+	}
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	pthread_t workers[MAX_WORKERS];
+	thread_sched_stats_t stats;
+	unsigned long i, j;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads noyau, nombre de threads par thread noyau\n");
+		return -1;
+	}
+
+	nb_workers = atoi(argv[1]);
+	nb_threads = atoi(argv[2]);
+	if (nb_workers < 1)
+		nb_workers = 1;
+	if (nb_workers > MAX_WORKERS)
+		nb_workers = MAX_WORKERS;
+
+	thread_sched_stats_reset();
+	pthread_barrier_init(&barrier, NULL, nb_workers + 1);
+	for (i = 0; i < nb_workers; i++) {
+		err = pthread_create(&workers[i], NULL, worker_main, (void *) i);
+		assert(!err);
+	}
+	pthread_barrier_wait(&barrier);
+
+	/* chaque thread noyau a son propre ordonnanceur */
+	for (i = 0; i < nb_workers; i++) {
+		assert(scheds[i] != thread_sched_self());
+		for (j = 0; j < i; j++)
+			assert(scheds[i] != scheds[j]);
+	}
+	/* les yield des autres ordonnanceurs ne sont pas comptés ici */
+	thread_sched_stats(&stats);
+	assert(stats.voluntary_switches == 0);
+
+	for (i = 0; i < nb_workers; i++) {
+		err = thread_sched_post(scheds[i], start, (void *) i);
+		assert(!err);
+	}
+	for (i = 0; i < nb_workers; i++) {
+		err = pthread_join(workers[i], NULL);
+		assert(!err);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	assert(token == NB_ROUNDS * nb_workers);
+	printf("%lu threads noyau, le jeton a fait %d tours\n", nb_workers, NB_ROUNDS);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "thread.h"
+
+/* test du placement NUMA.
+ *
+ * chaque thread noyau s'épingle à un processeur, et prend le nœud NUMA de ce processeur.
+ * Puis le thread principal crée des threads épinglées à chaque nœud, et à chaque ordonnanceur:
+ * elles vérifient qu'elles tournent au bon endroit, et sont jointes par une thread de leur ordonnanceur.
+ * Enfin, les piles libérées sont réutilisées par les threads suivantes du même nœud.
+ * Avec THREAD_NUMA_NODES=2, la topologie est simulée.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads noyau, nombre de threads
+ *
+ * support nécessaire:
+ * - thread_create_attr(), thread_join(), thread_yield(), thread_park(), thread_unpark()
+ * - thread_attr_setnode(), thread_attr_setsched()
+ * - thread_numa_nodes(), thread_sched_pin(), thread_sched_cpu(), thread_sched_node()
+ */
+
+#ifndef USE_PTHREAD
+
+#define MAX_WORKERS 16
+#define MAX_JOBS 256
+
+struct job {
+	thread_t thread;
+	/* où elle doit tourner (NULL ou -1 pour n'importe où), et où elle a tourné */
+	thread_sched_t *expected;
+	int node;
+	thread_sched_t *sched;
+};
+
+static unsigned long nb_workers;
+static pthread_barrier_t barrier;
+static thread_sched_t *scheds[MAX_WORKERS];
+static thread_t owners[MAX_WORKERS];
+static int cpus[CPU_SETSIZE], nb_cpus = 0;
+static struct job jobs[MAX_JOBS];
+static unsigned long nb_jobs = 0, nb_done = 0;
+static int is_stopping = 0;
+static thread_t main_thread;
+
+static void *job_main(void *_job) {
+	struct job *job = _job;
+
+	job->sched = thread_sched_self();
+	if (job->expected != NULL)
+		assert(job->sched == job->expected);
+	if (job->node != -1)
+		assert(thread_sched_node(job->sched) == job->node);
+	thread_yield();
+
+	if (__atomic_add_fetch(&nb_done, 1, __ATOMIC_SEQ_CST) == nb_jobs)
+		thread_unpark(main_thread);
+	return job;
+}
+
+static void *nothing(void *arg) {
+	return arg;
+}
+
+static void join_jobs(thread_sched_t *sched) {
+	void *ret;
+	int err;
+
+	for (unsigned long i = 0; i < nb_jobs; i++) {
+		if (jobs[i].sched == sched) {
+			err = thread_join(jobs[i].thread, &ret);
+			assert(!err);
+			assert(ret == &jobs[i]);
+		}
+	}
+}
+
+static void *worker_main(void *_worker) {
+	unsigned long worker = (unsigned long) _worker;
+	int cpu = cpus[worker % nb_cpus], err;
+
+	scheds[worker] = thread_sched_self();
+	owners[worker] = thread_self();
+	err = thread_sched_pin(cpu);
+	assert(!err);
+	assert(thread_sched_cpu(scheds[worker]) == cpu);
+	assert(sched_getcpu() == cpu);
+	assert(thread_sched_node(scheds[worker]) >= 0);
+	assert(thread_sched_node(scheds[worker]) < (int) thread_numa_nodes());
+
+	pthread_barrier_wait(&barrier);
+	while (!__atomic_load_n(&is_stopping, __ATOMIC_SEQ_CST))
+		thread_park();
+
+	join_jobs(scheds[worker]);
+	return NULL;
+}
+
+static int create_job(thread_sched_t *sched, int node) {
+	thread_attr_t attr;
+	struct job *job = &jobs[nb_jobs];
+	int err;
+
+	thread_attr_init(&attr);
+	err = thread_attr_setnode(&attr, node);
+	assert(!err);
+	err = thread_attr_setsched(&attr, sched);
+	assert(!err);
+	job->expected = sched;
+	job->node = sched == NULL ? node : -1;
+	job->sched = NULL;
+	/* compté avant la création: la thread peut finir tout de suite */
+	nb_jobs++;
+	if (thread_create_attr(&job->thread, &attr, job_main, job) != 0) {
+		nb_jobs--;
+		return -1;
+	}
+	return 0;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	pthread_t workers[MAX_WORKERS];
+	thread_sched_stats_t stats;
+	thread_attr_t attr;
+	thread_t *th;
+	cpu_set_t allowed;
+	unsigned long nb_threads, i, w;
+	int node, err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads noyau, nombre de threads\n");
+		return -1;
+	}
+
+	nb_workers = atoi(argv[1]);
+	nb_threads = atoi(argv[2]);
+	if (nb_workers < 1)
+		nb_workers = 1;
+	if (nb_workers > MAX_WORKERS)
+		nb_workers = MAX_WORKERS;
+	if (nb_threads > MAX_JOBS / (nb_workers + 8))
+		nb_threads = MAX_JOBS / (nb_workers + 8);
+
+	th = malloc(nb_threads * sizeof *th);
+	assert(th != NULL);
+	main_thread = thread_self();
+	err = sched_getaffinity(0, sizeof allowed, &allowed);
+	assert(!err);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &allowed))
+			cpus[nb_cpus++] = (int) i;
+	assert(nb_cpus > 0);
+	assert(thread_numa_nodes() >= 1);
+
+	thread_attr_init(&attr);
+	err = thread_attr_setnode(&attr, -2);
+	assert(err == -1);
+	err = thread_attr_setnode(&attr, (int) thread_numa_nodes());
+	assert(err == -1);
+
+	pthread_barrier_init(&barrier, NULL, nb_workers + 1);
+	for (w = 0; w < nb_workers; w++) {
+		err = pthread_create(&workers[w], NULL, worker_main, (void *) w);
+		assert(!err);
+	}
+	pthread_barrier_wait(&barrier);
+
+	/* des threads sur chaque nœud: la création échoue s'il n'y a pas d'ordonnanceur sur le nœud */
+	for (node = 0; node < (int) thread_numa_nodes(); node++) {
+		int has_sched = thread_sched_node(thread_sched_self()) == node;
+		for (w = 0; w < nb_workers; w++)
+			has_sched |= thread_sched_node(scheds[w]) == node;
+
+		for (i = 0; i < nb_threads; i++) {
+			err = create_job(NULL, node);
+			assert((err == 0) == has_sched);
+		}
+	}
+	/* et sur chaque ordonnanceur */
+	for (w = 0; w < nb_workers; w++) {
+		for (i = 0; i < nb_threads; i++) {
+			err = create_job(scheds[w], -1);
+			assert(!err);
+		}
+	}
+
+	thread_sched_stats(&stats);
+	printf("%lu threads créées, %lu envoyées à un autre ordonnanceur\n", nb_jobs, stats.threads_sent);
+
+	while (__atomic_load_n(&nb_done, __ATOMIC_SEQ_CST) < nb_jobs)
+		thread_park();
+	join_jobs(thread_sched_self());
+
+	__atomic_store_n(&is_stopping, 1, __ATOMIC_SEQ_CST);
+	for (w = 0; w < nb_workers; w++) {
+		err = thread_unpark(owners[w]);
+		assert(!err);
+	}
+	for (w = 0; w < nb_workers; w++) {
+		err = pthread_join(workers[w], NULL);
+		assert(!err);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	/* les piles des threads jointes sont réutilisées */
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], nothing, NULL);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	thread_sched_stats_reset();
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], nothing, NULL);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	thread_sched_stats(&stats);
+	assert(stats.stacks_reused == nb_threads);
+	printf("%u nœuds NUMA, %lu piles réutilisées\n", thread_numa_nodes(), stats.stacks_reused);
+
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "thread.h"
+#include "forkjoin.h"
+
+/* fibonacci avec le pool fork-join.
+ *
+ * même calcul que 51-fibonacci, mais chaque découpage est un fj_spawn/fj_join au lieu d'un
+ * thread_create/thread_join: les sous-tâches qui n'ont pas été volées sont exécutées directement.
+ * valgrind doit être content.
+ *
+ * arguments: entier x pour lequel calculer fibonacci(x), nombre de workers (1 par défaut)
+ *
+ * support nécessaire:
+ * - fj_pool_init(), fj_pool_run(), fj_pool_destroy()
+ * - fj_spawn(), fj_join()
+ */
+
+static void *fibo(void *_value) {
+	unsigned long value = (unsigned long) _value;
+	fj_task_t task;
+	void *res, *res2;
+
+	if (value < 3)
+		return (void *) 1;
+
+	fj_spawn(&task, fibo, (void *) (value - 1));
+	res2 = fibo((void *) (value - 2));
+	res = fj_join(&task);
+
+	return (void *) ((unsigned long) res + (unsigned long) res2);
+}
+
+unsigned long fibo_checker(unsigned long n) {
+	unsigned long a = 1;
+	unsigned long b = 1;
+	unsigned long c, i;
+
+	if (n <= 2) {
+		return 1;
+	}
+
+	for (i = 2; i < n; i++) {
+		c = a + b;
+		a = b;
+		b = c;
+	}
+	return c;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long value, res;
+	unsigned int workers = 1;
+	struct timeval tv1, tv2;
+	fj_pool_t *pool;
+	double s;
+
+	if (argc < 2) {
+		printf("argument manquant: entier x pour lequel calculer fibonacci(x)\n");
+		return -1;
+	}
+
+	value = atoi(argv[1]);
+	if (argc > 2)
+		workers = atoi(argv[2]);
+
+	if (fj_pool_init(&pool, workers) != 0) {
+		printf("fj_pool_init a échoué\n");
+		return EXIT_FAILURE;
+	}
+
+	gettimeofday(&tv1, NULL);
+	res = (unsigned long) fj_pool_run(pool, fibo, (void *) value);
+	gettimeofday(&tv2, NULL);
+	s = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) * 1e-6;
+
+	fj_pool_destroy(pool);
+
+	if (res != fibo_checker(value)) {
+		printf("fibo de %lu != %lu (FAILED)\n", value, fibo_checker(value));
+		return EXIT_FAILURE;
+	} else {
+		printf("fibo de %lu = %lu en %e s avec %u workers\n", value, res, s, workers);
+		return EXIT_SUCCESS;
+	}
+}
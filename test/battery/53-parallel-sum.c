@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "thread.h"
+#include "forkjoin.h"
+
+/* somme parallèle d'un tableau avec fj_parallel_for et fj_parallel_reduce.
+ *
+ * le tableau contient x * 100000 entiers, la somme est vérifiée avec la formule.
+ * valgrind doit être content.
+ *
+ * arguments: x, nombre de workers (1 par défaut), taille des sous-intervalles (automatique par défaut)
+ *
+ * support nécessaire:
+ * - fj_pool_init(), fj_pool_run(), fj_pool_destroy()
+ * - fj_parallel_for(), fj_parallel_reduce()
+ */
+
+struct sum {
+	unsigned long *values;
+	long n, grain;
+};
+
+static void fill(long begin, long end, void *_sum) {
+	struct sum *sum = _sum;
+	for (long i = begin; i < end; i++)
+		sum->values[i] = i;
+}
+
+static void *partial_sum(long begin, long end, void *_sum) {
+	struct sum *sum = _sum;
+	unsigned long total = 0;
+	for (long i = begin; i < end; i++)
+		total += sum->values[i];
+	return (void *) total;
+}
+
+static void *add(void *left, void *right, void *_sum __attribute__((unused))) {
+	return (void *) ((unsigned long) left + (unsigned long) right);
+}
+
+static void *run(void *_sum) {
+	struct sum *sum = _sum;
+	fj_parallel_for(0, sum->n, sum->grain, fill, sum);
+	return fj_parallel_reduce(0, sum->n, sum->grain, partial_sum, add, sum);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long res, expected;
+	unsigned int workers = 1;
+	struct timeval tv1, tv2;
+	struct sum sum;
+	fj_pool_t *pool;
+	unsigned long us;
+
+	if (argc < 2) {
+		printf("argument manquant: taille du tableau (en centaines de milliers)\n");
+		return -1;
+	}
+
+	sum.n = atol(argv[1]) * 100000;
+	sum.grain = 0;
+	if (argc > 2)
+		workers = atoi(argv[2]);
+	if (argc > 3)
+		sum.grain = atol(argv[3]);
+
+	sum.values = malloc(sum.n * sizeof *sum.values);
+	if (sum.n > 0 && sum.values == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	if (fj_pool_init(&pool, workers) != 0) {
+		printf("fj_pool_init a échoué\n");
+		return EXIT_FAILURE;
+	}
+
+	gettimeofday(&tv1, NULL);
+	res = (unsigned long) fj_pool_run(pool, run, &sum);
+	gettimeofday(&tv2, NULL);
+	us = (tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+
+	fj_pool_destroy(pool);
+	free(sum.values);
+
+	expected = sum.n > 0 ? (unsigned long) sum.n * (sum.n - 1) / 2 : 0;
+	if (res != expected) {
+		printf("somme de %ld entiers: %lu != %lu (FAILED)\n", sum.n, res, expected);
+		return EXIT_FAILURE;
+	}
+
+	printf("somme de %ld entiers = %lu en %lu us avec %u workers\n", sum.n, res, us, workers);
+	return EXIT_SUCCESS;
+}
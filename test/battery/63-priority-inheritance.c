@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "thread.h"
+
+/* test de l'héritage de priorité des mutex, avec la politique à priorités.
+ *
+ * une thread de basse priorité tient un mutex qu'une thread de haute priorité attend, pendant que
+ * des threads de priorité moyenne calculent: sans héritage, les threads moyennes passent avant la basse,
+ * et la haute attend qu'elles aient fini (inversion de priorité).
+ * Avec l'héritage, la basse prend la priorité de la haute jusqu'à ce qu'elle rende le mutex,
+ * et la haute l'obtient avant que les moyennes ne tournent.
+ * Puis avec une chaîne: la haute attend un mutex tenu par une thread qui attend celui de la basse.
+ * L'ordre d'exécution est déterministe.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads moyennes, nombre de pas de chaque thread
+ *
+ * support nécessaire:
+ * - thread_create_attr(), thread_attr_setpriority(), thread_join(), thread_park(), thread_unpark()
+ * - thread_setpriority(), thread_getpriority(), thread_sched_set_policy()
+ * - thread_mutex_*
+ * - thread_sched_stats()
+ */
+
+#ifndef USE_PTHREAD
+
+#define LOW 1
+#define CHAIN 2
+#define MEDIUM 10
+#define HIGH 20
+#define MAX_MEDIUMS 64
+
+static thread_mutex_t held_by_low, held_by_chain;
+static thread_t low;
+static unsigned long nb_steps;
+/* pas des threads moyennes faits, et quand la haute a eu le mutex */
+static unsigned long medium_steps, medium_steps_when_high_locked;
+static int is_chained;
+
+static thread_t create(void *(*func)(void *), int priority) {
+	thread_attr_t attr;
+	thread_t thread;
+	int err;
+
+	thread_attr_init(&attr);
+	err = thread_attr_setpriority(&attr, priority);
+	assert(!err);
+	err = thread_create_attr(&thread, &attr, func, NULL);
+	assert(!err);
+	return thread;
+}
+
+static void *low_main(void *dummy __attribute__((unused))) {
+	int err;
+
+	/* créée avec la priorité maximale: prend le mutex tout de suite, puis attend la haute */
+	thread_mutex_lock(&held_by_low);
+	err = thread_setpriority(thread_self(), LOW);
+	assert(!err);
+	thread_park();
+
+	/* la haute attend, directement ou par la chaîne: la basse a sa priorité */
+	assert(thread_getpriority(thread_self()) == HIGH);
+	for (unsigned long i = 0; i < nb_steps; i++)
+		thread_yield();
+	thread_mutex_unlock(&held_by_low);
+	assert(thread_getpriority(thread_self()) == LOW);
+	return NULL;
+}
+
+static void *chain_main(void *dummy __attribute__((unused))) {
+	int err;
+
+	thread_mutex_lock(&held_by_chain);
+	err = thread_setpriority(thread_self(), CHAIN);
+	assert(!err);
+	/* bloquée: la basse prend sa priorité */
+	thread_mutex_lock(&held_by_low);
+	assert(thread_getpriority(thread_self()) == HIGH);
+
+	thread_mutex_unlock(&held_by_low);
+	thread_mutex_unlock(&held_by_chain);
+	assert(thread_getpriority(thread_self()) == CHAIN);
+	return NULL;
+}
+
+static void *medium_main(void *dummy __attribute__((unused))) {
+	for (unsigned long i = 0; i < nb_steps; i++) {
+		medium_steps++;
+		thread_yield();
+	}
+	return NULL;
+}
+
+static void *high_main(void *dummy __attribute__((unused))) {
+	thread_mutex_t *mutex = is_chained ? &held_by_chain : &held_by_low;
+
+	thread_unpark(low);
+	thread_mutex_lock(mutex);
+	medium_steps_when_high_locked = medium_steps;
+	thread_mutex_unlock(mutex);
+	return NULL;
+}
+
+static void run(unsigned long nb_mediums) {
+	thread_t th[MAX_MEDIUMS + 3];
+	thread_sched_stats_t stats;
+	unsigned long nb_threads = 0, i;
+	int err;
+
+	medium_steps = 0;
+	medium_steps_when_high_locked = ~0UL;
+	thread_sched_stats_reset();
+
+	/* le thread principal garde la main pendant les créations, sauf pour celles qui prennent leur mutex */
+	err = thread_setpriority(thread_self(), THREAD_PRIORITY_MAX);
+	assert(!err);
+	low = th[nb_threads++] = create(low_main, THREAD_PRIORITY_MAX);
+	if (is_chained)
+		th[nb_threads++] = create(chain_main, THREAD_PRIORITY_MAX);
+	for (i = 0; i < nb_mediums; i++)
+		th[nb_threads++] = create(medium_main, MEDIUM);
+	th[nb_threads++] = create(high_main, HIGH);
+
+	/* puis passe après toutes les autres */
+	err = thread_setpriority(thread_self(), THREAD_PRIORITY_MIN);
+	assert(!err);
+	thread_yield();
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	assert(medium_steps == nb_mediums * nb_steps);
+	assert(medium_steps_when_high_locked == 0);
+
+	thread_sched_stats(&stats);
+	/* la basse, puis la chaîne et la basse encore */
+	assert(stats.priority_boosts == (is_chained ? 3 : 1));
+	printf("%s: la haute a eu le mutex après %lu pas des moyennes sur %lu, %lu priorités relevées\n",
+	       is_chained ? "chaîne" : "directe", medium_steps_when_high_locked, medium_steps, stats.priority_boosts);
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_mediums;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads moyennes, nombre de pas\n");
+		return -1;
+	}
+
+	nb_mediums = atoi(argv[1]);
+	nb_steps = atoi(argv[2]);
+	if (nb_mediums > MAX_MEDIUMS)
+		nb_mediums = MAX_MEDIUMS;
+
+	err = thread_sched_set_policy(THREAD_SCHED_PRIORITY);
+	assert(!err);
+	thread_mutex_init(&held_by_low);
+	thread_mutex_init(&held_by_chain);
+
+	is_chained = 0;
+	run(nb_mediums);
+	is_chained = 1;
+	run(nb_mediums);
+
+	thread_mutex_destroy(&held_by_low);
+	thread_mutex_destroy(&held_by_chain);
+	return EXIT_SUCCESS;
+#endif
+}
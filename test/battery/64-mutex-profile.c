@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "thread.h"
+
+/* test du profileur de contention des mutex.
+ *
+ * les threads prennent deux mutex: l'un est gardé pendant un yield (très disputé),
+ * l'autre est relâché tout de suite (jamais disputé).
+ * Le rapport doit classer le mutex disputé en premier, et l'échantillonnage doit réduire
+ * le nombre d'acquisitions mesurées.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de boucles par thread
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_mutex_*
+ * - thread_mutex_profile_*()
+ */
+
+#ifndef USE_PTHREAD
+
+#define SAMPLE_EVERY 4
+
+static thread_mutex_t hot, cold;
+static unsigned long nb_loops;
+
+static void *worker(void *dummy __attribute__((unused))) {
+	unsigned long i;
+
+	for (i = 0; i < nb_loops; i++) {
+		thread_mutex_lock(&hot);
+		thread_yield();
+		thread_mutex_unlock(&hot);
+
+		thread_mutex_lock(&cold);
+		thread_mutex_unlock(&cold);
+	}
+	return NULL;
+}
+
+static void run(unsigned long nb_threads) {
+	thread_t *th = malloc(nb_threads * sizeof *th);
+	unsigned long i;
+	int err;
+
+	assert(th != NULL);
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], worker, NULL);
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	free(th);
+}
+
+/**
+ * @return Le nombre d'acquisitions du mutex dans le rapport, -1 s'il n'y est pas
+ */
+static long acquisitions(const char *report, thread_mutex_t *mutex, unsigned int *rank) {
+	char pattern[64];
+	const char *line;
+	long count;
+
+	snprintf(pattern, sizeof pattern, " mutex %p: ", (void *) mutex);
+	line = strstr(report, pattern);
+	if (line == NULL)
+		return -1;
+	count = atol(line + strlen(pattern));
+
+	/* le rang est juste avant: "#<rang> mutex" */
+	while (line > report && line[-1] != '#')
+		line--;
+	*rank = atoi(line);
+	return count;
+}
+
+static char *report(void) {
+	char *buffer = NULL;
+	size_t size = 0;
+	FILE *file = open_memstream(&buffer, &size);
+	assert(file != NULL);
+	thread_mutex_profile_report(file, 10);
+	fclose(file);
+	return buffer;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_threads;
+	unsigned int hot_rank = 0, cold_rank = 0;
+	long hot_count, cold_count;
+	char *text;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de boucles par thread\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_loops = atoi(argv[2]);
+	thread_mutex_init(&hot);
+	thread_mutex_init(&cold);
+
+	/* tout est mesuré */
+	thread_mutex_profile_start(1);
+	run(nb_threads);
+	thread_mutex_profile_stop();
+
+	text = report();
+	hot_count = acquisitions(text, &hot, &hot_rank);
+	cold_count = acquisitions(text, &cold, &cold_rank);
+	assert(hot_count == (long) (nb_threads * nb_loops));
+	assert(cold_count == (long) (nb_threads * nb_loops));
+	if (nb_threads > 1 && nb_loops > 0 && hot_rank != 1) {
+		printf("%s\nle mutex disputé est classé %u (FAILED)\n", text, hot_rank);
+		return EXIT_FAILURE;
+	}
+	printf("%s", text);
+	free(text);
+
+	/* une acquisition sur SAMPLE_EVERY est mesurée */
+	thread_mutex_profile_reset();
+	thread_mutex_profile_start(SAMPLE_EVERY);
+	run(nb_threads);
+	thread_mutex_profile_stop();
+
+	/* après l'arrêt, plus rien n'est mesuré */
+	run(nb_threads);
+
+	text = report();
+	hot_count = acquisitions(text, &hot, &hot_rank);
+	cold_count = acquisitions(text, &cold, &cold_rank);
+	free(text);
+	if (hot_count + cold_count > (long) (2 * nb_threads * nb_loops / SAMPLE_EVERY + 1)) {
+		printf("%ld acquisitions mesurées sur %lu (FAILED)\n", hot_count + cold_count, 2 * nb_threads * nb_loops);
+		return EXIT_FAILURE;
+	}
+
+	thread_mutex_profile_reset();
+	thread_mutex_destroy(&cold);
+	thread_mutex_destroy(&hot);
+	return EXIT_SUCCESS;
+#endif
+}
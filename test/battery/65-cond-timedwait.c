@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "thread.h"
+
+/* test des attentes avec échéance sur une condition, par le shim pthread.
+ *
+ * pthread_cond_timedwait doit attendre jusqu'à l'échéance, mesurée sur l'horloge de la condition:
+ * CLOCK_REALTIME par défaut, CLOCK_MONOTONIC avec pthread_condattr_setclock, et l'horloge donnée
+ * à pthread_cond_clockwait. Puis des threads attendent avec une échéance lointaine et sont réveillées
+ * par un broadcast, avant l'échéance.
+ * Nos threads n'ont pas d'attente avec échéance: seul le binaire pthread (et donc le shim) teste quelque chose.
+ *
+ * arguments: nombre de threads, durée de l'attente en millisecondes
+ *
+ * support nécessaire:
+ * - pthread_cond_timedwait(), pthread_cond_clockwait(), pthread_condattr_setclock()
+ */
+
+#ifdef USE_PTHREAD
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static int is_ready;
+
+static long long now_ns(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static struct timespec deadline_in(clockid_t clock, long long ns) {
+	long long at = now_ns(clock) + ns;
+	struct timespec deadline = {at / 1000000000LL, at % 1000000000LL};
+	return deadline;
+}
+
+/**
+ * Wait on a condition that nobody signals.
+ * @return How long the wait lasted, in nanoseconds, or -1 if it didn't time out
+ */
+static long long wait_alone(pthread_cond_t *alone, clockid_t clock, int is_clockwait, long long timeout_ns) {
+	struct timespec deadline = deadline_in(clock, timeout_ns);
+	long long start = now_ns(CLOCK_MONOTONIC);
+	int err;
+
+	pthread_mutex_lock(&mutex);
+	do {
+		err = is_clockwait ? pthread_cond_clockwait(alone, &mutex, clock, &deadline)
+		                   : pthread_cond_timedwait(alone, &mutex, &deadline);
+	} while (err == 0);
+	pthread_mutex_unlock(&mutex);
+	return err == ETIMEDOUT ? now_ns(CLOCK_MONOTONIC) - start : -1;
+}
+
+static void *waiter(void *dummy __attribute__((unused))) {
+	struct timespec deadline = deadline_in(CLOCK_MONOTONIC, 60 * 1000000000LL);
+	int err = 0;
+
+	pthread_mutex_lock(&mutex);
+	while (!is_ready && err == 0)
+		err = pthread_cond_timedwait(&cond, &mutex, &deadline);
+	pthread_mutex_unlock(&mutex);
+	return (void *) (long) err;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifndef USE_PTHREAD
+	return 0;
+#else
+	pthread_condattr_t attr;
+	pthread_cond_t realtime = PTHREAD_COND_INITIALIZER;
+	pthread_t *th;
+	long long timeout_ns, waited;
+	void *ret;
+	int nb_threads, i, err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, durée de l'attente en millisecondes\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	timeout_ns = atoi(argv[2]) * 1000000LL;
+	th = malloc(nb_threads * sizeof *th);
+	assert(th != NULL);
+
+	pthread_condattr_init(&attr);
+	err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	assert(!err);
+	err = pthread_cond_init(&cond, &attr);
+	assert(!err);
+	pthread_condattr_destroy(&attr);
+
+	/* jusqu'à l'échéance, sur chaque horloge */
+	waited = wait_alone(&realtime, CLOCK_REALTIME, 0, timeout_ns);
+	if (waited < timeout_ns) {
+		printf("CLOCK_REALTIME: fin après %lld ns sur %lld (FAILED)\n", waited, timeout_ns);
+		return EXIT_FAILURE;
+	}
+	waited = wait_alone(&cond, CLOCK_MONOTONIC, 0, timeout_ns);
+	if (waited < timeout_ns) {
+		printf("CLOCK_MONOTONIC: fin après %lld ns sur %lld (FAILED)\n", waited, timeout_ns);
+		return EXIT_FAILURE;
+	}
+	waited = wait_alone(&realtime, CLOCK_MONOTONIC, 1, timeout_ns);
+	if (waited < timeout_ns) {
+		printf("pthread_cond_clockwait: fin après %lld ns sur %lld (FAILED)\n", waited, timeout_ns);
+		return EXIT_FAILURE;
+	}
+
+	/* réveillées avant l'échéance */
+	for (i = 0; i < nb_threads; i++) {
+		err = pthread_create(&th[i], NULL, waiter, NULL);
+		assert(!err);
+	}
+	pthread_mutex_lock(&mutex);
+	is_ready = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	for (i = 0; i < nb_threads; i++) {
+		err = pthread_join(th[i], &ret);
+		assert(!err);
+		if (ret != NULL) {
+			printf("thread %d: erreur %ld au lieu du réveil (FAILED)\n", i, (long) ret);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%d threads réveillées, échéances de %lld ns respectées sur chaque horloge\n", nb_threads, timeout_ns);
+	pthread_cond_destroy(&cond);
+	pthread_cond_destroy(&realtime);
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
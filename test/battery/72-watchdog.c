@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "thread.h"
+
+/* test du chien de garde, qui signale les threads qui gardent le processeur trop longtemps.
+ *
+ * une thread calcule sans jamais céder la main pendant plusieurs seuils, les autres font des yields.
+ * Le chien de garde doit avoir attrapé la première (une seule fois, avec sa pile sur la sortie d'erreur),
+ * et aucune des autres.
+ * Puis la même chose sur un autre thread noyau, dont l'ordonnanceur est créé après le démarrage du chien de garde.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads qui font des yields, nombre de seuils de calcul sans yield
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_watchdog_start(), thread_stats_get(), thread_sched_stats()
+ * - pthread_create(), pthread_join()
+ */
+
+#ifndef USE_PTHREAD
+
+#define THRESHOLD_MS 20
+
+static unsigned long nb_thresholds;
+static volatile int hog_done = 0;
+
+static unsigned long long elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000ULL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void *hog(void *dummy __attribute__((unused))) {
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (elapsed_ms(&start) < nb_thresholds * THRESHOLD_MS) {}
+	hog_done = 1;
+	return NULL;
+}
+
+static void *polite(void *dummy __attribute__((unused))) {
+	while (!hog_done)
+		thread_yield();
+	return NULL;
+}
+
+static void *worker_main(void *_hogs) {
+	thread_stats_t stats;
+	thread_t hogger;
+	int err;
+
+	err = thread_create(&hogger, hog, NULL);
+	assert(!err);
+	while (!hog_done)
+		thread_yield();
+	err = thread_stats_get(hogger, &stats);
+	assert(!err);
+	*(unsigned long *) _hogs = stats.hogs;
+	err = thread_join(hogger, NULL);
+	assert(!err);
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_threads, i;
+	thread_sched_stats_t sched_stats;
+	thread_stats_t stats;
+	thread_t *th, hogger;
+	pthread_t worker;
+	unsigned long worker_hogs = 0;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads qui font des yields, nombre de seuils de calcul sans yield\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_thresholds = atoi(argv[2]);
+	if (nb_thresholds < 2)
+		nb_thresholds = 2;
+
+	th = malloc(nb_threads * sizeof *th);
+	if (th == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	err = thread_watchdog_start(THRESHOLD_MS);
+	assert(!err);
+	assert(thread_watchdog_start(THRESHOLD_MS) == -1);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], polite, NULL);
+		assert(!err);
+	}
+	err = thread_create(&hogger, hog, NULL);
+	assert(!err);
+	while (!hog_done)
+		thread_yield();
+
+	err = thread_stats_get(hogger, &stats);
+	assert(!err);
+	printf("la thread gourmande a été attrapée %lu fois\n", stats.hogs);
+	assert(stats.hogs == 1);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_stats_get(th[i], &stats);
+		assert(!err);
+		assert(stats.hogs == 0);
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	err = thread_join(hogger, NULL);
+	assert(!err);
+
+	err = thread_sched_stats(&sched_stats);
+	assert(!err);
+	assert(sched_stats.watchdog_hogs == 1);
+
+	hog_done = 0;
+	err = pthread_create(&worker, NULL, worker_main, &worker_hogs);
+	assert(!err);
+	err = pthread_join(worker, NULL);
+	assert(!err);
+	printf("sur un autre thread noyau, attrapée %lu fois\n", worker_hogs);
+	assert(worker_hogs == 1);
+
+	err = thread_watchdog_stop();
+	assert(!err);
+
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
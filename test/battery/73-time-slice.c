@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include "thread.h"
+
+/* test des tranches de temps de thread_maybe_yield().
+ *
+ * des threads calculent en appelant thread_maybe_yield() à chaque itération.
+ * Elles ne doivent changer de main qu'une fois leur tranche écoulée: beaucoup moins souvent
+ * qu'elles ne l'appellent, mais au moins une fois pendant leur calcul, qui dure plusieurs tranches.
+ * Le calcul est compté en temps CPU du thread noyau, pendant les itérations de chaque thread: quand
+ * la machine est chargée, le temps écoulé compte celui des autres processus, pas ce temps-là.
+ * La durée moyenne des tranches est affichée; elle dépend de la charge de la machine, seule une
+ * borne très large (SLICE_BOUND tranches) est vérifiée.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, temps de calcul par thread (x10 ms)
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_maybe_yield(), thread_set_time_slice()
+ * - thread_stats_get()
+ */
+
+#ifndef USE_PTHREAD
+
+#define SLICE_US 2000
+#define SLICE_BOUND 25
+
+static unsigned long long work_ns;
+
+static unsigned long long cpu_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Calcule pendant work_ns de temps CPU, sans compter celui des autres threads quand elle cède la main.
+ */
+static void compute(unsigned long *calls) {
+	unsigned long long worked = 0, start;
+
+	do {
+		thread_maybe_yield();
+		start = cpu_ns();
+		(*calls)++;
+		worked += cpu_ns() - start;
+	} while (worked < work_ns);
+}
+
+static void *worker(void *calls) {
+	compute(calls);
+	return NULL;
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_PTHREAD
+	return 0;
+#else
+	unsigned long nb_threads, i, *calls, main_calls = 0;
+	thread_stats_t stats;
+	thread_t *th;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, temps de calcul par thread (x10 ms)\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	work_ns = atoi(argv[2]) * 10000000ULL;
+
+	th = malloc(nb_threads * sizeof *th);
+	calls = calloc(nb_threads, sizeof *calls);
+	if (th == NULL || calls == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	assert(thread_set_time_slice(0) == -1);
+	err = thread_set_time_slice(SLICE_US);
+	assert(!err);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], worker, &calls[i]);
+		assert(!err);
+	}
+	/* le main calcule aussi, pour que les threads aient toujours quelqu'un à qui céder la main */
+	compute(&main_calls);
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_stats_get(th[i], &stats);
+		assert(!err);
+		printf("thread %lu: %lu appels, %lu changements, %llu us par tranche\n", i, calls[i],
+		       stats.voluntary_switches, stats.run_ns / 1000 / (stats.voluntary_switches + 1));
+		assert(stats.voluntary_switches < calls[i] / 2);
+		if (work_ns > 2 * SLICE_US * 1000ULL) {
+			assert(stats.voluntary_switches > 0);
+			assert(stats.run_ns / stats.voluntary_switches < SLICE_BOUND * SLICE_US * 1000ULL);
+		}
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+
+	free(calls);
+	free(th);
+	return EXIT_SUCCESS;
+#endif
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "thread.h"
+#include "offload.h"
+
+/* test des appels bloquants déportés sur des threads noyau auxiliaires.
+ *
+ * des threads font chacune un appel qui dort, déporté avec thread_offload(), pendant qu'une autre
+ * compte ses yields: elle doit avancer pendant les appels, et les appels doivent se recouvrir,
+ * sans dépasser la profondeur de file configurée. Puis on teste les appels prêts à l'emploi
+ * (write, fsync, read, stat, getaddrinfo).
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, durée de chaque appel (x10 ms)
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_offload(), thread_offload_configure()
+ * - thread_read(), thread_write(), thread_fsync(), thread_stat(), thread_getaddrinfo()
+ */
+
+#define QUEUE_DEPTH 2
+
+static unsigned long sleep_us;
+static int in_progress = 0, max_in_progress = 0;
+static volatile int done = 0;
+static volatile unsigned long ticks = 0;
+
+/* exécuté sur une thread noyau auxiliaire */
+static void *slow_call(void *arg) {
+	int now = __atomic_add_fetch(&in_progress, 1, __ATOMIC_SEQ_CST), max;
+	while ((max = __atomic_load_n(&max_in_progress, __ATOMIC_SEQ_CST)) < now
+	       && !__atomic_compare_exchange_n(&max_in_progress, &max, now, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {}
+
+	usleep(sleep_us);
+	__atomic_sub_fetch(&in_progress, 1, __ATOMIC_SEQ_CST);
+	return arg;
+}
+
+static void *worker(void *arg) {
+	return thread_offload(slow_call, arg);
+}
+
+static void *ticker(void *dummy __attribute__((unused))) {
+	while (!done) {
+		ticks++;
+		thread_yield();
+	}
+	return NULL;
+}
+
+static void test_wrappers(void) {
+	char path[] = "/tmp/thread-offload-XXXXXX", buffer[16];
+	struct addrinfo hints, *result;
+	struct stat status;
+	ssize_t count;
+	int fd, err;
+
+	fd = mkstemp(path);
+	assert(fd != -1);
+	count = thread_write(fd, "offload", 7);
+	assert(count == 7);
+	err = thread_fsync(fd);
+	assert(!err);
+	lseek(fd, 0, SEEK_SET);
+	memset(buffer, 0, sizeof buffer);
+	count = thread_read(fd, buffer, sizeof buffer);
+	assert(count == 7);
+	assert(strcmp(buffer, "offload") == 0);
+	close(fd);
+
+	err = thread_stat(path, &status);
+	assert(!err);
+	assert(status.st_size == 7);
+	unlink(path);
+	errno = 0;
+	err = thread_stat(path, &status);
+	assert(err == -1 && errno == ENOENT);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_flags = AI_NUMERICHOST;
+	err = thread_getaddrinfo("127.0.0.1", NULL, &hints, &result);
+	assert(!err);
+	assert(result != NULL && result->ai_family == AF_INET);
+	freeaddrinfo(result);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long nb_threads, i;
+	thread_t *th, tick;
+	void *result;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, durée de chaque appel (x10 ms)\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	sleep_us = atoi(argv[2]) * 10000UL;
+
+	th = malloc(nb_threads * sizeof *th);
+	if (th == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	assert(thread_offload_configure(0, QUEUE_DEPTH) == -1);
+	err = thread_offload_configure(4, QUEUE_DEPTH);
+	assert(!err);
+
+	err = thread_create(&tick, ticker, NULL);
+	assert(!err);
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], worker, (void *) (i + 1));
+		assert(!err);
+	}
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], &result);
+		assert(!err);
+		assert(result == (void *) (i + 1));
+	}
+	done = 1;
+	err = thread_join(tick, NULL);
+	assert(!err);
+
+	printf("%lu yields pendant les appels, %d appels en même temps au plus\n", ticks, max_in_progress);
+	assert(ticks > 0);
+	if (nb_threads > 1)
+		assert(max_in_progress > 1);
+#ifndef USE_PTHREAD
+	assert(max_in_progress <= QUEUE_DEPTH);
+#endif
+
+	/* un appel depuis le main, seule thread restante: le scheduler attend sur l'eventfd */
+	result = thread_offload(slow_call, th);
+	assert(result == th);
+
+	test_wrappers();
+
+	free(th);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "thread.h"
+#include "offload.h"
+
+/* test des entrées-sorties par complétion (io_uring, ou déportées sans io_uring).
+ *
+ * des threads écrivent chacune des blocs à leurs positions dans un fichier avec thread_pwrite(),
+ * puis les relisent avec thread_pread(). Pendant ce temps, une thread attend des messages avec
+ * thread_recv() sur une paire de sockets, et le main les envoie avec thread_send() entre deux yields:
+ * l'attente ne doit pas bloquer les autres threads.
+ * Avec THREAD_IO_URING=0, les mêmes appels passent par les threads noyau auxiliaires.
+ * valgrind doit etre content.
+ *
+ * arguments: nombre de threads, nombre de blocs par thread
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_pread(), thread_pwrite(), thread_recv(), thread_send()
+ */
+
+#define BLOCK 512
+
+static int file, sockets[2];
+static unsigned long nb_threads, nb_blocks;
+
+static void *writer_reader(void *_index) {
+	unsigned long index = (unsigned long) _index, i;
+	char block[BLOCK], read_block[BLOCK];
+	ssize_t count;
+
+	for (i = 0; i < nb_blocks; i++) {
+		memset(block, (int) ('a' + (index + i) % 26), sizeof block);
+		count = thread_pwrite(file, block, sizeof block, (off_t) ((i * nb_threads + index) * BLOCK));
+		assert(count == BLOCK);
+	}
+	for (i = 0; i < nb_blocks; i++) {
+		memset(block, (int) ('a' + (index + i) % 26), sizeof block);
+		count = thread_pread(file, read_block, sizeof read_block, (off_t) ((i * nb_threads + index) * BLOCK));
+		assert(count == BLOCK);
+		assert(memcmp(block, read_block, sizeof block) == 0);
+	}
+	return NULL;
+}
+
+static void *receiver(void *dummy __attribute__((unused))) {
+	unsigned long received = 0, expected;
+	char message[24];
+	ssize_t count;
+
+	for (expected = 0; expected < nb_blocks; expected++) {
+		count = thread_recv(sockets[1], message, sizeof message, 0);
+		assert(count == sizeof message);
+		assert(strtoul(message, NULL, 10) == expected);
+		received++;
+	}
+	return (void *) received;
+}
+
+int main(int argc, char *argv[]) {
+	char path[] = "/tmp/thread-io-XXXXXX", message[24];
+	unsigned long i;
+	thread_t *th, receiving;
+	void *received;
+	ssize_t count;
+	int err;
+
+	if (argc < 3) {
+		printf("arguments manquants: nombre de threads, nombre de blocs par thread\n");
+		return -1;
+	}
+
+	nb_threads = atoi(argv[1]);
+	nb_blocks = atoi(argv[2]);
+
+	th = malloc(nb_threads * sizeof *th);
+	file = mkstemp(path);
+	err = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+	if (th == NULL || file == -1 || err) {
+		perror("malloc/mkstemp/socketpair");
+		return -1;
+	}
+	unlink(path);
+
+	err = thread_create(&receiving, receiver, NULL);
+	assert(!err);
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_create(&th[i], writer_reader, (void *) i);
+		assert(!err);
+	}
+
+	/* le receveur attend: les autres threads doivent continuer */
+	for (i = 0; i < nb_blocks; i++) {
+		thread_yield();
+		memset(message, 0, sizeof message);
+		snprintf(message, sizeof message, "%lu", i);
+		count = thread_send(sockets[0], message, sizeof message, 0);
+		assert(count == sizeof message);
+	}
+
+	for (i = 0; i < nb_threads; i++) {
+		err = thread_join(th[i], NULL);
+		assert(!err);
+	}
+	err = thread_join(receiving, &received);
+	assert(!err);
+	assert((unsigned long) received == nb_blocks);
+
+	/* une erreur est rendue dans errno */
+	count = thread_pread(-1, message, sizeof message, 0);
+	assert(count == -1);
+
+	printf("%lu blocs écrits et relus, %lu messages reçus\n", nb_threads * nb_blocks, (unsigned long) received);
+
+	close(sockets[0]);
+	close(sockets[1]);
+	close(file);
+	free(th);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include "thread.h"
+
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+/* microbenchmarks in-process, pour comparer les coûts de base avec ceux des pthreads.
+ *
+ * chaque benchmark est exécuté plusieurs fois (échantillons) après des exécutions de chauffe,
+ * chaque échantillon répète l'opération plusieurs fois et donne son coût moyen.
+ * On affiche la médiane, les percentiles, le min et le max des échantillons, en CSV ou en JSON.
+ *
+ * compilé deux fois: 'bench' avec nos threads, 'bench-pthread' avec -DUSE_PTHREAD.
+ */
+
+#ifdef USE_PTHREAD
+#define VARIANT "pthread"
+#else
+#define VARIANT "thread"
+#endif
+
+//region Timing
+
+static double ticks_per_ns = 1;
+
+static unsigned long long clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Cycle counter where available, nanoseconds otherwise.
+ */
+static inline unsigned long long ticks(void) {
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	return clock_ns();
+#endif
+}
+
+static void calibrate(void) {
+	unsigned long long ns_start = clock_ns(), ticks_start = ticks();
+	while (clock_ns() - ns_start < 50000000) {}
+	ticks_per_ns = (double) (ticks() - ticks_start) / (clock_ns() - ns_start);
+}
+
+static double ticks_to_ns(unsigned long long t) {
+	return t / ticks_per_ns;
+}
+
+//endregion
+
+//region Benchmarks
+
+static volatile int stop;
+static volatile int ready;
+static volatile unsigned long long exit_ticks;
+static thread_mutex_t lock;
+static thread_cond_t cond;
+static volatile unsigned long counter;
+
+static void *yield_partner(void *dummy __attribute__((unused))) {
+	while (!stop)
+		thread_yield();
+	return NULL;
+}
+
+/**
+ * Two threads yielding to each other: cost of a switch.
+ */
+static double bench_yield(unsigned long iterations) {
+	thread_t th;
+	unsigned long i;
+
+	stop = 0;
+	thread_create(&th, yield_partner, NULL);
+
+	unsigned long long start = ticks();
+	for (i = 0; i < iterations; i++)
+		thread_yield();
+	unsigned long long end = ticks();
+
+	stop = 1;
+	thread_join(th, NULL);
+	return ticks_to_ns(end - start) / (2 * iterations);
+}
+
+static void *maybe_yield_partner(void *dummy __attribute__((unused))) {
+	while (!stop)
+		thread_maybe_yield();
+	return NULL;
+}
+
+/**
+ * Two threads calling thread_maybe_yield in a loop: cost of the check, switches included.
+ */
+static double bench_maybe_yield(unsigned long iterations) {
+	thread_t th;
+	unsigned long i;
+
+	stop = 0;
+	thread_create(&th, maybe_yield_partner, NULL);
+
+	unsigned long long start = ticks();
+	for (i = 0; i < iterations; i++)
+		thread_maybe_yield();
+	unsigned long long end = ticks();
+
+	stop = 1;
+	thread_join(th, NULL);
+	return ticks_to_ns(end - start) / iterations;
+}
+
+static void *empty(void *dummy __attribute__((unused))) {
+	return NULL;
+}
+
+/**
+ * Create a thread and join it right away.
+ */
+static double bench_create_join(unsigned long iterations) {
+	thread_t th;
+	unsigned long i;
+
+	unsigned long long start = ticks();
+	for (i = 0; i < iterations; i++) {
+		thread_create(&th, empty, NULL);
+		thread_join(th, NULL);
+	}
+	return ticks_to_ns(ticks() - start) / iterations;
+}
+
+static void *mutex_partner(void *_iterations) {
+	unsigned long i, iterations = (unsigned long) _iterations;
+
+	for (i = 0; i < iterations; i++) {
+		thread_mutex_lock(&lock);
+		counter++;
+		thread_yield();
+		thread_mutex_unlock(&lock);
+		thread_yield();
+	}
+	return NULL;
+}
+
+/**
+ * Two threads taking a mutex in turn, yielding while holding it: cost of a contended acquisition.
+ */
+static double bench_mutex_handoff(unsigned long iterations) {
+	thread_t th;
+
+	counter = 0;
+	unsigned long long start = ticks();
+	thread_create(&th, mutex_partner, (void *) iterations);
+	mutex_partner((void *) iterations);
+	thread_join(th, NULL);
+	return ticks_to_ns(ticks() - start) / (2 * iterations);
+}
+
+static void *exit_when_joined(void *dummy __attribute__((unused))) {
+	while (!ready)
+		thread_yield();
+	thread_yield(); // let the joiner block
+	exit_ticks = ticks();
+	return NULL;
+}
+
+/**
+ * Time between the end of a thread and the return of thread_join in the thread waiting for it.
+ */
+static double bench_join_wakeup(unsigned long iterations) {
+	thread_t th;
+	unsigned long i;
+	unsigned long long total = 0;
+
+	for (i = 0; i < iterations; i++) {
+		ready = 0;
+		thread_create(&th, exit_when_joined, NULL);
+		ready = 1;
+		thread_join(th, NULL);
+		total += ticks() - exit_ticks;
+	}
+	return ticks_to_ns(total) / iterations;
+}
+
+static long resident_bytes(void) {
+	long size, resident;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm == NULL)
+		return 0;
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void *wait_for_release(void *dummy __attribute__((unused))) {
+	thread_mutex_lock(&lock);
+	counter++;
+	while (!stop)
+		thread_cond_wait(&cond, &lock);
+	thread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/**
+ * Resident memory of threads that have started and are blocked, in blocks that were never used before.
+ *
+ * The memory freed by the previous samples goes back to the system, and as many threads as the sample
+ * measures first take the blocks kept by the pools and caches of the library: otherwise the measured
+ * threads reuse blocks already resident, and a growth of the threads can't show.
+ */
+static double bench_memory(unsigned long iterations) {
+	thread_t *th = malloc(2 * iterations * sizeof *th);
+	unsigned long i;
+
+	if (th == NULL)
+		return 0;
+
+	stop = 0;
+	counter = 0;
+	malloc_trim(0);
+	for (i = 0; i < iterations; i++)
+		thread_create(&th[i], wait_for_release, NULL);
+	while (counter < iterations)
+		thread_yield();
+
+	long before = resident_bytes();
+	for (; i < 2 * iterations; i++)
+		thread_create(&th[i], wait_for_release, NULL);
+	while (counter < 2 * iterations)
+		thread_yield();
+	long after = resident_bytes();
+
+	thread_mutex_lock(&lock);
+	stop = 1;
+	thread_cond_broadcast(&cond);
+	thread_mutex_unlock(&lock);
+	for (i = 0; i < 2 * iterations; i++)
+		thread_join(th[i], NULL);
+	free(th);
+
+	return (double) (after - before) / iterations;
+}
+
+struct benchmark {
+	const char *name;
+	const char *unit;
+	double (*run)(unsigned long iterations);
+	/**
+	 * Divides the number of iterations, for the expensive benchmarks.
+	 */
+	unsigned long scale;
+};
+
+static const struct benchmark benchmarks[] = {
+		{"yield", "ns", bench_yield, 1},
+		{"maybe_yield", "ns", bench_maybe_yield, 1},
+		{"create_join", "ns", bench_create_join, 1},
+		{"mutex_handoff", "ns", bench_mutex_handoff, 1},
+		{"join_wakeup", "ns", bench_join_wakeup, 1},
+		{"memory_per_thread", "bytes", bench_memory, 10},
+};
+
+#define BENCHMARKS_NUMBER (sizeof benchmarks / sizeof benchmarks[0])
+
+//endregion
+
+//region Statistics and output
+
+struct summary {
+	double median, p90, p99, min, max, mean;
+};
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned int n, double p) {
+	double rank = p * (n - 1);
+	unsigned int low = (unsigned int) rank;
+	if (low + 1 >= n)
+		return sorted[n - 1];
+	return sorted[low] + (rank - low) * (sorted[low + 1] - sorted[low]);
+}
+
+static void summarize(double *samples, unsigned int n, struct summary *summary) {
+	double sum = 0;
+	qsort(samples, n, sizeof *samples, compare_doubles);
+	for (unsigned int i = 0; i < n; i++)
+		sum += samples[i];
+
+	summary->median = percentile(samples, n, 0.5);
+	summary->p90 = percentile(samples, n, 0.9);
+	summary->p99 = percentile(samples, n, 0.99);
+	summary->min = samples[0];
+	summary->max = samples[n - 1];
+	summary->mean = sum / n;
+}
+
+/**
+ * Where the results are written, stdout by default.
+ */
+static FILE *output;
+
+static void print_header(int json) {
+	if (json)
+		fprintf(output, "[\n");
+	else
+		fprintf(output, "variant,benchmark,unit,samples,iterations,median,p90,p99,min,max,mean\n");
+}
+
+static void print_summary(int json, int first, const struct benchmark *benchmark, unsigned int samples,
+                          unsigned long iterations, const struct summary *s) {
+	if (json)
+		fprintf(output, "%s  {\"variant\": \"%s\", \"benchmark\": \"%s\", \"unit\": \"%s\", \"samples\": %u, "
+		       "\"iterations\": %lu, \"median\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"min\": %.2f, "
+		       "\"max\": %.2f, \"mean\": %.2f}",
+		       first ? "" : ",\n", VARIANT, benchmark->name, benchmark->unit, samples, iterations,
+		       s->median, s->p90, s->p99, s->min, s->max, s->mean);
+	else
+		fprintf(output, "%s,%s,%s,%u,%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+		       VARIANT, benchmark->name, benchmark->unit, samples, iterations,
+		       s->median, s->p90, s->p99, s->min, s->max, s->mean);
+}
+
+static void print_footer(int json) {
+	if (json)
+		fprintf(output, "\n]\n");
+}
+
+//endregion
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [--format csv|json] [--samples N] [--warmup N] [--iterations N] [--filter NAME]"
+	                " [--output FILE]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option options[] = {
+			{"format", required_argument, NULL, 'f'},
+			{"samples", required_argument, NULL, 's'},
+			{"warmup", required_argument, NULL, 'w'},
+			{"iterations", required_argument, NULL, 'i'},
+			{"filter", required_argument, NULL, 'n'},
+			{"output", required_argument, NULL, 'o'},
+			{NULL, 0, NULL, 0},
+	};
+	unsigned int samples = 30, warmup = 3;
+	unsigned long iterations = 10000;
+	const char *filter = NULL, *output_path = NULL;
+	int json = 0, option, first = 1;
+
+	while ((option = getopt_long(argc, argv, "f:s:w:i:n:o:", options, NULL)) != -1) {
+		switch (option) {
+			case 'f':
+				json = strcmp(optarg, "json") == 0;
+				break;
+			case 's':
+				samples = atoi(optarg);
+				break;
+			case 'w':
+				warmup = atoi(optarg);
+				break;
+			case 'i':
+				iterations = atol(optarg);
+				break;
+			case 'n':
+				filter = optarg;
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (samples == 0 || iterations == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double *values = malloc(samples * sizeof *values);
+	if (values == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	output = stdout;
+	if (output_path != NULL && (output = fopen(output_path, "w")) == NULL) {
+		perror(output_path);
+		free(values);
+		return EXIT_FAILURE;
+	}
+
+	calibrate();
+	thread_mutex_init(&lock);
+	thread_cond_init(&cond);
+
+	print_header(json);
+	for (unsigned int b = 0; b < BENCHMARKS_NUMBER; b++) {
+		const struct benchmark *benchmark = &benchmarks[b];
+		unsigned long benchmark_iterations = iterations / benchmark->scale ? iterations / benchmark->scale : 1;
+		struct summary summary;
+
+		if (filter != NULL && strcmp(filter, benchmark->name) != 0)
+			continue;
+
+		for (unsigned int i = 0; i < warmup; i++)
+			benchmark->run(benchmark_iterations);
+		for (unsigned int i = 0; i < samples; i++)
+			values[i] = benchmark->run(benchmark_iterations);
+
+		summarize(values, samples, &summary);
+		print_summary(json, first, benchmark, samples, benchmark_iterations, &summary);
+		first = 0;
+		fflush(output);
+	}
+	print_footer(json);
+	if (output != stdout)
+		fclose(output);
+
+	thread_cond_destroy(&cond);
+	thread_mutex_destroy(&lock);
+	free(values);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+/* compare les résultats de 'bench --format csv' à une référence, pour détecter les régressions.
+ *
+ * on compare le meilleur échantillon (min) plutôt que la médiane: sur une machine partagée la
+ * médiane varie de 30 à 40% d'une exécution à l'autre, le min de quelques pourcents seulement.
+ *
+ * la référence contient, pour chaque benchmark, le min attendu et le ralentissement toléré
+ * (0.75 = jusqu'à 75% plus lent). Une ligne est affichée par benchmark, et le programme échoue
+ * si un benchmark est trop lent ou absent des résultats.
+ *
+ * avec --update, la référence est réécrite avec les valeurs mesurées (en gardant les tolérances).
+ */
+
+#define MAX_BENCHMARKS 64
+#define LINE_SIZE 512
+#define NAME_SIZE 64
+
+/**
+ * Tolerance of the benchmarks that are not in the baseline yet, when updating it.
+ */
+#define DEFAULT_TOLERANCE 0.75
+
+struct entry {
+	char name[NAME_SIZE];
+	char unit[NAME_SIZE];
+	double best;
+	double tolerance;
+	int is_measured;
+};
+
+static struct entry baseline[MAX_BENCHMARKS], results[MAX_BENCHMARKS];
+static unsigned int baseline_size = 0, results_size = 0;
+
+static struct entry *find(struct entry *entries, unsigned int size, const char *name) {
+	for (unsigned int i = 0; i < size; i++)
+		if (strcmp(entries[i].name, name) == 0)
+			return &entries[i];
+	return NULL;
+}
+
+/**
+ * Split a CSV line in place.
+ * @return The number of fields
+ */
+static unsigned int split(char *line, char **fields, unsigned int max_fields) {
+	unsigned int n = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	while (n < max_fields) {
+		fields[n++] = line;
+		line = strchr(line, ',');
+		if (line == NULL)
+			break;
+		*line++ = '\0';
+	}
+	return n;
+}
+
+/**
+ * Baseline format, one benchmark per line: benchmark,unit,min,tolerance. Lines starting with '#' are ignored.
+ */
+static int read_baseline(const char *path) {
+	char line[LINE_SIZE], *fields[4];
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (split(line, fields, 4) != 4 || baseline_size == MAX_BENCHMARKS) {
+			fprintf(stderr, "%s: invalid line '%s'\n", path, line);
+			fclose(file);
+			return -1;
+		}
+
+		struct entry *entry = &baseline[baseline_size++];
+		snprintf(entry->name, sizeof entry->name, "%.*s", NAME_SIZE - 1, fields[0]);
+		snprintf(entry->unit, sizeof entry->unit, "%.*s", NAME_SIZE - 1, fields[1]);
+		entry->best = atof(fields[2]);
+		entry->tolerance = atof(fields[3]);
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/**
+ * Results format: the CSV written by bench, with a header line.
+ */
+static int read_results(const char *path) {
+	char line[LINE_SIZE], *fields[11];
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	// Header
+	if (fgets(line, sizeof line, file) == NULL) {
+		fprintf(stderr, "%s: empty results\n", path);
+		fclose(file);
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (split(line, fields, 11) != 11 || results_size == MAX_BENCHMARKS) {
+			fprintf(stderr, "%s: invalid line '%s'\n", path, line);
+			fclose(file);
+			return -1;
+		}
+
+		struct entry *entry = &results[results_size++];
+		snprintf(entry->name, sizeof entry->name, "%.*s", NAME_SIZE - 1, fields[1]);
+		snprintf(entry->unit, sizeof entry->unit, "%.*s", NAME_SIZE - 1, fields[2]);
+		entry->best = atof(fields[8]);
+		entry->tolerance = DEFAULT_TOLERANCE;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+static int compare(double tolerance_scale) {
+	int regressions = 0;
+
+	printf("%-20s %17s %17s %9s %9s  %s\n", "benchmark", "baseline", "current", "change", "allowed", "status");
+	for (unsigned int i = 0; i < baseline_size; i++) {
+		struct entry *expected = &baseline[i];
+		struct entry *measured = find(results, results_size, expected->name);
+		double allowed = expected->tolerance * tolerance_scale;
+
+		if (measured == NULL) {
+			printf("%-20s %11.2f %-5s %17s %9s %8.0f%%  MISSING\n",
+			       expected->name, expected->best, expected->unit, "-", "-", 100 * allowed);
+			regressions++;
+			continue;
+		}
+
+		measured->is_measured = 1;
+		double change = expected->best > 0 ? measured->best / expected->best - 1 : 0;
+		const char *status = "ok";
+		if (change > allowed) {
+			status = "REGRESSION";
+			regressions++;
+		} else if (change < -allowed) {
+			status = "faster (update the baseline?)";
+		}
+
+		printf("%-20s %11.2f %-5s %11.2f %-5s %+8.1f%% %8.0f%%  %s\n",
+		       expected->name, expected->best, expected->unit, measured->best, measured->unit,
+		       100 * change, 100 * allowed, status);
+	}
+
+	for (unsigned int i = 0; i < results_size; i++)
+		if (!results[i].is_measured)
+			printf("%-20s %17s %11.2f %-5s %9s %9s  not in the baseline\n",
+			       results[i].name, "-", results[i].best, results[i].unit, "-", "-");
+
+	if (regressions > 0)
+		printf("\n%d benchmark(s) regressed, see the table above\n", regressions);
+	return regressions > 0;
+}
+
+static int update(const char *path) {
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	fprintf(file, "# Reference minimums of 'bench --format csv', regenerated with the perf-baseline target\n");
+	fprintf(file, "# tolerance: allowed slowdown before the perf tests fail (0.75 = 75%% slower)\n");
+	fprintf(file, "# benchmark,unit,min,tolerance\n");
+	for (unsigned int i = 0; i < results_size; i++) {
+		struct entry *old = find(baseline, baseline_size, results[i].name);
+		fprintf(file, "%s,%s,%.2f,%.2f\n", results[i].name, results[i].unit, results[i].best,
+		        old != NULL ? old->tolerance : results[i].tolerance);
+	}
+
+	fclose(file);
+	printf("Updated %s with %u benchmarks\n", path, results_size);
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [--tolerance-scale X] [--update] BASELINE RESULTS\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option options[] = {
+			{"tolerance-scale", required_argument, NULL, 't'},
+			{"update", no_argument, NULL, 'u'},
+			{NULL, 0, NULL, 0},
+	};
+	double tolerance_scale = 1;
+	int is_update = 0, option;
+
+	while ((option = getopt_long(argc, argv, "t:u", options, NULL)) != -1) {
+		switch (option) {
+			case 't':
+				tolerance_scale = atof(optarg);
+				break;
+			case 'u':
+				is_update = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	// For noisy machines, without reconfiguring
+	if (getenv("PERF_TOLERANCE_SCALE") != NULL)
+		tolerance_scale *= atof(getenv("PERF_TOLERANCE_SCALE"));
+
+	if (argc - optind != 2 || tolerance_scale <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	const char *baseline_path = argv[optind], *results_path = argv[optind + 1];
+	if (read_results(results_path) != 0)
+		return 2;
+	// A missing baseline is fine when creating it
+	if (read_baseline(baseline_path) != 0 && !is_update)
+		return 2;
+
+	if (is_update)
+		return update(baseline_path);
+
+	if (baseline_size == 0) {
+		fprintf(stderr, "%s: empty baseline\n", baseline_path);
+		return 2;
+	}
+	return compare(tolerance_scale);
+}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "thread.h"
+
+/* réveils entre deux threads noyau: latence d'un aller-retour et débit par rafales.
+ *
+ * Le thread principal et un thread noyau ouvrier ont chacun leur ordonnanceur.
+ * - pingpong: une thread de l'ouvrier et le thread principal se réveillent l'un l'autre (thread_unpark)
+ *   et s'endorment (thread_park), à tour de rôle. On mesure le temps d'un aller-retour.
+ * - burst: le thread principal réveille d'un coup N threads de l'ouvrier, et attend que la dernière
+ *   le réveille. On mesure le temps par réveil: les threads arrivent par lots dans la boîte de l'ouvrier.
+ * Pour chaque test, on mesure plusieurs échantillons et on garde le min et la médiane, avec les
+ * statistiques de la boîte de l'ouvrier (lots reçus, sommeils jusqu'à la sonnette).
+ *
+ * usage: bench-ping-pong [--rounds N] [--samples N] [--output FILE]
+ * sortie en CSV: test,batch,rounds,median_ns,min_ns,inbox_threads,inbox_batches,idle_sleeps
+ */
+
+#define MAX_BATCH 256
+
+static const unsigned long batches[] = {1, 16, MAX_BATCH};
+
+static thread_t main_thread;
+static thread_t workers[MAX_BATCH];
+static unsigned long nb_workers;
+/* pair: au tour du thread principal, impair: au tour de l'ouvrier */
+static unsigned long ball;
+static unsigned long remaining;
+static unsigned long round_id;
+static int stop;
+
+/* l'ordonnanceur de l'ouvrier, pour y créer les threads, et sa thread principale */
+static thread_sched_t *worker_sched;
+static thread_t worker_owner;
+static thread_sched_stats_t worker_stats;
+static pthread_barrier_t barrier;
+
+static unsigned long long clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void *ponger(void *dummy __attribute__((unused))) {
+	unsigned long expected = 1;
+
+	for (;;) {
+		while (__atomic_load_n(&ball, __ATOMIC_ACQUIRE) != expected) {
+			if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+				return NULL;
+			thread_park();
+		}
+		__atomic_store_n(&ball, expected + 1, __ATOMIC_RELEASE);
+		thread_unpark(main_thread);
+		expected += 2;
+	}
+}
+
+static void *burster(void *dummy __attribute__((unused))) {
+	unsigned long seen = 0;
+
+	for (;;) {
+		while (__atomic_load_n(&round_id, __ATOMIC_ACQUIRE) == seen) {
+			if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+				return NULL;
+			thread_park();
+		}
+		seen++;
+		if (__atomic_sub_fetch(&remaining, 1, __ATOMIC_ACQ_REL) == 0)
+			thread_unpark(main_thread);
+	}
+}
+
+/**
+ * The kernel thread of the worker: it runs the threads created on its scheduler until they are done.
+ */
+static void *worker_main(void *dummy __attribute__((unused))) {
+	worker_sched = thread_sched_self();
+	worker_owner = thread_self();
+	pthread_barrier_wait(&barrier);
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+		thread_park();
+	for (unsigned long i = 0; i < nb_workers; i++)
+		thread_join(workers[i], NULL);
+	thread_sched_stats(&worker_stats);
+	return NULL;
+}
+
+/**
+ * Start the worker and its threads: finish stops it, even if some threads can't be created.
+ * @return 0 on success, -1 if the threads can't be created
+ */
+static int start(pthread_t *worker, void *(*func)(void *), unsigned long nb_threads) {
+	thread_attr_t attr;
+
+	stop = 0;
+	ball = 0;
+	round_id = 0;
+	nb_workers = 0;
+	pthread_barrier_init(&barrier, NULL, 2);
+	if (pthread_create(worker, NULL, worker_main, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_destroy(&barrier);
+
+	thread_attr_init(&attr);
+	thread_attr_setsched(&attr, worker_sched);
+	for (; nb_workers < nb_threads; nb_workers++)
+		if (thread_create_attr(&workers[nb_workers], &attr, func, NULL) != 0)
+			return -1;
+	return 0;
+}
+
+static void finish(pthread_t worker) {
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	for (unsigned long i = 0; i < nb_workers; i++)
+		thread_unpark(workers[i]);
+	thread_unpark(worker_owner);
+	pthread_join(worker, NULL);
+}
+
+/**
+ * Time the round trips between the main thread and a thread of the worker.
+ * @return 0 on success, -1 if the thread of the worker can't be created
+ */
+static int measure_pingpong(unsigned long rounds, unsigned int samples, double *values) {
+	pthread_t worker;
+	int failed = start(&worker, ponger, 1);
+
+	for (unsigned int s = 0; s <= samples && !failed; s++) {
+		unsigned long long begin = clock_ns();
+		for (unsigned long r = 0; r < rounds; r++) {
+			unsigned long next = __atomic_add_fetch(&ball, 1, __ATOMIC_ACQ_REL);
+			thread_unpark(workers[0]);
+			while (__atomic_load_n(&ball, __ATOMIC_ACQUIRE) == next)
+				thread_park();
+		}
+		// The first sample warms up
+		if (s > 0)
+			values[s - 1] = (double) (clock_ns() - begin) / rounds;
+	}
+	finish(worker);
+	return failed ? -1 : 0;
+}
+
+/**
+ * Time the wakeups of batches of threads of the worker by the main thread.
+ * @return 0 on success, -1 if the threads of the worker can't be created
+ */
+static int measure_burst(unsigned long batch, unsigned long rounds, unsigned int samples, double *values) {
+	pthread_t worker;
+	int failed = start(&worker, burster, batch);
+
+	for (unsigned int s = 0; s <= samples && !failed; s++) {
+		unsigned long long begin = clock_ns();
+		for (unsigned long r = 0; r < rounds; r++) {
+			__atomic_store_n(&remaining, batch, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&round_id, 1, __ATOMIC_RELEASE);
+			for (unsigned long i = 0; i < batch; i++)
+				thread_unpark(workers[i]);
+			while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) != 0)
+				thread_park();
+		}
+		if (s > 0)
+			values[s - 1] = (double) (clock_ns() - begin) / (rounds * batch);
+	}
+	finish(worker);
+	return failed ? -1 : 0;
+}
+
+static void report(FILE *output, const char *test, unsigned long batch, unsigned long rounds,
+                   unsigned int samples, double *values) {
+	qsort(values, samples, sizeof *values, compare_doubles);
+	fprintf(output, "%s,%lu,%lu,%.2f,%.2f,%lu,%lu,%lu\n", test, batch, rounds, values[samples / 2], values[0],
+	        worker_stats.inbox_threads, worker_stats.inbox_batches, worker_stats.idle_sleeps);
+	fflush(output);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [--rounds N] [--samples N] [--output FILE]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option options[] = {
+			{"rounds", required_argument, NULL, 'n'},
+			{"samples", required_argument, NULL, 's'},
+			{"output", required_argument, NULL, 'o'},
+			{NULL, 0, NULL, 0},
+	};
+	unsigned long rounds = 20000;
+	unsigned int samples = 5;
+	const char *output_path = NULL;
+	FILE *output = stdout;
+	int option;
+
+	while ((option = getopt_long(argc, argv, "n:s:o:", options, NULL)) != -1) {
+		switch (option) {
+			case 'n':
+				rounds = atol(optarg);
+				break;
+			case 's':
+				samples = atoi(optarg);
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (samples == 0 || rounds == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double *values = malloc((samples + 1) * sizeof *values);
+	if (values == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	if (output_path != NULL && (output = fopen(output_path, "w")) == NULL) {
+		perror(output_path);
+		free(values);
+		return EXIT_FAILURE;
+	}
+
+	main_thread = thread_self();
+	fprintf(output, "test,batch,rounds,median_ns,min_ns,inbox_threads,inbox_batches,idle_sleeps\n");
+	if (measure_pingpong(rounds, samples, values) != 0)
+		fprintf(stderr, "%s: cannot start a thread on the worker\n", argv[0]);
+	else
+		report(output, "pingpong", 1, rounds, samples, values);
+	for (unsigned int b = 0; b < sizeof batches / sizeof *batches; b++) {
+		// The same number of wakeups for each batch size
+		unsigned long batch_rounds = rounds / batches[b] ? rounds / batches[b] : 1;
+		if (measure_burst(batches[b], batch_rounds, samples, values) != 0) {
+			fprintf(stderr, "%s: cannot start %lu threads on the worker\n", argv[0], batches[b]);
+			break;
+		}
+		report(output, "burst", batches[b], batch_rounds, samples, values);
+	}
+
+	if (output != stdout)
+		fclose(output);
+	free(values);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include "thread.h"
+
+/* passage à l'échelle: coût par opération et mémoire par thread, de mille à un million de threads.
+ *
+ * Pour chaque nombre de threads N (de 10 en 10), chaque échantillon:
+ * - create: crée N threads, qui attendent (thread_park), et mesure la mémoire résidente en plus;
+ * - switch: les N threads et le thread principal font des yields à tour de rôle;
+ * - join: joint les N threads, déjà finies;
+ * - chain: une chaîne de N threads, chacune crée la suivante et la joint (la dernière mesure la mémoire).
+ * On garde le min et la médiane des échantillons. Le coût par opération doit rester plat: à partir de
+ * --flat-from threads, d'un N au suivant, le min ne doit pas être multiplié par plus de --growth (un coût
+ * en O(N) le multiplie par 10), et la mémoire par thread ne doit pas dépasser --max-rss. Le code de retour
+ * est 1 sinon. En dessous de dix mille threads, elles tiennent dans le cache: de mille à dix mille, le
+ * join coûte 4 à 5 fois plus sans que ce soit en O(N), la comparaison commence donc à dix mille.
+ * --smoke s'arrête à cent mille threads, pour la CI. Un million de threads demande environ 6 Gio.
+ *
+ * usage: bench-scale [--min-threads N] [--max-threads N] [--switches N] [--samples N] [--growth X]
+ *                    [--flat-from N] [--max-rss KIB] [--smoke] [--output FILE]
+ * sortie en CSV: test,threads,median_ns,min_ns,rss_per_thread,status
+ */
+
+#define NB_TESTS 4
+
+enum test {
+	CREATE,
+	SWITCH,
+	JOIN,
+	CHAIN,
+};
+
+static const char *const test_names[NB_TESTS] = {"create", "switch", "join", "chain"};
+
+static volatile int stop;
+static unsigned long chain_length;
+static long chain_rss;
+
+static unsigned long long clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @return The resident memory of the process in bytes, 0 if unknown
+ */
+static long resident_bytes(void) {
+	FILE *statm = fopen("/proc/self/statm", "r");
+	long pages = 0;
+
+	if (statm == NULL)
+		return 0;
+	if (fscanf(statm, "%*s %ld", &pages) != 1)
+		pages = 0;
+	fclose(statm);
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void *spinner(void *dummy __attribute__((unused))) {
+	// thread_create switches to the new thread: the others wait, or creating them would be quadratic
+	thread_park();
+	while (!stop)
+		thread_yield();
+	return NULL;
+}
+
+static void *link_main(void *_depth) {
+	uintptr_t depth = (uintptr_t) _depth;
+	thread_t next;
+
+	if (depth == chain_length) {
+		chain_rss = resident_bytes();
+		return _depth;
+	}
+	if (thread_create(&next, link_main, (void *) (depth + 1)) != 0)
+		return NULL;
+	void *ret = NULL;
+	thread_join(next, &ret);
+	return ret;
+}
+
+/**
+ * One sample of each test with nb_threads threads.
+ * @param rss The resident memory per thread of create and chain, in bytes
+ * @return 0 on success, -1 if the threads can't be created
+ */
+static int measure(unsigned long nb_threads, unsigned long switches, double *values, long *rss) {
+	thread_t *th = malloc(nb_threads * sizeof *th);
+	unsigned long rounds = switches / (nb_threads + 1) ? switches / (nb_threads + 1) : 1, i;
+	unsigned long long start;
+	int failed = th == NULL;
+
+	// The memory freed by the previous samples doesn't count
+	malloc_trim(0);
+	long rss_before = resident_bytes();
+
+	stop = 0;
+	start = clock_ns();
+	for (i = 0; i < nb_threads && !failed; i++)
+		failed = thread_create(&th[i], spinner, NULL) != 0;
+	values[CREATE] = (double) (clock_ns() - start) / nb_threads;
+	rss[CREATE] = (resident_bytes() - rss_before) / (long) nb_threads;
+	nb_threads = i - failed;
+	for (i = 0; i < nb_threads; i++)
+		thread_unpark(th[i]);
+
+	// The first round runs the threads out of their park
+	thread_yield();
+	start = clock_ns();
+	for (unsigned long r = 0; r < rounds; r++)
+		thread_yield();
+	values[SWITCH] = (double) (clock_ns() - start) / (rounds * (nb_threads + 1));
+
+	// They all exit during this yield: only the joins are timed
+	stop = 1;
+	thread_yield();
+	start = clock_ns();
+	for (i = 0; i < nb_threads; i++)
+		thread_join(th[i], NULL);
+	values[JOIN] = (double) (clock_ns() - start) / (nb_threads ? nb_threads : 1);
+	free(th);
+	if (failed)
+		return -1;
+
+	malloc_trim(0);
+	rss_before = resident_bytes();
+	chain_length = nb_threads;
+	chain_rss = rss_before;
+	void *ret = NULL;
+	start = clock_ns();
+	ret = link_main((void *) 1);
+	values[CHAIN] = (double) (clock_ns() - start) / nb_threads;
+	rss[CHAIN] = (chain_rss - rss_before) / (long) nb_threads;
+	return ret == (void *) nb_threads ? 0 : -1;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [--min-threads N] [--max-threads N] [--switches N] [--samples N] [--growth X]\n"
+	                "       %*s [--flat-from N] [--max-rss KIB] [--smoke] [--output FILE]\n", name, (int) strlen(name), "");
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option options[] = {
+			{"min-threads", required_argument, NULL, 'm'},
+			{"max-threads", required_argument, NULL, 'M'},
+			{"switches", required_argument, NULL, 'n'},
+			{"samples", required_argument, NULL, 's'},
+			{"growth", required_argument, NULL, 'g'},
+			{"flat-from", required_argument, NULL, 'f'},
+			{"max-rss", required_argument, NULL, 'r'},
+			{"smoke", no_argument, NULL, 'S'},
+			{"output", required_argument, NULL, 'o'},
+			{NULL, 0, NULL, 0},
+	};
+	unsigned long min_threads = 1000, max_threads = 1000000, switches = 4000000, flat_from = 10000;
+	unsigned int samples = 3;
+	double max_growth = 4;
+	long max_rss = 32 * 1024;
+	const char *output_path = NULL;
+	FILE *output = stdout;
+	int option, failures = 0;
+
+	while ((option = getopt_long(argc, argv, "m:M:n:s:g:f:r:So:", options, NULL)) != -1) {
+		switch (option) {
+			case 'm':
+				min_threads = atol(optarg);
+				break;
+			case 'M':
+				max_threads = atol(optarg);
+				break;
+			case 'n':
+				switches = atol(optarg);
+				break;
+			case 's':
+				samples = atoi(optarg);
+				break;
+			case 'g':
+				max_growth = atof(optarg);
+				break;
+			case 'f':
+				flat_from = atol(optarg);
+				break;
+			case 'r':
+				max_rss = atol(optarg) * 1024;
+				break;
+			case 'S':
+				max_threads = 100000;
+				switches = 400000;
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (samples == 0 || switches == 0 || min_threads == 0 || max_threads < min_threads || max_growth <= 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double *values = malloc(NB_TESTS * samples * sizeof *values);
+	if (values == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	if (output_path != NULL && (output = fopen(output_path, "w")) == NULL) {
+		perror(output_path);
+		free(values);
+		return EXIT_FAILURE;
+	}
+
+	double previous_min[NB_TESTS] = {0};
+	fprintf(output, "test,threads,median_ns,min_ns,rss_per_thread,status\n");
+	for (unsigned long nb_threads = min_threads; nb_threads <= max_threads; nb_threads *= 10) {
+		long rss[NB_TESTS] = {0}, max_sample_rss[NB_TESTS] = {0};
+		int failed = 0;
+
+		for (unsigned int s = 0; s < samples && !failed; s++) {
+			double sample[NB_TESTS] = {0};
+			failed = measure(nb_threads, switches, sample, rss) != 0;
+			for (unsigned int t = 0; t < NB_TESTS; t++) {
+				values[t * samples + s] = sample[t];
+				if (rss[t] > max_sample_rss[t])
+					max_sample_rss[t] = rss[t];
+			}
+		}
+		if (failed) {
+			fprintf(stderr, "%s: cannot create %lu threads\n", argv[0], nb_threads);
+			failures++;
+			break;
+		}
+
+		for (unsigned int t = 0; t < NB_TESTS; t++) {
+			double *test_values = &values[t * samples];
+			const char *status = "ok";
+
+			qsort(test_values, samples, sizeof *test_values, compare_doubles);
+			// The previous step had ten times fewer threads
+			if (nb_threads / 10 >= flat_from && previous_min[t] > 0 && test_values[0] > previous_min[t] * max_growth) {
+				status = "NOT FLAT";
+				failures++;
+			} else if (max_sample_rss[t] > max_rss) {
+				status = "OVER MAX RSS";
+				failures++;
+			}
+			previous_min[t] = test_values[0];
+			fprintf(output, "%s,%lu,%.2f,%.2f,%ld,%s\n", test_names[t], nb_threads, test_values[samples / 2],
+			        test_values[0], max_sample_rss[t], status);
+			fflush(output);
+		}
+	}
+
+	if (failures > 0)
+		fprintf(stderr, "%s: %d measure(s) not flat or over %ld bytes per thread, see the status column\n",
+		        argv[0], failures, max_rss);
+	if (output != stdout)
+		fclose(output);
+	free(values);
+	return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
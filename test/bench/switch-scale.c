@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "thread.h"
+
+/* latence d'un changement de contexte selon le nombre de threads, avec et sans l'arène de piles.
+ *
+ * N threads font des yield en boucle, chacune touchant le haut de sa pile: à chaque changement,
+ * une autre pile et une autre structure de thread. Au-delà de quelques milliers de threads, les
+ * pages de 4 Kio ne tiennent plus dans le TLB, contrairement aux pages énormes de l'arène.
+ * Les threads attendent d'être toutes créées (thread_park) avant de commencer.
+ * Pour chaque nombre de threads, on mesure plusieurs échantillons et on garde le min et la médiane.
+ *
+ * usage: bench-switch-scale [--max-threads N] [--switches N] [--samples N] [--hugetlb] [--output FILE]
+ * sortie en CSV: arena,threads,switches,median_ns,min_ns,huge_pages,huge_bytes
+ */
+
+#define FRAME 256
+
+static volatile int stop;
+
+static unsigned long long clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *spinner(void *dummy __attribute__((unused))) {
+	volatile char frame[FRAME];
+
+	// thread_create switches to the new thread: the others wait, or creating them would be quadratic
+	thread_park();
+	while (!stop) {
+		frame[0]++;
+		frame[FRAME - 1]++;
+		thread_yield();
+	}
+	return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Time the switches between threads: each yield of the main thread lets all the others run once.
+ * @return 0 on success, -1 if the threads can't be created
+ */
+static int measure(unsigned long nb_threads, unsigned long switches, unsigned int samples, double *values) {
+	thread_t *th = malloc(nb_threads * sizeof *th);
+	unsigned long rounds = switches / (nb_threads + 1) ? switches / (nb_threads + 1) : 1, i;
+	int failed = th == NULL;
+
+	stop = 0;
+	for (i = 0; i < nb_threads && !failed; i++)
+		failed = thread_create(&th[i], spinner, NULL) != 0;
+	nb_threads = i - failed;
+	for (i = 0; i < nb_threads; i++)
+		thread_unpark(th[i]);
+
+	// The first round touches the stacks
+	thread_yield();
+	for (unsigned int s = 0; s < samples && !failed; s++) {
+		unsigned long long start = clock_ns();
+		for (unsigned long r = 0; r < rounds; r++)
+			thread_yield();
+		values[s] = (double) (clock_ns() - start) / (rounds * (nb_threads + 1));
+	}
+
+	stop = 1;
+	for (i = 0; i < nb_threads; i++)
+		thread_join(th[i], NULL);
+	free(th);
+	return failed ? -1 : 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [--max-threads N] [--switches N] [--samples N] [--hugetlb] [--output FILE]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option options[] = {
+			{"max-threads", required_argument, NULL, 'm'},
+			{"switches", required_argument, NULL, 'n'},
+			{"samples", required_argument, NULL, 's'},
+			{"hugetlb", no_argument, NULL, 'H'},
+			{"output", required_argument, NULL, 'o'},
+			{NULL, 0, NULL, 0},
+	};
+	/* sans l'arène, puis avec */
+	static const char *const arenas[] = {"none", "thp", "hugetlb"};
+	unsigned long max_threads = 16384, switches = 1000000;
+	unsigned int samples = 5, nb_arenas = 2;
+	const char *output_path = NULL;
+	FILE *output = stdout;
+	int option;
+
+	while ((option = getopt_long(argc, argv, "m:n:s:Ho:", options, NULL)) != -1) {
+		switch (option) {
+			case 'm':
+				max_threads = atol(optarg);
+				break;
+			case 'n':
+				switches = atol(optarg);
+				break;
+			case 's':
+				samples = atoi(optarg);
+				break;
+			case 'H':
+				nb_arenas = 3;
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (samples == 0 || switches == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double *values = malloc(samples * sizeof *values);
+	if (values == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	if (output_path != NULL && (output = fopen(output_path, "w")) == NULL) {
+		perror(output_path);
+		free(values);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(output, "arena,threads,switches,median_ns,min_ns,huge_pages,huge_bytes\n");
+	for (unsigned int a = 0; a < nb_arenas; a++) {
+		if (a == 0)
+			thread_stack_arena_stop();
+		else
+			thread_stack_arena_start(a == 2 ? THREAD_STACK_ARENA_HUGETLB : 0);
+
+		for (unsigned long nb_threads = 4; nb_threads <= max_threads; nb_threads *= 4) {
+			thread_stack_arena_stats_t stats;
+
+			if (measure(nb_threads, switches, samples, values) != 0) {
+				fprintf(stderr, "%s: cannot create %lu threads\n", argv[0], nb_threads);
+				break;
+			}
+			thread_stack_arena_stats(&stats);
+			qsort(values, samples, sizeof *values, compare_doubles);
+			fprintf(output, "%s,%lu,%lu,%.2f,%.2f,%lu,%lu\n", arenas[a], nb_threads, switches,
+			        values[samples / 2], values[0], stats.huge_pages, stats.huge_bytes);
+			fflush(output);
+		}
+	}
+
+	if (output != stdout)
+		fclose(output);
+	free(values);
+	return EXIT_SUCCESS;
+}
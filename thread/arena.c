@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "internal.h"
+#include "debug.h"
+
+/*
+ * Stack arena.
+ *
+ * With thousands of threads, each switch touches the top of another stack and the structure above
+ * it: one page per thread, more pages than the TLB holds. The arena carves the blocks of the default
+ * size (stack and structure, laid out as in numa.c) out of chunks of one huge page, so that a TLB
+ * entry covers about 30 threads. A chunk is a transparent huge page (madvise) or, if asked for, an
+ * explicit one (MAP_HUGETLB, from the pages reserved in /proc/sys/vm/nr_hugepages), falling back to
+ * a transparent one when there is none left.
+ *
+ * The chunks of a node are bound to it like the other blocks. Their header is at the start of the
+ * chunk, so a freed block finds its chunk by rounding its address down. Slots are carved on demand,
+ * after the freed ones, which are taken first from the chunk that was used last: the live stacks
+ * stay on as few huge pages as possible. The chunks are never given back while the program runs.
+ * A block freed on the kernel thread of a scheduler of its node goes to the arena cache of that
+ * scheduler, still counted as used by its chunk: its next threads take it without a lock. A miss
+ * refills the cache with the freed slots of the chunk it takes from, a full cache gives a batch back.
+ *
+ * A guard page below each stack catches overflows, but mprotect splits a transparent huge page into
+ * small ones: the stacks stay packed, without the TLB gain. Explicit huge pages can't be split.
+ */
+
+#define ARENA_CHUNK_SIZE (2UL * 1024 * 1024)
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+//region Structure declaration
+
+/**
+ * At the start of each chunk, followed by its slots.
+ */
+struct arena_chunk {
+	TAILQ_ENTRY(arena_chunk) entries;
+	struct arena_chunk *next;
+
+	/**
+	 * The flags the slots were carved with: the chunks of other flags aren't used any more.
+	 */
+	int flags;
+	char is_explicit;
+	char has_room;
+
+	/**
+	 * The offset of the first slot, and the slots carved so far and in use (or cached by a scheduler).
+	 * The freed ones are listed by their thread structure.
+	 */
+	unsigned long first;
+	unsigned int carved, used;
+	struct thread_queue free;
+};
+
+TAILQ_HEAD(arena_chunks, arena_chunk);
+
+struct arena_node {
+	pthread_mutex_t lock;
+
+	/**
+	 * The chunks with a free or uncarved slot, the last used first, and all the chunks.
+	 */
+	struct arena_chunks partial;
+	struct arena_chunk *chunks;
+	thread_stack_arena_stats_t stats;
+};
+
+/**
+ * The flags of thread_stack_arena_start, -1 when stopped.
+ */
+static int arena_flags = -1;
+
+static struct arena_node nodes[NUMA_MAX_NODES];
+static long page_size = 4096;
+
+/**
+ * Warn once when no explicit huge page is left.
+ */
+static int has_warned = 0;
+
+//endregion
+
+//region Layout
+
+static unsigned long round_up(unsigned long size, unsigned long alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * @return The offset of the stack in a slot: the guard page is below it
+ */
+static unsigned long stack_offset(int flags) {
+	return flags & THREAD_STACK_ARENA_GUARD ? (unsigned long) page_size : 0;
+}
+
+/**
+ * @return The size of a slot: a whole number of pages with the guard, cache lines without
+ */
+static unsigned long slot_size(int flags) {
+	unsigned long block = round_up(THREAD_STACK_SIZE_DEFAULT, 64) + sizeof(struct thread);
+	return round_up(stack_offset(flags) + block, flags & THREAD_STACK_ARENA_GUARD ? (unsigned long) page_size : 64);
+}
+
+/**
+ * @return The offset of the first slot: after the header, in its own page with the guard
+ */
+static unsigned long first_slot(int flags) {
+	return round_up(sizeof(struct arena_chunk), flags & THREAD_STACK_ARENA_GUARD ? (unsigned long) page_size : 64);
+}
+
+static unsigned int slots_per_chunk(int flags) {
+	return (unsigned int) ((ARENA_CHUNK_SIZE - first_slot(flags)) / slot_size(flags));
+}
+
+/**
+ * The slots of every chunk would be at the same offsets from a 2 MiB boundary, in the same sets of
+ * the caches: the structures of the threads would evict each other. The chunks are shifted by a
+ * thread structure, or a page with the guard, in the room left after the last slot.
+ * @return The offset of the first slot of the n-th chunk of a node
+ */
+static unsigned long colored_first_slot(int flags, unsigned long n) {
+	unsigned long step = flags & THREAD_STACK_ARENA_GUARD ? (unsigned long) page_size : round_up(sizeof(struct thread), 64);
+	unsigned long room = ARENA_CHUNK_SIZE - first_slot(flags) - slots_per_chunk(flags) * slot_size(flags);
+	return first_slot(flags) + n % (room / step + 1) * step;
+}
+
+//endregion
+
+//region Chunks
+
+static struct arena_chunk *chunk_of(struct thread *thread) {
+	return (struct arena_chunk *) ((uintptr_t) thread & ~(ARENA_CHUNK_SIZE - 1));
+}
+
+/**
+ * Map a chunk aligned on its size, so that it can be a huge page.
+ * @return The chunk, or MAP_FAILED
+ */
+static char *map_transparent(void) {
+	char *mapping = mmap(NULL, 2 * ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return MAP_FAILED;
+
+	char *chunk = (char *) round_up((uintptr_t) mapping, ARENA_CHUNK_SIZE);
+	if (chunk > mapping)
+		munmap(mapping, chunk - mapping);
+	munmap(chunk + ARENA_CHUNK_SIZE, mapping + 2 * ARENA_CHUNK_SIZE - (chunk + ARENA_CHUNK_SIZE));
+
+	if (madvise(chunk, ARENA_CHUNK_SIZE, MADV_HUGEPAGE) != 0)
+		debug("Transparent huge pages are not available: %d", errno)
+	return chunk;
+}
+
+/**
+ * Map and list a new chunk of a node, under its lock.
+ * @return The chunk, or NULL if the mapping failed
+ */
+static struct arena_chunk *new_chunk(struct arena_node *arena, int node, int flags) {
+	char *base = MAP_FAILED;
+	int is_explicit = 0;
+
+	if (flags & THREAD_STACK_ARENA_HUGETLB) {
+		base = mmap(NULL, ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		is_explicit = base != MAP_FAILED;
+		if (!is_explicit) {
+			arena->stats.hugetlb_failures++;
+			if (!__atomic_exchange_n(&has_warned, 1, __ATOMIC_RELAXED))
+				warn("No explicit huge page left (%d), using transparent ones", errno)
+		}
+	}
+	if (base == MAP_FAILED)
+		base = map_transparent();
+	if (base == MAP_FAILED) {
+		error("Stack arena chunk allocation failed: %d", errno)
+		return NULL;
+	}
+	numa_bind(base, ARENA_CHUNK_SIZE, node);
+
+	struct arena_chunk *chunk = (struct arena_chunk *) base;
+	chunk->flags = flags;
+	chunk->is_explicit = (char) is_explicit;
+	chunk->has_room = 1;
+	chunk->first = colored_first_slot(flags, arena->stats.huge_pages);
+	chunk->carved = 0;
+	chunk->used = 0;
+	TAILQ_INIT(&chunk->free);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	TAILQ_INSERT_HEAD(&arena->partial, chunk, entries);
+
+	arena->stats.huge_pages++;
+	arena->stats.explicit_huge_pages += is_explicit;
+	debug("New stack arena chunk %p on the node %d, %s", (void *) chunk, node, is_explicit ? "explicit" : "transparent")
+	return chunk;
+}
+
+/**
+ * Take a slot of a chunk with room.
+ * @param is_reused Set to 1 if the slot held a freed thread
+ */
+static struct thread *take_slot(struct arena_chunk *chunk, int node, int *is_reused) {
+	struct thread *thread = TAILQ_FIRST(&chunk->free);
+
+	if (thread != NULL) {
+		TAILQ_REMOVE(&chunk->free, thread, entries);
+		*is_reused = 1;
+	} else {
+		char *slot = (char *) chunk + chunk->first + chunk->carved++ * slot_size(chunk->flags);
+		char *stack = slot + stack_offset(chunk->flags);
+		if ((chunk->flags & THREAD_STACK_ARENA_GUARD) && mprotect(slot, (size_t) page_size, PROT_NONE) != 0)
+			warn("Cannot protect the guard page of a stack: %d", errno)
+
+		thread = (struct thread *) (stack + round_up(THREAD_STACK_SIZE_DEFAULT, 64));
+		thread->context.uc_stack.ss_sp = stack;
+		thread->context.uc_stack.ss_size = THREAD_STACK_SIZE_DEFAULT;
+		thread->node = node;
+		thread->is_mapped = 1;
+		thread->is_in_arena = 1;
+		*is_reused = 0;
+	}
+
+	__atomic_add_fetch(&chunk->used, 1, __ATOMIC_RELAXED);
+	return thread;
+}
+
+/**
+ * Put a block back in the free slots of its chunk, under the lock of its node.
+ */
+static void give_back(struct arena_node *arena, struct thread *thread) {
+	struct arena_chunk *chunk = chunk_of(thread);
+
+	TAILQ_INSERT_HEAD(&chunk->free, thread, entries);
+	__atomic_sub_fetch(&chunk->used, 1, __ATOMIC_RELAXED);
+	if (!chunk->has_room) {
+		TAILQ_INSERT_TAIL(&arena->partial, chunk, entries);
+		chunk->has_room = 1;
+	}
+}
+
+/**
+ * @return The arena cache of the scheduler of the calling kernel thread, NULL if it isn't on the node
+ */
+static struct block_cache *local_cache(int node) {
+	struct thread_sched *sched = local_sched;
+	return sched != NULL && sched->node == node ? &sched->arena_cache : NULL;
+}
+
+//endregion
+
+//region Arena
+
+void arena_init(void) {
+	page_size = sysconf(_SC_PAGESIZE);
+	for (int node = 0; node < NUMA_MAX_NODES; node++) {
+		nodes[node].lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+		TAILQ_INIT(&nodes[node].partial);
+		nodes[node].chunks = NULL;
+		memset(&nodes[node].stats, 0, sizeof nodes[node].stats);
+	}
+
+	const char *mode = getenv("THREAD_STACK_ARENA");
+	if (mode == NULL || strcmp(mode, "0") == 0)
+		return;
+
+	const char *guard = getenv("THREAD_STACK_ARENA_GUARD");
+	int flags = strcmp(mode, "hugetlb") == 0 ? THREAD_STACK_ARENA_HUGETLB : 0;
+	if (guard != NULL && strcmp(guard, "0") != 0)
+		flags |= THREAD_STACK_ARENA_GUARD;
+	if (thread_stack_arena_start(flags) != 0)
+		warn("Invalid stack arena THREAD_STACK_ARENA=%s, not using it", mode)
+}
+
+struct thread *arena_alloc_thread(int node, int *is_reused) {
+	int flags = __atomic_load_n(&arena_flags, __ATOMIC_RELAXED), is_cached;
+	struct arena_node *arena = &nodes[node];
+	struct block_cache *cache = local_cache(node);
+	struct arena_chunk *chunk;
+	struct thread *thread;
+
+	if (flags == -1)
+		return NULL;
+
+	while (cache != NULL && (thread = TAILQ_FIRST(&cache->threads)) != NULL) {
+		TAILQ_REMOVE(&cache->threads, thread, entries);
+		cache->size--;
+		chunk = chunk_of(thread);
+		if (chunk->flags == flags) {
+			__atomic_add_fetch(&arena->stats.stacks_packed, __atomic_load_n(&chunk->used, __ATOMIC_RELAXED) > 1,
+			                   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&arena->stats.stacks_in_use, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&arena->stats.stacks_allocated, 1, __ATOMIC_RELAXED);
+			*is_reused = 1;
+			return thread;
+		}
+
+		// Carved with other flags: not given any more
+		kernel.mutex_lock(&arena->lock);
+		give_back(arena, thread);
+		kernel.mutex_unlock(&arena->lock);
+	}
+
+	kernel.mutex_lock(&arena->lock);
+	// A freed slot has its pages already, an uncarved one not always
+	struct arena_chunk *uncarved = NULL;
+	TAILQ_FOREACH(chunk, &arena->partial, entries) {
+		if (chunk->flags != flags)
+			continue;
+		if (!TAILQ_EMPTY(&chunk->free))
+			break;
+		if (uncarved == NULL)
+			uncarved = chunk;
+	}
+	if (chunk == NULL)
+		chunk = uncarved;
+	if (chunk == NULL)
+		chunk = new_chunk(arena, node, flags);
+	if (chunk == NULL) {
+		arena->stats.fallbacks++;
+		kernel.mutex_unlock(&arena->lock);
+		return NULL;
+	}
+
+	__atomic_add_fetch(&arena->stats.stacks_packed, chunk->used > 0, __ATOMIC_RELAXED);
+	thread = take_slot(chunk, node, is_reused);
+	// Only the freed slots: the uncarved ones stay packed after the others
+	while (cache != NULL && cache->size < BLOCK_CACHE_BATCH && !TAILQ_EMPTY(&chunk->free)) {
+		struct thread *cached = take_slot(chunk, node, &is_cached);
+		TAILQ_INSERT_TAIL(&cache->threads, cached, entries);
+		cache->size++;
+	}
+	if (TAILQ_EMPTY(&chunk->free) && chunk->carved == slots_per_chunk(chunk->flags)) {
+		TAILQ_REMOVE(&arena->partial, chunk, entries);
+		chunk->has_room = 0;
+	} else if (chunk != TAILQ_FIRST(&arena->partial)) {
+		// Used last: its pages are the likeliest to be in the TLB
+		TAILQ_REMOVE(&arena->partial, chunk, entries);
+		TAILQ_INSERT_HEAD(&arena->partial, chunk, entries);
+	}
+	__atomic_add_fetch(&arena->stats.stacks_in_use, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&arena->stats.stacks_allocated, 1, __ATOMIC_RELAXED);
+	kernel.mutex_unlock(&arena->lock);
+	return thread;
+}
+
+void arena_free_thread(struct thread *thread) {
+	struct arena_node *arena = &nodes[thread->node];
+	struct block_cache *cache = local_cache(thread->node);
+
+	__atomic_sub_fetch(&arena->stats.stacks_in_use, 1, __ATOMIC_RELAXED);
+	// Kept while the arena gives blocks of its flags, the oldest batch goes back when the cache is full
+	if (cache != NULL && chunk_of(thread)->flags == __atomic_load_n(&arena_flags, __ATOMIC_RELAXED)) {
+		TAILQ_INSERT_HEAD(&cache->threads, thread, entries);
+		if (++cache->size <= BLOCK_CACHE_SIZE)
+			return;
+
+		kernel.mutex_lock(&arena->lock);
+		for (unsigned int i = 0; i < BLOCK_CACHE_BATCH; i++) {
+			struct thread *oldest = TAILQ_LAST(&cache->threads, thread_queue);
+			TAILQ_REMOVE(&cache->threads, oldest, entries);
+			give_back(arena, oldest);
+		}
+		kernel.mutex_unlock(&arena->lock);
+		cache->size -= BLOCK_CACHE_BATCH;
+		return;
+	}
+
+	kernel.mutex_lock(&arena->lock);
+	give_back(arena, thread);
+	kernel.mutex_unlock(&arena->lock);
+}
+
+void arena_flush(struct thread_sched *sched) {
+	struct block_cache *cache = &sched->arena_cache;
+	struct arena_node *arena = &nodes[sched->node];
+	struct thread *thread;
+
+	if (cache->size == 0)
+		return;
+
+	kernel.mutex_lock(&arena->lock);
+	while ((thread = TAILQ_FIRST(&cache->threads)) != NULL) {
+		TAILQ_REMOVE(&cache->threads, thread, entries);
+		give_back(arena, thread);
+	}
+	kernel.mutex_unlock(&arena->lock);
+	cache->size = 0;
+}
+
+void arena_exit(void) {
+	for (unsigned int node = 0; node < numa_nodes; node++) {
+		struct arena_node *arena = &nodes[node];
+
+		kernel.mutex_lock(&arena->lock);
+		// The threads of the other kernel threads may still run on theirs
+		for (struct arena_chunk **link = &arena->chunks, *chunk; (chunk = *link) != NULL;) {
+			if (chunk->used > 0) {
+				link = &chunk->next;
+				continue;
+			}
+			*link = chunk->next;
+			if (chunk->has_room)
+				TAILQ_REMOVE(&arena->partial, chunk, entries);
+			munmap(chunk, ARENA_CHUNK_SIZE);
+		}
+		kernel.mutex_unlock(&arena->lock);
+	}
+}
+
+/**
+ * @return Whether a mapping overlaps a chunk of the arena
+ */
+static int overlaps_arena(uintptr_t start, uintptr_t end) {
+	for (unsigned int node = 0; node < numa_nodes; node++)
+		for (struct arena_chunk *chunk = nodes[node].chunks; chunk != NULL; chunk = chunk->next)
+			if ((uintptr_t) chunk < end && (uintptr_t) chunk + ARENA_CHUNK_SIZE > start)
+				return 1;
+	return 0;
+}
+
+/**
+ * @return The bytes of the arena backed by huge pages, from /proc/self/smaps, under the locks
+ */
+static unsigned long huge_bytes(void) {
+	unsigned long total = 0, kb, start, end;
+	int is_counted = 0;
+	char line[256];
+
+	FILE *file = fopen("/proc/self/smaps", "r");
+	if (file == NULL)
+		return 0;
+
+	while (fgets(line, sizeof line, file) != NULL) {
+		// A mapping starts with its address range, its fields with their name
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			is_counted = overlaps_arena(start, end);
+		else if (is_counted && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1
+		                        || sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1))
+			total += kb * 1024;
+	}
+	fclose(file);
+	return total;
+}
+
+//endregion
+
+//region API
+
+int thread_stack_arena_start(int flags) {
+	if (flags & ~(THREAD_STACK_ARENA_HUGETLB | THREAD_STACK_ARENA_GUARD))
+		return -1;
+	// The guard page would be a whole huge page
+	if ((flags & THREAD_STACK_ARENA_HUGETLB) && (flags & THREAD_STACK_ARENA_GUARD))
+		return -1;
+
+	__atomic_store_n(&arena_flags, flags, __ATOMIC_RELAXED);
+	info("Stack arena of %s huge pages, %u stacks each%s", flags & THREAD_STACK_ARENA_HUGETLB ? "explicit" : "transparent",
+	     slots_per_chunk(flags), flags & THREAD_STACK_ARENA_GUARD ? ", with guard pages" : "")
+	return 0;
+}
+
+int thread_stack_arena_stop(void) {
+	__atomic_store_n(&arena_flags, -1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int thread_stack_arena_stats(thread_stack_arena_stats_t *stats) {
+	int flags = __atomic_load_n(&arena_flags, __ATOMIC_RELAXED);
+
+	memset(stats, 0, sizeof *stats);
+	stats->stacks_per_huge_page = slots_per_chunk(flags == -1 ? 0 : flags);
+
+	for (unsigned int node = 0; node < numa_nodes; node++)
+		kernel.mutex_lock(&nodes[node].lock);
+	for (unsigned int node = 0; node < numa_nodes; node++) {
+		const thread_stack_arena_stats_t *counters = &nodes[node].stats;
+		stats->huge_pages += counters->huge_pages;
+		stats->explicit_huge_pages += counters->explicit_huge_pages;
+		stats->hugetlb_failures += counters->hugetlb_failures;
+		// The caches of the schedulers count without the lock
+		stats->stacks_in_use += __atomic_load_n(&counters->stacks_in_use, __ATOMIC_RELAXED);
+		stats->stacks_allocated += __atomic_load_n(&counters->stacks_allocated, __ATOMIC_RELAXED);
+		stats->stacks_packed += __atomic_load_n(&counters->stacks_packed, __ATOMIC_RELAXED);
+		stats->fallbacks += counters->fallbacks;
+	}
+	stats->huge_bytes = huge_bytes();
+	for (unsigned int node = numa_nodes; node > 0; node--)
+		kernel.mutex_unlock(&nodes[node - 1].lock);
+	return 0;
+}
+
+//endregion
@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "forkjoin.h"
+#include "debug.h"
+
+/**
+ * Maximum number of pending tasks per worker. When it is full, spawns are executed immediately.
+ */
+#define DEQUE_SIZE 4096
+
+/**
+ * Number of sub-ranges per worker when the grain is chosen automatically.
+ */
+#define AUTO_GRAIN_SPLIT 8
+
+/**
+ * Number of times an idle worker looks for a task, yielding in between, before it sleeps.
+ */
+#define IDLE_SPINS 64
+
+/**
+ * Number of tasks a joining worker runs nested on its stack, each stolen while it waited for the
+ * previous one, before it sleeps instead: the stacks of our threads are small.
+ */
+#define MAX_HELP_DEPTH 8
+
+/**
+ * States of a task: a joiner that sleeps on it marks it, so the worker executing it wakes it up.
+ */
+#define TASK_PENDING 0
+#define TASK_DONE 1
+#define TASK_WAITED 2
+
+//region Structure declaration
+
+struct fj_worker {
+	thread_t thread;
+	struct fj_pool *pool;
+	unsigned int index;
+
+	/**
+	 * Number of stolen tasks running nested in fj_join on the worker's stack.
+	 */
+	unsigned int help_depth;
+
+	/**
+	 * The NUMA node the worker runs on: thieves try the workers of their own node first.
+	 */
+	int node;
+
+	/**
+	 * Protects the deque: the owner pushes and pops at the bottom, thieves steal at the top.
+	 */
+	thread_mutex_t lock;
+	unsigned int top, bottom;
+	fj_task_t *tasks[DEQUE_SIZE];
+};
+
+struct fj_pool {
+	unsigned int size;
+	atomic_int is_stopping;
+
+	/**
+	 * The worker of the calling thread, NULL for the other threads.
+	 */
+	thread_key_t worker_key;
+
+	/**
+	 * Idle workers sleep on idle_cond until a spawn changes the epoch.
+	 * A worker counts itself in nb_idle before it reads the epoch and looks for a task one last
+	 * time, a spawn pushes its task and changes the epoch before it reads nb_idle: either the
+	 * worker finds the task, or the spawn sees the worker and signals it.
+	 * The joiners that sleep until a task is done wait on done_cond, with the same lock.
+	 */
+	thread_mutex_t idle_lock;
+	thread_cond_t idle_cond;
+	thread_cond_t done_cond;
+	atomic_uint epoch;
+	atomic_uint nb_idle;
+
+	struct fj_worker workers[];
+};
+
+/**
+ * The pool currently executing fj_pool_run, if any.
+ */
+static _Atomic(struct fj_pool *) running_pool = NULL;
+
+//endregion
+
+//region Deque
+
+/**
+ * @return The NUMA node of the calling worker
+ */
+static int current_node(void) {
+#ifdef USE_PTHREAD
+	unsigned int cpu, node;
+	return syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int) node : 0;
+#else
+	return thread_sched_node(thread_sched_self());
+#endif
+}
+
+static struct fj_worker *current_worker(void) {
+	struct fj_pool *pool = atomic_load_explicit(&running_pool, memory_order_acquire);
+	return pool != NULL ? thread_getspecific(pool->worker_key) : NULL;
+}
+
+static int deque_push(struct fj_worker *worker, fj_task_t *task) {
+	int pushed = 0;
+
+	thread_mutex_lock(&worker->lock);
+	if (worker->bottom - worker->top < DEQUE_SIZE) {
+		worker->tasks[worker->bottom % DEQUE_SIZE] = task;
+		worker->bottom++;
+		task->owner = worker;
+		pushed = 1;
+	}
+	thread_mutex_unlock(&worker->lock);
+
+	return pushed;
+}
+
+static fj_task_t *deque_pop(struct fj_worker *worker) {
+	fj_task_t *task = NULL;
+
+	thread_mutex_lock(&worker->lock);
+	if (worker->bottom != worker->top) {
+		worker->bottom--;
+		task = worker->tasks[worker->bottom % DEQUE_SIZE];
+	}
+	thread_mutex_unlock(&worker->lock);
+
+	return task;
+}
+
+static fj_task_t *deque_steal(struct fj_worker *worker) {
+	fj_task_t *task = NULL;
+
+	thread_mutex_lock(&worker->lock);
+	if (worker->bottom != worker->top) {
+		task = worker->tasks[worker->top % DEQUE_SIZE];
+		worker->top++;
+	}
+	thread_mutex_unlock(&worker->lock);
+
+	return task;
+}
+
+/**
+ * Remove a specific task from its owner's deque.
+ * @return 1 if the task was still there (nobody will execute it), 0 if it has been taken
+ */
+static int deque_remove(struct fj_worker *worker, fj_task_t *task) {
+	int removed = 0;
+
+	thread_mutex_lock(&worker->lock);
+	// Joins usually happen in reverse spawn order: the task is most likely at the bottom
+	for (unsigned int i = worker->bottom; i != worker->top; i--) {
+		if (worker->tasks[(i - 1) % DEQUE_SIZE] == task) {
+			for (unsigned int j = i; j != worker->bottom; j++)
+				worker->tasks[(j - 1) % DEQUE_SIZE] = worker->tasks[j % DEQUE_SIZE];
+			worker->bottom--;
+			removed = 1;
+			break;
+		}
+	}
+	thread_mutex_unlock(&worker->lock);
+
+	return removed;
+}
+
+//endregion
+
+//region Tasks
+
+static void run_task(fj_task_t *task) {
+	// Once the task is done, its joiner may return: the task, on the joiner's stack, is gone
+	struct fj_pool *pool = task->owner != NULL ? task->owner->pool : NULL;
+
+	task->result = task->func(task->arg);
+	if (atomic_exchange(&task->state, TASK_DONE) == TASK_WAITED) {
+		thread_mutex_lock(&pool->idle_lock);
+		thread_cond_broadcast(&pool->done_cond);
+		thread_mutex_unlock(&pool->idle_lock);
+	}
+}
+
+static int is_done(fj_task_t *task) {
+	return atomic_load_explicit(&task->state, memory_order_acquire) == TASK_DONE;
+}
+
+/**
+ * Sleep until a task that another worker took is done.
+ */
+static void wait_done(fj_task_t *task) {
+	struct fj_pool *pool = task->owner->pool;
+	int pending = TASK_PENDING;
+
+	if (!atomic_compare_exchange_strong(&task->state, &pending, TASK_WAITED))
+		return;
+
+	thread_mutex_lock(&pool->idle_lock);
+	while (!is_done(task))
+		if (thread_cond_wait(&pool->done_cond, &pool->idle_lock) != 0)
+			break;
+	thread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * Execute one pending task: first from our own deque, then stolen from the other workers of our
+ * NUMA node, then from the others.
+ * @param self The current worker, can be NULL
+ * @param pool The pool to take tasks from
+ * @return 1 if a task was executed, 0 if there was nothing to do
+ */
+static int help(struct fj_worker *self, struct fj_pool *pool) {
+	fj_task_t *task = NULL;
+	unsigned int first = 0;
+	int node = -1;
+
+	if (self != NULL) {
+		task = deque_pop(self);
+		first = self->index + 1;
+		node = self->node;
+	}
+
+	for (int is_remote = 0; task == NULL && is_remote <= 1; is_remote++) {
+		for (unsigned int i = 0; task == NULL && i < pool->size; i++) {
+			struct fj_worker *victim = &pool->workers[(first + i) % pool->size];
+			if (victim != self && (node == -1 || (victim->node != node) == is_remote))
+				task = deque_steal(victim);
+		}
+		if (node == -1)
+			break;
+	}
+
+	if (task == NULL)
+		return 0;
+
+	run_task(task);
+	return 1;
+}
+
+void fj_spawn(fj_task_t *task, void *(*func)(void *), void *func_arg) {
+	task->func = func;
+	task->arg = func_arg;
+	task->result = NULL;
+	task->owner = NULL;
+	atomic_store_explicit(&task->state, TASK_PENDING, memory_order_relaxed);
+
+	struct fj_worker *worker = current_worker();
+	if (worker == NULL || !deque_push(worker, task)) {
+		run_task(task);
+		return;
+	}
+
+	struct fj_pool *pool = worker->pool;
+	atomic_fetch_add(&pool->epoch, 1);
+	if (atomic_load(&pool->nb_idle) > 0) {
+		thread_mutex_lock(&pool->idle_lock);
+		thread_cond_signal(&pool->idle_cond);
+		thread_mutex_unlock(&pool->idle_lock);
+	}
+}
+
+void *fj_join(fj_task_t *task) {
+	if (task->owner != NULL && deque_remove(task->owner, task)) {
+		// Nobody started it: no need to wait, do it ourselves
+		run_task(task);
+		return task->result;
+	}
+
+	// Only the workers help, and not deeper than MAX_HELP_DEPTH
+	struct fj_worker *self = current_worker();
+	while (!is_done(task)) {
+		if (self == NULL || self->help_depth >= MAX_HELP_DEPTH) {
+			wait_done(task);
+			break;
+		}
+
+		self->help_depth++;
+		int helped = help(self, self->pool);
+		self->help_depth--;
+		if (!helped)
+			thread_yield();
+	}
+
+	return task->result;
+}
+
+//endregion
+
+//region Pool
+
+/**
+ * Sleep until a task is spawned or the pool stops, unless a task can be executed right away.
+ */
+static void idle(struct fj_worker *worker, struct fj_pool *pool) {
+	atomic_fetch_add(&pool->nb_idle, 1);
+	unsigned int epoch = atomic_load(&pool->epoch);
+
+	if (!help(worker, pool)) {
+		thread_mutex_lock(&pool->idle_lock);
+		while (atomic_load(&pool->epoch) == epoch
+		       && !atomic_load_explicit(&pool->is_stopping, memory_order_acquire))
+			if (thread_cond_wait(&pool->idle_cond, &pool->idle_lock) != 0)
+				break;
+		thread_mutex_unlock(&pool->idle_lock);
+	}
+
+	atomic_fetch_sub(&pool->nb_idle, 1);
+}
+
+static void *worker_loop(void *_worker) {
+	struct fj_worker *worker = _worker;
+	struct fj_pool *pool = worker->pool;
+	unsigned int spins = 0;
+
+	worker->node = current_node();
+	thread_setspecific(pool->worker_key, worker);
+	while (!atomic_load_explicit(&pool->is_stopping, memory_order_acquire)) {
+		if (help(worker, pool)) {
+			spins = 0;
+		} else if (++spins < IDLE_SPINS) {
+			thread_yield();
+		} else {
+			idle(worker, pool);
+			spins = 0;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Stop the workers, join the first ones and free the pool.
+ * @param nb_started The number of workers that were started, counting the worker 0
+ */
+static void free_pool(struct fj_pool *pool, unsigned int nb_started) {
+	atomic_store_explicit(&pool->is_stopping, 1, memory_order_release);
+	thread_mutex_lock(&pool->idle_lock);
+	thread_cond_broadcast(&pool->idle_cond);
+	thread_mutex_unlock(&pool->idle_lock);
+
+	for (unsigned int i = 1; i < nb_started; i++)
+		thread_join(pool->workers[i].thread, NULL);
+
+	for (unsigned int i = 0; i < pool->size; i++)
+		thread_mutex_destroy(&pool->workers[i].lock);
+	thread_cond_destroy(&pool->done_cond);
+	thread_cond_destroy(&pool->idle_cond);
+	thread_mutex_destroy(&pool->idle_lock);
+	thread_key_delete(pool->worker_key);
+
+	free(pool);
+}
+
+int fj_pool_init(fj_pool_t **pool, unsigned int workers) {
+	if (workers == 0)
+		workers = 1;
+
+	struct fj_pool *new = malloc(sizeof *new + workers * sizeof new->workers[0]);
+	if (new == NULL) {
+		error("Fork-join pool allocation %s", "failed")
+		return -1;
+	}
+
+	if (thread_key_create(&new->worker_key, NULL) != 0) {
+		error("Cannot create the key of the %s", "fork-join workers")
+		free(new);
+		return -1;
+	}
+
+	new->size = workers;
+	atomic_init(&new->is_stopping, 0);
+	thread_mutex_init(&new->idle_lock);
+	thread_cond_init(&new->idle_cond);
+	thread_cond_init(&new->done_cond);
+	atomic_init(&new->epoch, 0);
+	atomic_init(&new->nb_idle, 0);
+
+	for (unsigned int i = 0; i < workers; i++) {
+		struct fj_worker *worker = &new->workers[i];
+		worker->pool = new;
+		worker->index = i;
+		worker->help_depth = 0;
+		worker->node = -1;
+		worker->top = 0;
+		worker->bottom = 0;
+		thread_mutex_init(&worker->lock);
+	}
+
+	// Worker 0 is whoever calls fj_pool_run
+	for (unsigned int i = 1; i < workers; i++) {
+		if (thread_create(&new->workers[i].thread, worker_loop, &new->workers[i]) != 0) {
+			error("Failed to create the fork-join worker %u", i)
+			free_pool(new, i);
+			return -1;
+		}
+	}
+
+	info("Created a fork-join pool of %u workers", workers)
+	*pool = new;
+	return 0;
+}
+
+void fj_pool_destroy(fj_pool_t *pool) {
+	free_pool(pool, pool->size);
+}
+
+void *fj_pool_run(fj_pool_t *pool, void *(*func)(void *), void *func_arg) {
+	pool->workers[0].thread = thread_self();
+	pool->workers[0].node = current_node();
+	thread_setspecific(pool->worker_key, &pool->workers[0]);
+	atomic_store_explicit(&running_pool, pool, memory_order_release);
+
+	void *result = func(func_arg);
+
+	atomic_store_explicit(&running_pool, NULL, memory_order_release);
+	thread_setspecific(pool->worker_key, NULL);
+	return result;
+}
+
+//endregion
+
+//region Parallel loops
+
+struct fj_range {
+	long begin, end, grain;
+	void (*body)(long, long, void *);
+	void *(*map)(long, long, void *);
+	void *(*combine)(void *, void *, void *);
+	void *arg;
+};
+
+static long auto_grain(long begin, long end, long grain) {
+	if (grain > 0)
+		return grain;
+
+	struct fj_pool *pool = atomic_load_explicit(&running_pool, memory_order_acquire);
+	long workers = pool != NULL ? pool->size : 1;
+	grain = (end - begin) / (workers * AUTO_GRAIN_SPLIT);
+	return grain > 0 ? grain : 1;
+}
+
+static void *for_range(void *_range) {
+	struct fj_range *range = _range;
+
+	if (range->end - range->begin <= range->grain) {
+		range->body(range->begin, range->end, range->arg);
+		return NULL;
+	}
+
+	struct fj_range left = *range, right = *range;
+	left.end = right.begin = range->begin + (range->end - range->begin) / 2;
+
+	fj_task_t task;
+	fj_spawn(&task, for_range, &left);
+	for_range(&right);
+	fj_join(&task);
+	return NULL;
+}
+
+static void *reduce_range(void *_range) {
+	struct fj_range *range = _range;
+
+	if (range->end - range->begin <= range->grain)
+		return range->map(range->begin, range->end, range->arg);
+
+	struct fj_range left = *range, right = *range;
+	left.end = right.begin = range->begin + (range->end - range->begin) / 2;
+
+	fj_task_t task;
+	fj_spawn(&task, reduce_range, &left);
+	void *right_value = reduce_range(&right);
+	void *left_value = fj_join(&task);
+	return range->combine(left_value, right_value, range->arg);
+}
+
+void fj_parallel_for(long begin, long end, long grain,
+                     void (*body)(long begin, long end, void *arg), void *arg) {
+	if (end <= begin)
+		return;
+
+	struct fj_range range = {
+			.begin = begin,
+			.end = end,
+			.grain = auto_grain(begin, end, grain),
+			.body = body,
+			.arg = arg,
+	};
+	for_range(&range);
+}
+
+void *fj_parallel_reduce(long begin, long end, long grain,
+                         void *(*map)(long begin, long end, void *arg),
+                         void *(*combine)(void *left, void *right, void *arg), void *arg) {
+	if (end <= begin)
+		return NULL;
+
+	struct fj_range range = {
+			.begin = begin,
+			.end = end,
+			.grain = auto_grain(begin, end, grain),
+			.map = map,
+			.combine = combine,
+			.arg = arg,
+	};
+	return reduce_range(&range);
+}
+
+//endregion
@@ -0,0 +1,681 @@
+#ifndef OS_S8_INTERNAL_H
+#define OS_S8_INTERNAL_H
+
+#include <ucontext.h>
+#include <sys/queue.h>
+#include <time.h>
+#include <pthread.h>
+#include "thread.h"
+
+#define STACK_SIZE THREAD_STACK_SIZE_DEFAULT
+
+/**
+ * Per kernel thread. The library is loaded with the program, so the variables are at a fixed
+ * offset from the thread pointer: accessing them is a single instruction, also in signal handlers.
+ */
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+#define PRIORITY_LEVELS (THREAD_PRIORITY_MAX - THREAD_PRIORITY_MIN + 1)
+
+//region Structure declaration
+
+struct thread {
+	ucontext_t context;
+	void *return_value;
+#ifdef USE_DEBUG
+	short id;
+#endif
+	unsigned int valgrind_stack;
+	TAILQ_ENTRY(thread) entries;
+
+	/**
+	 * Is this thread a zombie? (= called exit, but hasn't been joined yet)
+	 * 1 = zombie, 0 = active
+	 */
+	char is_zombie;
+
+	/**
+	 * Is this thread waiting (for a join, a mutex or a condition)?
+	 * 1 = blocked, 0 = running or in the run queue
+	 */
+	char is_blocked;
+
+	/**
+	 * Blocked in thread_park, unparked while it wasn't, or neither (enum park_state). thread_unpark
+	 * changes it from any kernel thread.
+	 */
+	int park_state;
+
+	/**
+	 * Why the thread is in the inbox of its scheduler (enum inbox_op).
+	 */
+	char inbox_op;
+
+	/**
+	 * The scheduler the thread runs on.
+	 */
+	struct thread_sched *sched;
+
+	/**
+	 * The NUMA node of the block holding its stack and this structure, and whether the block is
+	 * mapped (bound to the node) rather than allocated with malloc, carved out of a huge page of
+	 * the stack arena, or given by the caller of thread_create_inplace, which owns it. See numa.c and arena.c.
+	 */
+	int node;
+	char is_mapped;
+	char is_in_arena;
+	char is_inplace;
+
+	/**
+	 * The thread responsible for joining this one.
+	 */
+	struct thread *joiner;
+
+	/**
+	 * The generator this thread is currently executing, if any.
+	 */
+	struct thread_gen *generator;
+
+	/**
+	 * Between THREAD_PRIORITY_MIN and THREAD_PRIORITY_MAX, higher runs first: the priority the policies
+	 * use, raised above the base one (thread_setpriority) to the highest waiter of the mutexes it holds.
+	 */
+	int priority;
+	int base_priority;
+
+	/**
+	 * Priority inheritance: the mutexes the thread holds (linked by next_held), and the one it waits for.
+	 */
+	struct thread_mutex *held_mutexes;
+	struct thread_mutex *waiting_for;
+
+	/**
+	 * Fair-share policy: weighted running time (ns), when it was last scheduled, position in the heap.
+	 */
+	unsigned long long vruntime;
+	unsigned long long run_start;
+	unsigned int heap_index;
+
+	/**
+	 * Runtime statistics, and when the thread started running, waiting in the run queue or blocking.
+	 */
+	thread_stats_t stats;
+	unsigned long long state_since;
+
+	/**
+	 * Identifies the thread in the traces, 0 is the main thread.
+	 */
+	unsigned int trace_id;
+
+	/**
+	 * The function the thread runs (NULL for the main thread), and whether its stack is painted.
+	 */
+	void *(*func)(void *);
+	char is_stack_painted;
+
+	/**
+	 * Thread-specific values, allocated on the first thread_setspecific.
+	 */
+	struct thread_specific *specific;
+
+	/**
+	 * The mutex whose holding time is being profiled, and when it was acquired.
+	 */
+	void *lockprof_mutex;
+	unsigned long long lockprof_since;
+
+	/**
+	 * Cancellation: the request (enum cancel_state, thread_cancel changes it from any kernel thread),
+	 * and the cleanup handlers, innermost first.
+	 * While the thread is blocked, what thread_cancel takes it out of: the waiting queue of a mutex,
+	 * a condition or a slot, the thread it joins, or its io_uring operation. wake_up clears them, and
+	 * is_interrupted tells the thread that thread_cancel woke it up.
+	 */
+	int cancel_state;
+	struct thread_cleanup *cleanups;
+	struct thread_queue *wait_queue;
+	struct thread *join_target;
+	void *uring_request;
+	char is_interrupted;
+};
+
+TAILQ_HEAD(thread_queue, thread);
+
+/**
+ * Blocks kept by a scheduler for its next threads, and moved at once between it and its node.
+ */
+#define BLOCK_CACHE_SIZE 16
+#define BLOCK_CACHE_BATCH 8
+
+/**
+ * Blocks of the default size freed on a kernel thread, newest first. Only that kernel thread uses it.
+ */
+struct block_cache {
+	struct thread_queue threads;
+	unsigned int size;
+};
+
+//endregion
+
+//region Scheduler instances
+
+struct thread_sched;
+
+/**
+ * A function posted to a scheduler by thread_sched_post.
+ */
+struct sched_post {
+	void (*func)(void *);
+	void *arg;
+	struct sched_post *next;
+};
+
+enum park_state {
+	PARK_NONE,
+	PARK_PARKED,
+	PARK_PERMIT,
+};
+
+enum cancel_state {
+	CANCEL_NONE,
+	CANCEL_PENDING,
+	/** Exiting: the cleanup handlers run, the cancellation points don't act anymore. */
+	CANCEL_EXITING,
+};
+
+/**
+ * What the scheduler does with a thread of its inbox.
+ */
+enum inbox_op {
+	INBOX_ADOPT,
+	INBOX_UNPARK,
+	INBOX_OFFLOAD,
+};
+
+//endregion
+
+//region Scheduling policies
+
+/**
+ * Why a thread is put in the run queue.
+ */
+enum sched_enqueue {
+	/** Just created, or moved from another policy. */
+	SCHED_NEW,
+	/** It was running, and let another thread take control. */
+	SCHED_YIELD,
+	/** It was blocked. */
+	SCHED_WAKEUP,
+	/** It was blocked, and the wakeup policy asks to run it next. */
+	SCHED_WAKEUP_NEXT,
+};
+
+/**
+ * A scheduling policy. The run queue only contains the runnable threads that are not running.
+ */
+struct sched_ops {
+	const char *name;
+
+	/**
+	 * The policy becomes active: its run queue is empty, `sched->running` is the running thread.
+	 */
+	void (*init)(struct thread_sched *sched);
+
+	/**
+	 * Add a runnable thread to the run queue.
+	 */
+	void (*enqueue)(struct thread_sched *sched, struct thread *thread, enum sched_enqueue reason);
+
+	/**
+	 * Remove a specific thread from the run queue, because it is about to run.
+	 */
+	void (*dequeue)(struct thread_sched *sched, struct thread *thread);
+
+	/**
+	 * Remove the thread that should run next from the run queue.
+	 * @return The thread, or NULL if the run queue is empty
+	 */
+	struct thread *(*pick_next)(struct thread_sched *sched);
+
+	/**
+	 * The running thread stops running without going back to the run queue (blocked or dead).
+	 */
+	void (*on_block)(struct thread_sched *sched, struct thread *thread);
+
+	/**
+	 * The policy is no longer active (or the scheduler is freed): its run queue is empty.
+	 */
+	void (*destroy)(struct thread_sched *sched);
+};
+
+/**
+ * @return The operations implementing a policy, or NULL if it doesn't exist
+ */
+const struct sched_ops *sched_get_ops(thread_sched_policy_t policy);
+
+/**
+ * Parse a policy name ("fifo", "lifo", "priority" or "fair").
+ * @return 0 on success, -1 if the name is unknown
+ */
+int sched_policy_from_name(const char *name, thread_sched_policy_t *policy);
+
+//endregion
+
+//region Scheduler
+
+struct uring;
+
+/**
+ * The state of a scheduler instance. Only its kernel thread uses it, but for the inbox, to which the
+ * other kernel threads and the offload helpers add without a lock.
+ */
+struct thread_sched {
+	/**
+	 * 0 for the scheduler of the main kernel thread, then in creation order. The worker of the traces.
+	 */
+	unsigned int id;
+
+	/**
+	 * The processor its kernel thread is pinned to (-1 if it isn't), and its NUMA node.
+	 */
+	int cpu, node;
+
+	/**
+	 * The next scheduler in the list of numa.c.
+	 */
+	struct thread_sched *next_instance;
+
+	/**
+	 * The thread currently executing. It is never in the run queue.
+	 */
+	struct thread *running;
+
+	/**
+	 * The kernel thread's own context, which created the scheduler (the main thread of the program for
+	 * the first one), and a thread that has exited and whose stack can't be freed while it runs on it.
+	 */
+	struct thread *main_thread, *current_to_free;
+
+	const struct sched_ops *ops;
+	thread_sched_policy_t policy;
+	thread_wakeup_policy_t wakeup_policy;
+	thread_sched_stats_t stats;
+
+	/**
+	 * Threads that have been created and haven't exited, including the main thread.
+	 */
+	unsigned long live_threads;
+
+	/**
+	 * Run queues of the policies, see scheduler.c: FIFO and LIFO, strict priorities, fair share (min-heap).
+	 */
+	struct thread_queue queue;
+	struct thread_queue priority_queues[PRIORITY_LEVELS];
+	unsigned int priority_bitmap;
+	struct thread **heap;
+	unsigned int heap_size, heap_capacity;
+	unsigned long long min_vruntime;
+
+	/**
+	 * The doorbell: the scheduler sleeps on it when no thread is runnable, and the other kernel
+	 * threads write to it when they fill the inbox while it sleeps.
+	 */
+	int event_fd;
+
+	/**
+	 * The inbox: the threads added by the other kernel threads (linked by their entries) and the
+	 * posted functions, newest first, and whether the scheduler sleeps or is about to.
+	 * On their own cache line, the only one the other kernel threads write.
+	 */
+	struct thread *inbox __attribute__((aligned(64)));
+	struct sched_post *posts;
+	int is_idle;
+
+	/**
+	 * While a posted function runs, thread_create doesn't switch to the new thread.
+	 */
+	char is_running_posts __attribute__((aligned(64)));
+
+	/**
+	 * Offloaded calls: how many are in progress, and the threads waiting for room in the queue.
+	 */
+	unsigned int offload_in_flight;
+	struct thread_queue offload_slot_waiters;
+
+	/**
+	 * io_uring: operations submitted and not reaped yet, and the ring, created on the first operation.
+	 */
+	unsigned int uring_in_flight;
+	struct uring *uring;
+
+	/**
+	 * Blocks of its node freed by its threads, from the pool of numa.c and from the arena: the next
+	 * threads take them without a lock.
+	 */
+	struct block_cache pool_cache, arena_cache;
+
+	/**
+	 * Watchdog: the kernel thread its timer signals, the timer while watching, and the last run it
+	 * reported, not to report it at each tick. The next scheduler in the list of watchdog.c.
+	 */
+	pid_t tid;
+	timer_t watchdog_timer;
+	char has_watchdog_timer;
+	struct thread *reported_thread;
+	unsigned long long reported_since;
+	struct thread_sched *next_watched;
+};
+
+/**
+ * The scheduler of the current kernel thread, NULL until it calls the library.
+ */
+extern THREAD_LOCAL struct thread_sched *local_sched;
+
+/**
+ * Number of scheduler instances. While there are several, an idle scheduler waits for posted functions.
+ */
+extern unsigned int sched_instances;
+
+/**
+ * Create the scheduler of the current kernel thread.
+ */
+struct thread_sched *sched_create_local(void);
+
+static inline struct thread_sched *sched_local(void) {
+	struct thread_sched *sched = local_sched;
+	if (__builtin_expect(sched == NULL, 0))
+		sched = sched_create_local();
+	return sched;
+}
+
+/**
+ * No thread is runnable: sleep until the inbox is filled.
+ * @return 1 if threads may have been woken up, 0 if nothing can wake one up
+ */
+int sched_wait(struct thread_sched *sched);
+
+/**
+ * Tell the other kernel threads that the scheduler is about to sleep, so that they ring its doorbell.
+ * @return 1 if it may sleep, 0 if the inbox has been filled meanwhile (it isn't idle then)
+ */
+int sched_idle_begin(struct thread_sched *sched);
+
+static inline void sched_idle_end(struct thread_sched *sched) {
+	__atomic_store_n(&sched->is_idle, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reset the eventfd, before looking at the inbox.
+ */
+void sched_drain(struct thread_sched *sched);
+
+/**
+ * Add a thread to the inbox of a scheduler, from another kernel thread, and ring the doorbell if
+ * the scheduler sleeps. The thread must be in no queue: a new one, a parked one, or one blocked in
+ * an offloaded call.
+ */
+void sched_push(struct thread_sched *sched, struct thread *thread, enum inbox_op op);
+
+/**
+ * Take everything in the inbox at once: adopt, unpark or wake up the threads, and run the posted
+ * functions, oldest first.
+ */
+void sched_run_inbox(struct thread_sched *sched);
+
+static inline void sched_check_inbox(struct thread_sched *sched) {
+	if (__builtin_expect(__atomic_load_n(&sched->inbox, __ATOMIC_RELAXED) != NULL
+	                     || __atomic_load_n(&sched->posts, __ATOMIC_RELAXED) != NULL, 0))
+		sched_run_inbox(sched);
+}
+
+/**
+ * Stop running the current thread, which has been marked blocked and put in a waiting queue, and run another one.
+ * @return 0 when the current thread is running again, -1 if no other thread can run (nothing happened)
+ */
+int block_current(void);
+
+/**
+ * Make a blocked thread runnable again, according to the wakeup policy.
+ */
+void wake_up(struct thread *thread);
+
+/**
+ * Exit the running thread with THREAD_CANCELED, through thread_exit.
+ */
+void cancel_exit(void) __attribute__((noreturn));
+
+/**
+ * A cancellation point: exit if thread_cancel has been called for the running thread.
+ */
+static inline void cancel_point(struct thread *current) {
+	if (__builtin_expect(__atomic_load_n(&current->cancel_state, __ATOMIC_RELAXED) == CANCEL_PENDING, 0))
+		cancel_exit();
+}
+
+//endregion
+
+//region Kernel threads
+
+/**
+ * The pthread functions of the C library, which the library uses for its own kernel threads
+ * even when the pthread shim overrides them.
+ */
+struct kernel_pthread {
+	int (*create)(pthread_t *thread, const pthread_attr_t *attr, void *(*func)(void *), void *arg);
+	int (*join)(pthread_t thread, void **return_value);
+	int (*mutex_lock)(pthread_mutex_t *mutex);
+	int (*mutex_unlock)(pthread_mutex_t *mutex);
+	int (*cond_wait)(pthread_cond_t *cond, pthread_mutex_t *mutex);
+	int (*cond_signal)(pthread_cond_t *cond);
+	int (*cond_broadcast)(pthread_cond_t *cond);
+	int (*key_create)(pthread_key_t *key, void (*destructor)(void *));
+	int (*setspecific)(pthread_key_t key, const void *value);
+};
+
+extern struct kernel_pthread kernel;
+
+/**
+ * Look up the functions of `kernel` in the C library, when the library is loaded.
+ */
+void kernel_resolve(void);
+
+//endregion
+
+//region NUMA
+
+#define NUMA_MAX_NODES 64
+
+/**
+ * Number of NUMA nodes, 1 if the machine isn't NUMA.
+ */
+extern unsigned int numa_nodes;
+
+/**
+ * Read the topology (or fake it with THREAD_NUMA_NODES), and THREAD_PIN.
+ */
+void numa_init(void);
+
+/**
+ * Free the pools.
+ */
+void numa_exit(void);
+
+/**
+ * Set the node of a new scheduler, on its kernel thread, pinning it first with THREAD_PIN, and list it.
+ */
+void numa_attach(struct thread_sched *sched);
+
+/**
+ * Remove a scheduler from the list, and give the blocks of its caches back to its node.
+ */
+void numa_detach(struct thread_sched *sched);
+
+/**
+ * @return The scheduler of a node with the fewest threads, or NULL if the node has none
+ */
+struct thread_sched *numa_sched_on_node(int node);
+
+/**
+ * Allocate the block holding a stack and, above it, the structure of a thread, on a node.
+ * The stack fields of the context, node and is_mapped are set.
+ * @param is_reused Set to 1 if the block comes from the pool of the node
+ * @return The structure, or NULL if the allocation failed
+ */
+struct thread *numa_alloc_thread(unsigned long stack_size, int node, int *is_reused);
+
+/**
+ * Give back the block of a thread allocated by numa_alloc_thread.
+ */
+void numa_free_thread(struct thread *thread);
+
+/**
+ * Prefer a node for a mapping, when the machine is NUMA.
+ */
+void numa_bind(void *address, size_t size, int node);
+
+//endregion
+
+//region Stack arena
+
+/**
+ * Start the arena with THREAD_STACK_ARENA and THREAD_STACK_ARENA_GUARD.
+ */
+void arena_init(void);
+
+/**
+ * Unmap the chunks without threads.
+ */
+void arena_exit(void);
+
+/**
+ * Carve the block of a thread with a stack of the default size out of a huge page of a node,
+ * laid out like those of numa_alloc_thread.
+ * @param is_reused Set to 1 if the block held a freed thread
+ * @return The structure, or NULL if the arena is stopped or can't map a huge page
+ */
+struct thread *arena_alloc_thread(int node, int *is_reused);
+
+/**
+ * Give back the block of a thread carved by arena_alloc_thread.
+ */
+void arena_free_thread(struct thread *thread);
+
+/**
+ * Give the blocks of the arena cache of a scheduler back to their huge pages.
+ */
+void arena_flush(struct thread_sched *sched);
+
+//endregion
+
+//region Offload
+
+/**
+ * Wake up a thread whose offloaded call has completed, taken from the inbox of its scheduler.
+ */
+void offload_complete(struct thread_sched *sched, struct thread *thread);
+
+/**
+ * Stop the helper kernel threads.
+ */
+void offload_exit(void);
+
+/**
+ * Wait until no helper works for a scheduler about to be freed, on its kernel thread.
+ */
+void offload_detach(struct thread_sched *sched);
+
+//endregion
+
+//region io_uring
+
+/**
+ * Wake up the threads whose operations have completed (without a system call).
+ * @param submit 1 to also submit the operations prepared since the last submission
+ */
+void uring_poll(struct thread_sched *sched, int submit);
+
+/**
+ * No thread is runnable: submit the prepared operations, and sleep until one completes (or the
+ * inbox is filled).
+ * @return 1 if threads may have been woken up, 0 if no operation is in progress
+ */
+int uring_wait(struct thread_sched *sched);
+
+/**
+ * Ask the kernel to cancel an operation: it completes early, with -ECANCELED, if it hasn't yet.
+ * @param request The request of the blocked thread (struct thread.uring_request)
+ */
+void uring_cancel(struct thread_sched *sched, void *request);
+
+/**
+ * Close the ring of a scheduler.
+ */
+void uring_exit(struct thread_sched *sched);
+
+static inline void uring_check(struct thread_sched *sched, int submit) {
+	if (__builtin_expect(sched->uring_in_flight != 0, 0))
+		uring_poll(sched, submit);
+}
+
+//endregion
+
+//region Profiler
+
+/**
+ * Start profiling if the THREAD_PROFILE environment variable is set.
+ */
+void profiler_init(void);
+
+/**
+ * Stop profiling, and write the profile to the file named by THREAD_PROFILE.
+ */
+void profiler_exit(void);
+
+/**
+ * Unwind the stack of the code interrupted by a signal, from its handler.
+ * backtrace() must have been called once outside of the handler, so it doesn't allocate.
+ * @param context The third argument of the SA_SIGINFO handler
+ * @param first Set to the index of the interrupted function in frames
+ * @return The number of frames from the interrupted function
+ */
+int signal_backtrace(void **frames, int size, void *context, int *first);
+
+//endregion
+
+//region Watchdog
+
+/**
+ * Start the watchdog if the THREAD_WATCHDOG environment variable is set.
+ */
+void watchdog_init(void);
+
+/**
+ * Stop the watchdog.
+ */
+void watchdog_exit(void);
+
+/**
+ * List a new scheduler, on its kernel thread, and give it a timer if the watchdog is started.
+ */
+void watchdog_attach(struct thread_sched *sched);
+
+/**
+ * Delete the timer of a scheduler and remove it from the list, before it is freed.
+ */
+void watchdog_detach(struct thread_sched *sched);
+
+/**
+ * Count a thread that has run too long without switching, in its statistics and the scheduler's.
+ * Called by the signal handler of the watchdog, on the kernel thread of the scheduler.
+ */
+void count_hog(struct thread *thread);
+
+//endregion
+
+static inline unsigned long long now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif //OS_S8_INTERNAL_H
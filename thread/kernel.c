@@ -0,0 +1,67 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include "internal.h"
+#include "debug.h"
+
+/*
+ * The pthread functions of the C library.
+ *
+ * When the pthread shim is preloaded, the pthread_* symbols are the shim's, which create and lock
+ * our threads: the library looks up the C library's own definitions for its kernel threads.
+ */
+
+struct kernel_pthread kernel = {
+		pthread_create,
+		pthread_join,
+		pthread_mutex_lock,
+		pthread_mutex_unlock,
+		pthread_cond_wait,
+		pthread_cond_signal,
+		pthread_cond_broadcast,
+		pthread_key_create,
+		pthread_setspecific,
+};
+
+static int is_resolved = 0;
+
+/**
+ * @return The definition of a symbol in the C library (libpthread before glibc 2.34), or NULL
+ */
+static void *lookup(void *libpthread, void *libc, const char *name) {
+	void *symbol = libpthread != NULL ? dlsym(libpthread, name) : NULL;
+	if (symbol == NULL && libc != NULL)
+		symbol = dlsym(libc, name);
+	return symbol;
+}
+
+#define RESOLVE(field, name) \
+	do { \
+		void *symbol = lookup(libpthread, libc, name); \
+		if (symbol != NULL) \
+			*(void **) &kernel.field = symbol; \
+	} while (0)
+
+void kernel_resolve(void) {
+	if (is_resolved)
+		return;
+
+	// Only the libraries already loaded: the defaults are right for the others
+	void *libpthread = dlopen("libpthread.so.0", RTLD_LAZY | RTLD_NOLOAD);
+	void *libc = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD);
+
+	RESOLVE(create, "pthread_create");
+	RESOLVE(join, "pthread_join");
+	RESOLVE(mutex_lock, "pthread_mutex_lock");
+	RESOLVE(mutex_unlock, "pthread_mutex_unlock");
+	RESOLVE(cond_wait, "pthread_cond_wait");
+	RESOLVE(cond_signal, "pthread_cond_signal");
+	RESOLVE(cond_broadcast, "pthread_cond_broadcast");
+	RESOLVE(key_create, "pthread_key_create");
+	RESOLVE(setspecific, "pthread_setspecific");
+
+	if (libpthread != NULL)
+		dlclose(libpthread);
+	if (libc != NULL)
+		dlclose(libc);
+	is_resolved = 1;
+}
@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "lockprof.h"
+#include "debug.h"
+
+#define LOCKPROF_INITIAL_CAPACITY 64
+
+/**
+ * Bucket i counts the durations in [2^(i-1), 2^i) ns, the last one everything above.
+ */
+#define LOCKPROF_BUCKETS 40
+
+/**
+ * Number of waiting call sites kept per mutex.
+ */
+#define LOCKPROF_SITES 4
+
+/**
+ * Number of locks in the report printed at exit.
+ */
+#define LOCKPROF_EXIT_TOP 10
+
+//region Structure declaration
+
+struct lockprof_site {
+	void *address;
+	unsigned long waits;
+	unsigned long long wait_ns;
+};
+
+struct lockprof_histogram {
+	unsigned long long total_ns, max_ns;
+	unsigned long count;
+	unsigned long buckets[LOCKPROF_BUCKETS];
+};
+
+struct lockprof_entry {
+	/** NULL for a free slot. */
+	void *mutex;
+	unsigned long acquisitions;
+	unsigned long contended;
+	/** Only the contended acquisitions. */
+	struct lockprof_histogram wait;
+	struct lockprof_histogram hold;
+	struct lockprof_site sites[LOCKPROF_SITES];
+};
+
+unsigned int lockprof_sample_every = 0;
+THREAD_LOCAL unsigned int lockprof_countdown = 1;
+
+/**
+ * Open addressing, linear probing. Entries are never removed, only reset.
+ */
+static struct lockprof_entry *table = NULL;
+static unsigned int table_size = 0, table_capacity = 0;
+
+/**
+ * The last sampling period, for the report.
+ */
+static unsigned int sampled_every = 1;
+
+static int report_at_exit = 0;
+
+/**
+ * The threads of every scheduler record their acquisitions.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+//endregion
+
+//region Hash table
+
+static unsigned int hash(void *mutex) {
+	unsigned long key = (unsigned long) mutex;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdUL;
+	key ^= key >> 33;
+	return (unsigned int) key;
+}
+
+static struct lockprof_entry *slot(struct lockprof_entry *entries, unsigned int capacity, void *mutex) {
+	unsigned int i = hash(mutex) & (capacity - 1);
+	while (entries[i].mutex != NULL && entries[i].mutex != mutex)
+		i = (i + 1) & (capacity - 1);
+	return &entries[i];
+}
+
+/**
+ * @return The entry of the mutex, created if needed, or NULL if the allocation failed
+ */
+static struct lockprof_entry *lookup(void *mutex) {
+	// At most half full
+	if (2 * (table_size + 1) > table_capacity) {
+		unsigned int capacity = table_capacity ? 2 * table_capacity : LOCKPROF_INITIAL_CAPACITY;
+		struct lockprof_entry *entries = calloc(capacity, sizeof *entries);
+		if (entries == NULL) {
+			error("Mutex profile allocation %s", "failed")
+			return NULL;
+		}
+
+		for (unsigned int i = 0; i < table_capacity; i++)
+			if (table[i].mutex != NULL)
+				*slot(entries, capacity, table[i].mutex) = table[i];
+
+		free(table);
+		table = entries;
+		table_capacity = capacity;
+	}
+
+	struct lockprof_entry *entry = slot(table, table_capacity, mutex);
+	if (entry->mutex == NULL) {
+		entry->mutex = mutex;
+		table_size++;
+	}
+	return entry;
+}
+
+//endregion
+
+//region Recording
+
+static void record(struct lockprof_histogram *histogram, unsigned long long ns) {
+	unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= LOCKPROF_BUCKETS)
+		bucket = LOCKPROF_BUCKETS - 1;
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total_ns += ns;
+	if (ns > histogram->max_ns)
+		histogram->max_ns = ns;
+}
+
+/**
+ * Space-saving: a new site replaces the one with the least waiting time.
+ */
+static void record_site(struct lockprof_entry *entry, void *address, unsigned long long wait_ns) {
+	struct lockprof_site *least = &entry->sites[0];
+
+	for (int i = 0; i < LOCKPROF_SITES; i++) {
+		struct lockprof_site *site = &entry->sites[i];
+		if (site->address == address || site->address == NULL) {
+			site->address = address;
+			site->waits++;
+			site->wait_ns += wait_ns;
+			return;
+		}
+		if (site->wait_ns < least->wait_ns)
+			least = site;
+	}
+
+	least->address = address;
+	least->waits++;
+	least->wait_ns += wait_ns;
+}
+
+void lockprof_acquired(void *mutex, void *site, int contended, unsigned long long wait_ns, struct thread *thread) {
+	kernel.mutex_lock(&lock);
+	struct lockprof_entry *entry = lookup(mutex);
+	if (entry == NULL) {
+		kernel.mutex_unlock(&lock);
+		return;
+	}
+
+	entry->acquisitions++;
+	if (contended) {
+		entry->contended++;
+		record(&entry->wait, wait_ns);
+		record_site(entry, site, wait_ns);
+	}
+	kernel.mutex_unlock(&lock);
+
+	// A thread times one hold at a time
+	if (thread->lockprof_mutex == NULL) {
+		thread->lockprof_mutex = mutex;
+		thread->lockprof_since = now_ns();
+	}
+}
+
+void lockprof_released(struct thread *thread) {
+	unsigned long long hold_ns = now_ns() - thread->lockprof_since;
+	void *mutex = thread->lockprof_mutex;
+
+	thread->lockprof_mutex = NULL;
+	kernel.mutex_lock(&lock);
+	// Profiling may have been reset since the acquisition
+	if (table != NULL) {
+		struct lockprof_entry *entry = slot(table, table_capacity, mutex);
+		if (entry->mutex == mutex)
+			record(&entry->hold, hold_ns);
+	}
+	kernel.mutex_unlock(&lock);
+}
+
+//endregion
+
+//region API and report
+
+int thread_mutex_profile_start(unsigned int sample_every) {
+	if (sample_every == 0)
+		return -1;
+
+	lockprof_sample_every = sampled_every = sample_every;
+	lockprof_countdown = 1;
+	info("Profiling one mutex acquisition out of %u", sample_every)
+	return 0;
+}
+
+int thread_mutex_profile_stop(void) {
+	lockprof_sample_every = 0;
+	return 0;
+}
+
+void thread_mutex_profile_reset(void) {
+	kernel.mutex_lock(&lock);
+	free(table);
+	table = NULL;
+	table_size = table_capacity = 0;
+	kernel.mutex_unlock(&lock);
+}
+
+/**
+ * @return An upper bound of the duration under which a fraction of the histogram is
+ */
+static unsigned long long percentile(const struct lockprof_histogram *histogram, double fraction) {
+	unsigned long target = (unsigned long) (fraction * histogram->count + 0.5), seen = 0;
+	if (target == 0)
+		target = 1;
+
+	for (int i = 0; i < LOCKPROF_BUCKETS - 1; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= target) {
+			unsigned long long upper = (1ULL << i) - 1;
+			return upper < histogram->max_ns ? upper : histogram->max_ns;
+		}
+	}
+	return histogram->max_ns;
+}
+
+static void print_histogram(FILE *file, const char *name, const struct lockprof_histogram *histogram) {
+	if (histogram->count == 0) {
+		fprintf(file, "  %s: -\n", name);
+		return;
+	}
+	fprintf(file, "  %s: %lu samples, total %.3f ms, mean %llu ns, p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+	        name, histogram->count, histogram->total_ns / 1e6, histogram->total_ns / histogram->count,
+	        percentile(histogram, 0.5), percentile(histogram, 0.9), percentile(histogram, 0.99), histogram->max_ns);
+}
+
+static void print_site(FILE *file, const struct lockprof_site *site) {
+	Dl_info symbol;
+
+	fprintf(file, "    %lu waits, %.3f ms at %p", site->waits, site->wait_ns / 1e6, site->address);
+	if (dladdr(site->address, &symbol) != 0) {
+		if (symbol.dli_sname != NULL)
+			fprintf(file, " %s+0x%lx", symbol.dli_sname,
+			        (unsigned long) ((char *) site->address - (char *) symbol.dli_saddr));
+		if (symbol.dli_fname != NULL)
+			fprintf(file, " (%s+0x%lx)", symbol.dli_fname,
+			        (unsigned long) ((char *) site->address - (char *) symbol.dli_fbase));
+	}
+	fprintf(file, "\n");
+}
+
+static int compare_wait(const void *a, const void *b) {
+	const struct lockprof_entry *x = *(struct lockprof_entry *const *) a, *y = *(struct lockprof_entry *const *) b;
+	if (x->wait.total_ns != y->wait.total_ns)
+		return x->wait.total_ns < y->wait.total_ns ? 1 : -1;
+	return (x->contended < y->contended) - (x->contended > y->contended);
+}
+
+static int compare_sites(const void *a, const void *b) {
+	const struct lockprof_site *x = a, *y = b;
+	return (x->wait_ns < y->wait_ns) - (x->wait_ns > y->wait_ns);
+}
+
+int thread_mutex_profile_report(FILE *file, unsigned int top) {
+	kernel.mutex_lock(&lock);
+	struct lockprof_entry **sorted = malloc((table_size ? table_size : 1) * sizeof *sorted);
+	unsigned int n = 0;
+
+	if (sorted == NULL) {
+		kernel.mutex_unlock(&lock);
+		error("Mutex profile report allocation %s", "failed")
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < table_capacity; i++)
+		if (table[i].mutex != NULL)
+			sorted[n++] = &table[i];
+	qsort(sorted, n, sizeof *sorted, compare_wait);
+
+	fprintf(file, "Mutex contention profile: %u mutexes, one acquisition sampled out of %u, by total waiting time\n",
+	        n, sampled_every);
+	for (unsigned int i = 0; i < n && i < top; i++) {
+		struct lockprof_entry *entry = sorted[i];
+		fprintf(file, "#%u mutex %p: %lu acquisitions, %lu contended (%.1f%%)\n", i + 1, entry->mutex,
+		        entry->acquisitions, entry->contended, 100.0 * entry->contended / entry->acquisitions);
+		print_histogram(file, "wait", &entry->wait);
+		print_histogram(file, "hold", &entry->hold);
+
+		struct lockprof_site sites[LOCKPROF_SITES];
+		memcpy(sites, entry->sites, sizeof sites);
+		qsort(sites, LOCKPROF_SITES, sizeof sites[0], compare_sites);
+		for (int j = 0; j < LOCKPROF_SITES && sites[j].address != NULL; j++)
+			print_site(file, &sites[j]);
+	}
+
+	free(sorted);
+	kernel.mutex_unlock(&lock);
+	return 0;
+}
+
+void lockprof_init(void) {
+	const char *sample_every = getenv("THREAD_MUTEX_PROFILE");
+	if (sample_every == NULL)
+		return;
+
+	report_at_exit = 1;
+	if (thread_mutex_profile_start(strtoul(sample_every, NULL, 10)) != 0)
+		thread_mutex_profile_start(1);
+}
+
+void lockprof_exit(void) {
+	lockprof_sample_every = 0;
+	if (report_at_exit)
+		thread_mutex_profile_report(stderr, LOCKPROF_EXIT_TOP);
+	thread_mutex_profile_reset();
+}
+
+//endregion
@@ -0,0 +1,61 @@
+#ifndef OS_S8_LOCKPROF_H
+#define OS_S8_LOCKPROF_H
+
+#include "internal.h"
+
+/*
+ * Mutex contention profiler.
+ *
+ * The statistics live in a hash table indexed by the address of the mutex, so thread_mutex_t doesn't grow.
+ * One acquisition out of `lockprof_sample_every` is profiled: only those pay for the table lookup
+ * and the clock reads. When profiling is disabled, locking tests a global and unlocking tests a
+ * field of the running thread.
+ */
+
+/**
+ * 0 when profiling is disabled.
+ */
+extern unsigned int lockprof_sample_every;
+
+/**
+ * Acquisitions left before the next profiled one, per kernel thread: the schedulers don't share it.
+ */
+extern THREAD_LOCAL unsigned int lockprof_countdown;
+
+/**
+ * @return 1 if this acquisition should be profiled
+ */
+static inline int lockprof_sample(void) {
+	if (__builtin_expect(lockprof_sample_every == 0, 1))
+		return 0;
+	// A countdown left by a longer period is cut to the current one
+	if (--lockprof_countdown > 0 && lockprof_countdown < lockprof_sample_every)
+		return 0;
+	lockprof_countdown = lockprof_sample_every;
+	return 1;
+}
+
+/**
+ * A profiled acquisition succeeded: `thread` now holds the mutex.
+ * @param site The return address of thread_mutex_lock
+ * @param contended 1 if the thread had to wait
+ * @param wait_ns How long it took to acquire the mutex
+ */
+void lockprof_acquired(void *mutex, void *site, int contended, unsigned long long wait_ns, struct thread *thread);
+
+/**
+ * `thread` releases the profiled mutex it holds (thread->lockprof_mutex).
+ */
+void lockprof_released(struct thread *thread);
+
+/**
+ * Start profiling if the THREAD_MUTEX_PROFILE environment variable is set.
+ */
+void lockprof_init(void);
+
+/**
+ * Print the report requested by THREAD_MUTEX_PROFILE, and free the statistics.
+ */
+void lockprof_exit(void);
+
+#endif //OS_S8_LOCKPROF_H
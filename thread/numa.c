@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "internal.h"
+#include "debug.h"
+
+/*
+ * NUMA placement.
+ *
+ * The topology is read once: the node of each processor the process may run on. A scheduler takes
+ * the node of the processor its kernel thread runs on when it is created, or is pinned to.
+ * The stack and the structure of a thread are one block, allocated for the node of its scheduler:
+ * on a NUMA machine, the block is mapped and bound to the node; otherwise it comes from malloc, and
+ * the first touch by the pinned kernel thread keeps it local. When the threads are freed, the blocks
+ * of the default size go to the cache of the scheduler, if it is on their node, and the next threads
+ * take them without a lock. The cache is refilled from a pool per node, and spills to it when it is
+ * full, a batch at a time.
+ */
+
+/**
+ * Blocks kept in the pool of a node.
+ */
+#define NUMA_POOL_SIZE 64
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+
+// Not in the C library headers, but in libnuma's
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+//region Structure declaration
+
+struct numa_pool {
+	pthread_mutex_t lock;
+	struct thread_queue threads;
+	unsigned int size;
+};
+
+unsigned int numa_nodes = 1;
+
+/**
+ * The topology is the machine's, not a fake one: the blocks are bound to the nodes.
+ */
+static int is_bound = 0;
+
+/**
+ * The node of each processor (-1 for those the process can't run on), and the processors node after node.
+ */
+static int node_of_cpu[CPU_SETSIZE];
+static int pin_order[CPU_SETSIZE];
+static unsigned int nb_cpus = 0;
+
+/**
+ * THREAD_PIN is set: the new schedulers take the next processor of pin_order.
+ */
+static int is_pinning = 0;
+static unsigned int next_pin = 0;
+
+static struct numa_pool pools[NUMA_MAX_NODES];
+
+/**
+ * The schedulers, to find one on a node.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_sched *instances = NULL;
+
+//endregion
+
+//region Topology
+
+/**
+ * Give the processors of a list ("0-3,8,10-11") to a node.
+ */
+static void read_cpulist(const char *path, int node) {
+	unsigned int first, last;
+	int separator;
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return;
+
+	while (fscanf(file, "%u", &first) == 1) {
+		last = first;
+		separator = fgetc(file);
+		if (separator == '-') {
+			if (fscanf(file, "%u", &last) != 1)
+				break;
+			separator = fgetc(file);
+		}
+		for (unsigned int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			if (node_of_cpu[cpu] != -1)
+				node_of_cpu[cpu] = node;
+		if (separator != ',')
+			break;
+	}
+	fclose(file);
+}
+
+/**
+ * @return The node of the processor the calling kernel thread runs on
+ */
+static int current_node(void) {
+	int cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE && node_of_cpu[cpu] >= 0 ? node_of_cpu[cpu] : 0;
+}
+
+static void flush(struct thread_sched *sched);
+
+static int pin(struct thread_sched *sched, int cpu) {
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE || node_of_cpu[cpu] == -1)
+		return -1;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof set, &set) != 0) {
+		warn("Cannot pin the scheduler %u to the processor %d: %d", sched->id, cpu, errno)
+		return -1;
+	}
+
+	// The cached blocks belong to the previous node
+	if (node_of_cpu[cpu] != sched->node)
+		flush(sched);
+	sched->cpu = cpu;
+	sched->node = node_of_cpu[cpu];
+	debug("Scheduler %u pinned to the processor %d, node %d", sched->id, cpu, sched->node)
+	return 0;
+}
+
+void numa_init(void) {
+	cpu_set_t allowed;
+	char path[64];
+
+	if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+		CPU_ZERO(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		node_of_cpu[cpu] = CPU_ISSET(cpu, &allowed) ? 0 : -1;
+		nb_cpus += node_of_cpu[cpu] == 0;
+	}
+
+	const char *fake = getenv("THREAD_NUMA_NODES");
+	if (fake != NULL && strtoul(fake, NULL, 10) > 0) {
+		numa_nodes = strtoul(fake, NULL, 10) < NUMA_MAX_NODES ? strtoul(fake, NULL, 10) : NUMA_MAX_NODES;
+		unsigned int i = 0;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (node_of_cpu[cpu] == 0)
+				node_of_cpu[cpu] = (int) (i++ * numa_nodes / nb_cpus);
+	} else {
+		for (int node = 0; node < NUMA_MAX_NODES; node++) {
+			snprintf(path, sizeof path, NUMA_SYSFS "/node%d/cpulist", node);
+			if (access(path, R_OK) == 0) {
+				read_cpulist(path, node);
+				numa_nodes = node + 1;
+			}
+		}
+		is_bound = numa_nodes > 1;
+	}
+
+	unsigned int n = 0;
+	for (int node = 0; node < (int) numa_nodes; node++) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (node_of_cpu[cpu] == node)
+				pin_order[n++] = cpu;
+
+		pools[node].lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+		TAILQ_INIT(&pools[node].threads);
+		pools[node].size = 0;
+	}
+
+	const char *pinning = getenv("THREAD_PIN");
+	is_pinning = pinning != NULL && strcmp(pinning, "0") != 0;
+	info("%u processors on %u NUMA nodes%s%s", nb_cpus, numa_nodes, fake != NULL ? " (fake)" : "",
+	     is_pinning ? ", pinning the schedulers" : "")
+}
+
+//endregion
+
+//region Schedulers
+
+void numa_attach(struct thread_sched *sched) {
+	TAILQ_INIT(&sched->pool_cache.threads);
+	sched->pool_cache.size = 0;
+	TAILQ_INIT(&sched->arena_cache.threads);
+	sched->arena_cache.size = 0;
+	sched->cpu = -1;
+	sched->node = current_node();
+	if (is_pinning && nb_cpus > 0)
+		pin(sched, pin_order[__atomic_fetch_add(&next_pin, 1, __ATOMIC_RELAXED) % nb_cpus]);
+
+	kernel.mutex_lock(&lock);
+	sched->next_instance = instances;
+	instances = sched;
+	kernel.mutex_unlock(&lock);
+}
+
+void numa_detach(struct thread_sched *sched) {
+	flush(sched);
+
+	kernel.mutex_lock(&lock);
+	for (struct thread_sched **link = &instances; *link != NULL; link = &(*link)->next_instance) {
+		if (*link == sched) {
+			*link = sched->next_instance;
+			break;
+		}
+	}
+	kernel.mutex_unlock(&lock);
+}
+
+struct thread_sched *numa_sched_on_node(int node) {
+	struct thread_sched *best = NULL;
+
+	kernel.mutex_lock(&lock);
+	for (struct thread_sched *sched = instances; sched != NULL; sched = sched->next_instance)
+		if (sched->node == node && (best == NULL || __atomic_load_n(&sched->live_threads, __ATOMIC_RELAXED)
+		                                            < __atomic_load_n(&best->live_threads, __ATOMIC_RELAXED)))
+			best = sched;
+	kernel.mutex_unlock(&lock);
+	return best;
+}
+
+//endregion
+
+//region Blocks
+
+/**
+ * @return The size of the block of a thread: its stack, then its structure on a cache line boundary
+ */
+static size_t block_size(unsigned long stack_size) {
+	return ((stack_size + 63) & ~63UL) + sizeof(struct thread);
+}
+
+void numa_bind(void *address, size_t size, int node) {
+	if (!is_bound)
+		return;
+
+	// Preferred rather than bound: when the node is full, the memory comes from another one
+	unsigned long mask = 1UL << node;
+	if (syscall(SYS_mbind, address, size, MPOL_PREFERRED, &mask, NUMA_MAX_NODES + 1, 0) != 0)
+		debug("Cannot bind %p to the node %d: %d", address, node, errno)
+}
+
+static void release(struct thread *thread) {
+	char *block = thread->context.uc_stack.ss_sp;
+
+	// The structure is in the block: done with it
+	if (thread->is_mapped)
+		munmap(block, block_size(thread->context.uc_stack.ss_size));
+	else
+		free(block);
+}
+
+/**
+ * @return The pool cache of the scheduler of the calling kernel thread, NULL if it isn't on the node
+ */
+static struct block_cache *local_cache(int node) {
+	struct thread_sched *sched = local_sched;
+	return sched != NULL && sched->node == node ? &sched->pool_cache : NULL;
+}
+
+/**
+ * Take a block of the default size from the cache, or from the pool of the node, refilling the cache.
+ * @param cache Can be NULL
+ * @return The block, or NULL if both are empty
+ */
+static struct thread *pool_take(struct numa_pool *pool, struct block_cache *cache) {
+	struct thread *thread;
+
+	if (cache != NULL && (thread = TAILQ_FIRST(&cache->threads)) != NULL) {
+		TAILQ_REMOVE(&cache->threads, thread, entries);
+		cache->size--;
+		return thread;
+	}
+
+	kernel.mutex_lock(&pool->lock);
+	thread = TAILQ_FIRST(&pool->threads);
+	if (thread != NULL) {
+		TAILQ_REMOVE(&pool->threads, thread, entries);
+		pool->size--;
+	}
+	struct thread *next;
+	while (thread != NULL && cache != NULL && cache->size < BLOCK_CACHE_BATCH
+	       && (next = TAILQ_FIRST(&pool->threads)) != NULL) {
+		TAILQ_REMOVE(&pool->threads, next, entries);
+		pool->size--;
+		TAILQ_INSERT_TAIL(&cache->threads, next, entries);
+		cache->size++;
+	}
+	kernel.mutex_unlock(&pool->lock);
+	return thread;
+}
+
+/**
+ * Keep a block of the default size in the cache. When the cache is full, or there is none, the oldest
+ * blocks go to the pool of the node, and are released when it is full too.
+ * @param cache Can be NULL
+ */
+static void pool_give(struct numa_pool *pool, struct block_cache *cache, struct thread *thread) {
+	struct thread_queue spilled;
+
+	TAILQ_INIT(&spilled);
+	if (cache == NULL) {
+		TAILQ_INSERT_TAIL(&spilled, thread, entries);
+	} else {
+		if (cache->size == BLOCK_CACHE_SIZE) {
+			for (unsigned int i = 0; i < BLOCK_CACHE_BATCH; i++) {
+				struct thread *oldest = TAILQ_LAST(&cache->threads, thread_queue);
+				TAILQ_REMOVE(&cache->threads, oldest, entries);
+				TAILQ_INSERT_TAIL(&spilled, oldest, entries);
+			}
+			cache->size -= BLOCK_CACHE_BATCH;
+		}
+		TAILQ_INSERT_HEAD(&cache->threads, thread, entries);
+		cache->size++;
+		if (TAILQ_EMPTY(&spilled))
+			return;
+	}
+
+	kernel.mutex_lock(&pool->lock);
+	while ((thread = TAILQ_FIRST(&spilled)) != NULL && pool->size < NUMA_POOL_SIZE) {
+		TAILQ_REMOVE(&spilled, thread, entries);
+		TAILQ_INSERT_HEAD(&pool->threads, thread, entries);
+		pool->size++;
+	}
+	kernel.mutex_unlock(&pool->lock);
+
+	while ((thread = TAILQ_FIRST(&spilled)) != NULL) {
+		TAILQ_REMOVE(&spilled, thread, entries);
+		release(thread);
+	}
+}
+
+/**
+ * Give the cached blocks of a scheduler back to its node, on its kernel thread.
+ */
+static void flush(struct thread_sched *sched) {
+	struct thread *thread;
+
+	while ((thread = TAILQ_FIRST(&sched->pool_cache.threads)) != NULL) {
+		TAILQ_REMOVE(&sched->pool_cache.threads, thread, entries);
+		pool_give(&pools[thread->node], NULL, thread);
+	}
+	sched->pool_cache.size = 0;
+	arena_flush(sched);
+}
+
+struct thread *numa_alloc_thread(unsigned long stack_size, int node, int *is_reused) {
+	struct thread *thread = NULL;
+
+	*is_reused = 0;
+	if (stack_size == THREAD_STACK_SIZE_DEFAULT) {
+		thread = arena_alloc_thread(node, is_reused);
+		if (thread != NULL)
+			return thread;
+
+		thread = pool_take(&pools[node], local_cache(node));
+		if (thread != NULL) {
+			*is_reused = 1;
+			return thread;
+		}
+	}
+
+	size_t size = block_size(stack_size);
+	char *block;
+	if (is_bound) {
+		block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED)
+			return NULL;
+		numa_bind(block, size, node);
+	} else {
+		block = malloc(size);
+		if (block == NULL)
+			return NULL;
+	}
+
+	thread = (struct thread *) (block + size - sizeof *thread);
+	thread->context.uc_stack.ss_sp = block;
+	thread->context.uc_stack.ss_size = stack_size;
+	thread->node = node;
+	thread->is_mapped = (char) is_bound;
+	thread->is_in_arena = 0;
+	return thread;
+}
+
+void numa_free_thread(struct thread *thread) {
+	if (thread->is_in_arena)
+		arena_free_thread(thread);
+	else if (thread->context.uc_stack.ss_size == THREAD_STACK_SIZE_DEFAULT)
+		pool_give(&pools[thread->node], local_cache(thread->node), thread);
+	else
+		release(thread);
+}
+
+void numa_exit(void) {
+	for (unsigned int node = 0; node < numa_nodes; node++) {
+		struct thread *thread;
+		while ((thread = TAILQ_FIRST(&pools[node].threads)) != NULL) {
+			TAILQ_REMOVE(&pools[node].threads, thread, entries);
+			release(thread);
+		}
+		pools[node].size = 0;
+	}
+}
+
+//endregion
+
+//region API
+
+unsigned int thread_numa_nodes(void) {
+	return numa_nodes;
+}
+
+int thread_sched_pin(int cpu) {
+	return pin(sched_local(), cpu);
+}
+
+int thread_sched_cpu(thread_sched_t *sched) {
+	return sched->cpu;
+}
+
+int thread_sched_node(thread_sched_t *sched) {
+	return sched->node;
+}
+
+//endregion
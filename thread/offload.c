@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "offload.h"
+#include "internal.h"
+#include "trace.h"
+#include "debug.h"
+
+/*
+ * Offload pool.
+ *
+ * A request lives on the stack of the blocked thread that made it. The helpers, shared by all the
+ * schedulers, take the requests from a queue protected by a pthread mutex, and push the thread to
+ * the inbox of its scheduler (sched_push): the scheduler wakes it up when it switches, or when its
+ * doorbell rings if every thread was waiting.
+ */
+
+//region Structure declaration
+
+struct offload_request {
+	void *(*func)(void *);
+	void *arg;
+	void *result;
+	int error;
+	struct thread *thread;
+	struct offload_request *next;
+};
+
+static unsigned int nb_helpers = 0, queue_depth = 0;
+static pthread_t *helpers = NULL;
+static int is_started = 0, is_stopping = 0;
+
+/**
+ * Requests waiting for a helper (FIFO).
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t has_request = PTHREAD_COND_INITIALIZER;
+static struct offload_request *queue_head = NULL, *queue_tail = NULL;
+
+//endregion
+
+//region Helpers
+
+static void *helper_main(void *dummy __attribute__((unused))) {
+	kernel.mutex_lock(&lock);
+	for (;;) {
+		while (queue_head == NULL && !is_stopping)
+			kernel.cond_wait(&has_request, &lock);
+		if (queue_head == NULL)
+			break;
+
+		struct offload_request *request = queue_head;
+		queue_head = request->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+		kernel.mutex_unlock(&lock);
+
+		errno = 0;
+		request->result = request->func(request->arg);
+		request->error = errno;
+
+		// The request is on the stack of the thread: done with it
+		sched_push(request->thread->sched, request->thread, INBOX_OFFLOAD);
+		kernel.mutex_lock(&lock);
+	}
+	kernel.mutex_unlock(&lock);
+	return NULL;
+}
+
+static unsigned int env_or(const char *name, unsigned int value) {
+	const char *string = getenv(name);
+	return string != NULL && strtoul(string, NULL, 10) > 0 ? strtoul(string, NULL, 10) : value;
+}
+
+/**
+ * Start the helpers, on the first call.
+ * @return 0 on success, -1 on failure
+ */
+static int start(void) {
+	if (nb_helpers == 0) {
+		nb_helpers = env_or("THREAD_OFFLOAD_THREADS", THREAD_OFFLOAD_THREADS_DEFAULT);
+		queue_depth = env_or("THREAD_OFFLOAD_QUEUE", THREAD_OFFLOAD_QUEUE_DEFAULT);
+	}
+
+	helpers = malloc(nb_helpers * sizeof *helpers);
+	if (helpers == NULL) {
+		error("Cannot start the offload pool: %d", errno)
+		return -1;
+	}
+
+	// The signals (profiler, watchdog) must interrupt the kernel thread running the threads, not a helper
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	for (unsigned int i = 0; i < nb_helpers; i++) {
+		if (kernel.create(&helpers[i], NULL, helper_main, NULL) != 0) {
+			error("Cannot create the offload helper %u", i)
+			nb_helpers = i;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	if (nb_helpers == 0)
+		return -1;
+
+	is_started = 1;
+	info("Offload pool: %u helpers, %u calls in progress at most", nb_helpers, queue_depth)
+	return 0;
+}
+
+//endregion
+
+//region Scheduler side
+
+void offload_complete(struct thread_sched *sched, struct thread *thread) {
+	sched->offload_in_flight--;
+	wake_up(thread);
+
+	struct thread *waiter = TAILQ_FIRST(&sched->offload_slot_waiters);
+	if (waiter != NULL) {
+		TAILQ_REMOVE(&sched->offload_slot_waiters, waiter, entries);
+		wake_up(waiter);
+	}
+}
+
+void offload_exit(void) {
+	if (!is_started)
+		return;
+
+	kernel.mutex_lock(&lock);
+	is_stopping = 1;
+	kernel.cond_broadcast(&has_request);
+	kernel.mutex_unlock(&lock);
+
+	for (unsigned int i = 0; i < nb_helpers; i++)
+		kernel.join(helpers[i], NULL);
+	free(helpers);
+	helpers = NULL;
+	is_started = 0;
+	is_stopping = 0;
+}
+
+void offload_detach(struct thread_sched *sched) {
+	if (sched->offload_in_flight == 0)
+		return;
+
+	// The calls no helper has taken are dropped: their threads are freed with the scheduler
+	kernel.mutex_lock(&lock);
+	struct offload_request **link = &queue_head, *last = NULL;
+	while (*link != NULL) {
+		if ((*link)->thread->sched == sched) {
+			*link = (*link)->next;
+			sched->offload_in_flight--;
+		} else {
+			last = *link;
+			link = &(*link)->next;
+		}
+	}
+	queue_tail = last;
+	kernel.mutex_unlock(&lock);
+
+	// The helpers running the others push their threads to the inbox
+	while (sched->offload_in_flight > 0)
+		sched_wait(sched);
+}
+
+//endregion
+
+//region API
+
+int thread_offload_configure(unsigned int threads, unsigned int depth) {
+	if (threads == 0 || depth == 0 || is_started)
+		return -1;
+
+	nb_helpers = threads;
+	queue_depth = depth;
+	return 0;
+}
+
+void *thread_offload(void *(*func)(void *), void *arg) {
+	struct thread_sched *sched = sched_local();
+	struct thread *current = sched->running;
+
+	// Only before the call: once it has started, it can't be interrupted, and its result may have to be freed
+	cancel_point(current);
+
+	kernel.mutex_lock(&lock);
+	int failed = !is_started && start() != 0;
+	kernel.mutex_unlock(&lock);
+	if (failed) {
+		warn("Offload pool unavailable, calling %p in place", *(void **) &func)
+		return func(arg);
+	}
+
+	// Wait for a slot: a completed call wakes up the first waiter
+	while (sched->offload_in_flight >= queue_depth) {
+		current->is_blocked = 1;
+		TAILQ_INSERT_TAIL(&sched->offload_slot_waiters, current, entries);
+		current->wait_queue = &sched->offload_slot_waiters;
+		trace(TRACE_BLOCK_OFFLOAD, current->trace_id, (uintptr_t) *(void **) &func);
+		block_current();
+		if (current->is_interrupted) {
+			current->is_interrupted = 0;
+			cancel_exit();
+		}
+	}
+
+	struct offload_request request = {func, arg, NULL, 0, current, NULL};
+	sched->offload_in_flight++;
+
+	kernel.mutex_lock(&lock);
+	if (queue_tail != NULL)
+		queue_tail->next = &request;
+	else
+		queue_head = &request;
+	queue_tail = &request;
+	kernel.cond_signal(&has_request);
+	kernel.mutex_unlock(&lock);
+
+	current->is_blocked = 1;
+	trace(TRACE_BLOCK_OFFLOAD, current->trace_id, (uintptr_t) *(void **) &func);
+	block_current();
+
+	if (request.error != 0)
+		errno = request.error;
+	return request.result;
+}
+
+//endregion
+
+//region Wrappers
+
+struct io_call {
+	int fd;
+	void *buffer;
+	size_t count;
+};
+
+static void *call_read(void *_call) {
+	struct io_call *call = _call;
+	return (void *) read(call->fd, call->buffer, call->count);
+}
+
+static void *call_write(void *_call) {
+	struct io_call *call = _call;
+	return (void *) write(call->fd, call->buffer, call->count);
+}
+
+static void *call_fsync(void *_call) {
+	struct io_call *call = _call;
+	return (void *) (intptr_t) fsync(call->fd);
+}
+
+ssize_t thread_read(int fd, void *buffer, size_t count) {
+	struct io_call call = {fd, buffer, count};
+	return (ssize_t) thread_offload(call_read, &call);
+}
+
+ssize_t thread_write(int fd, const void *buffer, size_t count) {
+	struct io_call call = {fd, (void *) buffer, count};
+	return (ssize_t) thread_offload(call_write, &call);
+}
+
+int thread_fsync(int fd) {
+	struct io_call call = {fd, NULL, 0};
+	return (int) (intptr_t) thread_offload(call_fsync, &call);
+}
+
+struct stat_call {
+	const char *path;
+	struct stat *stat;
+};
+
+static void *call_stat(void *_call) {
+	struct stat_call *call = _call;
+	return (void *) (intptr_t) stat(call->path, call->stat);
+}
+
+int thread_stat(const char *path, struct stat *stat) {
+	struct stat_call call = {path, stat};
+	return (int) (intptr_t) thread_offload(call_stat, &call);
+}
+
+struct getaddrinfo_call {
+	const char *node;
+	const char *service;
+	const struct addrinfo *hints;
+	struct addrinfo **result;
+};
+
+static void *call_getaddrinfo(void *_call) {
+	struct getaddrinfo_call *call = _call;
+	return (void *) (intptr_t) getaddrinfo(call->node, call->service, call->hints, call->result);
+}
+
+int thread_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
+                       struct addrinfo **result) {
+	struct getaddrinfo_call call = {node, service, hints, result};
+	return (int) (intptr_t) thread_offload(call_getaddrinfo, &call);
+}
+
+//endregion
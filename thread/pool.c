@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include "pool.h"
+#include "debug.h"
+
+//region Structure declaration
+
+struct job {
+	void *(*func)(void *);
+	void *arg;
+	thread_future_t *future;
+};
+
+struct worker {
+	thread_t thread;
+	/**
+	 * Its creation failed: the slot stays reserved, with nothing to join.
+	 */
+	char is_dead;
+};
+
+struct thread_pool {
+	/**
+	 * Protects everything below, and the futures.
+	 */
+	thread_mutex_t lock;
+	thread_cond_t not_empty, not_full;
+
+	unsigned int max_workers;
+	/**
+	 * Number of reserved slots, dead ones included.
+	 */
+	unsigned int workers;
+	/**
+	 * Number of workers waiting for a job.
+	 */
+	unsigned int idle;
+	char is_stopping;
+	struct worker *slots;
+
+	/**
+	 * Ring buffer of queued jobs.
+	 */
+	unsigned int head, count, size;
+	struct job jobs[];
+};
+
+//endregion
+
+static void *worker_loop(void *_pool) {
+	struct thread_pool *pool = _pool;
+
+	thread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->count == 0 && !pool->is_stopping) {
+			pool->idle++;
+			thread_cond_wait(&pool->not_empty, &pool->lock);
+			pool->idle--;
+		}
+
+		if (pool->count == 0)
+			break; // stopping, and nothing left to do
+
+		struct job job = pool->jobs[pool->head];
+		pool->head = (pool->head + 1) % pool->size;
+		pool->count--;
+		thread_cond_signal(&pool->not_full);
+		thread_mutex_unlock(&pool->lock);
+
+		void *result = job.func(job.arg);
+
+		thread_mutex_lock(&pool->lock);
+		if (job.future != NULL) {
+			job.future->result = result;
+			job.future->is_done = 1;
+			thread_cond_signal(&job.future->done);
+		}
+	}
+	thread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * Create a worker. The caller must have reserved its slot by incrementing pool->workers.
+ */
+static int start_worker(struct thread_pool *pool, unsigned int index) {
+	if (thread_create(&pool->slots[index].thread, worker_loop, pool) != 0) {
+		error("Failed to create the pool worker %u", index)
+		return -1;
+	}
+	return 0;
+}
+
+int thread_pool_init(thread_pool_t **pool, unsigned int min_workers, unsigned int max_workers,
+                     unsigned int queue_size) {
+	if (max_workers == 0 || min_workers > max_workers || queue_size == 0) {
+		error("Invalid pool parameters: %u to %u workers, %u jobs", min_workers, max_workers, queue_size)
+		return -1;
+	}
+
+	struct thread_pool *new = malloc(sizeof *new + queue_size * sizeof new->jobs[0]);
+	if (new == NULL) {
+		error("Pool allocation %s", "failed")
+		return -1;
+	}
+
+	new->slots = malloc(max_workers * sizeof *new->slots);
+	if (new->slots == NULL) {
+		error("Pool workers allocation %s", "failed")
+		free(new);
+		return -1;
+	}
+
+	thread_mutex_init(&new->lock);
+	thread_cond_init(&new->not_empty);
+	thread_cond_init(&new->not_full);
+	new->max_workers = max_workers;
+	new->workers = min_workers;
+	new->idle = 0;
+	new->is_stopping = 0;
+	new->head = 0;
+	new->count = 0;
+	new->size = queue_size;
+
+	for (unsigned int i = 0; i < min_workers; i++) {
+		new->slots[i].is_dead = 0;
+		if (start_worker(new, i) != 0) {
+			new->workers = i;
+			thread_pool_destroy(new);
+			return -1;
+		}
+	}
+
+	info("Created a pool of %u to %u workers", min_workers, max_workers)
+	*pool = new;
+	return 0;
+}
+
+void thread_pool_destroy(thread_pool_t *pool) {
+	thread_mutex_lock(&pool->lock);
+	pool->is_stopping = 1;
+	thread_cond_broadcast(&pool->not_empty);
+	thread_cond_broadcast(&pool->not_full);
+	thread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->workers; i++)
+		if (!pool->slots[i].is_dead)
+			thread_join(pool->slots[i].thread, NULL);
+
+	thread_cond_destroy(&pool->not_full);
+	thread_cond_destroy(&pool->not_empty);
+	thread_mutex_destroy(&pool->lock);
+	free(pool->slots);
+	free(pool);
+}
+
+int thread_pool_submit(thread_pool_t *pool, thread_future_t *future,
+                       void *(*func)(void *), void *func_arg, int flags) {
+	thread_mutex_lock(&pool->lock);
+
+	while (pool->count == pool->size && !pool->is_stopping) {
+		if (flags & THREAD_POOL_NONBLOCK) {
+			thread_mutex_unlock(&pool->lock);
+			return -1;
+		}
+		thread_cond_wait(&pool->not_full, &pool->lock);
+	}
+
+	if (pool->is_stopping) {
+		thread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	if (future != NULL) {
+		future->pool = pool;
+		future->result = NULL;
+		future->is_done = 0;
+		thread_cond_init(&future->done);
+	}
+
+	struct job *job = &pool->jobs[(pool->head + pool->count) % pool->size];
+	job->func = func;
+	job->arg = func_arg;
+	job->future = future;
+	pool->count++;
+	thread_cond_signal(&pool->not_empty);
+
+	// More jobs than idle workers to pick them up: grow
+	int grow = pool->count > pool->idle && pool->workers < pool->max_workers;
+	unsigned int index = pool->workers;
+	if (grow) {
+		pool->slots[index].is_dead = 0;
+		pool->workers++;
+	}
+
+	thread_mutex_unlock(&pool->lock);
+
+	// Other submitters may have reserved the next slots meanwhile: only this one is given up
+	if (grow && start_worker(pool, index) != 0) {
+		thread_mutex_lock(&pool->lock);
+		pool->slots[index].is_dead = 1;
+		thread_mutex_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+int thread_pool_wait(thread_future_t *future, void **return_value) {
+	struct thread_pool *pool = future->pool;
+
+	thread_mutex_lock(&pool->lock);
+	while (!future->is_done) {
+		if (thread_cond_wait(&future->done, &pool->lock) != 0) {
+			thread_mutex_unlock(&pool->lock);
+			return -1;
+		}
+	}
+	thread_mutex_unlock(&pool->lock);
+
+	if (return_value != NULL)
+		*return_value = future->result;
+
+	thread_cond_destroy(&future->done);
+	return 0;
+}
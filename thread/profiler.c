@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#include "internal.h"
+#include "debug.h"
+
+/*
+ * Sampling profiler.
+ *
+ * ITIMER_PROF sends SIGPROF after each period of processor time. The handler runs on the stack of
+ * the interrupted thread: it unwinds it with backtrace() and appends the frames, tagged with the
+ * running thread, to a preallocated buffer. Nothing is allocated nor symbolized in the handler:
+ * thread_profile_dump resolves the addresses with dladdr and merges identical stacks into the
+ * collapsed format of flamegraph.pl ("thread-2;main;worker;compute 42").
+ */
+
+#define PROFILE_DEFAULT_FREQUENCY 997
+
+/**
+ * Frames kept per sample, from the interrupted function.
+ */
+#define PROFILE_MAX_DEPTH 64
+
+/**
+ * Size of the sample buffer, in words. A sample takes 2 words + 1 per frame: the thread, the depth + 1,
+ * then the frames. The depth is written last, 0 until then, so a sample is readable once it is set.
+ * When the buffer is full, the new samples are dropped.
+ */
+#define PROFILE_BUFFER_WORDS (1 << 18)
+
+static void **buffer = NULL;
+static volatile unsigned long used = 0, dropped = 0;
+static volatile int is_profiling = 0;
+static struct sigaction previous_action;
+
+/**
+ * Where the profile is written at exit, from THREAD_PROFILE.
+ */
+static const char *exit_path = NULL;
+
+//region Sampling
+
+int signal_backtrace(void **frames, int size, void *context, int *first) {
+	int depth = backtrace(frames, size);
+
+	// Skip the handler and the signal trampoline: start at the interrupted instruction
+	*first = 0;
+#if defined(__x86_64__)
+	void *pc = (void *) ((ucontext_t *) context)->uc_mcontext.gregs[REG_RIP];
+	while (*first < depth && frames[*first] != pc)
+		(*first)++;
+	if (*first == depth)
+		*first = depth > 2 ? 2 : 0;
+#else
+	(void) context;
+	*first = depth > 2 ? 2 : 0;
+#endif
+
+	return depth - *first;
+}
+
+static void on_sigprof(int sig __attribute__((unused)), siginfo_t *info __attribute__((unused)), void *context) {
+	int saved_errno = errno, first;
+	void *frames[PROFILE_MAX_DEPTH + 8];
+	int depth = signal_backtrace(frames, sizeof frames / sizeof frames[0], context, &first);
+
+	if (depth > PROFILE_MAX_DEPTH)
+		depth = PROFILE_MAX_DEPTH;
+
+	// Any kernel thread may take the signal: reserve the room, the handlers may run at the same time
+	struct thread_sched *sched = local_sched;
+	unsigned long at = __atomic_load_n(&used, __ATOMIC_RELAXED);
+	int is_full;
+	do {
+		is_full = buffer == NULL || sched == NULL || at + 2 + depth > PROFILE_BUFFER_WORDS;
+	} while (!is_full && !__atomic_compare_exchange_n(&used, &at, at + 2 + depth, 0, __ATOMIC_RELAXED,
+	                                                   __ATOMIC_RELAXED));
+
+	if (is_full) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		buffer[at] = (void *) (unsigned long) sched->running->trace_id;
+		memcpy(&buffer[at + 2], &frames[first], depth * sizeof frames[0]);
+		// Commits the sample: the dump may run on another kernel thread
+		__atomic_store_n(&buffer[at + 1], (void *) (unsigned long) (depth + 1), __ATOMIC_RELEASE);
+	}
+
+	errno = saved_errno;
+}
+
+int thread_profile_start(unsigned int frequency) {
+	if (frequency == 0)
+		frequency = PROFILE_DEFAULT_FREQUENCY;
+	if (frequency > 1000000 || is_profiling)
+		return -1;
+
+	if (buffer == NULL && (buffer = calloc(PROFILE_BUFFER_WORDS, sizeof *buffer)) == NULL) {
+		error("Profile buffer allocation %s", "failed")
+		return -1;
+	}
+	// The samples of the previous run were committed
+	memset(buffer, 0, used * sizeof *buffer);
+	used = dropped = 0;
+
+	// The first call to backtrace loads the unwinder, which allocates: not in the handler
+	void *preload[1];
+	backtrace(preload, 1);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_sigaction = on_sigprof;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &previous_action) != 0) {
+		error("Cannot handle SIGPROF: %d", errno)
+		return -1;
+	}
+
+	long period = 1000000 / frequency;
+	struct itimerval timer = {
+			.it_interval = {period / 1000000, period % 1000000},
+			.it_value = {period / 1000000, period % 1000000},
+	};
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+		error("Cannot start the profiling timer: %d", errno)
+		sigaction(SIGPROF, &previous_action, NULL);
+		return -1;
+	}
+
+	is_profiling = 1;
+	info("Profiling at %u Hz", frequency)
+	return 0;
+}
+
+int thread_profile_stop(void) {
+	struct itimerval timer;
+
+	if (!is_profiling)
+		return 0;
+
+	memset(&timer, 0, sizeof timer);
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &previous_action, NULL);
+	is_profiling = 0;
+	return 0;
+}
+
+//endregion
+
+//region Folded stacks
+
+struct folded {
+	char *stack;
+	unsigned long count;
+};
+
+static int compare_folded(const void *a, const void *b) {
+	return strcmp(((const struct folded *) a)->stack, ((const struct folded *) b)->stack);
+}
+
+/**
+ * Append the name of a frame: the symbol, or the object and the offset in it.
+ */
+static void append_frame(FILE *out, void *address) {
+	Dl_info symbol;
+	int found = dladdr(address, &symbol) != 0;
+
+	if (found && symbol.dli_sname != NULL) {
+		fprintf(out, ";%s", symbol.dli_sname);
+	} else if (found && symbol.dli_fname != NULL) {
+		const char *name = strrchr(symbol.dli_fname, '/');
+		fprintf(out, ";%s+0x%lx", name != NULL ? name + 1 : symbol.dli_fname,
+		        (unsigned long) ((char *) address - (char *) symbol.dli_fbase));
+	} else {
+		fprintf(out, ";%p", address);
+	}
+}
+
+/**
+ * @return The number of words of the sample starting at `at`, 0 if it is still being written
+ */
+static unsigned long sample_words(unsigned long at) {
+	unsigned long committed = (unsigned long) __atomic_load_n(&buffer[at + 1], __ATOMIC_ACQUIRE);
+	return committed != 0 ? 1 + committed : 0;
+}
+
+/**
+ * @return The collapsed stack of a sample, allocated
+ */
+static char *fold(void **sample) {
+	unsigned long thread = (unsigned long) sample[0], depth = (unsigned long) sample[1] - 1;
+	char *stack = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&stack, &size);
+	if (out == NULL)
+		return NULL;
+
+	if (thread == 0)
+		fprintf(out, "main");
+	else
+		fprintf(out, "thread-%lu", thread);
+
+	// Root first. The return addresses point after the call: look up the call instruction
+	for (unsigned long i = depth; i > 0; i--)
+		append_frame(out, (char *) sample[2 + i - 1] - (i > 1 ? 1 : 0));
+
+	fclose(out);
+	return stack;
+}
+
+int thread_profile_dump(const char *path) {
+	sigset_t block, previous;
+	int failed = 0;
+
+	if (buffer == NULL) {
+		warn("Nothing to dump to %s, profiling has never started", path)
+		return -1;
+	}
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		error("Cannot open the profile file %s", path)
+		return -1;
+	}
+
+	// Our handler would interrupt the read; those of the other kernel threads may still be writing:
+	// stop at the first sample that isn't committed, the ones after it aren't read
+	sigemptyset(&block);
+	sigaddset(&block, SIGPROF);
+	sigprocmask(SIG_BLOCK, &block, &previous);
+
+	unsigned long end = __atomic_load_n(&used, __ATOMIC_RELAXED), samples = 0, read = 0, words;
+	for (; read < end && (words = sample_words(read)) != 0; read += words)
+		samples++;
+
+	struct folded *folded = malloc((samples ? samples : 1) * sizeof *folded);
+	unsigned long n = 0;
+	if (folded == NULL) {
+		failed = 1;
+	} else {
+		for (unsigned long i = 0; i < read; i += sample_words(i)) {
+			folded[n].stack = fold(&buffer[i]);
+			folded[n].count = 1;
+			if (folded[n].stack != NULL)
+				n++;
+		}
+	}
+	unsigned long lost = dropped;
+
+	sigprocmask(SIG_SETMASK, &previous, NULL);
+
+	if (folded != NULL) {
+		qsort(folded, n, sizeof *folded, compare_folded);
+		for (unsigned long i = 0; i < n; i++) {
+			if (i + 1 < n && strcmp(folded[i].stack, folded[i + 1].stack) == 0) {
+				folded[i + 1].count += folded[i].count;
+			} else if (fprintf(file, "%s %lu\n", folded[i].stack, folded[i].count) < 0) {
+				failed = 1;
+			}
+			free(folded[i].stack);
+		}
+		free(folded);
+	}
+
+	failed |= fclose(file) != 0;
+	if (failed) {
+		error("Failed to write the profile %s", path)
+		return -1;
+	}
+
+	if (lost > 0)
+		warn("%lu samples were dropped, the profile buffer was full", lost)
+	if (read < end)
+		warn("The samples after the first %lu were still being written, they aren't in %s", samples, path)
+	info("Dumped %lu samples to %s", samples, path)
+	return 0;
+}
+
+//endregion
+
+void profiler_init(void) {
+	exit_path = getenv("THREAD_PROFILE");
+	if (exit_path == NULL)
+		return;
+
+	const char *frequency = getenv("THREAD_PROFILE_HZ");
+	thread_profile_start(frequency != NULL ? strtoul(frequency, NULL, 10) : 0);
+}
+
+void profiler_exit(void) {
+	thread_profile_stop();
+	if (exit_path != NULL && buffer != NULL)
+		thread_profile_dump(exit_path);
+
+	free(buffer);
+	buffer = NULL;
+}
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "thread.h"
+#include "debug.h"
+
+/*
+ * pthread on top of our threads.
+ *
+ * Preloaded (LD_PRELOAD=libthread-pthread-shim.so), this library overrides the pthread functions of the
+ * C library: the threads of an unmodified program become threads of this library, which all run on
+ * the kernel thread of main. The library itself keeps using the C library for its own kernel threads.
+ *
+ * The pthread objects are large enough to hold ours. They are used in place, and initialized on first
+ * use since PTHREAD_MUTEX_INITIALIZER and PTHREAD_COND_INITIALIZER are all zeros.
+ *
+ * Not supported: the attributes other than the stack size (a detached thread stays allocated until the
+ * end of the program), the mutex types (locking a mutex again succeeds, and the first unlock releases it),
+ * cancellation, and the other pthread functions, which stay the C library's.
+ */
+
+/**
+ * A condition variable, how many times it has been signaled, and the clock of its deadlines
+ * (pthread_condattr_setclock), for pthread_cond_timedwait.
+ */
+struct shim_cond {
+	thread_cond_t cond;
+	unsigned long signals;
+	clockid_t clock;
+};
+
+_Static_assert(sizeof(thread_mutex_t) <= sizeof(pthread_mutex_t), "a thread_mutex_t must fit in a pthread_mutex_t");
+_Static_assert(sizeof(struct shim_cond) <= sizeof(pthread_cond_t), "a shim_cond must fit in a pthread_cond_t");
+_Static_assert(sizeof(thread_key_t) <= sizeof(pthread_key_t), "a thread_key_t must fit in a pthread_key_t");
+
+//region Threads
+
+int pthread_create(pthread_t *new_thread, const pthread_attr_t *pthread_attr, void *(*func)(void *), void *arg) {
+	thread_attr_t attr;
+	size_t stack_size;
+	thread_t thread;
+
+	thread_attr_init(&attr);
+	if (pthread_attr != NULL && pthread_attr_getstacksize(pthread_attr, &stack_size) == 0
+	    && stack_size >= THREAD_STACK_SIZE_MIN)
+		thread_attr_setstacksize(&attr, stack_size);
+
+	if (thread_create_attr(&thread, &attr, func, arg) != 0)
+		return EAGAIN;
+	*new_thread = (pthread_t) thread;
+	return 0;
+}
+
+int pthread_join(pthread_t thread, void **return_value) {
+	return thread_join((thread_t) thread, return_value) == 0 ? 0 : EDEADLK;
+}
+
+void pthread_exit(void *return_value) {
+	thread_exit(return_value);
+	// Back in main once all the other threads are dead: like pthread, the process ends with the last thread
+	exit(EXIT_SUCCESS);
+}
+
+pthread_t pthread_self(void) {
+	return (pthread_t) thread_self();
+}
+
+int pthread_equal(pthread_t a, pthread_t b) {
+	return a == b;
+}
+
+/**
+ * A thread is freed when it is joined: a detached thread stays allocated until the end of the program.
+ */
+int pthread_detach(pthread_t thread __attribute__((unused))) {
+	return 0;
+}
+
+/**
+ * pthread_yield is an alias of sched_yield in glibc.
+ */
+int sched_yield(void) {
+	thread_yield();
+	return 0;
+}
+
+//endregion
+
+//region Mutex
+
+static thread_mutex_t *to_mutex(pthread_mutex_t *mutex) {
+	thread_mutex_t *ours = (thread_mutex_t *) mutex;
+	if (ours->waiting_queue.tqh_last == NULL)
+		thread_mutex_init(ours);
+	return ours;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr __attribute__((unused))) {
+	return thread_mutex_init((thread_mutex_t *) mutex) == 0 ? 0 : EINVAL;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+	return thread_mutex_destroy(to_mutex(mutex)) == 0 ? 0 : EBUSY;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+	return thread_mutex_lock(to_mutex(mutex)) == 0 ? 0 : EDEADLK;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+	thread_mutex_t *ours = to_mutex(mutex);
+	if (ours->owner != NULL && ours->owner != thread_self())
+		return EBUSY;
+	return thread_mutex_lock(ours) == 0 ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+	return thread_mutex_unlock(to_mutex(mutex)) == 0 ? 0 : EPERM;
+}
+
+//endregion
+
+//region Condition variables
+
+static struct shim_cond *to_cond(pthread_cond_t *cond) {
+	struct shim_cond *ours = (struct shim_cond *) cond;
+	if (ours->cond.waiting_queue.tqh_last == NULL) {
+		thread_cond_init(&ours->cond);
+		ours->signals = 0;
+		ours->clock = CLOCK_REALTIME;
+	}
+	return ours;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+	struct shim_cond *ours = (struct shim_cond *) cond;
+	ours->signals = 0;
+	ours->clock = CLOCK_REALTIME;
+	if (attr != NULL && pthread_condattr_getclock(attr, &ours->clock) != 0)
+		return EINVAL;
+	return thread_cond_init(&ours->cond) == 0 ? 0 : EINVAL;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) {
+	return thread_cond_destroy(&to_cond(cond)->cond) == 0 ? 0 : EBUSY;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	return thread_cond_wait(&to_cond(cond)->cond, to_mutex(mutex)) == 0 ? 0 : EDEADLK;
+}
+
+/**
+ * Nothing wakes a blocked thread at a given time: the thread polls, yielding, until it is signaled or
+ * the deadline passes. It sleeps when there is nobody to yield to, and may wake up spuriously.
+ */
+static int timed_wait(struct shim_cond *ours, pthread_mutex_t *mutex, clockid_t clock, const struct timespec *deadline) {
+	thread_mutex_t *ours_mutex = to_mutex(mutex);
+	unsigned long signals = ours->signals;
+	int timed_out = 0;
+	struct timespec now;
+
+	if (clock_gettime(clock, &now) != 0)
+		return EINVAL;
+	thread_mutex_unlock(ours_mutex);
+	while (ours->signals == signals) {
+		clock_gettime(clock, &now);
+		long long remaining = (deadline->tv_sec - now.tv_sec) * 1000000000LL + deadline->tv_nsec - now.tv_nsec;
+		if (remaining <= 0) {
+			timed_out = 1;
+			break;
+		}
+
+		thread_stats_t before, after;
+		thread_stats_get(thread_self(), &before);
+		thread_yield();
+		thread_stats_get(thread_self(), &after);
+		if (after.voluntary_switches == before.voluntary_switches) {
+			// Alone: sleep, but not past the deadline
+			struct timespec pause = {0, remaining < 1000000 ? remaining : 1000000};
+			nanosleep(&pause, NULL);
+		}
+	}
+	thread_mutex_lock(ours_mutex);
+	return timed_out ? ETIMEDOUT : 0;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline) {
+	struct shim_cond *ours = to_cond(cond);
+	return timed_wait(ours, mutex, ours->clock, deadline);
+}
+
+int pthread_cond_clockwait(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clock,
+                           const struct timespec *deadline) {
+	return timed_wait(to_cond(cond), mutex, clock, deadline);
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+	struct shim_cond *ours = to_cond(cond);
+	ours->signals++;
+	return thread_cond_signal(&ours->cond) == 0 ? 0 : EINVAL;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+	struct shim_cond *ours = to_cond(cond);
+	ours->signals++;
+	return thread_cond_broadcast(&ours->cond) == 0 ? 0 : EINVAL;
+}
+
+//endregion
+
+//region Thread-specific data
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *)) {
+	thread_key_t ours;
+	if (thread_key_create(&ours, destructor) != 0)
+		return EAGAIN;
+	*key = ours;
+	return 0;
+}
+
+int pthread_key_delete(pthread_key_t key) {
+	return thread_key_delete(key) == 0 ? 0 : EINVAL;
+}
+
+void *pthread_getspecific(pthread_key_t key) {
+	return thread_getspecific(key);
+}
+
+/*
+ * glibc declares value as never read (access none), so passing it on to a function that may read it
+ * looks like a read of uninitialized memory; thread_setspecific only stores the pointer.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+int pthread_setspecific(pthread_key_t key, const void *value) {
+	return thread_setspecific(key, value) == 0 ? 0 : EINVAL;
+}
+#pragma GCC diagnostic pop
+
+//endregion
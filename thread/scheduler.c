@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "debug.h"
+
+static void noop_on_block(struct thread_sched *sched __attribute__((unused)),
+                          struct thread *thread __attribute__((unused))) {}
+
+static void noop_destroy(struct thread_sched *sched __attribute__((unused))) {}
+
+//region FIFO and LIFO
+
+/*
+ * FIFO and LIFO share sched->queue, only one policy is active at a time.
+ */
+
+static void queue_init(struct thread_sched *sched) {
+	TAILQ_INIT(&sched->queue);
+}
+
+static void fifo_enqueue(struct thread_sched *sched, struct thread *thread, enum sched_enqueue reason) {
+	if (reason == SCHED_WAKEUP_NEXT)
+		TAILQ_INSERT_HEAD(&sched->queue, thread, entries);
+	else
+		TAILQ_INSERT_TAIL(&sched->queue, thread, entries);
+}
+
+/**
+ * New and woken threads run first, while their data is still in the cache.
+ * Yielding threads still go to the back of the queue, or yields would never switch.
+ */
+static void lifo_enqueue(struct thread_sched *sched, struct thread *thread, enum sched_enqueue reason) {
+	if (reason == SCHED_YIELD)
+		TAILQ_INSERT_TAIL(&sched->queue, thread, entries);
+	else
+		TAILQ_INSERT_HEAD(&sched->queue, thread, entries);
+}
+
+static void queue_dequeue(struct thread_sched *sched, struct thread *thread) {
+	TAILQ_REMOVE(&sched->queue, thread, entries);
+}
+
+static struct thread *queue_pick_next(struct thread_sched *sched) {
+	struct thread *next = TAILQ_FIRST(&sched->queue);
+	if (next != NULL)
+		TAILQ_REMOVE(&sched->queue, next, entries);
+	return next;
+}
+
+static const struct sched_ops sched_fifo = {
+		.name = "fifo",
+		.init = queue_init,
+		.enqueue = fifo_enqueue,
+		.dequeue = queue_dequeue,
+		.pick_next = queue_pick_next,
+		.on_block = noop_on_block,
+		.destroy = noop_destroy,
+};
+
+static const struct sched_ops sched_lifo = {
+		.name = "lifo",
+		.init = queue_init,
+		.enqueue = lifo_enqueue,
+		.dequeue = queue_dequeue,
+		.pick_next = queue_pick_next,
+		.on_block = noop_on_block,
+		.destroy = noop_destroy,
+};
+
+//endregion
+
+//region Strict priorities
+
+/*
+ * Bit i of sched->priority_bitmap is set when sched->priority_queues[i] isn't empty.
+ */
+
+static void priority_init(struct thread_sched *sched) {
+	for (int i = 0; i < PRIORITY_LEVELS; i++)
+		TAILQ_INIT(&sched->priority_queues[i]);
+	sched->priority_bitmap = 0;
+}
+
+static void priority_enqueue(struct thread_sched *sched, struct thread *thread, enum sched_enqueue reason) {
+	int level = thread->priority - THREAD_PRIORITY_MIN;
+
+	if (reason == SCHED_WAKEUP_NEXT)
+		TAILQ_INSERT_HEAD(&sched->priority_queues[level], thread, entries);
+	else
+		TAILQ_INSERT_TAIL(&sched->priority_queues[level], thread, entries);
+	sched->priority_bitmap |= 1u << level;
+}
+
+static void priority_dequeue(struct thread_sched *sched, struct thread *thread) {
+	int level = thread->priority - THREAD_PRIORITY_MIN;
+
+	TAILQ_REMOVE(&sched->priority_queues[level], thread, entries);
+	if (TAILQ_EMPTY(&sched->priority_queues[level]))
+		sched->priority_bitmap &= ~(1u << level);
+}
+
+static struct thread *priority_pick_next(struct thread_sched *sched) {
+	if (sched->priority_bitmap == 0)
+		return NULL;
+
+	int level = 31 - __builtin_clz(sched->priority_bitmap);
+	struct thread *next = TAILQ_FIRST(&sched->priority_queues[level]);
+	priority_dequeue(sched, next);
+	return next;
+}
+
+static const struct sched_ops sched_priority = {
+		.name = "priority",
+		.init = priority_init,
+		.enqueue = priority_enqueue,
+		.dequeue = priority_dequeue,
+		.pick_next = priority_pick_next,
+		.on_block = noop_on_block,
+		.destroy = noop_destroy,
+};
+
+//endregion
+
+//region Fair share
+
+/*
+ * Each thread accumulates a virtual running time, its real running time divided by its weight.
+ * The runnable thread with the smallest virtual running time runs next (min-heap).
+ */
+
+#define FAIR_WEIGHT(priority) ((unsigned long long) ((priority) - THREAD_PRIORITY_MIN + 1))
+#define FAIR_HEAP_INITIAL_CAPACITY 64
+
+/*
+ * sched->min_vruntime never decreases: new and woken threads start from there, so they can't starve the others.
+ */
+
+static void heap_set(struct thread_sched *sched, unsigned int index, struct thread *thread) {
+	sched->heap[index] = thread;
+	thread->heap_index = index;
+}
+
+static void heap_sift_up(struct thread_sched *sched, unsigned int index) {
+	struct thread **heap = sched->heap, *thread = heap[index];
+
+	while (index > 0) {
+		unsigned int parent = (index - 1) / 2;
+		if (heap[parent]->vruntime <= thread->vruntime)
+			break;
+		heap_set(sched, index, heap[parent]);
+		index = parent;
+	}
+	heap_set(sched, index, thread);
+}
+
+static void heap_sift_down(struct thread_sched *sched, unsigned int index) {
+	struct thread **heap = sched->heap, *thread = heap[index];
+
+	for (;;) {
+		unsigned int child = 2 * index + 1;
+		if (child >= sched->heap_size)
+			break;
+		if (child + 1 < sched->heap_size && heap[child + 1]->vruntime < heap[child]->vruntime)
+			child++;
+		if (thread->vruntime <= heap[child]->vruntime)
+			break;
+		heap_set(sched, index, heap[child]);
+		index = child;
+	}
+	heap_set(sched, index, thread);
+}
+
+static void fair_charge(struct thread_sched *sched __attribute__((unused)), struct thread *thread) {
+	unsigned long long now = now_ns();
+	thread->vruntime += (now - thread->run_start) * FAIR_WEIGHT(THREAD_PRIORITY_DEFAULT)
+	                    / FAIR_WEIGHT(thread->priority);
+	thread->run_start = now;
+}
+
+static void fair_destroy(struct thread_sched *sched) {
+	free(sched->heap);
+	sched->heap = NULL;
+	sched->heap_size = sched->heap_capacity = 0;
+}
+
+static void fair_init(struct thread_sched *sched) {
+	sched->heap_size = 0;
+	sched->min_vruntime = sched->running->vruntime;
+	sched->running->run_start = now_ns();
+}
+
+static void fair_enqueue(struct thread_sched *sched, struct thread *thread, enum sched_enqueue reason) {
+	switch (reason) {
+		case SCHED_NEW:
+			thread->vruntime = sched->min_vruntime;
+			break;
+		case SCHED_YIELD:
+			fair_charge(sched, thread);
+			break;
+		case SCHED_WAKEUP:
+		case SCHED_WAKEUP_NEXT:
+			if (thread->vruntime < sched->min_vruntime)
+				thread->vruntime = sched->min_vruntime;
+			break;
+	}
+
+	if (sched->heap_size == sched->heap_capacity) {
+		sched->heap_capacity = sched->heap_capacity ? 2 * sched->heap_capacity : FAIR_HEAP_INITIAL_CAPACITY;
+		sched->heap = realloc(sched->heap, sched->heap_capacity * sizeof *sched->heap);
+		if (sched->heap == NULL) {
+			error("Run queue allocation %s", "failed")
+			exit(1);
+		}
+	}
+
+	heap_set(sched, sched->heap_size, thread);
+	sched->heap_size++;
+	heap_sift_up(sched, thread->heap_index);
+}
+
+static void fair_dequeue(struct thread_sched *sched, struct thread *thread) {
+	unsigned int index = thread->heap_index;
+
+	sched->heap_size--;
+	if (index != sched->heap_size) {
+		struct thread *moved = sched->heap[sched->heap_size];
+		heap_set(sched, index, moved);
+		heap_sift_down(sched, index);
+		heap_sift_up(sched, moved->heap_index);
+	}
+	thread->run_start = now_ns();
+}
+
+static struct thread *fair_pick_next(struct thread_sched *sched) {
+	if (sched->heap_size == 0)
+		return NULL;
+
+	struct thread *next = sched->heap[0];
+	if (next->vruntime > sched->min_vruntime)
+		sched->min_vruntime = next->vruntime;
+	fair_dequeue(sched, next);
+	return next;
+}
+
+static const struct sched_ops sched_fair = {
+		.name = "fair",
+		.init = fair_init,
+		.enqueue = fair_enqueue,
+		.dequeue = fair_dequeue,
+		.pick_next = fair_pick_next,
+		.on_block = fair_charge,
+		.destroy = fair_destroy,
+};
+
+//endregion
+
+static const struct sched_ops *const policies[] = {
+		[THREAD_SCHED_FIFO] = &sched_fifo,
+		[THREAD_SCHED_LIFO] = &sched_lifo,
+		[THREAD_SCHED_PRIORITY] = &sched_priority,
+		[THREAD_SCHED_FAIR] = &sched_fair,
+};
+
+#define POLICIES_NUMBER (sizeof policies / sizeof policies[0])
+
+const struct sched_ops *sched_get_ops(thread_sched_policy_t policy) {
+	if ((unsigned int) policy >= POLICIES_NUMBER)
+		return NULL;
+	return policies[policy];
+}
+
+int sched_policy_from_name(const char *name, thread_sched_policy_t *policy) {
+	for (unsigned int i = 0; i < POLICIES_NUMBER; i++) {
+		if (strcmp(name, policies[i]->name) == 0) {
+			*policy = i;
+			return 0;
+		}
+	}
+	return -1;
+}
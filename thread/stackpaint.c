@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <valgrind/valgrind.h>
+#include "stackpaint.h"
+#include "debug.h"
+
+#define STACKPAINT_CANARY 0x5354414b43414e59UL
+
+/**
+ * Added to the deepest use seen before recommending a size: signal handlers (the profiler's
+ * unwinds the stack) run on the stack of the interrupted thread.
+ */
+#define STACKPAINT_SIGNAL_MARGIN (8 * 1024)
+
+#define STACKPAINT_PAGE_SIZE 4096
+
+/**
+ * Number of functions in the report printed at exit.
+ */
+#define STACKPAINT_EXIT_TOP 10
+
+//region Structure declaration
+
+struct stackpaint_entry {
+	void *(*func)(void *);
+	unsigned long threads;
+	unsigned long long total_bytes;
+	unsigned long max_bytes;
+};
+
+int stackpaint_enabled = 0;
+
+/**
+ * There are few distinct thread functions: a linear search is enough.
+ */
+static struct stackpaint_entry *entries = NULL;
+static unsigned int entries_size = 0, entries_capacity = 0;
+
+/**
+ * All the functions together.
+ */
+static struct stackpaint_entry all = {NULL, 0, 0, 0};
+
+/**
+ * The threads of every scheduler record their stack use.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int report_at_exit = 0;
+
+//endregion
+
+//region Painting and scanning
+
+void stackpaint_paint(void *stack, unsigned long size) {
+	unsigned long *word = stack, words = size / sizeof *word;
+
+	for (unsigned long i = 0; i < words; i++)
+		word[i] = STACKPAINT_CANARY;
+}
+
+unsigned long stackpaint_usage(const void *stack, unsigned long size) {
+	const unsigned long *word = stack;
+	unsigned long words = size / sizeof *word, untouched = 0;
+
+	/*
+	 * Under Valgrind, the part of the stack below the stack pointer is not addressable:
+	 * reading it is the point here, not a bug of the program.
+	 */
+	VALGRIND_DISABLE_ERROR_REPORTING;
+	while (untouched < words && word[untouched] == STACKPAINT_CANARY)
+		untouched++;
+	VALGRIND_ENABLE_ERROR_REPORTING;
+
+	return size - untouched * sizeof *word;
+}
+
+static void add(struct stackpaint_entry *entry, unsigned long used) {
+	entry->threads++;
+	entry->total_bytes += used;
+	if (used > entry->max_bytes)
+		entry->max_bytes = used;
+}
+
+static void record(void *(*func)(void *), unsigned long used) {
+	add(&all, used);
+
+	for (unsigned int i = 0; i < entries_size; i++) {
+		if (entries[i].func == func) {
+			add(&entries[i], used);
+			return;
+		}
+	}
+
+	if (entries_size == entries_capacity) {
+		unsigned int capacity = entries_capacity ? 2 * entries_capacity : 16;
+		struct stackpaint_entry *new = realloc(entries, capacity * sizeof *new);
+		if (new == NULL) {
+			error("Stack statistics allocation %s", "failed")
+			return;
+		}
+		entries = new;
+		entries_capacity = capacity;
+	}
+
+	struct stackpaint_entry *entry = &entries[entries_size++];
+	entry->func = func;
+	entry->threads = entry->total_bytes = entry->max_bytes = 0;
+	add(entry, used);
+}
+
+void stackpaint_record(void *(*func)(void *), unsigned long used) {
+	kernel.mutex_lock(&lock);
+	record(func, used);
+	kernel.mutex_unlock(&lock);
+}
+
+//endregion
+
+//region API and report
+
+int thread_stack_paint_start(void) {
+	stackpaint_enabled = 1;
+	info("Painting the stacks of the new %s", "threads")
+	return 0;
+}
+
+int thread_stack_paint_stop(void) {
+	stackpaint_enabled = 0;
+	return 0;
+}
+
+static unsigned long recommend(const struct stackpaint_entry *entry) {
+	unsigned long size = entry->max_bytes + entry->max_bytes / 2 + STACKPAINT_SIGNAL_MARGIN;
+
+	size = (size + STACKPAINT_PAGE_SIZE - 1) & ~(STACKPAINT_PAGE_SIZE - 1UL);
+	return size < THREAD_STACK_SIZE_MIN ? THREAD_STACK_SIZE_MIN : size;
+}
+
+unsigned long thread_stack_recommended_size(void *(*func)(void *)) {
+	unsigned long size = 0;
+
+	kernel.mutex_lock(&lock);
+	if (func == NULL) {
+		size = all.threads ? recommend(&all) : 0;
+	} else {
+		for (unsigned int i = 0; i < entries_size; i++)
+			if (entries[i].func == func)
+				size = recommend(&entries[i]);
+	}
+	kernel.mutex_unlock(&lock);
+	return size;
+}
+
+static int compare_max(const void *a, const void *b) {
+	const struct stackpaint_entry *x = a, *y = b;
+	return (x->max_bytes < y->max_bytes) - (x->max_bytes > y->max_bytes);
+}
+
+static void print_entry(FILE *file, const struct stackpaint_entry *entry) {
+	fprintf(file, ": %lu threads, mean %llu B, max %lu B, recommended %lu B\n", entry->threads,
+	        entry->total_bytes / entry->threads, entry->max_bytes, recommend(entry));
+}
+
+int thread_stack_report(FILE *file, unsigned int top) {
+	Dl_info symbol;
+
+	kernel.mutex_lock(&lock);
+	fprintf(file, "Stack use of %lu painted threads, by deepest use\n", all.threads);
+	if (all.threads == 0) {
+		kernel.mutex_unlock(&lock);
+		return 0;
+	}
+
+	qsort(entries, entries_size, sizeof *entries, compare_max);
+	fprintf(file, "all");
+	print_entry(file, &all);
+	for (unsigned int i = 0; i < entries_size && i < top; i++) {
+		void *address = *(void **) &entries[i].func;
+		if (dladdr(address, &symbol) != 0 && symbol.dli_sname != NULL)
+			fprintf(file, "#%u %s (%p)", i + 1, symbol.dli_sname, address);
+		else
+			fprintf(file, "#%u %p", i + 1, address);
+		print_entry(file, &entries[i]);
+	}
+	kernel.mutex_unlock(&lock);
+	return 0;
+}
+
+void stackpaint_init(void) {
+	if (getenv("THREAD_STACK_PAINT") == NULL)
+		return;
+
+	report_at_exit = 1;
+	thread_stack_paint_start();
+}
+
+void stackpaint_exit(void) {
+	stackpaint_enabled = 0;
+	if (report_at_exit)
+		thread_stack_report(stderr, STACKPAINT_EXIT_TOP);
+
+	free(entries);
+	entries = NULL;
+	entries_size = entries_capacity = 0;
+}
+
+//endregion
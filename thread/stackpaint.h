@@ -0,0 +1,45 @@
+#ifndef OS_S8_STACKPAINT_H
+#define OS_S8_STACKPAINT_H
+
+#include "internal.h"
+
+/*
+ * Stack painting.
+ *
+ * The stack of a new thread is filled with a canary word. Stacks grow down, so the canary words left
+ * at the bottom of the stack are the part that has never been used: scanning from the lowest address
+ * up to the first overwritten word gives the deepest use so far.
+ */
+
+/**
+ * 1 when the stacks of the new threads are painted.
+ */
+extern int stackpaint_enabled;
+
+/**
+ * Fill a stack with the canary.
+ */
+void stackpaint_paint(void *stack, unsigned long size);
+
+/**
+ * @return The deepest use of a painted stack, in bytes
+ */
+unsigned long stackpaint_usage(const void *stack, unsigned long size);
+
+/**
+ * A painted thread that ran `func` is freed: add its use to the statistics of the function.
+ */
+void stackpaint_record(void *(*func)(void *), unsigned long used);
+
+/**
+ * Start painting if the THREAD_STACK_PAINT environment variable is set.
+ */
+void stackpaint_init(void);
+
+/**
+ * Print the report requested by THREAD_STACK_PAINT, and free the statistics.
+ * Call it once all the threads are freed.
+ */
+void stackpaint_exit(void);
+
+#endif //OS_S8_STACKPAINT_H
@@ -2,191 +2,1201 @@
 #include <ucontext.h>
 #include <sys/queue.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "thread.h"
 #include <valgrind/valgrind.h>
+#include "internal.h"
+#include "trace.h"
+#include "lockprof.h"
+#include "stackpaint.h"
 #include "debug.h"
 #include <assert.h>
 
-#define STACK_SIZE (64 * 1024)
-
 #ifdef USE_DEBUG
 static short next_thread_id = 0;
 #endif
 
 //region Structure declaration
 
-struct thread {
-	ucontext_t context;
-	void *return_value;
-#ifdef USE_DEBUG
-	short id;
+/*
+ * On x86-64, generators switch with a few instructions instead of swapcontext, which also saves
+ * and restores the signal mask with two system calls on every switch.
+ */
+#ifdef __x86_64__
+#define GEN_FAST_SWITCH
 #endif
-	unsigned int valgrind_stack;
-	STAILQ_ENTRY(thread) entries;
 
+struct thread_gen {
+#ifdef GEN_FAST_SWITCH
+	void *stack_pointer;
+	/**
+	 * Where thread_gen_yield goes back to.
+	 */
+	void *caller_stack_pointer;
+#else
+	ucontext_t context;
+	/**
+	 * Where thread_gen_yield goes back to.
+	 */
+	ucontext_t caller;
+#endif
+	void *stack;
+	void *(*func)(void *);
+	void *func_arg;
 	/**
-	 * Is this thread a zombie? (= called exit, but hasn't been joined yet)
-	 * 1 = zombie, 0 = active
+	 * The generator that was running when this one was resumed.
 	 */
-	char is_zombie;
+	struct thread_gen *parent;
+	/**
+	 * Value passed by the last resume or yield.
+	 */
+	void *value;
+	char is_done;
+	unsigned int valgrind_stack;
+};
+
+THREAD_LOCAL struct thread_sched *local_sched = NULL;
+
+unsigned int sched_instances = 0;
+
+/**
+ * The scheduler of the main kernel thread, freed when the program exits.
+ */
+static struct thread_sched *main_sched = NULL;
+static unsigned int next_sched_id = 0;
+
+/**
+ * Its destructor frees the scheduler of a kernel thread that exits.
+ */
+static pthread_key_t sched_key;
+
+/**
+ * The policy of the new schedulers, from THREAD_SCHED.
+ */
+static thread_sched_policy_t initial_policy = THREAD_SCHED_FIFO;
+
+static unsigned int next_trace_id = 1;
+
+THREAD_LOCAL unsigned long long thread_slice_deadline = 0;
+
+/**
+ * Length of a time slice, in thread_slice_clock units: 0 until the first expired slice
+ * calibrates the clock, so only the programs calling thread_maybe_yield pay for the deadlines.
+ * Read without the lock, written with it.
+ */
+static unsigned long long slice_ticks = 0;
+static unsigned int slice_us = 1000;
+static double slice_ticks_per_ns = 0;
+static pthread_mutex_t slice_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_thread(struct thread *thread) {
+	debug("%hd is being freed, on address %p", thread->id, (void *) thread)
+
+	if (thread->is_stack_painted)
+		stackpaint_record(thread->func, stackpaint_usage(thread->context.uc_stack.ss_sp,
+		                                                 thread->context.uc_stack.ss_size));
+
+	if (thread->valgrind_stack != -1)
+		VALGRIND_STACK_DEREGISTER(thread->valgrind_stack);
+
+	free(thread->specific);
+	// A main thread is alone, the others share a block with their stack, owned by the caller if created in place
+	if (thread->node == -1)
+		free(thread);
+	else if (!thread->is_inplace)
+		numa_free_thread(thread);
+}
+
+/**
+ * @return The thread standing for the kernel thread's own context
+ */
+static struct thread *new_main_thread(struct thread_sched *sched) {
+	struct thread *main_thread = malloc(sizeof *main_thread);
+	if (main_thread == NULL) {
+		error("Main thread allocation %s", "failed")
+		exit(1);
+	}
+
+	main_thread->return_value = NULL;
+	main_thread->context.uc_stack.ss_sp = NULL;
+	main_thread->is_zombie = 0;
+	main_thread->is_blocked = 0;
+	main_thread->park_state = PARK_NONE;
+	main_thread->sched = sched;
+	main_thread->node = -1;
+	main_thread->is_mapped = 0;
+	main_thread->is_in_arena = 0;
+	main_thread->is_inplace = 0;
+	main_thread->joiner = NULL;
+	main_thread->generator = NULL;
+	main_thread->priority = THREAD_PRIORITY_DEFAULT;
+	main_thread->base_priority = THREAD_PRIORITY_DEFAULT;
+	main_thread->held_mutexes = NULL;
+	main_thread->waiting_for = NULL;
+	main_thread->vruntime = 0;
+	memset(&main_thread->stats, 0, sizeof main_thread->stats);
+	main_thread->state_since = now_ns();
+	main_thread->trace_id = 0;
+	main_thread->func = NULL;
+	main_thread->specific = NULL;
+	main_thread->is_stack_painted = 0;
+	main_thread->lockprof_mutex = NULL;
+	main_thread->cancel_state = CANCEL_NONE;
+	main_thread->cleanups = NULL;
+	main_thread->wait_queue = NULL;
+	main_thread->join_target = NULL;
+	main_thread->uring_request = NULL;
+	main_thread->is_interrupted = 0;
+#ifdef USE_DEBUG
+	main_thread->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+#endif
+	main_thread->valgrind_stack = -1;
+	return main_thread;
+}
+
+struct thread_sched *sched_create_local(void) {
+	// Aligned for the cache line of the inbox
+	struct thread_sched *sched;
+	if (posix_memalign((void **) &sched, 64, sizeof *sched) != 0) {
+		error("Scheduler allocation %s", "failed")
+		exit(1);
+	}
+	memset(sched, 0, sizeof *sched);
+
+	sched->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (sched->event_fd == -1) {
+		error("Cannot create the eventfd of a scheduler: %d", errno)
+		exit(1);
+	}
+
+	sched->id = __atomic_fetch_add(&next_sched_id, 1, __ATOMIC_RELAXED);
+	numa_attach(sched);
+	sched->main_thread = sched->running = new_main_thread(sched);
+	sched->current_to_free = NULL;
+	sched->policy = initial_policy;
+	sched->ops = sched_get_ops(sched->policy);
+	sched->wakeup_policy = THREAD_WAKEUP_FIFO;
+	sched->live_threads = 1;
+	sched->inbox = NULL;
+	sched->posts = NULL;
+	TAILQ_INIT(&sched->offload_slot_waiters);
+	sched->uring = NULL;
+	sched->ops->init(sched);
+
+	local_sched = sched;
+	trace_register(sched);
+	watchdog_attach(sched);
+	__atomic_add_fetch(&sched_instances, 1, __ATOMIC_RELAXED);
+	// The main scheduler lives until the program exits, the others until their kernel thread exits
+	if (main_sched != NULL)
+		kernel.setspecific(sched_key, sched);
+
+	debug("%hd is the main thread of the scheduler %u, policy %s", sched->main_thread->id, sched->id,
+	      sched->ops->name)
+	return sched;
+}
+
+/**
+ * Free a scheduler and its threads, on its kernel thread.
+ */
+static void sched_free(struct thread_sched *sched) {
+	struct thread *thread;
+
+	// Its handler reads the running thread
+	watchdog_detach(sched);
+	while ((thread = sched->ops->pick_next(sched)) != NULL)
+		if (thread != sched->main_thread)
+			free_thread(thread);
+
+	if (sched->running != sched->main_thread && sched->running != sched->current_to_free)
+		free_thread(sched->running);
+
+	free_thread(sched->main_thread);
+
+	if (sched->current_to_free != NULL && sched->current_to_free != sched->main_thread)
+		free_thread(sched->current_to_free);
+
+	sched->ops->destroy(sched);
+	uring_exit(sched);
+	trace_unregister(sched);
+
+	// Nobody will run the functions still posted
+	while (sched->posts != NULL) {
+		struct sched_post *post = sched->posts;
+		sched->posts = post->next;
+		free(post);
+	}
+
+	close(sched->event_fd);
+	numa_detach(sched);
+	__atomic_sub_fetch(&sched_instances, 1, __ATOMIC_RELAXED);
+	local_sched = NULL;
+	free(sched);
+}
+
+static void free_local_sched(void *sched) {
+	info("Scheduler %u: its kernel thread has exited, freeing its threads", ((struct thread_sched *) sched)->id)
+	local_sched = sched;
+	// The helpers push the threads of the calls in progress to the inbox: not once it is freed
+	offload_detach(sched);
+	sched_free(sched);
+}
+
+__attribute__((unused)) __attribute__((constructor))
+static void initialize_threads() {
+	kernel_resolve();
+	if (kernel.key_create(&sched_key, free_local_sched) != 0) {
+		error("Cannot create the key of the %s", "schedulers")
+		exit(1);
+	}
+
+	const char *policy_name = getenv("THREAD_SCHED");
+	if (policy_name != NULL && sched_policy_from_name(policy_name, &initial_policy) != 0) {
+		warn("Unknown scheduling policy THREAD_SCHED=%s, using FIFO", policy_name)
+		initial_policy = THREAD_SCHED_FIFO;
+	}
+
+	const char *slice = getenv("THREAD_TIME_SLICE_US");
+	if (slice != NULL && thread_set_time_slice(strtoul(slice, NULL, 10)) != 0)
+		warn("Invalid time slice THREAD_TIME_SLICE_US=%s, using %u us", slice, slice_us)
+
+	numa_init();
+	arena_init();
+	// Create the scheduler of the main thread (so it can call thread_self and thread_yield)
+	main_sched = sched_create_local();
+
+	trace_init();
+	lockprof_init();
+	profiler_init();
+	stackpaint_init();
+	watchdog_init();
+}
+
+__attribute__((unused)) __attribute__((destructor))
+static void free_threads() {
+	watchdog_exit();
+	profiler_exit();
+	printf("\n");
+	info("%s, now freeing all remaining threads…", "Program has exited")
+
+	// The helpers push to the inboxes of the schedulers: stopped before any is freed
+	offload_exit();
+
+	// exit() may have been called by another kernel thread
+	struct thread_sched *caller = local_sched;
+	local_sched = main_sched;
+	sched_free(main_sched);
+	local_sched = caller != main_sched ? caller : NULL;
+
+	numa_exit();
+	arena_exit();
+	trace_exit();
+	lockprof_exit();
+	stackpaint_exit();
+}
+
+//endregion
+
+static struct thread *thread_self_safe(void) {
+	return sched_local()->running;
+}
+
+thread_t thread_self(void) {
+	return thread_self_safe();
+}
+
+void func_and_exit(void *(*func)(void *), void *func_arg) {
+	thread_exit(func(func_arg));
+}
+
+//region Attributes
+
+int thread_attr_init(thread_attr_t *attr) {
+	attr->priority = THREAD_PRIORITY_DEFAULT;
+	attr->stack_size = THREAD_STACK_SIZE_DEFAULT;
+	attr->node = -1;
+	attr->sched = NULL;
+	return 0;
+}
+
+int thread_attr_setpriority(thread_attr_t *attr, int priority) {
+	if (priority < THREAD_PRIORITY_MIN || priority > THREAD_PRIORITY_MAX)
+		return -1;
+
+	attr->priority = priority;
+	return 0;
+}
+
+int thread_attr_setstacksize(thread_attr_t *attr, unsigned long stack_size) {
+	if (stack_size < THREAD_STACK_SIZE_MIN)
+		return -1;
+
+	attr->stack_size = stack_size;
+	return 0;
+}
+
+int thread_attr_setnode(thread_attr_t *attr, int node) {
+	if (node < -1 || node >= (int) numa_nodes)
+		return -1;
+
+	attr->node = node;
+	return 0;
+}
+
+int thread_attr_setsched(thread_attr_t *attr, struct thread_sched *sched) {
+	attr->sched = sched;
+	return 0;
+}
+
+//endregion
+
+int thread_create(thread_t *new_thread, void *(*func)(void *), void *func_arg) {
+	return thread_create_attr(new_thread, NULL, func, func_arg);
+}
+
+static int yield(struct thread_sched *sched);
+
+/**
+ * Make a new thread runnable, on the kernel thread of its scheduler.
+ */
+static void adopt(struct thread *new) {
+	struct thread_sched *sched = new->sched;
+
+	sched->stats.threads_created++;
+	sched->live_threads++;
+	trace(TRACE_CREATE, sched->running->trace_id, new->trace_id);
+	info("%hd was just created, on address %p", new->id, (void *) new)
+	sched->ops->enqueue(sched, new, SCHED_NEW);
+}
+
+/**
+ * @return The scheduler a new thread runs on, NULL if there is none on the node of the attributes
+ */
+static struct thread_sched *attr_sched(struct thread_sched *sched, const thread_attr_t *attr) {
+	struct thread_sched *target = attr->sched;
+	if (target == NULL && attr->node != -1 && attr->node != sched->node
+	    && (target = numa_sched_on_node(attr->node)) == NULL) {
+		warn("No scheduler on the NUMA node %d", attr->node)
+		return NULL;
+	}
+	return target != NULL ? target : sched;
+}
+
+/**
+ * Set up a new thread in its block, whose stack fields are set, and make it runnable.
+ */
+static int start_thread(thread_t *new_thread, struct thread *new, struct thread_sched *target,
+                        const thread_attr_t *attr, void *(*func)(void *), void *func_arg) {
+	struct thread_sched *sched = sched_local();
+
+	void *stack = new->context.uc_stack.ss_sp;
+	size_t stack_size = new->context.uc_stack.ss_size;
+	if (getcontext(&new->context) == -1) {
+		error("Failed to get context: %hd", new->id)
+		exit(1);
+	}
+
+	new->context.uc_stack.ss_size = stack_size;
+	new->context.uc_stack.ss_sp = stack;
+	new->is_stack_painted = stackpaint_enabled;
+	if (new->is_stack_painted)
+		stackpaint_paint(new->context.uc_stack.ss_sp, stack_size);
+
+	new->context.uc_link = &target->main_thread->context;
+	new->is_zombie = 0;
+	new->is_blocked = 0;
+	new->park_state = PARK_NONE;
+	new->sched = target;
+	new->joiner = NULL;
+	new->generator = NULL;
+	new->priority = attr->priority;
+	new->base_priority = attr->priority;
+	new->held_mutexes = NULL;
+	new->waiting_for = NULL;
+	new->vruntime = 0;
+	memset(&new->stats, 0, sizeof new->stats);
+	new->state_since = now_ns();
+	new->trace_id = __atomic_fetch_add(&next_trace_id, 1, __ATOMIC_RELAXED);
+	new->func = func;
+	new->specific = NULL;
+	new->lockprof_mutex = NULL;
+	new->cancel_state = CANCEL_NONE;
+	new->cleanups = NULL;
+	new->wait_queue = NULL;
+	new->join_target = NULL;
+	new->uring_request = NULL;
+	new->is_interrupted = 0;
+	makecontext(&new->context, (void (*)(void)) func_and_exit, 2, func, func_arg);
+
+	new->return_value = NULL;
+#ifdef USE_DEBUG
+	new->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+#endif
+	new->valgrind_stack = VALGRIND_STACK_REGISTER(new->context.uc_stack.ss_sp,
+	                                              new->context.uc_stack.ss_sp +
+	                                              new->context.uc_stack.ss_size);
+	*new_thread = new;
+
+	if (target != sched) {
+		sched->stats.threads_sent++;
+		sched_push(target, new, INBOX_ADOPT);
+		return 0;
+	}
+	adopt(new);
+
+	// A posted function must not switch: the new thread runs later
+	if (sched->is_running_posts)
+		return 0;
+	// Not a cancellation point: the new thread would have nobody to join it
+	return yield(sched);
+}
+
+int thread_create_attr(thread_t *new_thread, const thread_attr_t *attr, void *(*func)(void *), void *func_arg) {
+	struct thread_sched *sched = sched_local(), *target;
+	thread_attr_t default_attr;
+	int is_reused;
+	if (attr == NULL) {
+		thread_attr_init(&default_attr);
+		attr = &default_attr;
+	}
+
+	target = attr_sched(sched, attr);
+	if (target == NULL)
+		return -1;
+
+	struct thread *new = numa_alloc_thread(attr->stack_size, target->node, &is_reused);
+	if (new == NULL) {
+		error("New thread allocation %s", "failed")
+		exit(1);
+	}
+	new->is_inplace = 0;
+	sched->stats.stacks_reused += is_reused;
+	return start_thread(new_thread, new, target, attr, func, func_arg);
+}
+
+_Static_assert(sizeof(struct thread) + 64 + 16 <= THREAD_INPLACE_OVERHEAD,
+               "THREAD_INPLACE_OVERHEAD must hold a thread and its alignments");
+
+int thread_create_inplace(thread_t *new_thread, void *buffer, size_t size, const thread_attr_t *attr,
+                          void *(*func)(void *), void *func_arg) {
+	struct thread_sched *sched = sched_local(), *target;
+	thread_attr_t default_attr;
+	if (attr == NULL) {
+		thread_attr_init(&default_attr);
+		attr = &default_attr;
+	}
+
+	if (buffer == NULL || size < THREAD_INPLACE_SIZE(THREAD_STACK_SIZE_MIN)) {
+		warn("Buffer %p of %zu bytes too small for a thread", buffer, size)
+		return -1;
+	}
+	target = attr_sched(sched, attr);
+	if (target == NULL)
+		return -1;
+
+	// Laid out like the blocks of numa_alloc_thread: the stack, then the structure on a cache line boundary
+	uintptr_t stack = ((uintptr_t) buffer + 15) & ~15UL;
+	uintptr_t end = ((uintptr_t) buffer + size - sizeof(struct thread)) & ~63UL;
+	struct thread *new = (struct thread *) end;
+	new->context.uc_stack.ss_sp = (void *) stack;
+	new->context.uc_stack.ss_size = end - stack;
+	new->node = target->node;
+	new->is_mapped = 0;
+	new->is_in_arena = 0;
+	new->is_inplace = 1;
+	return start_thread(new_thread, new, target, attr, func, func_arg);
+}
+
+//region Statistics
+
+static unsigned int delay_bucket(unsigned long long delay) {
+	if (delay < 4)
+		return delay;
+
+	int exponent = 63 - __builtin_clzll(delay);
+	return 4 * (exponent - 1) + ((delay >> (exponent - 2)) & 3);
+}
+
+unsigned long long thread_sched_stats_bucket_min(unsigned int bucket) {
+	if (bucket < 4)
+		return bucket;
+	if (bucket >= THREAD_STATS_DELAY_BUCKETS)
+		return ULLONG_MAX;
+
+	return (4ULL + bucket % 4) << (bucket / 4 - 1);
+}
+
+/**
+ * The running thread stops running (it is still runnable, blocked or dead) and `next`, which was
+ * waiting in the run queue, starts.
+ */
+static void account_switch(struct thread_sched *sched, struct thread *current, struct thread *next) {
+	thread_sched_stats_t *sched_stats = &sched->stats;
+	unsigned long long now = now_ns();
+
+	current->stats.run_ns += now - current->state_since;
+	current->state_since = now;
+	if (current->is_zombie) {
+		sched_stats->exit_switches++;
+	} else if (current->is_blocked) {
+		current->stats.blocking_switches++;
+		sched_stats->blocking_switches++;
+	} else {
+		current->stats.voluntary_switches++;
+		sched_stats->voluntary_switches++;
+	}
+
+	// Sample the stack depth (generators run on their own stack, ignore them)
+	char *stack = current->context.uc_stack.ss_sp, *sp = (char *) &now;
+	if (current != sched->main_thread && sp > stack && sp < stack + current->context.uc_stack.ss_size) {
+		unsigned long used = stack + current->context.uc_stack.ss_size - sp;
+		if (used > current->stats.stack_high_water)
+			current->stats.stack_high_water = used;
+	}
+
+	unsigned long long ticks = __atomic_load_n(&slice_ticks, __ATOMIC_RELAXED);
+	if (ticks != 0)
+		thread_slice_deadline = thread_slice_clock() + ticks;
+
+	unsigned long long delay = now - next->state_since;
+	next->stats.runnable_ns += delay;
+	next->state_since = now;
+	sched_stats->delay_count++;
+	sched_stats->delay_histogram[delay_bucket(delay)]++;
+	if (delay > sched_stats->delay_max_ns)
+		sched_stats->delay_max_ns = delay;
+}
+
+void count_hog(struct thread *thread) {
+	// The handler may interrupt the code reading or resetting them
+	__atomic_fetch_add(&thread->stats.hogs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&thread->sched->stats.watchdog_hogs, 1, __ATOMIC_RELAXED);
+}
+
+int thread_stats_get(thread_t thread, thread_stats_t *stats) {
+	struct thread *target = thread;
+	unsigned long long elapsed = now_ns() - target->state_since;
+
+	*stats = target->stats;
+	if (target == target->sched->running)
+		stats->run_ns += elapsed;
+	else if (target->is_blocked)
+		stats->blocked_ns += elapsed;
+	else if (!target->is_zombie)
+		stats->runnable_ns += elapsed;
+
+	long painted = thread_stack_usage(thread);
+	if (painted > (long) stats->stack_high_water)
+		stats->stack_high_water = painted;
+
+	return 0;
+}
+
+long thread_stack_usage(thread_t thread) {
+	struct thread *target = thread;
+
+	if (!target->is_stack_painted)
+		return -1;
+	return (long) stackpaint_usage(target->context.uc_stack.ss_sp, target->context.uc_stack.ss_size);
+}
+
+/**
+ * @return An upper bound of the delay under which a fraction of the delays are
+ */
+static unsigned long long delay_percentile(const thread_sched_stats_t *stats, double fraction) {
+	unsigned long long target = (unsigned long long) (fraction * stats->delay_count + 0.5), seen = 0;
+
+	if (stats->delay_count == 0)
+		return 0;
+	if (target == 0)
+		target = 1;
+
+	for (unsigned int i = 0; i < THREAD_STATS_DELAY_BUCKETS; i++) {
+		seen += stats->delay_histogram[i];
+		if (seen >= target) {
+			unsigned long long upper = thread_sched_stats_bucket_min(i + 1) - 1;
+			return upper < stats->delay_max_ns ? upper : stats->delay_max_ns;
+		}
+	}
+	return stats->delay_max_ns;
+}
+
+int thread_sched_stats(thread_sched_stats_t *stats) {
+	*stats = sched_local()->stats;
+	stats->delay_p50_ns = delay_percentile(stats, 0.5);
+	stats->delay_p90_ns = delay_percentile(stats, 0.9);
+	stats->delay_p99_ns = delay_percentile(stats, 0.99);
+	return 0;
+}
+
+void thread_sched_stats_reset(void) {
+	memset(&sched_local()->stats, 0, sizeof sched_local()->stats);
+}
+
+//endregion
+
+/**
+ * Switch from the running thread to another one.
+ * The running thread must already be in the run queue, in a waiting queue, or dead.
+ */
+static int switch_to(struct thread_sched *sched, struct thread *next) {
+	struct thread *current = sched->running;
+
+	if (next == current) {
+		debug("%hd: No thread to yield to, noop.", current->id)
+		return 0;
+	}
+
+	debug("yield: %hd -> %hd", current->id, next->id)
+	account_switch(sched, current, next);
+	trace(TRACE_SWITCH, current->trace_id, next->trace_id);
+	sched->running = next;
+	return swapcontext(&current->context, &next->context);
+}
+
+/**
+ * @return The thread that should run next, after waiting for the I/O, the offloaded calls or the
+ * posted functions if none is runnable, or NULL if none is runnable and nothing can wake one up
+ */
+static struct thread *pick_next_or_wait(struct thread_sched *sched) {
+	struct thread *next;
+
+	sched_check_inbox(sched);
+	// Keep the prepared operations: the next threads may prepare more, submitted together
+	uring_check(sched, 0);
+	while ((next = sched->ops->pick_next(sched)) == NULL && (uring_wait(sched) || sched_wait(sched))) {}
+	return next;
+}
+
+int block_current(void) {
+	struct thread_sched *sched = local_sched;
+
+	// Before waiting: the current thread may be woken up, and back in the run queue, after
+	sched->ops->on_block(sched, sched->running);
+	struct thread *next = pick_next_or_wait(sched);
+	if (next == NULL)
+		return -1;
+
+	// Its offloaded call has completed while no other thread could run
+	if (next == sched->running)
+		return 0;
+
+	return switch_to(sched, next);
+}
+
+void wake_up(struct thread *thread) {
+	struct thread_sched *sched = thread->sched;
+	unsigned long long now = now_ns();
+
+	thread->stats.blocked_ns += now - thread->state_since;
+	thread->state_since = now;
+	thread->is_blocked = 0;
+	// Not waiting anymore: thread_cancel has nothing to take it out of
+	thread->wait_queue = NULL;
+	thread->join_target = NULL;
+	thread->uring_request = NULL;
+	trace(TRACE_WAKE, sched->running->trace_id, thread->trace_id);
+	sched->ops->enqueue(sched, thread, sched->wakeup_policy == THREAD_WAKEUP_NEXT ? SCHED_WAKEUP_NEXT : SCHED_WAKEUP);
+}
+
+int thread_set_wakeup_policy(thread_wakeup_policy_t policy) {
+	if (policy != THREAD_WAKEUP_FIFO && policy != THREAD_WAKEUP_NEXT)
+		return -1;
+
+	sched_local()->wakeup_policy = policy;
+	return 0;
+}
+
+//region Scheduling policies
+
+int thread_sched_set_policy(thread_sched_policy_t policy) {
+	struct thread_sched *sched = sched_local();
+	const struct sched_ops *ops = sched_get_ops(policy), *previous = sched->ops;
+	if (ops == NULL)
+		return -1;
+
+	if (ops == previous)
+		return 0;
+
+	// Move all runnable threads to the new policy
+	struct thread_queue runnable = TAILQ_HEAD_INITIALIZER(runnable);
+	struct thread *thread;
+	while ((thread = previous->pick_next(sched)) != NULL)
+		TAILQ_INSERT_TAIL(&runnable, thread, entries);
+	previous->destroy(sched);
+
+	sched->ops = ops;
+	sched->policy = policy;
+	ops->init(sched);
+	while ((thread = TAILQ_FIRST(&runnable)) != NULL) {
+		TAILQ_REMOVE(&runnable, thread, entries);
+		ops->enqueue(sched, thread, SCHED_NEW);
+	}
+
+	info("Scheduling policy: %s -> %s", previous->name, ops->name)
+	return 0;
+}
+
+thread_sched_policy_t thread_sched_get_policy(void) {
+	return sched_local()->policy;
+}
+
+static void set_priority(struct thread *thread, int priority) {
+	struct thread_sched *sched = thread->sched;
+
+	// The policy may have stored the thread according to its priority
+	int is_queued = thread != sched->running && !thread->is_blocked && !thread->is_zombie;
+	if (is_queued)
+		sched->ops->dequeue(sched, thread);
+	thread->priority = priority;
+	if (is_queued)
+		sched->ops->enqueue(sched, thread, SCHED_YIELD);
+}
+
+/**
+ * @return The base priority of a thread, or the priority of the highest waiter of the mutexes it holds
+ */
+static int inherited_priority(struct thread *thread) {
+	int priority = thread->base_priority;
+	struct thread *waiter;
+
+	for (struct thread_mutex *mutex = thread->held_mutexes; mutex != NULL; mutex = mutex->next_held)
+		TAILQ_FOREACH(waiter, &mutex->waiting_queue, entries)
+			if (waiter->priority > priority)
+				priority = waiter->priority;
+	return priority;
+}
+
+/**
+ * Give a thread the priority it inherits, then the owner of the mutex it waits for, and so on
+ * along the chain until a priority doesn't change.
+ */
+static void update_priority(struct thread *thread) {
+	while (thread != NULL) {
+		int priority = inherited_priority(thread);
+		if (priority == thread->priority)
+			return;
+		if (priority > thread->priority && priority > thread->base_priority)
+			thread->sched->stats.priority_boosts++;
+		debug("%d: Priority %d -> %d", thread->id, thread->priority, priority)
+		set_priority(thread, priority);
+		thread = thread->waiting_for != NULL ? thread->waiting_for->owner : NULL;
+	}
+}
+
+int thread_setpriority(thread_t thread, int priority) {
+	struct thread *target = thread;
+
+	if (priority < THREAD_PRIORITY_MIN || priority > THREAD_PRIORITY_MAX)
+		return -1;
+
+	// The boost from the waiters of its mutexes stays
+	target->base_priority = priority;
+	update_priority(target);
+	return 0;
+}
+
+int thread_getpriority(thread_t thread) {
+	return ((struct thread *) thread)->priority;
+}
+
+//endregion
+
+static int yield(struct thread_sched *sched) {
+	sched_check_inbox(sched);
+	uring_check(sched, 1);
+	sched->ops->enqueue(sched, sched->running, SCHED_YIELD);
+	return switch_to(sched, sched->ops->pick_next(sched));
+}
+
+int thread_yield(void) {
+	struct thread_sched *sched = sched_local();
+
+	cancel_point(sched->running);
+	return yield(sched);
+}
+
+int thread_yield_to(thread_t thread) {
+	struct thread_sched *sched = sched_local();
+	struct thread *target = thread;
+	struct thread *current = sched->running;
+
+	if (target == current)
+		return 0;
+
+	if (target->is_zombie || target->is_blocked || target->sched != sched) {
+		debug("%hd: Cannot yield to %hd, which is not runnable.", current->id, target->id)
+		return -1;
+	}
+
+	// Like thread_yield, but the target jumps the queue
+	sched->ops->dequeue(sched, target);
+	sched->ops->enqueue(sched, current, SCHED_YIELD);
+	return switch_to(sched, target);
+}
+
+//region Scheduler instances
+
+thread_sched_t *thread_sched_self(void) {
+	return sched_local();
+}
+
+int sched_wait(struct thread_sched *sched) {
+	struct pollfd poll_fd = {sched->event_fd, POLLIN, 0};
+
+	// Alone, with no call in progress: nothing can wake a thread up
+	if (sched->offload_in_flight == 0 && __atomic_load_n(&sched_instances, __ATOMIC_RELAXED) < 2)
+		return 0;
+
+	if (sched_idle_begin(sched)) {
+		sched->stats.idle_sleeps++;
+		while (poll(&poll_fd, 1, -1) == -1 && errno == EINTR) {}
+	}
+	sched_idle_end(sched);
+	sched_drain(sched);
+	sched_check_inbox(sched);
+	return 1;
+}
+
+int sched_idle_begin(struct thread_sched *sched) {
+	// Sequentially consistent, like the pushes: they see is_idle, or it sees what they pushed
+	__atomic_store_n(&sched->is_idle, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched->inbox, __ATOMIC_SEQ_CST) == NULL
+	    && __atomic_load_n(&sched->posts, __ATOMIC_SEQ_CST) == NULL)
+		return 1;
+
+	sched_idle_end(sched);
+	return 0;
+}
 
-	/**
-	 * The thread responsible for joining this one.
-	 */
-	struct thread *joiner;
-};
+void sched_drain(struct thread_sched *sched) {
+	uint64_t count;
 
-STAILQ_HEAD(thread_queue, thread);
-struct thread_queue threads;
+	// Non-blocking: it may be drained already
+	if (read(sched->event_fd, &count, sizeof count) == -1 && errno != EAGAIN)
+		warn("Cannot read the eventfd of the scheduler %u: %d", sched->id, errno)
+}
 
-struct thread *main_thread, *current_to_free = NULL;
+/**
+ * Ring the doorbell of a scheduler, if it sleeps: when it runs, it looks at its inbox when it switches.
+ */
+static void notify(struct thread_sched *sched) {
+	if (!__atomic_load_n(&sched->is_idle, __ATOMIC_SEQ_CST))
+		return;
 
-static void free_thread(struct thread *thread) {
-	debug("%hd is being freed, on address %p", thread->id, (void *) thread)
+	uint64_t one = 1;
+	if (write(sched->event_fd, &one, sizeof one) != sizeof one)
+		warn("Cannot wake up the scheduler %u: %d", sched->id, errno)
+}
 
-	if (thread->valgrind_stack != -1)
-		VALGRIND_STACK_DEREGISTER(thread->valgrind_stack);
+void sched_push(struct thread_sched *sched, struct thread *thread, enum inbox_op op) {
+	struct thread *head = __atomic_load_n(&sched->inbox, __ATOMIC_RELAXED);
 
-	free(thread->context.uc_stack.ss_sp);
-	free(thread);
+	thread->inbox_op = (char) op;
+	do {
+		TAILQ_NEXT(thread, entries) = head;
+	} while (!__atomic_compare_exchange_n(&sched->inbox, &head, thread, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	notify(sched);
 }
 
-__attribute__((unused)) __attribute__((constructor))
-static void initialize_threads() {
-	STAILQ_INIT(&threads);
+void sched_run_inbox(struct thread_sched *sched) {
+	struct thread *thread = __atomic_exchange_n(&sched->inbox, NULL, __ATOMIC_ACQUIRE), *oldest = NULL;
+	struct sched_post *post = __atomic_exchange_n(&sched->posts, NULL, __ATOMIC_ACQUIRE), *oldest_post = NULL;
 
-	// Create the main thread (so it can call thread_self and thread_yield)
-	main_thread = malloc(sizeof *main_thread);
-	main_thread->return_value = NULL;
-	main_thread->context.uc_stack.ss_sp = NULL;
-	main_thread->is_zombie = 0;
-	main_thread->joiner = NULL;
-#ifdef USE_DEBUG
-	main_thread->id = next_thread_id++;
-#endif
-	main_thread->valgrind_stack = -1;
+	// Oldest first
+	if (thread != NULL)
+		sched->stats.inbox_batches++;
+	while (thread != NULL) {
+		struct thread *next = TAILQ_NEXT(thread, entries);
+		TAILQ_NEXT(thread, entries) = oldest;
+		oldest = thread;
+		thread = next;
+	}
+	while (post != NULL) {
+		struct sched_post *next = post->next;
+		post->next = oldest_post;
+		oldest_post = post;
+		post = next;
+	}
+
+	while (oldest != NULL) {
+		// Waking it up links it in a queue
+		struct thread *next = TAILQ_NEXT(oldest, entries);
+		sched->stats.inbox_threads++;
+		switch (oldest->inbox_op) {
+			case INBOX_ADOPT:
+				adopt(oldest);
+				break;
+			case INBOX_UNPARK:
+				wake_up(oldest);
+				break;
+			case INBOX_OFFLOAD:
+				offload_complete(sched, oldest);
+				break;
+		}
+		oldest = next;
+	}
 
-	STAILQ_INSERT_HEAD(&threads, main_thread, entries);
-	debug("%hd is the main thread.", main_thread->id)
+	sched->is_running_posts = 1;
+	while (oldest_post != NULL) {
+		struct sched_post *next = oldest_post->next;
+		oldest_post->func(oldest_post->arg);
+		free(oldest_post);
+		oldest_post = next;
+	}
+	sched->is_running_posts = 0;
 }
 
-__attribute__((unused)) __attribute__((destructor))
-static void free_threads() {
-	printf("\n");
-	info("%s, now freeing all remaining threads…", "Program has exited")
+int thread_sched_post(thread_sched_t *sched, void (*func)(void *), void *arg) {
+	struct sched_post *post = malloc(sizeof *post);
+	if (post == NULL) {
+		error("Posted function allocation %s", "failed")
+		return -1;
+	}
+	post->func = func;
+	post->arg = arg;
 
-	struct thread *current = STAILQ_FIRST(&threads);
-	struct thread *next;
+	post->next = __atomic_load_n(&sched->posts, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&sched->posts, &post->next, post, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {}
+	notify(sched);
+	return 0;
+}
+
+int thread_park(void) {
+	struct thread *current = thread_self_safe();
+	int state = PARK_PERMIT;
+
+	cancel_point(current);
+
+	// Unparked since its last park: consume it
+	if (__atomic_compare_exchange_n(&current->park_state, &state, PARK_NONE, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
 
-	while (current != NULL) {
-		next = STAILQ_NEXT(current, entries);
-		if (current != main_thread)
-			free_thread(current);
-		current = next;
+	current->is_blocked = 1;
+	state = PARK_NONE;
+	if (!__atomic_compare_exchange_n(&current->park_state, &state, PARK_PARKED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		// Unparked in between, by another kernel thread
+		__atomic_store_n(&current->park_state, PARK_NONE, __ATOMIC_RELAXED);
+		current->is_blocked = 0;
+		return 0;
+	}
+
+	trace(TRACE_BLOCK_PARK, current->trace_id, 0);
+	if (block_current() != 0) {
+		error("%hd: I'm the last thread alive, but I was asked to park. Nobody can unpark me.", current->id)
+		__atomic_store_n(&current->park_state, PARK_NONE, __ATOMIC_RELAXED);
+		current->is_blocked = 0;
+		return -1;
 	}
+	// Maybe unparked by thread_cancel
+	cancel_point(current);
+	return 0;
+}
+
+int thread_unpark(thread_t thread) {
+	struct thread *target = thread;
+	int state = __atomic_load_n(&target->park_state, __ATOMIC_RELAXED), next;
 
-	free_thread(main_thread);
+	// Wake it up if it is parked, give it a permit otherwise
+	do {
+		if (state == PARK_PERMIT)
+			return 0;
+		next = state == PARK_PARKED ? PARK_NONE : PARK_PERMIT;
+	} while (!__atomic_compare_exchange_n(&target->park_state, &state, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
-	if (current_to_free != NULL)
-		free_thread(current_to_free);
+	if (state == PARK_PARKED) {
+		if (target->sched == local_sched)
+			wake_up(target);
+		else
+			sched_push(target->sched, target, INBOX_UNPARK);
+	}
+	return 0;
 }
 
 //endregion
 
-static struct thread *thread_self_safe(void) {
-	return STAILQ_FIRST(&threads);
-}
+//region Time slices
 
-thread_t thread_self(void) {
-	return thread_self_safe();
-}
+int thread_set_time_slice(unsigned int slice) {
+	if (slice == 0)
+		return -1;
 
-void func_and_exit(void *(*func)(void *), void *func_arg) {
-	thread_exit(func(func_arg));
+	kernel.mutex_lock(&slice_lock);
+	slice_us = slice;
+	if (slice_ticks != 0)
+		__atomic_store_n(&slice_ticks, (unsigned long long) (slice_us * 1000.0 * slice_ticks_per_ns), __ATOMIC_RELAXED);
+	kernel.mutex_unlock(&slice_lock);
+	return 0;
 }
 
-int thread_create(thread_t *new_thread, void *(*func)(void *), void *func_arg) {
-	struct thread *new = malloc(sizeof *new);
-	if (new == NULL) {
-		error("New thread allocation %s", "failed")
-		exit(1);
-	}
-
-	if (getcontext(&new->context) == -1) {
-		error("Failed to get context: %hd", new->id)
-		exit(1);
-	}
+#define SLICE_CALIBRATION_NS 50000
+#define SLICE_CALIBRATION_TRIES 5
 
-	new->context.uc_stack.ss_size = STACK_SIZE;
-	new->context.uc_stack.ss_sp = malloc(STACK_SIZE);
-	if (new->context.uc_stack.ss_sp == NULL) {
-		error("New thread stack allocation failed: %hd", new->id);
-		exit(1);
+/**
+ * Measure the speed of thread_slice_clock, against the monotonic clock, once per process.
+ *
+ * The monotonic clock is read before the cycle counter at the start and after it at the end: if the
+ * kernel thread is preempted between the two, the measure only gets longer in nanoseconds, and the
+ * smallest number of nanoseconds per tick of a few tries is the right one.
+ */
+static void calibrate_slice_clock(void) {
+	kernel.mutex_lock(&slice_lock);
+	if (slice_ticks != 0) {
+		kernel.mutex_unlock(&slice_lock);
+		return;
 	}
 
-	new->context.uc_link = &main_thread->context;
-	new->is_zombie = 0;
-	new->joiner = NULL;
-	makecontext(&new->context, (void (*)(void)) func_and_exit, 2, func, func_arg);
+#ifdef __x86_64__
+	double ns_per_tick = 0;
+	for (int i = 0; i < SLICE_CALIBRATION_TRIES; i++) {
+		unsigned long long start_ns = now_ns(), start_ticks = thread_slice_clock(), end_ticks, end_ns;
+		do {
+			end_ticks = thread_slice_clock();
+			end_ns = now_ns();
+		} while (end_ns - start_ns < SLICE_CALIBRATION_NS);
 
-	new->return_value = NULL;
-#ifdef USE_DEBUG
-	new->id = next_thread_id++;
+		double measured = (double) (end_ns - start_ns) / (double) (end_ticks - start_ticks);
+		if (i == 0 || measured < ns_per_tick)
+			ns_per_tick = measured;
+	}
+	slice_ticks_per_ns = 1 / ns_per_tick;
+#else
+	slice_ticks_per_ns = 1;
 #endif
-	new->valgrind_stack = VALGRIND_STACK_REGISTER(new->context.uc_stack.ss_sp,
-	                                              new->context.uc_stack.ss_sp +
-	                                              new->context.uc_stack.ss_size);
-	*new_thread = new;
-	info("%hd was just created, on address %p", new->id, (void *) new)
+	__atomic_store_n(&slice_ticks, (unsigned long long) (slice_us * 1000.0 * slice_ticks_per_ns), __ATOMIC_RELAXED);
+	debug("Time slice: %u us, %llu ticks", slice_us, slice_ticks)
+	kernel.mutex_unlock(&slice_lock);
+}
 
-	STAILQ_INSERT_TAIL(&threads, new, entries);
+int thread_slice_expired(void) {
+	unsigned long long ticks = __atomic_load_n(&slice_ticks, __ATOMIC_RELAXED);
+	if (ticks == 0) {
+		calibrate_slice_clock();
+		ticks = __atomic_load_n(&slice_ticks, __ATOMIC_RELAXED);
+	}
 
+	// If no other thread runs, the current one goes on with a new slice
+	thread_slice_deadline = thread_slice_clock() + ticks;
 	return thread_yield();
 }
 
-static int thread_is_alone(void) {
-	assert(!STAILQ_EMPTY(&threads));
-	return STAILQ_NEXT(STAILQ_FIRST(&threads), entries) == NULL;
-}
+//endregion
+
+//region Thread-specific data
+
+/*
+ * A key is in use while its sequence number is odd. A value belongs to the key if it was set with
+ * the same sequence number: deleting and creating a key again forgets the values of the old one.
+ */
 
 /**
- * Yield to another thread, from current.
- * @param current The current thread. Should be at the end of the queue.
+ * Destructor passes at exit, for the destructors that set values again.
  */
-static int thread_yield_from(struct thread *current) {
-	assert(current);
+#define KEY_DESTRUCTOR_ITERATIONS 4
+
+struct thread_specific {
+	unsigned long sequence;
+	void *value;
+};
 
-	struct thread *next = STAILQ_FIRST(&threads);
-	assert(next);
+static struct {
+	unsigned long sequence;
+	void (*destructor)(void *);
+} keys[THREAD_KEYS_MAX];
 
-	if (next == current) {
-		debug("%hd: No thread to yield to, noop.", thread_self_safe()->id)
-		return 0;
-	} else {
-		debug("yield: %hd -> %hd", current->id, next->id)
-		return swapcontext(&current->context, &next->context);
+/**
+ * The schedulers create and delete keys concurrently.
+ */
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_key_used(thread_key_t key) {
+	return key < THREAD_KEYS_MAX && keys[key].sequence % 2 == 1;
+}
+
+int thread_key_create(thread_key_t *key, void (*destructor)(void *)) {
+	int result = -1;
+
+	kernel.mutex_lock(&keys_lock);
+	for (thread_key_t i = 0; i < THREAD_KEYS_MAX; i++) {
+		if (!is_key_used(i)) {
+			keys[i].destructor = destructor;
+			keys[i].sequence++;
+			*key = i;
+			result = 0;
+			break;
+		}
 	}
+	kernel.mutex_unlock(&keys_lock);
+	return result;
 }
 
-int thread_yield(void) {
-	if (thread_is_alone()) {
-		debug("%hd: No thread to yield to, noop.", thread_self_safe()->id)
-		// No thread to yield to: there is only one thread
-		return 0;
-	} else {
-		struct thread *current = STAILQ_FIRST(&threads);
-		assert(current);
+int thread_key_delete(thread_key_t key) {
+	int result = -1;
+
+	kernel.mutex_lock(&keys_lock);
+	if (is_key_used(key)) {
+		keys[key].sequence++;
+		result = 0;
+	}
+	kernel.mutex_unlock(&keys_lock);
+	return result;
+}
+
+void *thread_getspecific(thread_key_t key) {
+	struct thread_specific *specific = thread_self_safe()->specific;
+
+	if (specific == NULL || !is_key_used(key) || specific[key].sequence != keys[key].sequence)
+		return NULL;
+	return specific[key].value;
+}
 
-		STAILQ_REMOVE_HEAD(&threads, entries);
-		STAILQ_INSERT_TAIL(&threads, current, entries);
+int thread_setspecific(thread_key_t key, const void *value) {
+	struct thread *running = thread_self_safe();
 
-		return thread_yield_from(current);
+	if (!is_key_used(key))
+		return -1;
+
+	if (running->specific == NULL && (running->specific = calloc(THREAD_KEYS_MAX, sizeof *running->specific)) == NULL) {
+		error("Thread-specific data allocation %s", "failed")
+		return -1;
+	}
+
+	running->specific[key].sequence = keys[key].sequence;
+	running->specific[key].value = (void *) value;
+	return 0;
+}
+
+static void run_key_destructors(struct thread *thread) {
+	int again = thread->specific != NULL;
+
+	for (int iteration = 0; again && iteration < KEY_DESTRUCTOR_ITERATIONS; iteration++) {
+		again = 0;
+		for (thread_key_t key = 0; key < THREAD_KEYS_MAX; key++) {
+			struct thread_specific *specific = &thread->specific[key];
+			if (!is_key_used(key) || keys[key].destructor == NULL || specific->value == NULL
+			    || specific->sequence != keys[key].sequence)
+				continue;
+
+			void *value = specific->value;
+			specific->value = NULL;
+			keys[key].destructor(value);
+			again = 1;
+		}
 	}
 }
 
+//endregion
+
 int thread_join(thread_t thread, void **return_value) {
 	struct thread *target = thread;
 	info("%hd: Will join %hd", thread_self_safe()->id, target->id)
+	cancel_point(thread_self_safe());
 
 	if (target->joiner != NULL) {
 		error("%hd: The thread %hd has already been claimed for join by the thread %hd",
@@ -197,18 +1207,24 @@ int thread_join(thread_t thread, void **return_value) {
 
 	if (!target->is_zombie) { // the target hasn't died yet
 		struct thread *current = thread_self_safe();
-		STAILQ_REMOVE_HEAD(&threads, entries); // I'm not alive anymore
+		current->is_blocked = 1; // I'm not alive anymore
+		current->join_target = target;
+		trace(TRACE_BLOCK_JOIN, current->trace_id, target->trace_id);
 
-		if (STAILQ_EMPTY(&threads)) {
+		// Yield to another thread, the one I'm waiting for will add me back to the live threads
+		if (block_current() != 0) {
 			error("%hd: I'm the last thread alive, but I was asked to join %hd, which is not dead. This is impossible.",
 			      current->id, target->id)
-			STAILQ_INSERT_HEAD(&threads, current, entries);
+			current->is_blocked = 0;
+			current->join_target = NULL;
 			target->joiner = NULL;
 			return -1;
 		}
-
-		// Yield to another thread, the one I'm waiting for will add me back to the live threads
-		thread_yield_from(current);
+		// thread_cancel gave up the join: the target can be joined by another thread
+		if (current->is_interrupted) {
+			current->is_interrupted = 0;
+			cancel_exit();
+		}
 	}
 	assert(target->is_zombie);
 
@@ -217,7 +1233,7 @@ int thread_join(thread_t thread, void **return_value) {
 		*return_value = target->return_value;
 	}
 
-	if (target != main_thread)
+	if (target != target->sched->main_thread)
 		free_thread(target);
 	else
 		debug("Detected and cancelled an attempt to free %s.", "the main thread")
@@ -226,41 +1242,152 @@ int thread_join(thread_t thread, void **return_value) {
 }
 
 void thread_exit(void *return_value) {
-	struct thread *current = STAILQ_FIRST(&threads);
-	assert(current);
+	struct thread_sched *sched = sched_local();
+	struct thread *current = sched->running;
+
+	// The cleanup handlers may hit cancellation points: they don't act anymore
+	__atomic_store_n(&current->cancel_state, CANCEL_EXITING, __ATOMIC_RELAXED);
+	while (current->cleanups != NULL) {
+		struct thread_cleanup *cleanup = current->cleanups;
+		current->cleanups = cleanup->next;
+		cleanup->routine(cleanup->arg);
+	}
+	run_key_destructors(current);
 
 	current->return_value = return_value;
-	STAILQ_REMOVE_HEAD(&threads, entries);
 	current->is_zombie = 1;
 
 	if (current->joiner != NULL)
-		STAILQ_INSERT_TAIL(&threads, current->joiner, entries);
+		wake_up(current->joiner);
 
+	sched->stats.threads_exited++;
+	sched->live_threads--;
+	trace(TRACE_EXIT, current->trace_id, 0);
 	info("%hd has died with return value %p.", current->id, return_value)
 
-	if (STAILQ_EMPTY(&threads)) {
+	sched->ops->on_block(sched, current);
+	struct thread *next = pick_next_or_wait(sched);
+	if (next == NULL) {
 		info("All threads are dead: %s", "forcing termination")
-		current_to_free = current;
-		setcontext(&main_thread->context);
+		sched->current_to_free = current;
+		sched->running = sched->main_thread;
+		setcontext(&sched->main_thread->context);
 	} else {
-		struct thread *next = STAILQ_FIRST(&threads);
 		debug("The execution will now move to %hd.", next->id)
+		account_switch(sched, current, next);
+		trace(TRACE_SWITCH, current->trace_id, next->trace_id);
+		sched->running = next;
 		swapcontext(&current->context, &next->context);
 	}
 }
 
+//region Cancellation
+
+void cancel_exit(void) {
+	debug("%hd: Cancelled", thread_self_safe()->id)
+	thread_exit(THREAD_CANCELED);
+	__builtin_unreachable();
+}
+
+/**
+ * Take a cancelled thread out of its wait: it acts on the cancellation when it runs.
+ * On the kernel thread of its scheduler.
+ */
+static void interrupt(void *_target) {
+	struct thread *target = _target;
+
+	// Running or runnable: it acts at its next cancellation point
+	if (!target->is_blocked || target->is_zombie)
+		return;
+
+	if (target->wait_queue != NULL) {
+		TAILQ_REMOVE(target->wait_queue, target, entries);
+		target->is_interrupted = 1;
+		wake_up(target);
+	} else if (target->join_target != NULL) {
+		target->join_target->joiner = NULL;
+		target->is_interrupted = 1;
+		wake_up(target);
+	} else if (target->uring_request != NULL) {
+		// Its completion wakes it up
+		uring_cancel(target->sched, target->uring_request);
+	} else {
+		// Parked, or waiting for an offloaded call, which can't be interrupted
+		thread_unpark(target);
+	}
+}
+
+int thread_cancel(thread_t thread) {
+	struct thread *target = thread;
+	int state = CANCEL_NONE;
+
+	if (!__atomic_compare_exchange_n(&target->cancel_state, &state, CANCEL_PENDING, 0, __ATOMIC_ACQ_REL,
+	                                 __ATOMIC_RELAXED))
+		return 0;
+
+	info("%hd: Cancelling %hd", thread_self_safe()->id, target->id)
+	if (target->sched == sched_local()) {
+		interrupt(target);
+		return 0;
+	}
+	return thread_sched_post(target->sched, interrupt, target);
+}
+
+void thread_testcancel(void) {
+	cancel_point(thread_self_safe());
+}
+
+void thread_cleanup_register(thread_cleanup_t *cleanup) {
+	struct thread *current = thread_self_safe();
+
+	cleanup->next = current->cleanups;
+	current->cleanups = cleanup;
+}
+
+void thread_cleanup_unregister(thread_cleanup_t *cleanup, int execute) {
+	struct thread *current = thread_self_safe();
+
+	// The handlers are pushed and popped in the same block: this one is the innermost
+	current->cleanups = cleanup->next;
+	if (execute)
+		cleanup->routine(cleanup->arg);
+}
+
+//endregion
+
 //region Mutex
 
+/**
+ * Add a mutex to those its new owner holds.
+ */
+static void hold(struct thread *owner, thread_mutex_t *mutex) {
+	mutex->owner = owner;
+	mutex->next_held = owner->held_mutexes;
+	owner->held_mutexes = mutex;
+}
+
+static void release_held(struct thread *owner, thread_mutex_t *mutex) {
+	// Most often the last one locked, at the head
+	for (struct thread_mutex **link = &owner->held_mutexes; *link != NULL; link = &(*link)->next_held) {
+		if (*link == mutex) {
+			*link = mutex->next_held;
+			break;
+		}
+	}
+	mutex->next_held = NULL;
+}
+
 int thread_mutex_init(thread_mutex_t *mutex) {
 	mutex->owner = NULL;
-	STAILQ_INIT(&mutex->waiting_queue);
+	TAILQ_INIT(&mutex->waiting_queue);
+	mutex->next_held = NULL;
 	debug("Created mutex %p", (void *) mutex)
 	return 0;
 }
 
 int thread_mutex_destroy(thread_mutex_t *mutex) {
 	debug("Destroying mutex %p", (void *) mutex)
-	if (!STAILQ_EMPTY(&mutex->waiting_queue)) {
+	if (!TAILQ_EMPTY(&mutex->waiting_queue)) {
 		warn("Attempted to destroy a owner mutex: %p", (void *) mutex)
 		thread_mutex_unlock(mutex);
 		perror("Ebusy"); //FIXME: faire planter
@@ -268,36 +1395,333 @@ int thread_mutex_destroy(thread_mutex_t *mutex) {
 	return 0;
 }
 
-int thread_mutex_lock(thread_mutex_t *mutex) {
+/**
+ * Inlined, so the profiler sees the caller of thread_mutex_lock or thread_cond_wait.
+ * @param is_cancel_point 0 to keep waiting when thread_cancel interrupts the wait
+ */
+static inline __attribute__((always_inline)) int lock(thread_mutex_t *mutex, int is_cancel_point) {
+	int profiled = lockprof_sample(), contended = 0;
+	unsigned long long wait_start = profiled ? now_ns() : 0;
+
+	if (is_cancel_point)
+		cancel_point(thread_self_safe());
+
 	do {
 		if (mutex->owner == NULL) {
 			debug("%d: Locking mutex %p", thread_self_safe()->id, (void *) mutex)
-			mutex->owner = thread_self();
+			hold(thread_self_safe(), mutex);
+			trace(TRACE_MUTEX_LOCK, thread_self_safe()->trace_id, (uintptr_t) mutex);
 		} else if (mutex->owner == thread_self_safe()) {
 			// Nothing to do, I'm already the owner
 		} else {
 			struct thread *current = thread_self_safe();
 			debug("%d: Mutex %p is already owner", current->id, (void *) mutex)
-			STAILQ_REMOVE(&threads, current, thread, entries);
-			STAILQ_INSERT_TAIL(&mutex->waiting_queue,
-			                   current,
-			                   entries);
-			thread_yield_from(current);
+			current->is_blocked = 1;
+			contended = 1;
+			trace(TRACE_BLOCK_MUTEX, current->trace_id, (uintptr_t) mutex);
+			TAILQ_INSERT_TAIL(&mutex->waiting_queue,
+			                  current,
+			                  entries);
+			// The owner runs with my priority at least, until it unlocks
+			current->waiting_for = mutex;
+			// Same layout as a thread_queue
+			current->wait_queue = (struct thread_queue *) &mutex->waiting_queue;
+			update_priority(mutex->owner);
+			if (block_current() != 0) {
+				error("%hd: I'm the last thread alive, but I'm waiting for mutex %p. This is a deadlock.",
+				      current->id, (void *) mutex)
+				TAILQ_REMOVE(&mutex->waiting_queue, current, entries);
+				current->is_blocked = 0;
+				current->waiting_for = NULL;
+				current->wait_queue = NULL;
+				update_priority(mutex->owner);
+				return -1;
+			}
+			// Taken out of the queue by thread_cancel, without the mutex
+			if (current->is_interrupted) {
+				current->is_interrupted = 0;
+				current->waiting_for = NULL;
+				update_priority(mutex->owner);
+				if (is_cancel_point)
+					cancel_exit();
+			}
 		}
 	} while (mutex->owner != thread_self());
+
+	if (profiled)
+		lockprof_acquired(mutex, __builtin_return_address(0), contended, now_ns() - wait_start, thread_self_safe());
 	return 0;
 }
 
+int thread_mutex_lock(thread_mutex_t *mutex) {
+	return lock(mutex, 1);
+}
+
 int thread_mutex_unlock(thread_mutex_t *mutex) {
+	struct thread *running = thread_self_safe();
 	debug("%d: Unlocking mutex %p", thread_self_safe()->id, (void *) mutex)
-	if (!STAILQ_EMPTY(&mutex->waiting_queue)) {
-		struct thread *next_thread = STAILQ_FIRST(&mutex->waiting_queue);
-		STAILQ_REMOVE_HEAD(&mutex->waiting_queue, entries);
-		STAILQ_INSERT_TAIL(&threads, next_thread, entries);
-		mutex->owner = next_thread;
+	trace(TRACE_MUTEX_UNLOCK, running->trace_id, (uintptr_t) mutex);
+	if (running->lockprof_mutex == mutex)
+		lockprof_released(running);
+	struct thread *owner = mutex->owner;
+	if (owner != NULL)
+		release_held(owner, mutex);
+	if (!TAILQ_EMPTY(&mutex->waiting_queue)) {
+		struct thread *next_thread = TAILQ_FIRST(&mutex->waiting_queue);
+		TAILQ_REMOVE(&mutex->waiting_queue, next_thread, entries);
+		next_thread->waiting_for = NULL;
+		wake_up(next_thread);
+		hold(next_thread, mutex);
+		trace(TRACE_MUTEX_LOCK, next_thread->trace_id, (uintptr_t) mutex); // handed over
+		// The waiters left now boost the new owner
+		if (!TAILQ_EMPTY(&mutex->waiting_queue))
+			update_priority(next_thread);
 	} else {
 		mutex->owner = NULL;
 	}
+	// Undo the boost from the waiters of this mutex
+	if (owner != NULL && owner->priority != owner->base_priority)
+		update_priority(owner);
+	return 0;
+}
+
+//endregion
+
+//region Condition variables
+
+int thread_cond_init(thread_cond_t *cond) {
+	TAILQ_INIT(&cond->waiting_queue);
+	debug("Created condition %p", (void *) cond)
+	return 0;
+}
+
+int thread_cond_destroy(thread_cond_t *cond) {
+	debug("Destroying condition %p", (void *) cond)
+	if (!TAILQ_EMPTY(&cond->waiting_queue)) {
+		warn("Attempted to destroy a condition some threads are waiting for: %p", (void *) cond)
+		return -1;
+	}
+	return 0;
+}
+
+int thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex) {
+	struct thread *current = thread_self_safe();
+	cancel_point(current);
+	thread_mutex_unlock(mutex);
+	TAILQ_INSERT_TAIL(&cond->waiting_queue, current, entries);
+	current->is_blocked = 1; // I'm not alive anymore
+	current->wait_queue = (struct thread_queue *) &cond->waiting_queue;
+	trace(TRACE_BLOCK_COND, current->trace_id, (uintptr_t) cond);
+
+	// Yield to another thread, thread_cond_signal will add me back to the live threads
+	if (block_current() != 0) {
+		error("%hd: I'm the last thread alive, but I was asked to wait for %p. Nobody can signal it.",
+		      current->id, (void *) cond)
+		TAILQ_REMOVE(&cond->waiting_queue, current, entries);
+		current->is_blocked = 0;
+		current->wait_queue = NULL;
+		current->is_interrupted = 0;
+		lock(mutex, 0);
+		return -1;
+	}
+
+	// With the mutex locked again, even when woken up by thread_cancel: its cleanup handlers expect it
+	int is_interrupted = current->is_interrupted;
+	current->is_interrupted = 0;
+	int err = lock(mutex, 0);
+	if (is_interrupted)
+		cancel_exit();
+	return err;
+}
+
+int thread_cond_signal(thread_cond_t *cond) {
+	if (!TAILQ_EMPTY(&cond->waiting_queue)) {
+		struct thread *next_thread = TAILQ_FIRST(&cond->waiting_queue);
+		TAILQ_REMOVE(&cond->waiting_queue, next_thread, entries);
+		wake_up(next_thread);
+	}
+	return 0;
+}
+
+int thread_cond_broadcast(thread_cond_t *cond) {
+	while (!TAILQ_EMPTY(&cond->waiting_queue)) {
+		// When woken threads are inserted right after the current one, start from the last waiter
+		// so the first one is still the first to run
+		struct thread *next_thread = thread_self_safe()->sched->wakeup_policy == THREAD_WAKEUP_NEXT
+		                             ? TAILQ_LAST(&cond->waiting_queue, waiting_queue)
+		                             : TAILQ_FIRST(&cond->waiting_queue);
+		TAILQ_REMOVE(&cond->waiting_queue, next_thread, entries);
+		wake_up(next_thread);
+	}
+	return 0;
+}
+
+//endregion
+
+//region Generators
+
+#ifdef GEN_FAST_SWITCH
+
+/*
+ * gen_switch(void **save, void *restore): push the callee-saved registers, store the stack pointer
+ * in *save, load restore as the stack pointer and pop the registers saved there.
+ */
+void gen_switch(void **save, void *restore);
+__asm__(
+		".text\n"
+		".type gen_switch, @function\n"
+		"gen_switch:\n"
+		"	pushq %rbp\n"
+		"	pushq %rbx\n"
+		"	pushq %r12\n"
+		"	pushq %r13\n"
+		"	pushq %r14\n"
+		"	pushq %r15\n"
+		"	subq $8, %rsp\n"
+		"	stmxcsr (%rsp)\n"
+		"	fnstcw 4(%rsp)\n"
+		"	movq %rsp, (%rdi)\n"
+		"	movq %rsi, %rsp\n"
+		"	ldmxcsr (%rsp)\n"
+		"	fldcw 4(%rsp)\n"
+		"	addq $8, %rsp\n"
+		"	popq %r15\n"
+		"	popq %r14\n"
+		"	popq %r13\n"
+		"	popq %r12\n"
+		"	popq %rbx\n"
+		"	popq %rbp\n"
+		"	ret\n"
+		".size gen_switch, .-gen_switch\n"
+);
+
+static void gen_start(void);
+
+/**
+ * Prepare the stack so the first gen_switch to it "returns" into gen_start.
+ */
+static void gen_init_context(struct thread_gen *gen) {
+	unsigned long *top = (unsigned long *) (((unsigned long) gen->stack + STACK_SIZE) & ~15UL);
+	unsigned int control_words[2];
+
+	__asm__ volatile("stmxcsr %0\n\tfnstcw %1" : "=m"(control_words[0]), "=m"(control_words[1]));
+
+	*--top = 0; // gen_start never returns
+	*--top = (unsigned long) gen_start;
+	for (int i = 0; i < 6; i++)
+		*--top = 0; // rbp, rbx, r12 to r15
+	top--;
+	((unsigned int *) top)[0] = control_words[0];
+	((unsigned int *) top)[1] = control_words[1];
+	gen->stack_pointer = top;
+}
+
+#define gen_switch_in(gen) gen_switch(&(gen)->caller_stack_pointer, (gen)->stack_pointer)
+#define gen_switch_out(gen) gen_switch(&(gen)->stack_pointer, (gen)->caller_stack_pointer)
+
+#else // GEN_FAST_SWITCH
+
+static void gen_start(void);
+
+static void gen_init_context(struct thread_gen *gen) {
+	if (getcontext(&gen->context) == -1) {
+		error("Failed to get context: %p", (void *) gen)
+		exit(1);
+	}
+
+	gen->context.uc_stack.ss_size = STACK_SIZE;
+	gen->context.uc_stack.ss_sp = gen->stack;
+	gen->context.uc_link = NULL;
+	makecontext(&gen->context, gen_start, 0);
+}
+
+#define gen_switch_in(gen) swapcontext(&(gen)->caller, &(gen)->context)
+#define gen_switch_out(gen) swapcontext(&(gen)->context, &(gen)->caller)
+
+#endif // GEN_FAST_SWITCH
+
+static void gen_start(void) {
+	// The thread that resumed us has just set itself as our runner
+	struct thread_gen *gen = thread_self_safe()->generator;
+
+	gen->value = gen->func(gen->func_arg);
+	gen->is_done = 1;
+	debug("Generator %p has returned %p", (void *) gen, gen->value)
+
+	// thread_gen_yield may have changed the running thread: find the current generator again
+	gen = thread_self_safe()->generator;
+	gen_switch_out(gen);
+	abort(); // a finished generator is never resumed
+}
+
+int thread_gen_create(thread_gen_t *new_gen, void *(*func)(void *), void *func_arg) {
+	struct thread_gen *new = malloc(sizeof *new);
+	if (new == NULL) {
+		error("New generator allocation %s", "failed")
+		return -1;
+	}
+
+	new->stack = malloc(STACK_SIZE);
+	if (new->stack == NULL) {
+		error("New generator stack allocation failed: %p", (void *) new)
+		free(new);
+		return -1;
+	}
+
+	new->func = func;
+	new->func_arg = func_arg;
+	new->parent = NULL;
+	new->value = NULL;
+	new->is_done = 0;
+	gen_init_context(new);
+
+	new->valgrind_stack = VALGRIND_STACK_REGISTER(new->stack, (char *) new->stack + STACK_SIZE);
+	*new_gen = new;
+	debug("Generator %p was just created", (void *) new)
+	return 0;
+}
+
+void *thread_gen_resume(thread_gen_t _gen, void *in) {
+	struct thread_gen *gen = _gen;
+	struct thread *current = thread_self_safe();
+
+	if (gen->is_done) {
+		warn("Generator %p has already returned", (void *) gen)
+		return NULL;
+	}
+
+	gen->value = in;
+	gen->parent = current->generator;
+	current->generator = gen;
+	gen_switch_in(gen);
+
+	// The generator may have yielded from another thread than the one that resumed it
+	current = thread_self_safe();
+	current->generator = gen->parent;
+	return gen->value;
+}
+
+void *thread_gen_yield(void *out) {
+	struct thread_gen *gen = thread_self_safe()->generator;
+	assert(gen);
+
+	gen->value = out;
+	gen_switch_out(gen);
+	return gen->value;
+}
+
+int thread_gen_is_done(thread_gen_t gen) {
+	return ((struct thread_gen *) gen)->is_done;
+}
+
+int thread_gen_destroy(thread_gen_t _gen) {
+	struct thread_gen *gen = _gen;
+
+	if (gen->valgrind_stack != -1)
+		VALGRIND_STACK_DEREGISTER(gen->valgrind_stack);
+
+	free(gen->stack);
+	free(gen);
 	return 0;
 }
 
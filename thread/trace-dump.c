@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "trace.h"
+
+/*
+ * Convert a file written by thread_trace_dump (or THREAD_TRACE) to the Chrome trace format,
+ * which chrome://tracing and Perfetto open.
+ *
+ * Each scheduler (worker) is a process and each thread a track in it: the slices are the periods
+ * during which it runs, the other events are instants.
+ *
+ * usage: thread-trace-dump TRACE [OUTPUT.json]
+ */
+
+static const char *const block_names[] = {
+		[TRACE_BLOCK_JOIN] = "join",
+		[TRACE_BLOCK_MUTEX] = "mutex",
+		[TRACE_BLOCK_COND] = "cond",
+		[TRACE_BLOCK_OFFLOAD] = "offload",
+		[TRACE_BLOCK_IO] = "io",
+		[TRACE_BLOCK_PARK] = "park",
+};
+
+static struct trace_header header;
+static double ns_per_tick = 1;
+
+/**
+ * @return The timestamp in microseconds since tracing started
+ */
+static double to_us(uint64_t tsc) {
+	return (double) (int64_t) (tsc - header.start_tsc) * ns_per_tick / 1000;
+}
+
+static int first_event = 1;
+
+static void separator(FILE *out) {
+	fprintf(out, first_event ? "\n" : ",\n");
+	first_event = 0;
+}
+
+static void instant(FILE *out, const struct trace_event *event, const char *name, const char *args_format, uint64_t arg) {
+	separator(out);
+	fprintf(out, "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": %u, \"tid\": %" PRIu32,
+	        name, to_us(event->tsc), event->worker, event->thread);
+	if (args_format != NULL) {
+		fprintf(out, ", \"args\": {");
+		fprintf(out, args_format, arg);
+		fprintf(out, "}");
+	}
+	fprintf(out, "}");
+}
+
+static void slice(FILE *out, unsigned int worker, uint32_t thread, uint64_t start, uint64_t end) {
+	separator(out);
+	fprintf(out, "{\"name\": \"running\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %u, \"tid\": %" PRIu32 "}",
+	        to_us(start), to_us(end) - to_us(start), worker, thread);
+}
+
+/**
+ * The state of a worker: the thread it runs, and since when. The first switch tells who was running.
+ */
+struct worker {
+	uint32_t running;
+	uint64_t since;
+	int known, seen;
+};
+
+/**
+ * A thread seen on a worker, to name its track.
+ */
+struct track {
+	uint16_t worker;
+	uint32_t thread;
+};
+
+static int compare_tracks(const void *a, const void *b) {
+	const struct track *x = a, *y = b;
+	if (x->worker != y->worker)
+		return x->worker < y->worker ? -1 : 1;
+	return (x->thread > y->thread) - (x->thread < y->thread);
+}
+
+static void thread_name(FILE *out, unsigned int worker, uint32_t thread) {
+	separator(out);
+	if (thread == 0)
+		fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %u, \"tid\": 0, \"args\": {\"name\": \"main\"}}",
+		        worker);
+	else
+		fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %u, \"tid\": %" PRIu32
+		             ", \"args\": {\"name\": \"thread %" PRIu32 "\"}}", worker, thread, thread);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s TRACE [OUTPUT.json]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE *in = fopen(argv[1], "r");
+	if (in == NULL) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&header, sizeof header, 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0
+	    || header.version != TRACE_VERSION || header.event_size != sizeof(struct trace_event)) {
+		fprintf(stderr, "%s: not a trace file, or from another version\n", argv[1]);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	struct trace_event *events = malloc(header.events * sizeof *events);
+	if (header.events > 0 && (events == NULL || fread(events, sizeof *events, header.events, in) != header.events)) {
+		fprintf(stderr, "%s: truncated trace\n", argv[1]);
+		free(events);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+	fclose(in);
+
+	FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+	if (out == NULL) {
+		perror(argv[2]);
+		free(events);
+		return EXIT_FAILURE;
+	}
+
+	if (header.end_tsc > header.start_tsc)
+		ns_per_tick = (double) (header.end_ns - header.start_ns) / (header.end_tsc - header.start_tsc);
+
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"lost_events\": %" PRIu64 "}, \"traceEvents\": [",
+	        header.lost);
+
+	struct worker *workers = calloc(UINT16_MAX + 1, sizeof *workers);
+	/* At most two tracks per event: the thread, and the one it switches to */
+	struct track *tracks = malloc((2 * header.events + 1) * sizeof *tracks);
+	uint64_t nb_tracks = 0;
+	char buffer[64];
+
+	if (workers == NULL || tracks == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		free(workers);
+		free(tracks);
+		free(events);
+		if (out != stdout)
+			fclose(out);
+		return EXIT_FAILURE;
+	}
+
+	for (uint64_t i = 0; i < header.events; i++) {
+		const struct trace_event *event = &events[i];
+		struct worker *worker = &workers[event->worker];
+		if (!worker->seen) {
+			worker->since = event->tsc;
+			worker->seen = 1;
+		}
+		tracks[nb_tracks++] = (struct track) {event->worker, event->thread};
+
+		switch (event->type) {
+			case TRACE_SWITCH:
+				slice(out, event->worker, event->thread, worker->since, event->tsc);
+				worker->running = (uint32_t) event->arg;
+				worker->since = event->tsc;
+				worker->known = 1;
+				tracks[nb_tracks++] = (struct track) {event->worker, worker->running};
+				break;
+			case TRACE_CREATE:
+				instant(out, event, "create", "\"thread\": %" PRIu64, event->arg);
+				break;
+			case TRACE_BLOCK_JOIN:
+				instant(out, event, "block join", "\"thread\": %" PRIu64, event->arg);
+				break;
+			case TRACE_BLOCK_MUTEX:
+			case TRACE_BLOCK_COND:
+			case TRACE_BLOCK_OFFLOAD:
+				snprintf(buffer, sizeof buffer, "block %s", block_names[event->type]);
+				instant(out, event, buffer, "\"object\": \"0x%" PRIx64 "\"", event->arg);
+				break;
+			case TRACE_BLOCK_IO:
+				instant(out, event, "block io", "\"fd\": %" PRIu64, event->arg);
+				break;
+			case TRACE_BLOCK_PARK:
+				instant(out, event, "block park", NULL, 0);
+				break;
+			case TRACE_WAKE:
+				instant(out, event, "wake", "\"thread\": %" PRIu64, event->arg);
+				break;
+			case TRACE_EXIT:
+				instant(out, event, "exit", NULL, 0);
+				break;
+			case TRACE_MUTEX_LOCK:
+				instant(out, event, "lock", "\"mutex\": \"0x%" PRIx64 "\"", event->arg);
+				break;
+			case TRACE_MUTEX_UNLOCK:
+				instant(out, event, "unlock", "\"mutex\": \"0x%" PRIx64 "\"", event->arg);
+				break;
+			default:
+				fprintf(stderr, "%s: unknown event type %u, ignored\n", argv[1], event->type);
+		}
+	}
+
+	// The last run of each worker lasts until its last event
+	for (uint64_t i = header.events; i > 0; i--) {
+		struct worker *worker = &workers[events[i - 1].worker];
+		if (worker->known) {
+			slice(out, events[i - 1].worker, worker->running, worker->since, events[i - 1].tsc);
+			worker->known = 0;
+		}
+	}
+
+	qsort(tracks, nb_tracks, sizeof *tracks, compare_tracks);
+	for (uint64_t i = 0; i < nb_tracks; i++)
+		if (i == 0 || compare_tracks(&tracks[i - 1], &tracks[i]) != 0)
+			thread_name(out, tracks[i].worker, tracks[i].thread);
+
+	fprintf(out, "\n]}\n");
+	free(workers);
+	free(tracks);
+	free(events);
+
+	if (out != stdout && fclose(out) != 0) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
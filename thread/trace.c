@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "trace.h"
+#include "debug.h"
+
+/**
+ * The ring of a scheduler, and where its kernel thread looks for it (NULL once the scheduler is freed).
+ * Only the kernel thread of the scheduler changes its ring, at a switch point (see sync_ring): no other
+ * one can free the events while an event is being recorded.
+ */
+struct trace_entry {
+	struct trace_ring ring;
+	struct trace_ring **slot;
+	struct thread_sched *sched;
+	/** The tracing session the ring was emptied for. */
+	unsigned long generation;
+	/** Its scheduler has stopped recording in it: the events can be read. */
+	int is_stopped;
+	struct trace_entry *next;
+};
+
+THREAD_LOCAL struct trace_ring *trace_ring = NULL;
+
+/**
+ * The rings are added and started by the kernel threads of the schedulers, under the lock.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_entry *entries = NULL;
+static uint64_t capacity = 0;
+static int is_tracing = 0;
+static unsigned long generation = 0;
+static uint64_t start_tsc, start_ns;
+
+/**
+ * Where the trace is written at exit, from THREAD_TRACE.
+ */
+static const char *exit_path = NULL;
+
+/**
+ * (Re)allocate the events of a ring, and empty it.
+ * @return 0 on success, -1 on failure
+ */
+static int allocate(struct trace_entry *entry) {
+	struct trace_event *new = realloc(entry->ring.events, capacity * sizeof *new);
+	if (new == NULL) {
+		error("Trace allocation of %lu events failed", (unsigned long) capacity)
+		return -1;
+	}
+
+	entry->ring.events = new;
+	entry->ring.mask = capacity - 1;
+	entry->ring.head = 0;
+	entry->generation = generation;
+	return 0;
+}
+
+/**
+ * Start or stop recording in the ring of the current kernel thread's scheduler, as the last
+ * thread_trace_start or thread_trace_stop asked, under the lock.
+ * @return 0 on success, -1 if the ring can't be allocated
+ */
+static int sync_ring(struct trace_entry *entry) {
+	trace_ring = NULL;
+	entry->is_stopped = 1;
+	if (!is_tracing)
+		return 0;
+	if (entry->generation != generation && allocate(entry) != 0)
+		return -1;
+
+	entry->is_stopped = 0;
+	trace_ring = &entry->ring;
+	return 0;
+}
+
+/**
+ * Posted to the schedulers of the other kernel threads.
+ */
+static void sync_posted(void *entry) {
+	kernel.mutex_lock(&lock);
+	if (((struct trace_entry *) entry)->sched != NULL)
+		sync_ring(entry);
+	kernel.mutex_unlock(&lock);
+}
+
+/**
+ * Have every scheduler sync its ring, at its next switch point for those of the other kernel threads.
+ * @return 0 on success, -1 if the ring of the current kernel thread can't be allocated
+ */
+static int sync_rings(void) {
+	int failed = 0;
+
+	for (struct trace_entry *entry = entries; entry != NULL; entry = entry->next) {
+		if (entry->sched == NULL)
+			continue;
+		if (entry->sched == local_sched)
+			failed |= sync_ring(entry) != 0;
+		else if (thread_sched_post(entry->sched, sync_posted, entry) != 0)
+			warn("Cannot reach the scheduler %u to change its trace ring", entry->sched->id)
+	}
+	return failed ? -1 : 0;
+}
+
+int thread_trace_start(unsigned long events) {
+	struct trace_entry **link, *entry;
+
+	if (events == 0)
+		events = TRACE_DEFAULT_EVENTS;
+	sched_local();
+
+	kernel.mutex_lock(&lock);
+	capacity = 1;
+	while (capacity < events)
+		capacity <<= 1;
+
+	// The rings of the freed schedulers only have older events, and nobody records in them
+	for (link = &entries; (entry = *link) != NULL;) {
+		if (entry->sched == NULL) {
+			*link = entry->next;
+			free(entry->ring.events);
+			free(entry);
+			continue;
+		}
+		link = &entry->next;
+	}
+
+	generation++;
+	is_tracing = 1;
+	start_tsc = trace_clock();
+	start_ns = now_ns();
+	int failed = sync_rings();
+	if (failed)
+		is_tracing = 0;
+	kernel.mutex_unlock(&lock);
+
+	if (failed)
+		return -1;
+	info("Tracing the last %lu events of each scheduler", (unsigned long) capacity)
+	return 0;
+}
+
+int thread_trace_stop(void) {
+	kernel.mutex_lock(&lock);
+	is_tracing = 0;
+	sync_rings();
+	kernel.mutex_unlock(&lock);
+	return 0;
+}
+
+/**
+ * @return Whether the events of a ring can be read: nobody records in it anymore, or the caller does
+ */
+static int is_readable(const struct trace_entry *entry) {
+	return entry->ring.events != NULL && (entry->sched == NULL || entry->is_stopped || entry->sched == local_sched);
+}
+
+/**
+ * @return The index of the oldest event still in a ring
+ */
+static uint64_t first_event(const struct trace_ring *ring) {
+	uint64_t size = ring->mask + 1;
+	return ring->head > size ? ring->head - size : 0;
+}
+
+int thread_trace_dump(const char *path) {
+	struct trace_header header = {
+			.magic = TRACE_MAGIC,
+			.version = TRACE_VERSION,
+			.event_size = sizeof(struct trace_event),
+	};
+	unsigned int rings = 0, skipped = 0;
+	int failed = 0;
+
+	kernel.mutex_lock(&lock);
+	for (struct trace_entry *entry = entries; entry != NULL; entry = entry->next) {
+		if (!is_readable(entry)) {
+			skipped += entry->ring.events != NULL;
+			continue;
+		}
+		rings++;
+		header.events += entry->ring.head - first_event(&entry->ring);
+		header.lost += first_event(&entry->ring);
+	}
+	if (skipped > 0)
+		warn("%u schedulers still record events, or haven't switched since thread_trace_stop: "
+		     "their rings are left out of %s", skipped, path)
+	if (rings == 0) {
+		kernel.mutex_unlock(&lock);
+		warn("Nothing to dump to %s, tracing has never started", path)
+		return -1;
+	}
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		kernel.mutex_unlock(&lock);
+		error("Cannot open the trace file %s", path)
+		return -1;
+	}
+
+	header.start_tsc = start_tsc;
+	header.start_ns = start_ns;
+	header.end_tsc = trace_clock();
+	header.end_ns = now_ns();
+	failed |= fwrite(&header, sizeof header, 1, file) != 1;
+
+	// Merge the rings, each one is oldest first
+	uint64_t *next = calloc(rings, sizeof *next);
+	struct trace_ring **sorted = malloc(rings * sizeof *sorted);
+	if (next == NULL || sorted == NULL) {
+		failed = 1;
+	} else {
+		unsigned int n = 0;
+		for (struct trace_entry *entry = entries; entry != NULL; entry = entry->next) {
+			if (is_readable(entry)) {
+				next[n] = first_event(&entry->ring);
+				sorted[n++] = &entry->ring;
+			}
+		}
+
+		for (uint64_t written = 0; written < header.events && !failed; written++) {
+			unsigned int oldest = rings;
+			for (unsigned int i = 0; i < rings; i++)
+				if (next[i] < sorted[i]->head
+				    && (oldest == rings || sorted[i]->events[next[i] & sorted[i]->mask].tsc
+				                           < sorted[oldest]->events[next[oldest] & sorted[oldest]->mask].tsc))
+					oldest = i;
+			failed |= fwrite(&sorted[oldest]->events[next[oldest]++ & sorted[oldest]->mask],
+			                 sizeof(struct trace_event), 1, file) != 1;
+		}
+	}
+	free(next);
+	free(sorted);
+	kernel.mutex_unlock(&lock);
+	failed |= fclose(file) != 0;
+
+	if (failed) {
+		error("Failed to write the trace file %s", path)
+		return -1;
+	}
+
+	info("Dumped %lu events to %s", (unsigned long) header.events, path)
+	return 0;
+}
+
+void trace_register(struct thread_sched *sched) {
+	struct trace_entry *entry = calloc(1, sizeof *entry);
+	if (entry == NULL) {
+		error("Trace ring allocation %s", "failed")
+		return;
+	}
+	entry->ring.worker = (uint16_t) sched->id;
+	entry->slot = &trace_ring;
+	entry->sched = sched;
+	entry->is_stopped = 1;
+
+	kernel.mutex_lock(&lock);
+	entry->next = entries;
+	entries = entry;
+	sync_ring(entry);
+	kernel.mutex_unlock(&lock);
+}
+
+void trace_unregister(struct thread_sched *sched) {
+	kernel.mutex_lock(&lock);
+	for (struct trace_entry *entry = entries; entry != NULL; entry = entry->next) {
+		if (entry->sched == sched) {
+			__atomic_store_n(entry->slot, NULL, __ATOMIC_RELEASE);
+			entry->slot = NULL;
+			entry->sched = NULL;
+		}
+	}
+	kernel.mutex_unlock(&lock);
+}
+
+void trace_init(void) {
+	exit_path = getenv("THREAD_TRACE");
+	if (exit_path == NULL)
+		return;
+
+	const char *events = getenv("THREAD_TRACE_EVENTS");
+	thread_trace_start(events != NULL ? strtoul(events, NULL, 10) : 0);
+}
+
+void trace_exit(void) {
+	thread_trace_stop();
+	if (exit_path != NULL)
+		thread_trace_dump(exit_path);
+
+	// The rings of the kernel threads still running are left to them
+	kernel.mutex_lock(&lock);
+	while (entries != NULL) {
+		struct trace_entry *entry = entries;
+		entries = entry->next;
+		if (entry->sched == NULL || entry->is_stopped || entry->sched == local_sched) {
+			if (entry->slot != NULL)
+				__atomic_store_n(entry->slot, NULL, __ATOMIC_RELEASE);
+			free(entry->ring.events);
+			free(entry);
+		}
+	}
+	kernel.mutex_unlock(&lock);
+}
@@ -0,0 +1,146 @@
+#ifndef OS_S8_TRACE_H
+#define OS_S8_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+/*
+ * Binary event tracer.
+ *
+ * Events are written to a ring buffer that keeps the most recent ones: recording is a timestamp and
+ * a 24-byte store, and a single test of a pointer when tracing is disabled. Each scheduler has its
+ * own ring, which only its kernel thread writes to, so no lock nor atomic operation is needed.
+ *
+ * The file written by thread_trace_dump is a trace_header followed by the events of all the rings,
+ * oldest first.
+ * thread-trace-dump converts it to the Chrome trace format.
+ */
+
+#define TRACE_MAGIC "THRTRACE"
+#define TRACE_VERSION 1
+
+/**
+ * Capacity of the ring when none is given.
+ */
+#define TRACE_DEFAULT_EVENTS (1UL << 16)
+
+enum trace_type {
+	/** arg: the new thread. */
+	TRACE_CREATE,
+	/** arg: the thread that runs next. */
+	TRACE_SWITCH,
+	/** arg: the joined thread. */
+	TRACE_BLOCK_JOIN,
+	/** arg: the address of the mutex. */
+	TRACE_BLOCK_MUTEX,
+	/** arg: the address of the condition. */
+	TRACE_BLOCK_COND,
+	/** arg: the thread made runnable. */
+	TRACE_WAKE,
+	/** arg: unused. */
+	TRACE_EXIT,
+	/** arg: the address of the mutex. */
+	TRACE_MUTEX_LOCK,
+	/** arg: the address of the mutex. */
+	TRACE_MUTEX_UNLOCK,
+	/** arg: the address of the offloaded function. */
+	TRACE_BLOCK_OFFLOAD,
+	/** arg: the file descriptor. */
+	TRACE_BLOCK_IO,
+	/** arg: unused. */
+	TRACE_BLOCK_PARK,
+	TRACE_TYPES,
+};
+
+struct trace_event {
+	/** Timestamp, see trace_clock. */
+	uint64_t tsc;
+	uint64_t arg;
+	/** The thread doing the action (trace_id). */
+	uint32_t thread;
+	uint16_t type;
+	/** The kernel thread running the scheduler. */
+	uint16_t worker;
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+	/** Number of events after the header. */
+	uint64_t events;
+	/** Number of older events overwritten by these ones. */
+	uint64_t lost;
+	/** Two (timestamp, nanoseconds) pairs, to convert the timestamps: when tracing started and when it was dumped. */
+	uint64_t start_tsc, start_ns;
+	uint64_t end_tsc, end_ns;
+};
+
+struct trace_ring {
+	struct trace_event *events;
+	/** Capacity - 1, the capacity is a power of two. */
+	uint64_t mask;
+	/** Number of events ever recorded, the next one goes to head & mask. */
+	uint64_t head;
+	/** The scheduler recording it. */
+	uint16_t worker;
+};
+
+/**
+ * The ring of the current kernel thread's scheduler, NULL when tracing is disabled.
+ */
+extern __thread struct trace_ring *trace_ring __attribute__((tls_model("initial-exec")));
+
+/**
+ * Cycle counter where available, nanoseconds otherwise.
+ */
+static inline uint64_t trace_clock(void) {
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static inline void trace(enum trace_type type, uint32_t thread, uint64_t arg) {
+	struct trace_ring *ring = trace_ring;
+	if (__builtin_expect(ring == NULL, 1))
+		return;
+
+	struct trace_event *event = &ring->events[ring->head++ & ring->mask];
+	event->tsc = trace_clock();
+	event->arg = arg;
+	event->thread = thread;
+	event->type = type;
+	event->worker = ring->worker;
+}
+
+/**
+ * Start tracing if the THREAD_TRACE environment variable is set.
+ */
+void trace_init(void);
+
+struct thread_sched;
+
+/**
+ * Give the scheduler of the current kernel thread a ring.
+ */
+void trace_register(struct thread_sched *sched);
+
+/**
+ * A scheduler is freed: stop recording its events, and posting to it. Its ring is kept for the dump.
+ */
+void trace_unregister(struct thread_sched *sched);
+
+/**
+ * Write the trace to the file named by THREAD_TRACE, and free it.
+ */
+void trace_exit(void);
+
+#endif //OS_S8_TRACE_H
@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <valgrind/valgrind.h>
+#include "offload.h"
+#include "internal.h"
+#include "trace.h"
+#include "debug.h"
+
+/*
+ * io_uring backend, with the raw system calls.
+ *
+ * Each scheduler has its own ring, set up on its first operation. A request lives on the stack of
+ * the blocked thread, its address is the user_data of the submission. Submissions are only prepared
+ * in the shared ring: io_uring_enter submits them when no thread is runnable (and waits for a
+ * completion at the same time), when a thread yields, or when URING_BATCH are waiting. Completions
+ * are read from the shared ring when the scheduler switches.
+ */
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * Submission ring size. The completion ring is twice as large.
+ */
+#define URING_ENTRIES 256
+
+/**
+ * Prepared submissions that are submitted without waiting for the scheduler to be idle.
+ */
+#define URING_BATCH 32
+
+//region Fallback
+
+struct io_call {
+	int fd;
+	void *buffer;
+	size_t count;
+	off_t offset;
+	int flags;
+};
+
+static void *call_pread(void *_call) {
+	struct io_call *call = _call;
+	return (void *) pread(call->fd, call->buffer, call->count, call->offset);
+}
+
+static void *call_pwrite(void *_call) {
+	struct io_call *call = _call;
+	return (void *) pwrite(call->fd, call->buffer, call->count, call->offset);
+}
+
+static void *call_recv(void *_call) {
+	struct io_call *call = _call;
+	return (void *) recv(call->fd, call->buffer, call->count, call->flags);
+}
+
+static void *call_send(void *_call) {
+	struct io_call *call = _call;
+	return (void *) send(call->fd, call->buffer, call->count, call->flags);
+}
+
+//endregion
+
+#ifdef HAVE_IO_URING
+
+//region Ring
+
+enum uring_state {
+	URING_UNKNOWN,
+	URING_READY,
+	URING_UNAVAILABLE,
+};
+
+struct uring_request {
+	struct thread *thread;
+	int result;
+};
+
+struct uring {
+	enum uring_state state;
+
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries, sq_local_tail;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/**
+	 * Prepared and not submitted yet.
+	 */
+	unsigned int to_submit;
+
+	/**
+	 * A poll of the scheduler's eventfd is in the ring, so the idle wait also ends when a function
+	 * is posted or an offloaded call completes.
+	 */
+	int is_event_polled;
+
+	/**
+	 * Threads waiting for room in the completion ring.
+	 */
+	struct thread_queue slot_waiters;
+};
+
+/**
+ * The user_data of the poll of the eventfd, and of the cancellations.
+ */
+static char event_poll_tag;
+static char cancel_tag;
+
+static int setup(struct uring *ring) {
+	struct io_uring_params params;
+	const char *enabled = getenv("THREAD_IO_URING");
+
+	if ((enabled != NULL && strcmp(enabled, "0") == 0) || RUNNING_ON_VALGRIND) {
+		// Valgrind doesn't know that the kernel writes to the buffers
+		info("io_uring %s, offloading the I/O", "disabled")
+		return -1;
+	}
+
+	memset(&params, 0, sizeof params);
+	ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		info("io_uring unavailable (%d), offloading the I/O", errno)
+		return -1;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ring
+	                                                         : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+	                                                                MAP_SHARED | MAP_POPULATE, ring->fd,
+	                                                                IORING_OFF_CQ_RING);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		error("Cannot map the io_uring rings: %d", errno)
+		close(ring->fd);
+		return -1;
+	}
+
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	ring->cq_entries = params.cq_entries;
+
+	info("io_uring: %u submissions, %u completions", ring->sq_entries, ring->cq_entries)
+	return 0;
+}
+
+/**
+ * Submit the prepared operations, and wait for `wait` completions.
+ */
+static void enter(struct uring *ring, unsigned int wait) {
+	long submitted;
+
+	while ((submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+	                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) {
+		if (errno == EINTR)
+			continue;
+		// EAGAIN or EBUSY: not enough resources, the completions must be reaped first
+		if ((errno == EAGAIN || errno == EBUSY) && wait == 0)
+			return;
+		error("io_uring_enter failed: %d", errno)
+		return;
+	}
+	ring->to_submit -= submitted < ring->to_submit ? submitted : ring->to_submit;
+}
+
+/**
+ * @return A submission to fill, in the ring
+ */
+static struct io_uring_sqe *prepare(struct uring *ring) {
+	// Full: submit (the kernel copies the submissions, which frees them)
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+		enter(ring, 0);
+
+	unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof *sqe);
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+static void reap(struct thread_sched *sched) {
+	struct uring *ring = sched->uring;
+	unsigned int head = *ring->cq_head, tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+		if (cqe->user_data == (uintptr_t) &event_poll_tag) {
+			ring->is_event_polled = 0;
+			sched_drain(sched);
+			sched_check_inbox(sched);
+			continue;
+		}
+		if (cqe->user_data == (uintptr_t) &cancel_tag) {
+			// The cancelled operation completes on its own
+			sched->uring_in_flight--;
+			continue;
+		}
+
+		struct uring_request *request = (struct uring_request *) (uintptr_t) cqe->user_data;
+		request->result = cqe->res;
+		sched->uring_in_flight--;
+		wake_up(request->thread);
+
+		struct thread *waiter = TAILQ_FIRST(&ring->slot_waiters);
+		if (waiter != NULL) {
+			TAILQ_REMOVE(&ring->slot_waiters, waiter, entries);
+			wake_up(waiter);
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+//endregion
+
+//region Scheduler side
+
+void uring_poll(struct thread_sched *sched, int submit) {
+	if (submit && sched->uring->to_submit > 0)
+		enter(sched->uring, 0);
+	reap(sched);
+}
+
+int uring_wait(struct thread_sched *sched) {
+	struct uring *ring = sched->uring;
+
+	if (sched->uring_in_flight == 0)
+		return 0;
+
+	// Something else can wake a thread up: wait for it too
+	if (!ring->is_event_polled
+	    && (sched->offload_in_flight > 0 || __atomic_load_n(&sched_instances, __ATOMIC_RELAXED) > 1)) {
+		struct io_uring_sqe *sqe = prepare(ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = sched->event_fd;
+		sqe->poll_events = POLLIN;
+		sqe->user_data = (uintptr_t) &event_poll_tag;
+		ring->is_event_polled = 1;
+	}
+
+	// The doorbell only rings if the scheduler is idle
+	int may_sleep = !ring->is_event_polled || sched_idle_begin(sched);
+	enter(ring, may_sleep);
+	sched_idle_end(sched);
+	reap(sched);
+	sched_check_inbox(sched);
+	return 1;
+}
+
+void uring_cancel(struct thread_sched *sched, void *request) {
+	struct io_uring_sqe *sqe = prepare(sched->uring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) request;
+	sqe->user_data = (uintptr_t) &cancel_tag;
+	// Its completion takes room in the ring too
+	sched->uring_in_flight++;
+}
+
+void uring_exit(struct thread_sched *sched) {
+	struct uring *ring = sched->uring;
+
+	if (ring == NULL)
+		return;
+	if (ring->state == URING_READY) {
+		munmap(ring->sqes, ring->sqes_size);
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+	}
+	free(ring);
+	sched->uring = NULL;
+}
+
+//endregion
+
+/**
+ * Submit an operation and block the current thread until it completes.
+ * @return The result of the operation, or -1 with errno set
+ */
+static ssize_t submit_and_block(int opcode, int fd, void *buffer, size_t count, off_t offset, int flags) {
+	struct thread_sched *sched = local_sched;
+	struct uring *ring = sched->uring;
+	struct thread *current = sched->running;
+	struct uring_request request = {current, 0};
+
+	cancel_point(current);
+	// Leave room in the completion ring for every operation in progress
+	while (sched->uring_in_flight >= ring->cq_entries) {
+		current->is_blocked = 1;
+		TAILQ_INSERT_TAIL(&ring->slot_waiters, current, entries);
+		current->wait_queue = &ring->slot_waiters;
+		trace(TRACE_BLOCK_IO, current->trace_id, (uint64_t) fd);
+		block_current();
+		if (current->is_interrupted) {
+			current->is_interrupted = 0;
+			cancel_exit();
+		}
+	}
+
+	struct io_uring_sqe *sqe = prepare(ring);
+	sqe->opcode = (uint8_t) opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buffer;
+	sqe->len = (uint32_t) count;
+	sqe->off = (uint64_t) offset;
+	sqe->msg_flags = (uint32_t) flags;
+	sqe->user_data = (uintptr_t) &request;
+	sched->uring_in_flight++;
+	if (ring->to_submit >= URING_BATCH)
+		enter(ring, 0);
+
+	current->is_blocked = 1;
+	current->uring_request = &request;
+	trace(TRACE_BLOCK_IO, current->trace_id, (uint64_t) fd);
+	block_current();
+
+	// Cancelled by thread_cancel, before it had any effect; otherwise its result is returned
+	if (request.result == -ECANCELED)
+		cancel_point(current);
+	if (request.result < 0) {
+		errno = -request.result;
+		return -1;
+	}
+	return request.result;
+}
+
+static int is_available(void) {
+	struct thread_sched *sched = sched_local();
+	struct uring *ring = sched->uring;
+
+	if (ring == NULL) {
+		if ((ring = calloc(1, sizeof *ring)) == NULL) {
+			error("io_uring allocation %s", "failed")
+			return 0;
+		}
+		TAILQ_INIT(&ring->slot_waiters);
+		ring->state = setup(ring) == 0 ? URING_READY : URING_UNAVAILABLE;
+		sched->uring = ring;
+	}
+	return ring->state == URING_READY;
+}
+
+#else
+
+void uring_poll(struct thread_sched *sched __attribute__((unused)), int submit __attribute__((unused))) {}
+
+int uring_wait(struct thread_sched *sched __attribute__((unused))) {
+	return 0;
+}
+
+void uring_cancel(struct thread_sched *sched __attribute__((unused)), void *request __attribute__((unused))) {}
+
+void uring_exit(struct thread_sched *sched __attribute__((unused))) {}
+
+static ssize_t submit_and_block(int opcode __attribute__((unused)), int fd __attribute__((unused)),
+                                void *buffer __attribute__((unused)), size_t count __attribute__((unused)),
+                                off_t offset __attribute__((unused)), int flags __attribute__((unused))) {
+	return -1;
+}
+
+static int is_available(void) {
+	return 0;
+}
+
+#define IORING_OP_READ 0
+#define IORING_OP_WRITE 0
+#define IORING_OP_RECV 0
+#define IORING_OP_SEND 0
+
+#endif /* HAVE_IO_URING */
+
+//region API
+
+ssize_t thread_pread(int fd, void *buffer, size_t count, off_t offset) {
+	if (is_available())
+		return submit_and_block(IORING_OP_READ, fd, buffer, count, offset, 0);
+
+	struct io_call call = {fd, buffer, count, offset, 0};
+	return (ssize_t) thread_offload(call_pread, &call);
+}
+
+ssize_t thread_pwrite(int fd, const void *buffer, size_t count, off_t offset) {
+	if (is_available())
+		return submit_and_block(IORING_OP_WRITE, fd, (void *) buffer, count, offset, 0);
+
+	struct io_call call = {fd, (void *) buffer, count, offset, 0};
+	return (ssize_t) thread_offload(call_pwrite, &call);
+}
+
+ssize_t thread_recv(int fd, void *buffer, size_t count, int flags) {
+	if (is_available())
+		return submit_and_block(IORING_OP_RECV, fd, buffer, count, 0, flags);
+
+	struct io_call call = {fd, buffer, count, 0, flags};
+	return (ssize_t) thread_offload(call_recv, &call);
+}
+
+ssize_t thread_send(int fd, const void *buffer, size_t count, int flags) {
+	if (is_available())
+		return submit_and_block(IORING_OP_SEND, fd, (void *) buffer, count, 0, flags);
+
+	struct io_call call = {fd, (void *) buffer, count, 0, flags};
+	return (ssize_t) thread_offload(call_send, &call);
+}
+
+//endregion
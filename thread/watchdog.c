@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include "internal.h"
+#include "debug.h"
+
+/*
+ * Watchdog.
+ *
+ * Each scheduler has a timer, which sends SIGRTMIN every half threshold to its kernel thread: those
+ * that exist when the watchdog starts, and those created while it watches. The handler runs on the
+ * stack of the thread that holds the processor for its scheduler, so it doesn't need to stop it to
+ * print its backtrace. Since when it runs is the state_since of its statistics, updated by every
+ * switch: watching costs nothing to the scheduler. The handler only uses async-signal-safe functions.
+ */
+
+#define WATCHDOG_DEFAULT_THRESHOLD_MS 100
+
+#define WATCHDOG_MAX_DEPTH 32
+
+// Not exposed by older C libraries
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static volatile int is_watching = 0;
+static unsigned long long threshold_ns;
+static struct sigaction previous_action;
+
+/**
+ * The schedulers, to give them a timer when the watchdog starts. Protects is_watching and the timers.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_sched *watched = NULL;
+
+//region Report
+
+/**
+ * Append a number to a buffer, without stdio.
+ */
+static char *append_number(char *buffer, unsigned long long number) {
+	char digits[24];
+	int n = 0;
+
+	do {
+		digits[n++] = (char) ('0' + number % 10);
+		number /= 10;
+	} while (number > 0);
+	while (n > 0)
+		*buffer++ = digits[--n];
+	return buffer;
+}
+
+static char *append_string(char *buffer, const char *string) {
+	size_t length = strlen(string);
+	memcpy(buffer, string, length);
+	return buffer + length;
+}
+
+static void on_tick(int sig __attribute__((unused)), siginfo_t *info __attribute__((unused)), void *context) {
+	int saved_errno = errno;
+	struct thread_sched *sched = local_sched;
+
+	// Its scheduler may be gone
+	if (sched == NULL)
+		return;
+
+	struct thread *thread = sched->running;
+	unsigned long long running_ns = now_ns() - thread->state_since;
+
+	// A blocked thread is still the running one while the scheduler waits for offloaded calls
+	if (running_ns < threshold_ns || sched->live_threads < 2 || thread->is_blocked
+	    || (thread == sched->reported_thread && thread->state_since == sched->reported_since)) {
+		errno = saved_errno;
+		return;
+	}
+
+	sched->reported_thread = thread;
+	sched->reported_since = thread->state_since;
+	count_hog(thread);
+
+	char message[128], *end = append_string(message, "[WATCHDOG] ");
+	if (thread->trace_id == 0) {
+		end = append_string(end, "main");
+	} else {
+		end = append_string(end, "thread-");
+		end = append_number(end, thread->trace_id);
+	}
+	end = append_string(end, " has been running for ");
+	end = append_number(end, running_ns / 1000000);
+	end = append_string(end, " ms without switching, at:\n");
+	if (write(STDERR_FILENO, message, end - message) < 0)
+		goto out;
+
+	void *frames[WATCHDOG_MAX_DEPTH + 8];
+	int first, depth = signal_backtrace(frames, sizeof frames / sizeof frames[0], context, &first);
+	backtrace_symbols_fd(&frames[first], depth < WATCHDOG_MAX_DEPTH ? depth : WATCHDOG_MAX_DEPTH, STDERR_FILENO);
+
+out:
+	errno = saved_errno;
+}
+
+//endregion
+
+//region Timers
+
+/**
+ * Start the timer of a scheduler, under the lock.
+ * @return 0 on success, -1 on failure
+ */
+static int arm(struct thread_sched *sched) {
+	struct sigevent event;
+	memset(&event, 0, sizeof event);
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGRTMIN;
+	event.sigev_notify_thread_id = sched->tid;
+	if (timer_create(CLOCK_MONOTONIC, &event, &sched->watchdog_timer) != 0) {
+		error("Cannot create the watchdog timer of the scheduler %u: %d", sched->id, errno)
+		return -1;
+	}
+
+	// Check twice per threshold: a run is caught between 1 and 1.5 threshold
+	unsigned long long period_ns = threshold_ns / 2;
+	struct itimerspec spec = {
+			.it_interval = {period_ns / 1000000000, period_ns % 1000000000},
+			.it_value = {period_ns / 1000000000, period_ns % 1000000000},
+	};
+	if (timer_settime(sched->watchdog_timer, 0, &spec, NULL) != 0) {
+		error("Cannot start the watchdog timer of the scheduler %u: %d", sched->id, errno)
+		timer_delete(sched->watchdog_timer);
+		return -1;
+	}
+
+	sched->has_watchdog_timer = 1;
+	sched->reported_thread = NULL;
+	return 0;
+}
+
+/**
+ * Delete the timer of a scheduler, if it has one, under the lock.
+ */
+static void disarm(struct thread_sched *sched) {
+	if (!sched->has_watchdog_timer)
+		return;
+
+	timer_delete(sched->watchdog_timer);
+	sched->has_watchdog_timer = 0;
+}
+
+void watchdog_attach(struct thread_sched *sched) {
+	sched->tid = (pid_t) syscall(SYS_gettid);
+	sched->has_watchdog_timer = 0;
+	sched->reported_thread = NULL;
+
+	kernel.mutex_lock(&lock);
+	sched->next_watched = watched;
+	watched = sched;
+	if (is_watching)
+		arm(sched);
+	kernel.mutex_unlock(&lock);
+}
+
+void watchdog_detach(struct thread_sched *sched) {
+	kernel.mutex_lock(&lock);
+	for (struct thread_sched **link = &watched; *link != NULL; link = &(*link)->next_watched) {
+		if (*link == sched) {
+			*link = sched->next_watched;
+			break;
+		}
+	}
+	disarm(sched);
+	kernel.mutex_unlock(&lock);
+}
+
+//endregion
+
+//region API
+
+int thread_watchdog_start(unsigned int threshold_ms) {
+	if (is_watching)
+		return -1;
+	if (threshold_ms == 0)
+		threshold_ms = WATCHDOG_DEFAULT_THRESHOLD_MS;
+	threshold_ns = threshold_ms * 1000000ULL;
+
+	// The first call to backtrace loads the unwinder, which allocates: not in the handler
+	void *preload[1];
+	backtrace(preload, 1);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_sigaction = on_tick;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGRTMIN, &action, &previous_action) != 0) {
+		error("Cannot handle SIGRTMIN: %d", errno)
+		return -1;
+	}
+
+	// The calling kernel thread is watched too
+	sched_local();
+
+	int failed = 0;
+	kernel.mutex_lock(&lock);
+	for (struct thread_sched *sched = watched; sched != NULL && !failed; sched = sched->next_watched)
+		failed = arm(sched) != 0;
+	if (failed) {
+		for (struct thread_sched *sched = watched; sched != NULL; sched = sched->next_watched)
+			disarm(sched);
+	} else {
+		is_watching = 1;
+	}
+	kernel.mutex_unlock(&lock);
+
+	if (failed) {
+		sigaction(SIGRTMIN, &previous_action, NULL);
+		return -1;
+	}
+
+	info("Watchdog threshold: %u ms", threshold_ms)
+	return 0;
+}
+
+int thread_watchdog_stop(void) {
+	if (!is_watching)
+		return 0;
+
+	kernel.mutex_lock(&lock);
+	for (struct thread_sched *sched = watched; sched != NULL; sched = sched->next_watched)
+		disarm(sched);
+	is_watching = 0;
+	kernel.mutex_unlock(&lock);
+
+	sigaction(SIGRTMIN, &previous_action, NULL);
+	return 0;
+}
+
+void watchdog_init(void) {
+	const char *threshold = getenv("THREAD_WATCHDOG");
+	if (threshold != NULL)
+		thread_watchdog_start(strtoul(threshold, NULL, 10));
+}
+
+void watchdog_exit(void) {
+	thread_watchdog_stop();
+}
+
+//endregion